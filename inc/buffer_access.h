@@ -0,0 +1,28 @@
+#ifndef BUFFER_ACCESS_H
+#define BUFFER_ACCESS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// CPU access bracketing for dmabufs. On platforms without coherent caches
+// the exporter flushes/invalidates on these calls; file descriptors that
+// are not dmabufs (memfd, plain files) are accepted and ignored.
+enum class BufferAccess {
+  Read,
+  Write,
+  ReadWrite,
+};
+
+int beginCpuAccess(int fd, BufferAccess access);
+int endCpuAccess(int fd, BufferAccess access);
+
+// Copy out of memory that may be mapped uncached or write-combined. Uses
+// streaming loads (MOVNTDQA) where available, which fetch a full line per
+// access from WC memory instead of one uncached read per word. Falls back
+// to memcpy elsewhere.
+void streamCopy(void *dst, const void *src, size_t length);
+
+// Name of the copy implementation selected at runtime, for reporting.
+const char *streamCopyImplementation();
+
+#endif // BUFFER_ACCESS_H
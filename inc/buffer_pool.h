@@ -0,0 +1,62 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+// Where the memory of application-provided frame buffers comes from.
+enum class PoolSource {
+  Auto,    // udmabuf, then dma-heap
+  Udmabuf, // memfd (hugepages when possible) exported through /dev/udmabuf
+  DmaHeap, // /dev/dma_heap/system
+  Memfd,   // plain memfd, CPU consumers only: devices cannot import it
+};
+
+bool parsePoolSource(const std::string &name, PoolSource &source);
+const char *poolSourceName(PoolSource source);
+
+struct PoolConfig {
+  PoolSource source = PoolSource::Auto;
+  unsigned int count = 0;  // 0: use StreamConfiguration::bufferCount
+  size_t alignment = 64;   // plane offset alignment, for SIMD consumers
+  bool hugepages = true;
+};
+
+// Application-owned frame buffers. Each buffer is one fd holding all the
+// planes of a frame at aligned offsets, and stays mapped for the CPU for
+// the lifetime of the pool so consumers never have to mmap per frame.
+class BufferPool {
+public:
+  struct Buffer {
+    int fd;
+    size_t size;
+    uint8_t *memory;
+    std::unique_ptr<libcamera::FrameBuffer> frameBuffer;
+  };
+
+  BufferPool() = default;
+  ~BufferPool();
+
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
+  // Returns the number of buffers allocated, or a negative error code.
+  int allocate(const libcamera::StreamConfiguration &config,
+               const PoolConfig &poolConfig);
+  void free();
+
+  PoolSource source() const { return source_; }
+  const std::vector<Buffer> &buffers() const { return buffers_; }
+  const Buffer *find(const libcamera::FrameBuffer *frameBuffer) const;
+
+private:
+  int allocateMemory(PoolSource source, size_t &size, bool hugepages);
+
+  PoolSource source_ = PoolSource::Auto;
+  std::vector<Buffer> buffers_;
+};
+
+#endif // BUFFER_POOL_H
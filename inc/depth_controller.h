@@ -0,0 +1,58 @@
+#ifndef DEPTH_CONTROLLER_H
+#define DEPTH_CONTROLLER_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+enum class DepthPolicy {
+  Fixed,      // keep every allocated request in flight
+  Latency,    // smallest depth that does not drop frames
+  Throughput, // deep queue, shrink only after a long clean period
+};
+
+bool parseDepthPolicy(const std::string &name, DepthPolicy &policy);
+const char *depthPolicyName(DepthPolicy policy);
+
+// Chooses how many requests to keep queued to the camera. It is fed the
+// sensor timestamp of every completed frame, the time the application held
+// the request before requeueing it, and detects drops from gaps in the
+// frame sequence numbers. The target depth is re-evaluated once per window
+// of frames and always stays within [minDepth, maxDepth].
+class DepthController {
+public:
+  DepthController(DepthPolicy policy, unsigned int minDepth,
+                  unsigned int maxDepth);
+
+  void frameCompleted(uint32_t sequence, uint64_t timestamp);
+  void requestRequeued(std::chrono::nanoseconds holdTime);
+
+  unsigned int depth() const { return depth_; }
+  unsigned int drops() const { return totalDrops_; }
+
+private:
+  static constexpr unsigned int kWindow = 30;
+  static constexpr unsigned int kCleanWindowsToShrink = 10;
+
+  void update();
+  std::chrono::nanoseconds holdPercentile(unsigned int percent);
+
+  DepthPolicy policy_;
+  unsigned int minDepth_;
+  unsigned int maxDepth_;
+  unsigned int depth_;
+
+  bool first_ = true;
+  uint32_t lastSequence_ = 0;
+  uint64_t lastTimestamp_ = 0;
+  uint64_t frameInterval_ = 0; // ns, smoothed
+
+  unsigned int frames_ = 0;
+  unsigned int windowDrops_ = 0;
+  unsigned int totalDrops_ = 0;
+  unsigned int cleanWindows_ = 0;
+  std::vector<std::chrono::nanoseconds> holdTimes_;
+};
+
+#endif // DEPTH_CONTROLLER_H
@@ -0,0 +1,183 @@
+#ifndef DMABUF_CLIENT_H
+#define DMABUF_CLIENT_H
+
+// Header-only client for the dmabuf sharing socket (see dmabuf_protocol.h).
+// Receives and maps the frame buffers once, then waits for Ready messages
+// and releases buffers back to the server.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <vector>
+
+#include "dmabuf_protocol.h"
+
+class DmabufClient {
+public:
+  struct Buffer {
+    unsigned int numPlanes = 0;
+    int fd[3] = { -1, -1, -1 };
+    uint32_t offset[3] = {};
+    uint32_t length[3] = {};
+    // Mapping of the buffer each plane lives in, read-only. Planes of the
+    // same buffer share one mapping, owned by the first of them.
+    uint8_t *memory[3] = {};
+    size_t size[3] = {}; // of the mappings owned by each plane, or 0
+
+    const uint8_t *plane(unsigned int p) const {
+      return memory[p] + offset[p];
+    }
+  };
+
+  DmabufClient() = default;
+  ~DmabufClient() { close(); }
+
+  DmabufClient(const DmabufClient &) = delete;
+  DmabufClient &operator=(const DmabufClient &) = delete;
+
+  int connect(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+      return -ENAMETOOLONG;
+
+    fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+      return -errno;
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    if (::connect(fd_, reinterpret_cast<struct sockaddr *>(&addr),
+                  sizeof(addr)) < 0) {
+      int ret = -errno;
+      close();
+      return ret;
+    }
+
+    if (recv(fd_, &hello_, sizeof(hello_), 0) != sizeof(hello_) ||
+        hello_.type != DmabufMessageType::Hello) {
+      close();
+      return -EPROTO;
+    }
+
+    buffers_.resize(hello_.index);
+    for (unsigned int i = 0; i < buffers_.size(); ++i) {
+      int ret = receiveBuffer();
+      if (ret < 0) {
+        close();
+        return ret;
+      }
+    }
+
+    return 0;
+  }
+
+  void close() {
+    for (Buffer &buffer : buffers_) {
+      for (unsigned int p = 0; p < buffer.numPlanes; ++p) {
+        if (buffer.size[p] && buffer.memory[p])
+          munmap(buffer.memory[p], buffer.size[p]);
+        ::close(buffer.fd[p]);
+      }
+    }
+    buffers_.clear();
+
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = -1;
+  }
+
+  const DmabufMessage &layout() const { return hello_; }
+  const std::vector<Buffer> &buffers() const { return buffers_; }
+
+  // Block until the next frame is ready. Returns its message, with
+  // type Ready, or a zeroed message when the server went away.
+  DmabufMessage waitFrame() {
+    DmabufMessage msg = {};
+    if (recv(fd_, &msg, sizeof(msg), 0) != sizeof(msg) ||
+        msg.type != DmabufMessageType::Ready)
+      return {};
+    return msg;
+  }
+
+  // Hand buffer `index` back; it must not be read afterwards.
+  bool release(unsigned int index) {
+    DmabufMessage msg = {};
+    msg.type = DmabufMessageType::Release;
+    msg.index = index;
+    return send(fd_, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg);
+  }
+
+private:
+  int receiveBuffer() {
+    DmabufMessage msg = {};
+    struct iovec iov = { &msg, sizeof(msg) };
+    char control[CMSG_SPACE(sizeof(int) * 3)] = {};
+    struct msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    if (recvmsg(fd_, &hdr, MSG_CMSG_CLOEXEC) != sizeof(msg) ||
+        msg.type != DmabufMessageType::Buffer || msg.index >= buffers_.size())
+      return -EPROTO;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || msg.numPlanes > 3 ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * msg.numPlanes))
+      return -EPROTO;
+
+    Buffer &buffer = buffers_[msg.index];
+    buffer.numPlanes = msg.numPlanes;
+    memcpy(buffer.fd, CMSG_DATA(cmsg), sizeof(int) * msg.numPlanes);
+
+    // Every fd received is a new descriptor, even for planes of the same
+    // buffer, so planes are matched by the file they refer to instead.
+    struct stat st[3];
+    unsigned int owner[3];
+    for (unsigned int p = 0; p < msg.numPlanes; ++p) {
+      if (fstat(buffer.fd[p], &st[p]) < 0)
+        return -errno;
+
+      owner[p] = p;
+      for (unsigned int q = 0; q < p; ++q) {
+        if (st[q].st_dev == st[p].st_dev && st[q].st_ino == st[p].st_ino) {
+          owner[p] = owner[q];
+          break;
+        }
+      }
+
+      buffer.offset[p] = msg.offset[p];
+      buffer.length[p] = msg.length[p];
+      size_t &size = buffer.size[owner[p]];
+      size = std::max<size_t>(size, size_t(msg.offset[p]) + msg.length[p]);
+    }
+
+    for (unsigned int p = 0; p < msg.numPlanes; ++p) {
+      if (owner[p] != p) {
+        buffer.memory[p] = buffer.memory[owner[p]];
+        continue;
+      }
+
+      void *mem = mmap(NULL, buffer.size[p], PROT_READ, MAP_SHARED,
+                       buffer.fd[p], 0);
+      if (mem == MAP_FAILED)
+        return -errno;
+      buffer.memory[p] = static_cast<uint8_t *>(mem);
+    }
+
+    return 0;
+  }
+
+  int fd_ = -1;
+  DmabufMessage hello_ = {};
+  std::vector<Buffer> buffers_;
+};
+
+#endif // DMABUF_CLIENT_H
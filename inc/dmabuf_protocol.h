@@ -0,0 +1,38 @@
+#ifndef DMABUF_PROTOCOL_H
+#define DMABUF_PROTOCOL_H
+
+// Wire protocol of the dmabuf sharing socket (SOCK_SEQPACKET, one message
+// per packet).
+//
+// On connection the server sends a Hello, then one Buffer message per
+// frame buffer carrying the plane fds as SCM_RIGHTS ancillary data. From
+// then on only Ready messages are sent for each frame; the client answers
+// each of them with a Release once it no longer reads the buffer. A buffer
+// goes back to the camera when every client it was sent to released it.
+
+#include <cstdint>
+
+enum class DmabufMessageType : uint32_t {
+  Hello = 1,   // server -> client: bufferCount, image layout
+  Buffer = 2,  // server -> client: index, planes, fds attached
+  Ready = 3,   // server -> client: index, sequence, timestamp
+  Release = 4, // client -> server: index
+};
+
+struct DmabufMessage {
+  DmabufMessageType type;
+  uint32_t index;       // buffer index, or buffer count for Hello
+  uint64_t sequence;
+  uint64_t timestamp;
+
+  // Hello / Buffer only
+  uint32_t format;      // FrameFormat value
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t numPlanes;
+  uint32_t offset[3];
+  uint32_t length[3];
+};
+
+#endif // DMABUF_PROTOCOL_H
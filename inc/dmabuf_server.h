@@ -0,0 +1,91 @@
+#ifndef DMABUF_SERVER_H
+#define DMABUF_SERVER_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "dmabuf_protocol.h"
+#include "frame_view.h"
+
+// Shares frame buffers with local processes by passing their dmabuf fds
+// once over a unix socket, then only signalling which buffer is ready.
+// Independent of libcamera: the frame is kept alive by an opaque hold
+// reference (e.g. a FrameHandle) until every client released it.
+class DmabufServer {
+public:
+  struct BufferDesc {
+    unsigned int numPlanes;
+    int fd[3];
+    uint32_t offset[3];
+    uint32_t length[3];
+  };
+
+  struct Layout {
+    FrameFormat format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+  };
+
+  DmabufServer() = default;
+  ~DmabufServer();
+
+  DmabufServer(const DmabufServer &) = delete;
+  DmabufServer &operator=(const DmabufServer &) = delete;
+
+  // Buffers are not owned: their fds must stay open while serving. At
+  // most maxOutstanding buffers are held for clients at any time, all
+  // clients together.
+  int start(const std::string &path, const Layout &layout,
+            const std::vector<BufferDesc> &buffers,
+            unsigned int maxOutstanding = 2);
+  void stop();
+
+  // Announce a filled buffer to all clients with room for it. The hold
+  // reference is dropped once all of them released the buffer. The frame
+  // is skipped while maxOutstanding buffers are held already.
+  void publish(unsigned int index, uint64_t sequence, uint64_t timestamp,
+               std::shared_ptr<const void> hold);
+
+  unsigned int clients() const;
+  uint64_t skipped() const { return skipped_; }
+
+private:
+  struct Client {
+    int fd;
+    std::set<unsigned int> outstanding;
+  };
+
+  struct Slot {
+    std::shared_ptr<const void> hold;
+    std::set<int> pending; // client fds yet to release
+  };
+
+  void run();
+  void acceptClient();
+  bool sendBuffers(int fd);
+  void handleRelease(Client &client, unsigned int index);
+  void dropClient(int fd);
+
+  std::string path_;
+  Layout layout_ = {};
+  std::vector<BufferDesc> buffers_;
+  unsigned int maxOutstanding_ = 2;
+
+  int listenFd_ = -1;
+  int wakeFd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> running_{ false };
+
+  mutable std::mutex lock_;
+  std::vector<Client> clients_;
+  std::vector<Slot> slots_;
+  std::atomic<uint64_t> skipped_{ 0 };
+};
+
+#endif // DMABUF_SERVER_H
@@ -0,0 +1,159 @@
+#ifndef FRAME_ARCHIVE_H
+#define FRAME_ARCHIVE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+#include "lossless_codec.h"
+#include "tile_change.h"
+
+// Recording file of losslessly compressed frames with random access.
+//
+//   ArchiveHeader | record | record | ... | index | ArchiveFooter
+//
+// Each record is an ArchiveRecord followed by its payload. The index, one
+// uint64_t file offset per record, and the footer are written by close().
+// A file without them, e.g. after a crash, is indexed by scanning the
+// records instead. All fields are little endian.
+//
+// Key frames are a LosslessEncoder payload of the whole frame. Delta
+// frames (kArchiveDeltaFrame) only carry the tiles that changed since the
+// previous frame:
+//
+//   ArchiveDelta | change bitmap | LosslessEncoder payload of the tiles
+//
+// The changed tiles are stacked into a column tileSize pixels wide in
+// raster order; partial tiles at the right and bottom edges are padded.
+// Decoding a delta frame starts from the preceding key frame.
+
+static constexpr uint32_t kArchiveMagic = 0x5241434f;       // "OCAR"
+static constexpr uint32_t kArchiveRecordMagic = 0x4d415246; // "FRAM"
+static constexpr uint32_t kArchiveIndexMagic = 0x58444e49;  // "INDX"
+static constexpr uint32_t kArchiveVersion = 1;
+
+struct ArchiveHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t format; // FrameFormat value
+  uint32_t width;
+  uint32_t height;
+  uint32_t reserved;
+};
+
+static constexpr uint32_t kArchiveDeltaFrame = 1 << 0;
+
+struct ArchiveRecord {
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t sequence;
+  uint64_t timestamp;
+  uint64_t size; // payload bytes following the record
+};
+
+struct ArchiveDelta {
+  uint32_t tileSize;
+  uint32_t tilesX;
+  uint32_t tilesY;
+  uint32_t changed; // number of tiles in the payload
+};
+
+struct ArchiveFooter {
+  uint32_t magic;
+  uint32_t reserved;
+  uint64_t count;
+  uint64_t indexOffset;
+};
+
+class ArchiveWriter {
+public:
+  ArchiveWriter() = default;
+  ~ArchiveWriter();
+
+  ArchiveWriter(const ArchiveWriter &) = delete;
+  ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+  int open(const std::string &path, FrameFormat format, unsigned int width,
+           unsigned int height);
+  void close();
+
+  // Store only the tiles that changed between frames, with a key frame
+  // every keyframeInterval frames or when most tiles changed. 0 records
+  // key frames only. See TileChangeDetector for tileSize and threshold.
+  void setDeltaFrames(unsigned int keyframeInterval,
+                      unsigned int tileSize = 16, unsigned int threshold = 0);
+
+  // Compress and append a frame. The view must match the format and size
+  // the archive was opened with.
+  int write(const FrameView &view, uint64_t sequence, uint64_t timestamp);
+
+  uint64_t frames() const { return index_.size(); }
+  uint64_t keyframes() const { return keyframes_; }
+  uint64_t rawBytes() const { return rawBytes_; }
+  uint64_t storedBytes() const { return offset_; }
+
+private:
+  int append(const void *data, size_t size);
+  bool encodeDelta(const FrameView &view);
+
+  int fd_ = -1;
+  ArchiveHeader header_ = {};
+  uint64_t offset_ = 0;
+  uint64_t rawBytes_ = 0;
+  uint64_t keyframes_ = 0;
+  std::vector<uint64_t> index_;
+  LosslessEncoder encoder_;
+  std::vector<uint8_t> payload_;
+
+  unsigned int keyframeInterval_ = 0;
+  unsigned int sinceKeyframe_ = 0;
+  TileChangeDetector detector_;
+  LosslessEncoder tileEncoder_{ 256 };
+  std::vector<uint8_t> tileMemory_;
+  std::vector<uint8_t> tilePayload_;
+};
+
+class ArchiveReader {
+public:
+  ArchiveReader() = default;
+  ~ArchiveReader();
+
+  ArchiveReader(const ArchiveReader &) = delete;
+  ArchiveReader &operator=(const ArchiveReader &) = delete;
+
+  int open(const std::string &path);
+  void close();
+
+  FrameFormat format() const { return FrameFormat(header_.format); }
+  unsigned int width() const { return header_.width; }
+  unsigned int height() const { return header_.height; }
+  size_t frames() const { return index_.size(); }
+
+  // Record header of frame i, without decoding it.
+  int record(size_t i, ArchiveRecord &record) const;
+
+  // Decode frame i into a view of the archive's format and size. Delta
+  // frames are rebuilt from the last key frame, or from the previously
+  // read frame when reading forward.
+  int read(size_t i, const FrameView &view, ArchiveRecord *record = nullptr);
+
+private:
+  bool loadIndex(uint64_t fileSize);
+  void scanRecords(uint64_t fileSize);
+  int loadPayload(size_t i, ArchiveRecord &record);
+  int applyDelta();
+
+  int fd_ = -1;
+  ArchiveHeader header_ = {};
+  std::vector<uint64_t> index_;
+  std::vector<uint8_t> payload_;
+
+  // Last decoded frame, the base for following delta frames.
+  std::vector<uint8_t> frameMemory_;
+  FrameView frame_;
+  size_t current_ = SIZE_MAX;
+  std::vector<uint8_t> tileMemory_;
+};
+
+#endif // FRAME_ARCHIVE_H
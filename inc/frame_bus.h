@@ -0,0 +1,115 @@
+#ifndef FRAME_BUS_H
+#define FRAME_BUS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_handle.h"
+
+// What a subscriber queue does when a frame arrives and it is full.
+enum class Backpressure {
+  DropOldest, // discard the oldest queued frame
+  DropNewest, // discard the incoming frame
+  Block,      // wait for room, bounded by the block timeout, then drop
+  LatestOnly, // keep a single frame, always the most recent
+};
+
+bool parseBackpressure(const std::string &name, Backpressure &policy);
+const char *backpressureName(Backpressure policy);
+
+// Distributes frames to several consumers. Every subscriber has its own
+// bounded queue and worker thread, so a slow consumer only ever affects
+// its own queue. Queued frames are FrameHandles: a frame returns to the
+// camera once all subscribers are done with it.
+//
+// Every frame held, queued or in a callback, pins a camera buffer. With a
+// buffer budget each subscriber reserves its own share of it, its queue
+// capacity plus the frame in its callback, so a slow consumer can neither
+// starve the camera nor take the buffers of another subscriber. Consumers
+// that need a deeper queue than their share must copy frames out.
+class FrameBus {
+public:
+  using Callback = std::function<void(const FrameHandle &frame)>;
+
+  class Subscriber {
+  public:
+    const std::string &name() const { return name_; }
+    Backpressure policy() const { return policy_; }
+
+    uint64_t delivered() const { return delivered_; }
+    uint64_t dropped() const { return dropped_; }
+    unsigned int lag() const;
+    unsigned int maxLag() const { return maxLag_; }
+
+  private:
+    friend class FrameBus;
+
+    Subscriber(const std::string &name, Backpressure policy,
+               unsigned int capacity, Callback callback,
+               std::chrono::milliseconds blockTimeout);
+
+    void push(const FrameHandle &frame);
+    void run();
+    void stop();
+
+    std::string name_;
+    Backpressure policy_;
+    unsigned int capacity_;
+    Callback callback_;
+    std::chrono::milliseconds blockTimeout_;
+
+    mutable std::mutex lock_;
+    std::condition_variable available_;
+    std::condition_variable space_;
+    std::deque<FrameHandle> queue_;
+    bool stopping_ = false;
+
+    std::atomic<uint64_t> delivered_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+    std::atomic<unsigned int> maxLag_{ 0 };
+    std::thread thread_;
+  };
+
+  FrameBus() = default;
+  ~FrameBus();
+
+  // Buffers the subscribers may hold between them; 0, the default, for no
+  // limit. Call before subscribe().
+  void setBufferBudget(unsigned int buffers) { budget_ = buffers; }
+  unsigned int bufferBudget() const { return budget_; }
+  // Buffers reserved by the subscribers so far.
+  unsigned int reserved() const { return reserved_; }
+
+  // Buffers a subscriber reserves: its queue and the frame in its callback.
+  static unsigned int share(Backpressure policy, unsigned int capacity);
+
+  // Subscribers must be added before the first publish(). With a buffer
+  // budget, capacity is clamped to the budget left, and nullptr returned
+  // when not even one queued frame fits. Block subscribers then don't
+  // wait: publish() runs on the camera thread, which must never stall.
+  Subscriber *subscribe(const std::string &name, Backpressure policy,
+                        unsigned int capacity, Callback callback,
+                        std::chrono::milliseconds blockTimeout =
+                            std::chrono::milliseconds(100));
+
+  void publish(const FrameHandle &frame);
+  // Drain nothing further; queued frames are released undelivered.
+  void stop();
+
+  void printStats() const;
+
+private:
+  std::vector<std::unique_ptr<Subscriber>> subscribers_;
+  unsigned int budget_ = 0;
+  unsigned int reserved_ = 0;
+};
+
+#endif // FRAME_BUS_H
@@ -0,0 +1,62 @@
+#ifndef FRAME_HANDLE_H
+#define FRAME_HANDLE_H
+
+#include <memory>
+#include <mutex>
+
+#include <libcamera/libcamera.h>
+
+#include "frame_stats.h"
+#include "mapped_frame.h"
+
+class BufferPool;
+
+// A completed request seen as a frame. Consumers share it through a
+// FrameHandle; the request goes back to the camera only once the last
+// handle is dropped, so frames can be held without copying them.
+class Frame {
+public:
+  // prot is the protection of the pixel mapping, PROT_WRITE for
+  // consumers that modify the frame in place. Buffers from pool reuse
+  // its mapping instead of being mapped for every frame.
+  Frame(libcamera::Request *request,
+        const libcamera::StreamConfiguration &config, int prot = PROT_READ,
+        const BufferPool *pool = nullptr);
+
+  libcamera::Request *request() const { return request_; }
+  libcamera::FrameBuffer *buffer() const { return buffer_; }
+  const libcamera::StreamConfiguration &config() const { return config_; }
+  const libcamera::FrameMetadata &metadata() const {
+    return buffer_->metadata();
+  }
+
+  // CPU view of the pixels, mapped on first use and shared by all holders.
+  const FrameView &view() const;
+
+  // Image statistics, computed on first use and shared like the view.
+  const FrameStats &stats() const;
+
+  // Whether motion was seen in the frame. Set by the capture thread
+  // before the frame is handed to any consumer.
+  bool motion() const { return motion_; }
+  void setMotion(bool motion) const { motion_ = motion; }
+
+private:
+  libcamera::Request *request_;
+  libcamera::FrameBuffer *buffer_;
+  const libcamera::StreamConfiguration &config_;
+  int prot_;
+  const BufferPool *pool_;
+
+  mutable std::once_flag mapOnce_;
+  mutable std::unique_ptr<MappedFrame> mapped_;
+
+  mutable std::once_flag statsOnce_;
+  mutable FrameStats stats_;
+
+  mutable bool motion_ = false;
+};
+
+using FrameHandle = std::shared_ptr<const Frame>;
+
+#endif // FRAME_HANDLE_H
@@ -0,0 +1,35 @@
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <cstdint>
+
+#include "frame_view.h"
+
+// Luma at or below kClipLow, or at or above kClipHigh, counts as clipped.
+static constexpr unsigned int kClipLow = 2;
+static constexpr unsigned int kClipHigh = 253;
+
+// Image statistics for health checks: a blocked or covered lens shows as
+// a dark frame with little sharpness, focus drift as falling sharpness at
+// a steady mean, bad exposure as clipping.
+struct FrameStats {
+  uint32_t histogram[256]; // luma
+  uint64_t pixels;
+  double luma; // mean
+
+  // Y, Cb, Cr for YUV formats, R, G, B for RGB formats; R8 only has Y.
+  double mean[3];
+
+  double clippedLow;  // percent of pixels with luma <= kClipLow
+  double clippedHigh; // percent of pixels with luma >= kClipHigh
+
+  // Variance of the 4-neighbour Laplacian of luma. Depends on the scene
+  // and noise too, so compare it over time rather than to a fixed value.
+  double sharpness;
+};
+
+// Compute all the statistics in one pass over the frame, in parallel
+// bands of rows. Luma of RGB formats is BT.601 (77 R + 150 G + 29 B) / 256.
+FrameStats computeFrameStats(const FrameView &view);
+
+#endif // FRAME_STATS_H
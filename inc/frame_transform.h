@@ -0,0 +1,47 @@
+#ifndef FRAME_TRANSFORM_H
+#define FRAME_TRANSFORM_H
+
+#include <string>
+
+#include "frame_view.h"
+
+// The eight rotations and mirrors of an image, with the bit layout of
+// libcamera::Transform: the source is flipped first, then transposed, so
+// Rot90 (VFlip | Transpose) rotates by 90 degrees clockwise.
+enum class FrameTransform {
+  Identity = 0,
+  HFlip = 1,
+  VFlip = 2,
+  Rot180 = 3,
+  Transpose = 4,
+  Rot270 = 5,
+  Rot90 = 6,
+  Rot180Transpose = 7,
+};
+
+bool parseFrameTransform(const std::string &name, FrameTransform &transform);
+const char *frameTransformName(FrameTransform transform);
+
+inline bool transposes(FrameTransform transform) {
+  return static_cast<int>(transform) & 4;
+}
+
+// Rotate or mirror src into dst, which must have the format of src and
+// its size, swapped when the transform transposes. Packed YUV chroma is
+// averaged over the pixel pairs of the new rows when transposed. Returns
+// 0, or -EINVAL when the sizes don't match or the transposed size doesn't
+// fit the format's alignment.
+//
+// Transposes work in 8x8 (4x4 for 4 byte pixels) blocks transposed in
+// SSE2 registers, walked in 64x64 tiles so the source lines a tile reads
+// are used whole before they leave the cache. Bands of tiles run on the
+// shared thread pool. Mirrors reverse rows 16 bytes at a time.
+int transformFrame(const FrameView &src, const FrameView &dst,
+                   FrameTransform transform);
+
+// Transpose the samples of one plane, bytesPerPixel bytes each, into dst,
+// which has the same sample size and src's width and height swapped. For
+// other frame processing that is cheaper along columns than along rows.
+void transposeSamples(const PlaneView &src, const PlaneView &dst);
+
+#endif // FRAME_TRANSFORM_H
@@ -0,0 +1,91 @@
+#ifndef FRAME_VIEW_H
+#define FRAME_VIEW_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+// Pixel layouts understood by the CPU-side frame processing code. Kept
+// independent of libcamera so the kernels can be used on any memory.
+enum class FrameFormat {
+  Unknown,
+  XRGB8888,
+  XBGR8888,
+  RGB888,
+  BGR888,
+  YUYV,
+  UYVY,
+  NV12,
+  NV21,
+  YUV420,
+  R8,
+  RAW16, // Bayer samples, 10 to 16 bits in 16 bit little endian words
+  RAW10P, // MIPI CSI-2 packed Bayer samples, see raw_packing.h
+  RAW12P,
+};
+
+struct FormatInfo {
+  const char *name;
+  unsigned int numPlanes;
+  unsigned int bytesPerPixel[3]; // bytes per sample group in each plane
+  unsigned int hSub[3];          // horizontal subsampling per plane
+  unsigned int vSub[3];          // vertical subsampling per plane
+  unsigned int hAlign;           // pixel alignment required for crops
+  unsigned int vAlign;
+};
+
+const FormatInfo &formatInfo(FrameFormat format);
+
+// Stride in bytes of a plane, given the stride of the first plane.
+size_t planeStride(FrameFormat format, unsigned int plane, size_t stride);
+
+// One plane of a frame in memory. Width is in sample groups (e.g. UV pairs
+// for the NV12 chroma plane), stride is in bytes.
+struct PlaneView {
+  uint8_t *data = nullptr;
+  size_t stride = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+  unsigned int bytesPerPixel = 0;
+
+  uint8_t *row(unsigned int y) const { return data + y * stride; }
+  size_t rowBytes() const { return size_t(width) * bytesPerPixel; }
+};
+
+// Non-owning view of an image. Sub-views (crops) share the parent memory
+// and only adjust the plane pointers, so no pixels are copied.
+struct FrameView {
+  FrameFormat format = FrameFormat::Unknown;
+  unsigned int width = 0;
+  unsigned int height = 0;
+  unsigned int numPlanes = 0;
+  PlaneView planes[3];
+
+  bool isValid() const { return numPlanes != 0; }
+  size_t packedSize() const;
+};
+
+// Build a view over contiguous or per-plane memory. When fewer plane
+// pointers than the format needs are given (nullptr), the remaining planes
+// are assumed to follow the previous one directly.
+FrameView makeFrameView(FrameFormat format, unsigned int width,
+                        unsigned int height, size_t stride,
+                        uint8_t *const planes[3]);
+
+// Build a view over packed planes in memory, which is resized to fit.
+FrameView allocateFrameView(FrameFormat format, unsigned int width,
+                            unsigned int height, std::vector<uint8_t> &memory);
+
+// Copy the visible pixels between two views of the same format and size.
+void copyFrameView(const FrameView &src, const FrameView &dst);
+
+// Write the visible pixels of a view, row by row, without padding.
+// With streaming set, rows are first copied out with streamCopy() into a
+// cached staging buffer, which is much faster when the view maps uncached
+// or write-combined device memory. Returns the number of bytes written,
+// or 0 on stream error.
+size_t writeFrameView(std::ostream &out, const FrameView &view,
+                      bool streaming = false);
+
+#endif // FRAME_VIEW_H
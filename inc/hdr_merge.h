@@ -0,0 +1,91 @@
+#ifndef HDR_MERGE_H
+#define HDR_MERGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+
+// Most exposures in one bracket.
+constexpr unsigned int kMaxBracket = 8;
+
+struct BracketExposure {
+  int32_t exposureTime; // µs
+  float analogueGain;
+};
+
+// Parse "E[xG],E[xG][,...]", two or more exposure times in µs, each with
+// an optional analogue gain of at least 1.
+bool parseBracket(const std::string &arg,
+                  std::vector<BracketExposure> &exposures);
+
+// Cycles the exposures of a bracket over consecutive requests, and tells
+// from the metadata of a completed request which exposure a frame was
+// captured with. Sensors apply controls a few frames late, so frames are
+// matched by what the metadata reports rather than by the request order.
+class HdrBracket {
+public:
+  HdrBracket() = default;
+  explicit HdrBracket(const std::vector<BracketExposure> &exposures);
+
+  size_t size() const { return exposures_.size(); }
+  const BracketExposure &exposure(unsigned int index) const {
+    return exposures_[index];
+  }
+
+  // Exposure of the next request to queue.
+  const BracketExposure &next();
+
+  // Index of the exposure a frame was captured with, or -1 when neither
+  // its time nor its gain are within 20% of any, e.g. while the sensor
+  // settles.
+  int match(int32_t exposureTime, float analogueGain) const;
+
+private:
+  std::vector<BracketExposure> exposures_;
+  unsigned int next_ = 0;
+};
+
+// Fast exposure fusion of a bracket of 8 bit frames.
+//
+// Every frame is weighted per pixel by how well exposed it is, a Gaussian
+// of its luma around mid grey, and the frames are averaged with these
+// weights. This is the single scale form of Mertens' exposure fusion,
+// without the contrast and saturation measures or the Laplacian pyramid,
+// which keeps it to one pass over the frames: the weights of a row are
+// looked up for all frames, then blended 16 samples at a time in float
+// vector registers. Chroma samples take the weight of their luma. Bands
+// of rows are spread over the shared thread pool.
+class HdrMerger {
+public:
+  HdrMerger() = default;
+
+  // Returns 0, or -EINVAL for formats other than 8 bit RGB and YUV, an
+  // empty size or a bracket outside 2 to kMaxBracket frames.
+  int configure(FrameFormat format, unsigned int width, unsigned int height,
+                unsigned int frames);
+
+  bool isConfigured() const { return frames_ != 0; }
+
+  // Fuse the configured number of frames into output, all of the
+  // configured format and size, one merge at a time. Returns 0 or
+  // -EINVAL.
+  int merge(const FrameView *views, const FrameView &output) const;
+
+private:
+  void weightRow(const FrameView &view, unsigned int plane, unsigned int y,
+                 float *weights) const;
+
+  FrameFormat format_ = FrameFormat::Unknown;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  unsigned int frames_ = 0;
+  size_t rowSamples_ = 0; // of the widest plane
+
+  float weight_[256];
+  mutable std::vector<float> scratch_; // frames x rowSamples_ per band
+};
+
+#endif // HDR_MERGE_H
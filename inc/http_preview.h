@@ -0,0 +1,76 @@
+#ifndef HTTP_PREVIEW_H
+#define HTTP_PREVIEW_H
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "frame_view.h"
+#include "jpeg_encoder.h"
+
+// Minimal HTTP server streaming multipart MJPEG for live preview.
+//
+//   GET /                      small HTML page embedding the stream
+//   GET /stream[?width=W]      multipart/x-mixed-replace JPEG stream
+//
+// Each frame is encoded once per distinct output size requested by the
+// clients able to take it, never once per client. Clients whose socket
+// is still busy with the previous frame skip the new one.
+class HttpPreviewServer {
+public:
+  explicit HttpPreviewServer(int quality = 75);
+  ~HttpPreviewServer();
+
+  HttpPreviewServer(const HttpPreviewServer &) = delete;
+  HttpPreviewServer &operator=(const HttpPreviewServer &) = delete;
+
+  // Listen on "PORT" (loopback only) or "unix:/path". Returns 0, or
+  // -EINVAL for a port outside 1-65535 or a bad path.
+  int start(const std::string &address);
+  void stop();
+
+  void publish(const FrameView &view);
+
+  unsigned int clients() const;
+  uint64_t encodes() const { return encodes_; }
+
+private:
+  using Part = std::shared_ptr<const std::vector<uint8_t>>;
+
+  struct Client {
+    int fd = -1;
+    bool streaming = false;
+    bool closing = false;
+    std::string request;
+    unsigned int width = 0; // requested width, 0 for full size
+    Part pending;
+    size_t offset = 0;
+    uint64_t sent = 0;
+    uint64_t skipped = 0;
+  };
+
+  void run();
+  void wake();
+  void readRequest(Client &client);
+  bool flush(Client &client);
+  void closeClient(int fd);
+
+  JpegEncoder encoder_;
+  std::map<unsigned int, YuvImage> images_; // scratch, per scale
+
+  std::string unixPath_;
+  int listenFd_ = -1;
+  int wakeFd_ = -1;
+  std::thread thread_;
+  std::atomic<bool> running_{ false };
+
+  mutable std::mutex lock_;
+  std::vector<Client> clients_;
+  std::atomic<uint64_t> encodes_{ 0 };
+};
+
+#endif // HTTP_PREVIEW_H
@@ -0,0 +1,51 @@
+#ifndef JPEG_ENCODER_H
+#define JPEG_ENCODER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_view.h"
+
+// Planar YCbCr 4:2:0 image, the encoder input. Planes are padded to whole
+// 16x16 MCUs by edge replication so the encoder never reads out of bounds.
+struct YuvImage {
+  unsigned int width = 0;
+  unsigned int height = 0;
+  unsigned int yStride = 0;
+  unsigned int cStride = 0;
+  std::vector<uint8_t> y;
+  std::vector<uint8_t> cb;
+  std::vector<uint8_t> cr;
+
+  void resize(unsigned int width, unsigned int height);
+};
+
+// Convert any supported frame to YCbCr 4:2:0, downscaling by an integer
+// factor (box filter) on the way so smaller outputs cost less to encode.
+// Bands of rows are converted in parallel on the shared thread pool. The
+// scale is limited so that the output is at least 2x2. Returns -EINVAL for
+// raw Bayer frames and frames smaller than 2x2.
+int convertToYuv420(const FrameView &view, unsigned int scale,
+                    YuvImage &image);
+
+// Baseline (sequential, Huffman) JPEG encoder with the standard tables.
+// The image is split into restart-interval slices of whole MCU rows which
+// are encoded in parallel; slices == 0 picks two per pool thread.
+class JpegEncoder {
+public:
+  explicit JpegEncoder(int quality = 80, unsigned int slices = 0);
+
+  void encode(const YuvImage &image, std::vector<uint8_t> &out) const;
+
+private:
+  void writeHeaders(const YuvImage &image, unsigned int restartInterval,
+                    std::vector<uint8_t> &out) const;
+  void encodeSlice(const YuvImage &image, unsigned int first,
+                   unsigned int last, std::vector<uint8_t> &out) const;
+
+  unsigned int slices_;
+  uint8_t quant_[2][64];   // zigzag order, as stored in DQT
+  float divisor_[2][64];   // natural order, reciprocal of the scaled quantizer
+};
+
+#endif // JPEG_ENCODER_H
@@ -0,0 +1,113 @@
+#ifndef LENS_REMAP_H
+#define LENS_REMAP_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+
+// Pinhole intrinsics and Brown-Conrady distortion, the model used by
+// OpenCV's calibration (k1, k2, p1, p2, k3), in pixels of the calibration
+// resolution. Frames of another size get the intrinsics scaled to theirs.
+struct LensModel {
+  double fx = 0.0;
+  double fy = 0.0;
+  double cx = 0.0;
+  double cy = 0.0;
+  double k1 = 0.0;
+  double k2 = 0.0;
+  double p1 = 0.0;
+  double p2 = 0.0;
+  double k3 = 0.0;
+  unsigned int width = 0;  // calibration resolution, 0 for the frame's
+  unsigned int height = 0;
+  double zoom = 1.0; // focal length of the output relative to fx, fy
+};
+
+// Parse "fx,fy,cx,cy,k1,k2[,p1,p2[,k3]]".
+bool parseLensModel(const std::string &arg, LensModel &model);
+
+// Default directory of cached maps: $XDG_CACHE_HOME/onecam, or
+// $HOME/.cache/onecam.
+std::string defaultLensCacheDir();
+
+// Lens undistortion with precomputed remap tables.
+//
+// configure() computes, for every output pixel of every plane, the source
+// position it samples, once per lens model, format and size. A map entry
+// is 6 bytes: integer source coordinates and 7 bit bilinear fractions.
+// Entries are stored tile by tile, in the order apply() walks them, so
+// each tile reads its map sequentially and a compact area of the source
+// that stays in cache. Tiles are spread over the shared thread pool.
+//
+// Maps can be cached on disk, keyed by everything they depend on, so a
+// restart loads them instead of evaluating the model per pixel again.
+class LensRemap {
+public:
+  LensRemap() = default;
+
+  // Build the maps for frames of this format and size, or load them from
+  // cacheDir when it holds them; an empty cacheDir disables the cache.
+  // Returns 0, or -EINVAL for unsupported formats or models.
+  int configure(const LensModel &model, FrameFormat format,
+                unsigned int width, unsigned int height,
+                const std::string &cacheDir = std::string());
+
+  bool isConfigured() const { return !maps_.empty(); }
+  bool fromCache() const { return fromCache_; }
+
+  // The file the maps were loaded from or saved to, empty if neither.
+  const std::string &cachePath() const { return cachePath_; }
+  size_t mapBytes() const;
+
+  // Undistort src into dst, both of the configured format and size.
+  // Pixels mapping outside the source are black. Returns 0 or -EINVAL.
+  int apply(const FrameView &src, const FrameView &dst) const;
+
+  struct Entry {
+    uint16_t x; // top left source sample, kOutside when there is none
+    uint16_t y;
+    uint8_t fx; // fractions of the next sample, 0 to 128
+    uint8_t fy;
+  };
+
+  static constexpr uint16_t kOutside = 0xffff;
+
+private:
+  // One map per distinct plane sampling grid.
+  struct Map {
+    unsigned int width;
+    unsigned int height;
+    unsigned int hSub;
+    unsigned int vSub;
+    unsigned int tileWidth;
+    unsigned int tileHeight;
+    std::vector<Entry> entries; // tile-major, rows within a tile
+  };
+
+  // Samples of one colour component (or interleaved group) of a plane.
+  struct Channel {
+    unsigned int plane;
+    unsigned int offset;     // of the first sample in a row, in bytes
+    unsigned int step;       // between samples, in bytes
+    unsigned int components; // interleaved bytes per sample
+    unsigned int map;
+    uint8_t fill;            // value of pixels outside the source
+  };
+
+  void buildMap(const LensModel &model, Map &map) const;
+  bool loadCache(const std::string &path);
+  int saveCache(const std::string &path) const;
+
+  FrameFormat format_ = FrameFormat::Unknown;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  std::vector<Map> maps_;
+  std::vector<Channel> channels_;
+  std::vector<uint8_t> key_;
+  bool fromCache_ = false;
+  std::string cachePath_;
+};
+
+#endif // LENS_REMAP_H
@@ -0,0 +1,41 @@
+#ifndef LOSSLESS_CODEC_H
+#define LOSSLESS_CODEC_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "frame_view.h"
+
+// Intra-only lossless frame codec for recording, in the spirit of FFV1
+// and JPEG-LS. Samples are predicted with the median edge detector from
+// their left, upper and upper-left neighbours of the same component, and
+// residuals are Rice coded with a parameter per local-gradient context
+// chosen for the whole tile. RGB formats are decorrelated as (R-G, G, B-G)
+// first, and components constant over a tile (e.g. the X byte) are not
+// coded at all.
+//
+// Every plane is split into bands of rows (tiles) coded independently, so
+// tiles are encoded and decoded in parallel. The payload only depends on
+// the pixels, format and size:
+//
+//   uint32_t tileRows, tileCount, tileSize[tileCount], tile data...
+//
+// all little endian, tiles ordered by plane then band.
+class LosslessEncoder {
+public:
+  explicit LosslessEncoder(unsigned int tileRows = 32);
+
+  // Replace out with the compressed visible pixels of the view.
+  void encode(const FrameView &view, std::vector<uint8_t> &out);
+
+private:
+  unsigned int tileRows_;
+  std::vector<std::vector<uint8_t>> tiles_;
+};
+
+// Decode a payload into a view of the format and size it was encoded
+// from. Returns false if the payload is truncated or corrupt.
+bool decodeLossless(const uint8_t *data, size_t size, const FrameView &view);
+
+#endif // LOSSLESS_CODEC_H
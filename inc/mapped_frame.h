@@ -0,0 +1,49 @@
+#ifndef MAPPED_FRAME_H
+#define MAPPED_FRAME_H
+
+#include <sys/mman.h>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "frame_view.h"
+
+FrameFormat frameFormatFromPixelFormat(const libcamera::PixelFormat &format);
+
+// CPU mapping of a FrameBuffer. Planes sharing a dmabuf are mapped once,
+// and the result is exposed as a FrameView described by the stream
+// configuration. CPU access is bracketed with DMA_BUF_IOCTL_SYNC for the
+// lifetime of the object; unmapped on destruction.
+//
+// Buffers that are already mapped for good, such as those of a BufferPool,
+// pass that mapping as memory and are not mapped again; it must cover the
+// whole buffer from offset 0 with at least prot access.
+class MappedFrame {
+public:
+  MappedFrame(const libcamera::FrameBuffer *buffer,
+              const libcamera::StreamConfiguration &config,
+              int prot = PROT_READ, uint8_t *memory = nullptr);
+  ~MappedFrame();
+
+  MappedFrame(const MappedFrame &) = delete;
+  MappedFrame &operator=(const MappedFrame &) = delete;
+
+  bool isValid() const { return view_.isValid(); }
+  const FrameView &view() const { return view_; }
+
+private:
+  struct Mapping {
+    int fd;
+    void *address;
+    size_t length;
+    bool owned;
+    bool synced;
+  };
+
+  int prot_;
+
+  std::vector<Mapping> mappings_;
+  FrameView view_;
+};
+
+#endif // MAPPED_FRAME_H
@@ -0,0 +1,96 @@
+#ifndef MOTION_DETECTOR_H
+#define MOTION_DETECTOR_H
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_view.h"
+#include "roi.h"
+
+struct MotionConfig {
+  unsigned int scale = 4;          // luma is downscaled by 4 or 8
+  unsigned int threshold = 16;     // luma difference to the background
+  unsigned int minArea = 12;       // low-res pixels of the smallest blob
+  unsigned int learnShift = 4;     // background moves 1/2^n per frame
+  unsigned int triggerFrames = 2;  // frames with motion before Started
+  unsigned int releaseFrames = 30; // frames without motion before Stopped
+};
+
+// Connected region of changed pixels, in full resolution coordinates.
+struct MotionBlob {
+  Roi box;
+  unsigned int area; // in low-res pixels
+};
+
+enum class MotionEvent {
+  None,
+  Started,
+  Stopped,
+};
+
+// Cheap motion detection on a low-resolution luma plane.
+//
+// Every frame is box-filtered down to a luma plane 1/scale the size and
+// compared against a background model, a running average kept with 8
+// fractional bits. Pixels further than the threshold from the background
+// are foreground; they still join the background, but four times slower,
+// so objects that stop moving fade into it. Foreground pixels are grouped
+// into 8-connected blobs and blobs smaller than minArea are dropped as
+// noise. When more than half the plane changes at once, usually a
+// lighting or exposure change, the background is relearnt instead.
+//
+// Motion is reported with hysteresis: Started after triggerFrames
+// consecutive frames with blobs, Stopped after releaseFrames without.
+class MotionDetector {
+public:
+  explicit MotionDetector(const MotionConfig &config = MotionConfig());
+
+  // Analyse a frame. The first frame, and any frame of a different size,
+  // only (re)initialises the background.
+  MotionEvent process(const FrameView &view);
+  void reset();
+
+  bool active() const { return active_; }
+
+  // Results of the last process() call.
+  const std::vector<MotionBlob> &blobs() const { return blobs_; }
+  unsigned int foreground() const { return foreground_; }
+
+  // Low-resolution planes, lumaWidth() x lumaHeight() pixels.
+  unsigned int lumaWidth() const { return width_; }
+  unsigned int lumaHeight() const { return height_; }
+  const std::vector<uint8_t> &luma() const { return luma_; }
+  const std::vector<uint8_t> &mask() const { return mask_; }
+
+private:
+  struct Run {
+    unsigned int y;
+    unsigned int x0; // first pixel
+    unsigned int x1; // one past the last pixel
+    uint32_t label;
+  };
+
+  void downscale(const FrameView &view);
+  void subtractBackground();
+  void findBlobs();
+
+  MotionConfig config_;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  FrameFormat format_ = FrameFormat::Unknown;
+
+  std::vector<uint8_t> luma_;
+  std::vector<uint16_t> background_; // 8.8 fixed point
+  std::vector<uint8_t> mask_;
+  unsigned int foreground_ = 0;
+
+  std::vector<Run> runs_;
+  std::vector<uint32_t> parent_;
+  std::vector<MotionBlob> blobs_;
+
+  bool active_ = false;
+  unsigned int moving_ = 0;
+  unsigned int quiet_ = 0;
+};
+
+#endif // MOTION_DETECTOR_H
@@ -23,6 +23,7 @@
 
 // libcamera headers
 #include <libcamera/libcamera.h>
+#include <libcamera/version.h>
 
 using namespace libcamera;
 using namespace std::chrono_literals;
@@ -0,0 +1,104 @@
+#ifndef PRIVACY_MASK_H
+#define PRIVACY_MASK_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+
+enum class MaskStyle {
+  Fill,
+  Blur,
+};
+
+bool parseMaskStyle(const std::string &name, MaskStyle &style);
+const char *maskStyleName(MaskStyle style);
+
+// A polygon in frame pixel coordinates; pixels whose centre lies inside
+// it (even-odd rule) are masked. Rectangles are four point polygons.
+struct MaskRegion {
+  struct Point {
+    int x;
+    int y;
+  };
+
+  std::vector<Point> points;
+};
+
+// Parse "x,y,w,h" as a rectangle or "x1,y1,x2,y2,x3,y3[,...]" as a
+// polygon of three or more points.
+bool parseMaskRegion(const std::string &arg, MaskRegion &region);
+
+struct MaskConfig {
+  MaskStyle style = MaskStyle::Blur;
+  unsigned int radius = 24; // of the blur box in pixels, at most 127
+  unsigned int passes = 3;  // box blurs, three approximate a Gaussian
+  uint8_t fill = 0;         // grey level of solid fills
+};
+
+// Privacy masking, applied in place on the frame.
+//
+// configure() rasterises the regions once into spans of masked samples
+// for every plane, so apply() only ever touches the masked rows. Fills
+// write the spans directly. Blurs work on a copy of the bounding boxes of
+// the regions, merged where they overlap: running-sum box filters, whose
+// cost doesn't depend on the radius, run down strips of columns, 16 at a
+// time in vector registers, and across the rows as the columns of the
+// transposed box. The spans are copied back from the result. Strips
+// and rows are spread over the shared thread pool.
+class PrivacyMask {
+public:
+  PrivacyMask() = default;
+
+  // Returns 0, or -EINVAL for unsupported formats, empty regions or a
+  // blur radius of 0 or above 127.
+  int configure(const std::vector<MaskRegion> &regions,
+                const MaskConfig &config, FrameFormat format,
+                unsigned int width, unsigned int height);
+
+  bool isConfigured() const { return !planes_.empty(); }
+
+  // Frame pixels covered by the regions.
+  size_t maskedPixels() const { return maskedPixels_; }
+
+  // Mask a frame of the configured format and size, in place. Returns 0
+  // or -EINVAL.
+  int apply(const FrameView &view) const;
+
+private:
+  // Masked samples [x0, x1) of row y, in sample groups of the plane.
+  struct Span {
+    unsigned int y;
+    unsigned int x0;
+    unsigned int x1;
+  };
+
+  struct Box {
+    unsigned int x0;
+    unsigned int y0;
+    unsigned int x1;
+    unsigned int y1;
+  };
+
+  struct Plane {
+    std::vector<Span> spans; // sorted by row
+    std::vector<Box> boxes;  // blurred areas
+    unsigned int radiusX;    // in sample groups
+    unsigned int radiusY;
+    uint8_t fill[4];         // one sample group
+  };
+
+  void fillPlane(const PlaneView &plane, const Plane &mask) const;
+  void blurBox(const PlaneView &plane, const Plane &mask,
+               const Box &box) const;
+
+  MaskConfig config_;
+  FrameFormat format_ = FrameFormat::Unknown;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  size_t maskedPixels_ = 0;
+  std::vector<Plane> planes_;
+};
+
+#endif // PRIVACY_MASK_H
@@ -0,0 +1,138 @@
+#ifndef RAW_CORRECTION_H
+#define RAW_CORRECTION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+
+// Layout of a raw Bayer stream, from its libcamera name, e.g. "SRGGB10"
+// or "SBGGR12_CSI2P". Unpacked samples are held in 16 bit containers.
+struct RawFormat {
+  unsigned int bitDepth = 0;
+  bool packed = false; // MIPI CSI-2 packing
+};
+
+bool parseRawFormat(const std::string &name, RawFormat &format);
+
+// Parse "N" or "N,N,N,N" black levels, for the four positions of the 2x2
+// colour filter pattern in raster order.
+bool parseBlackLevel(const std::string &arg, uint16_t blackLevel[4]);
+
+// Sensor calibration from a capture with the lens covered, memory mapped
+// read-only from the file written by RawCalibrator.
+//
+// The file holds a header, the dark frame relative to the black level of
+// its colour channel as one signed 16 bit value per pixel, then the
+// sorted raster indices of the defective pixels, all in host byte order.
+class RawCalibration {
+public:
+  RawCalibration() = default;
+  ~RawCalibration();
+
+  RawCalibration(const RawCalibration &) = delete;
+  RawCalibration &operator=(const RawCalibration &) = delete;
+
+  // Returns 0, -errno if the file can't be mapped, or -EINVAL if it isn't
+  // a calibration file.
+  int load(const std::string &path);
+
+  bool isLoaded() const { return data_ != nullptr; }
+
+  unsigned int width() const { return width_; }
+  unsigned int height() const { return height_; }
+  unsigned int bitDepth() const { return bitDepth_; }
+  const uint16_t *blackLevel() const { return blackLevel_; }
+
+  // Fixed pattern of the dark signal around the black level, width() by
+  // height() values.
+  const int16_t *darkFrame() const { return darkFrame_; }
+
+  const uint32_t *defects() const { return defects_; }
+  size_t defectCount() const { return defectCount_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  unsigned int bitDepth_ = 0;
+  uint16_t blackLevel_[4] = {};
+  const int16_t *darkFrame_ = nullptr;
+  const uint32_t *defects_ = nullptr;
+  size_t defectCount_ = 0;
+};
+
+// Averages dark frames into a calibration file. The black level of every
+// colour channel is the median of its averaged pixels, the dark frame
+// what each pixel adds to it. Pixels whose dark signal stays above it by
+// more than a threshold are hot and go into the defect map.
+class RawCalibrator {
+public:
+  RawCalibrator() = default;
+
+  // Returns 0, or -EINVAL for an empty size or a bit depth above 16.
+  int configure(unsigned int width, unsigned int height,
+                unsigned int bitDepth);
+
+  // Accumulate a RAW16 frame of the configured size. Returns 0 or -EINVAL.
+  int add(const FrameView &view);
+  unsigned int frames() const { return frames_; }
+
+  // Write the calibration, replacing the file atomically. A threshold of
+  // 0 picks 1/64 of the sample range. Returns 0 or -errno.
+  int save(const std::string &path, unsigned int threshold = 0) const;
+
+private:
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  unsigned int bitDepth_ = 0;
+  unsigned int frames_ = 0;
+  std::vector<uint32_t> sums_;
+};
+
+// Raw domain sensor corrections, applied in place on RAW16 frames before
+// anything else reads them.
+//
+// The black level of the pixel's colour channel, offset by the calibrated
+// dark signal of the pixel, is subtracted with saturating 16 bit
+// arithmetic, eight pixels at a time in vector registers, over bands of
+// rows on the shared thread pool. Defective pixels are then replaced by
+// the mean of their nearest neighbours of the same colour, which
+// configure() has picked once, leaving out other defects.
+class RawCorrector {
+public:
+  RawCorrector() = default;
+
+  // Correct frames of this size with the calibration, if any, and the
+  // black levels, or those of the calibration when blackLevel is null.
+  // The calibration must outlive the corrector. Returns 0, or -EINVAL
+  // when the calibration is for another size, a black level is above
+  // 32767 or there's nothing to correct.
+  int configure(unsigned int width, unsigned int height,
+                const uint16_t *blackLevel,
+                const RawCalibration *calibration = nullptr);
+
+  bool isConfigured() const { return width_ != 0; }
+
+  // Correct a RAW16 frame of the configured size in place. Returns 0 or
+  // -EINVAL.
+  int apply(const FrameView &view) const;
+
+private:
+  struct Defect {
+    unsigned int x;
+    unsigned int y;
+    uint8_t neighbours; // bit i set when kNeighbours[i] is usable
+  };
+
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  uint16_t blackLevel_[4] = {};
+  const int16_t *darkFrame_ = nullptr;
+  std::vector<Defect> defects_;
+};
+
+#endif // RAW_CORRECTION_H
@@ -0,0 +1,29 @@
+#ifndef RAW_PACKING_H
+#define RAW_PACKING_H
+
+#include "frame_view.h"
+
+// MIPI CSI-2 packed Bayer formats: RAW10P stores four samples in five
+// bytes, their upper 8 bits then a byte of the four lower 2 bit pairs;
+// RAW12P stores two samples in three bytes the same way. Unpacked, the
+// samples are right aligned in RAW16 words.
+//
+// Rows are converted with byte shuffles, 16 samples at a time with AVX2
+// when the CPU has it or with NEON, in bands of rows on the shared thread
+// pool. Source and destination must not overlap.
+
+// Packed format of a bit depth, or FrameFormat::Unknown.
+FrameFormat packedRawFormat(unsigned int bitDepth);
+
+// Unpack a RAW10P or RAW12P view into a RAW16 view of the same size.
+// Returns 0, or -EINVAL for mismatched views.
+int unpackRaw(const FrameView &src, const FrameView &dst);
+
+// Pack a RAW16 view into a RAW10P or RAW12P view of the same size.
+// Samples above the packed bit depth are clipped. Returns 0 or -EINVAL.
+int packRaw(const FrameView &src, const FrameView &dst);
+
+// Name of the kernels selected at runtime, for reporting.
+const char *rawPackingImplementation();
+
+#endif // RAW_PACKING_H
@@ -0,0 +1,85 @@
+#ifndef REQUEST_QUEUE_H
+#define REQUEST_QUEUE_H
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <libcamera/libcamera.h>
+
+#include "depth_controller.h"
+#include "frame_handle.h"
+
+class BufferPool;
+
+// Owns the decision of which requests are queued to the camera. Completed
+// requests are handed back through requeue(), or automatically when the
+// last FrameHandle from acquire() is dropped; they are either queued again
+// or parked until the depth controller asks for more requests in flight.
+//
+// Spare requests are never counted in the target depth, so while consumers
+// hold frames the camera keeps being fed from the spares.
+class RequestQueue {
+public:
+  RequestQueue(std::shared_ptr<libcamera::Camera> camera, DepthPolicy policy,
+               unsigned int minDepth, unsigned int spares = 0);
+
+  // Register the requests to cycle; they all start idle.
+  void add(const std::vector<std::unique_ptr<libcamera::Request>> &requests);
+  // Queue up to the initial depth. Call after Camera::start().
+  void start();
+
+  // Called with every request just before it's queued, with the queue
+  // locked, e.g. to set per-frame controls, which reuse() clears.
+  void setPrepare(std::function<void(libcamera::Request *)> prepare);
+  // Pool the request buffers come from, if any, so that frames use its
+  // mapping. It must outlive the queue.
+  void setBufferPool(const BufferPool *pool) { pool_ = pool; }
+
+  // Call first thing in the requestCompleted slot. Queues idle requests
+  // to make up for the one that completed.
+  void completed(libcamera::Request *request);
+  // Give a completed request back for reuse.
+  void requeue(libcamera::Request *request);
+  // Wrap a completed request in a shared handle which requeues it on
+  // release. Handles must not outlive the queue. prot is passed on to
+  // the frame's mapping.
+  FrameHandle acquire(libcamera::Request *request,
+                      const libcamera::StreamConfiguration &config,
+                      int prot = PROT_READ);
+  // Stop requeueing; requests released from now on stay idle.
+  void stop();
+
+  unsigned int depth() const;
+  unsigned int inFlight() const;
+  unsigned int drops() const;
+  unsigned int held() const;
+  unsigned int starved() const;
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  void fill();
+  void release(libcamera::Request *request);
+
+  std::shared_ptr<libcamera::Camera> camera_;
+  DepthController controller_;
+  DepthPolicy policy_;
+  unsigned int minDepth_;
+  unsigned int spares_;
+  std::function<void(libcamera::Request *)> prepare_;
+  const BufferPool *pool_ = nullptr;
+
+  mutable std::mutex lock_;
+  std::vector<libcamera::Request *> idle_;
+  std::unordered_map<libcamera::Request *, Clock::time_point> completedAt_;
+  unsigned int inFlight_ = 0;
+  unsigned int held_ = 0;
+  unsigned int starved_ = 0;
+  bool stopped_ = false;
+};
+
+#endif // REQUEST_QUEUE_H
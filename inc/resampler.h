@@ -0,0 +1,66 @@
+#ifndef RESAMPLER_H
+#define RESAMPLER_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "frame_view.h"
+
+enum class ResampleFilter {
+  Box,      // area average, best for integer downscales
+  Bilinear, // triangle, widened when downscaling
+  Lanczos,  // Lanczos-3, sharpest, slowest
+};
+
+bool parseResampleFilter(const std::string &name, ResampleFilter &filter);
+const char *resampleFilterName(ResampleFilter filter);
+
+struct ResampleSize {
+  unsigned int width;
+  unsigned int height;
+};
+
+// Parse "WxH[,WxH...]".
+bool parseResampleSizes(const std::string &arg,
+                        std::vector<ResampleSize> &sizes);
+
+// Separable image resampler with 14 bit fixed point coefficients.
+//
+// Rows are filtered vertically first, every byte of a row alike whatever
+// the pixel layout, then horizontally per component into the output. The
+// coefficients of each source/output size pair are computed once and
+// kept. Source rows are split into bands resampled in parallel, and each
+// band produces its rows of every output before moving on, so several
+// output sizes cost a single read of the source.
+class Resampler {
+public:
+  explicit Resampler(ResampleFilter filter = ResampleFilter::Bilinear);
+
+  ResampleFilter filter() const { return filter_; }
+
+  // Resample src into every output. Outputs must have the format of src;
+  // sizes are free, up or down. Returns 0 or -EINVAL.
+  int resample(const FrameView &src, const FrameView *outputs,
+               size_t count);
+  int resample(const FrameView &src, const FrameView &output) {
+    return resample(src, &output, 1);
+  }
+
+  // Filter taps of one axis.
+  struct Axis {
+    unsigned int taps;
+    std::vector<unsigned int> start;  // first source sample per output
+    std::vector<int16_t> weights;     // taps per output, sum 1 << 14
+  };
+
+private:
+  const Axis &axis(unsigned int srcSize, unsigned int dstSize);
+
+  ResampleFilter filter_;
+  std::map<std::pair<unsigned int, unsigned int>, Axis> axes_;
+};
+
+#endif // RESAMPLER_H
@@ -0,0 +1,30 @@
+#ifndef ROI_H
+#define ROI_H
+
+#include <string>
+
+#include "frame_view.h"
+
+// Region of interest in output pixel coordinates.
+struct Roi {
+  unsigned int x = 0;
+  unsigned int y = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+
+  bool isNull() const { return !width || !height; }
+};
+
+// Parse "x,y,width,height".
+bool parseRoi(const std::string &arg, Roi &roi);
+
+// Clamp the ROI to a width x height frame and align it to the chroma
+// subsampling of the format, so every plane can be cropped exactly.
+Roi alignRoi(const Roi &roi, FrameFormat format, unsigned int width,
+             unsigned int height);
+
+// Zero-copy crop: the returned view points into the memory of the source
+// view and keeps its strides. The ROI must already be aligned.
+FrameView cropFrameView(const FrameView &view, const Roi &roi);
+
+#endif // ROI_H
@@ -0,0 +1,287 @@
+#ifndef ROW_PIPELINE_H
+#define ROW_PIPELINE_H
+
+// Fused row-streaming pipelines composed at compile time.
+//
+// Chaining whole-frame operations rereads the frame, and every
+// intermediate image, from memory for each of them. A RowPipeline instead
+// pushes one row at a time through all its stages: intermediate rows are
+// a few kilobytes that stay in L1, and the frame is read exactly once.
+//
+//   uint32_t histogram[256] = {};
+//   auto pipeline = makeRowPipeline(Downscale2x(), Downscale2x(),
+//                                   Histogram(histogram));
+//   dispatchFormat(frameFormatFromPixelFormat(config.pixelFormat),
+//                  [&](auto format) {
+//                    runGray<decltype(format)::value>(view, pipeline);
+//                  });
+//
+// Every stage is a plain class with two members, templated on the rest of
+// the pipeline so the compiler inlines the whole chain into the row loop:
+//
+//   template<typename Next> void push(const uint8_t *row, unsigned int width,
+//                                     Next &next);
+//   template<typename Next> void flush(Next &next);
+//
+// push() forwards zero or more rows to next.push(row, width); flush() is
+// called at the end of a frame and must reset the stage for the next one.
+// Stages that only observe rows, like Histogram, pass them on unchanged so
+// they can sit anywhere in the chain. Stages own their row buffers, so a pipeline
+// allocates on its first frame only.
+
+#include <algorithm>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "frame_view.h"
+
+/* -------------------------------------------------------------------------
+ * Composition
+ */
+
+template<typename... Stages>
+class RowPipeline;
+
+template<>
+class RowPipeline<> {
+public:
+  void push(const uint8_t *, unsigned int) {}
+  void flush() {}
+};
+
+template<typename Stage, typename... Rest>
+class RowPipeline<Stage, Rest...> {
+public:
+  explicit RowPipeline(Stage stage, Rest... rest)
+    : stage_(std::move(stage)), next_(std::move(rest)...) {}
+
+  void push(const uint8_t *row, unsigned int width) {
+    stage_.push(row, width, next_);
+  }
+
+  void flush() {
+    stage_.flush(next_);
+    next_.flush();
+  }
+
+  Stage &stage() { return stage_; }
+  RowPipeline<Rest...> &next() { return next_; }
+
+private:
+  Stage stage_;
+  RowPipeline<Rest...> next_;
+};
+
+template<typename... Stages>
+RowPipeline<Stages...> makeRowPipeline(Stages... stages) {
+  return RowPipeline<Stages...>(std::move(stages)...);
+}
+
+/* -------------------------------------------------------------------------
+ * Sources
+ */
+
+template<FrameFormat F>
+using FormatTag = std::integral_constant<FrameFormat, F>;
+
+// Call fn with the FormatTag of a runtime format, instantiating it for
+// every format the sources support. Returns false for other formats.
+template<typename Fn>
+bool dispatchFormat(FrameFormat format, Fn &&fn) {
+  switch (format) {
+  case FrameFormat::XRGB8888:
+    fn(FormatTag<FrameFormat::XRGB8888>());
+    return true;
+  case FrameFormat::XBGR8888:
+    fn(FormatTag<FrameFormat::XBGR8888>());
+    return true;
+  case FrameFormat::RGB888:
+    fn(FormatTag<FrameFormat::RGB888>());
+    return true;
+  case FrameFormat::BGR888:
+    fn(FormatTag<FrameFormat::BGR888>());
+    return true;
+  case FrameFormat::YUYV:
+    fn(FormatTag<FrameFormat::YUYV>());
+    return true;
+  case FrameFormat::UYVY:
+    fn(FormatTag<FrameFormat::UYVY>());
+    return true;
+  case FrameFormat::NV12:
+    fn(FormatTag<FrameFormat::NV12>());
+    return true;
+  case FrameFormat::NV21:
+    fn(FormatTag<FrameFormat::NV21>());
+    return true;
+  case FrameFormat::YUV420:
+    fn(FormatTag<FrameFormat::YUV420>());
+    return true;
+  case FrameFormat::R8:
+    fn(FormatTag<FrameFormat::R8>());
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Width of the gray rows of a frame of format F. Packed 4:2:2 rows only
+// hold whole macropixels, so the last column of an odd width is dropped.
+template<FrameFormat F>
+inline unsigned int grayWidth(const FrameView &view) {
+  if constexpr (F == FrameFormat::YUYV || F == FrameFormat::UYVY)
+    return view.planes[0].width * 2;
+  else
+    return view.width;
+}
+
+// Gray row y of a frame of format F. Formats with a luma plane return it
+// in place; others are converted into buffer, which holds grayWidth()
+// bytes. RGB uses BT.601 luma, (77 R + 150 G + 29 B) / 256.
+template<FrameFormat F>
+inline const uint8_t *grayRow(const FrameView &view, unsigned int y,
+                              uint8_t *buffer) {
+  const uint8_t *src = view.planes[0].row(y);
+  unsigned int width = grayWidth<F>(view);
+
+  if constexpr (F == FrameFormat::NV12 || F == FrameFormat::NV21 ||
+                F == FrameFormat::YUV420 || F == FrameFormat::R8) {
+    return src;
+  } else if constexpr (F == FrameFormat::YUYV || F == FrameFormat::UYVY) {
+    constexpr unsigned int offset = F == FrameFormat::UYVY;
+    for (unsigned int x = 0; x < width; ++x)
+      buffer[x] = src[2 * x + offset];
+    return buffer;
+  } else {
+    constexpr unsigned int bpp =
+        F == FrameFormat::XRGB8888 || F == FrameFormat::XBGR8888 ? 4 : 3;
+    // XRGB8888 and RGB888 are B G R in memory, the others R G B.
+    constexpr unsigned int r =
+        F == FrameFormat::XRGB8888 || F == FrameFormat::RGB888 ? 2 : 0;
+    constexpr unsigned int b = 2 - r;
+    for (unsigned int x = 0; x < width; ++x, src += bpp)
+      buffer[x] = (77 * src[r] + 150 * src[1] + 29 * src[b]) >> 8;
+    return buffer;
+  }
+}
+
+// Stream the gray rows of a frame through a pipeline, then flush it.
+template<FrameFormat F, typename Pipeline>
+void runGray(const FrameView &view, Pipeline &pipeline) {
+  thread_local std::vector<uint8_t> buffer;
+  unsigned int width = grayWidth<F>(view);
+  buffer.resize(width);
+
+  for (unsigned int y = 0; y < view.height; ++y)
+    pipeline.push(grayRow<F>(view, y, buffer.data()), width);
+
+  pipeline.flush();
+}
+
+/* -------------------------------------------------------------------------
+ * Stages
+ */
+
+// Halve both dimensions with a rounded 2x2 box filter. An odd last row or
+// column is dropped.
+class Downscale2x {
+public:
+  template<typename Next>
+  void push(const uint8_t *row, unsigned int width, Next &next) {
+    unsigned int half = width / 2;
+
+    // The upstream row buffer is reused, so keep a copy of the first row
+    // of each pair. Rows are bytes and may alias anything: work on local
+    // pointers so the loop doesn't reload the vectors' data every store.
+    if (!odd_) {
+      previous_.assign(row, row + width);
+    } else {
+      out_.resize(half);
+      const uint8_t *above = previous_.data();
+      uint8_t *out = out_.data();
+      for (unsigned int x = 0; x < half; ++x)
+        out[x] = (above[2 * x] + above[2 * x + 1] + row[2 * x] +
+                  row[2 * x + 1] + 2) >> 2;
+      next.push(out, half);
+    }
+
+    odd_ = !odd_;
+  }
+
+  template<typename Next>
+  void flush(Next &) { odd_ = false; }
+
+private:
+  std::vector<uint8_t> previous_;
+  std::vector<uint8_t> out_;
+  bool odd_ = false;
+};
+
+// Add the rows to a 256 bin histogram owned by the caller.
+class Histogram {
+public:
+  explicit Histogram(uint32_t (&bins)[256]) : bins_(bins) {}
+
+  template<typename Next>
+  void push(const uint8_t *row, unsigned int width, Next &next) {
+    uint32_t *bins = bins_;
+    for (unsigned int x = 0; x < width; ++x)
+      bins[row[x]]++;
+    next.push(row, width);
+  }
+
+  template<typename Next>
+  void flush(Next &) {}
+
+private:
+  uint32_t (&bins_)[256];
+};
+
+// Store the rows into a plane, e.g. of an R8 frame. Rows beyond the
+// plane's height are not stored.
+class StoreRows {
+public:
+  explicit StoreRows(const PlaneView &plane) : plane_(plane) {}
+
+  template<typename Next>
+  void push(const uint8_t *row, unsigned int width, Next &next) {
+    if (y_ < plane_.height)
+      std::copy_n(row, std::min<size_t>(width, plane_.rowBytes()),
+                  plane_.row(y_++));
+    next.push(row, width);
+  }
+
+  template<typename Next>
+  void flush(Next &) { y_ = 0; }
+
+private:
+  PlaneView plane_;
+  unsigned int y_ = 0;
+};
+
+// Pass rows through unchanged while calling fn(row, width) on them.
+template<typename Fn>
+class Tap {
+public:
+  explicit Tap(Fn fn) : fn_(std::move(fn)) {}
+
+  template<typename Next>
+  void push(const uint8_t *row, unsigned int width, Next &next) {
+    fn_(row, width);
+    next.push(row, width);
+  }
+
+  template<typename Next>
+  void flush(Next &) {}
+
+private:
+  Fn fn_;
+};
+
+template<typename Fn>
+Tap<Fn> makeTap(Fn fn) {
+  return Tap<Fn>(std::move(fn));
+}
+
+#endif // ROW_PIPELINE_H
@@ -0,0 +1,212 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Shared-memory frame ring: layout and header-only reader.
+//
+// A publisher exports frames into /dev/shm/<name>. Readers map the ring
+// and access frames without any syscall: every slot descriptor is guarded
+// by a seqlock, odd while the publisher writes the slot. A reader takes a
+// snapshot of the descriptor, consumes the pixels in place, then checks
+// the descriptor is unchanged to know the data was not overwritten.
+//
+//   +--------------+-------------------+--------+--------+-----+
+//   | ShmRingHeader| ShmSlotDescriptor | slot 0 | slot 1 | ... |
+//   |              | x slotCount       |        |        |     |
+//   +--------------+-------------------+--------+--------+-----+
+//
+// Only depends on the C++ standard library and POSIX, so it can be
+// copied into consumer projects on its own.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static constexpr uint32_t kShmRingMagic = 0x4d524e47; // "GNRM"
+static constexpr uint32_t kShmRingVersion = 1;
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free,
+              "shared memory atomics must be lock free");
+
+struct alignas(64) ShmRingHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t slotCount;
+  uint32_t numPlanes;
+  uint64_t slotSize;   // bytes between slots, page aligned
+  uint64_t dataOffset; // offset of slot 0 from the start of the ring
+
+  // Image layout of every slot: planes are packed without row padding.
+  uint32_t format; // FrameFormat value
+  uint32_t width;
+  uint32_t height;
+  uint32_t planeStride[3];
+  uint64_t planeOffset[3];
+
+  // Number of frames ever published; the latest is in slot
+  // (writeIndex - 1) % slotCount.
+  std::atomic<uint64_t> writeIndex;
+};
+
+struct alignas(64) ShmSlotDescriptor {
+  std::atomic<uint64_t> seq; // odd while the slot is written
+  uint64_t frameIndex;       // position in the publication order
+  uint64_t sequence;         // camera frame sequence number
+  uint64_t timestamp;        // sensor timestamp, ns
+  uint64_t bytesUsed;
+};
+
+class ShmRingReader {
+public:
+  struct FrameRef {
+    uint32_t slot = 0;
+    uint64_t seq = 0;
+    uint64_t frameIndex = 0;
+    uint64_t sequence = 0;
+    uint64_t timestamp = 0;
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+  };
+
+  ShmRingReader() = default;
+  ~ShmRingReader() { close(); }
+
+  ShmRingReader(const ShmRingReader &) = delete;
+  ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+  bool open(const std::string &name) {
+    close();
+
+    int fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+      return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(ShmRingHeader)) {
+      ::close(fd);
+      return false;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mem == MAP_FAILED)
+      return false;
+
+    base_ = static_cast<const uint8_t *>(mem);
+    size_ = st.st_size;
+
+    const ShmRingHeader *h = header();
+    if (h->magic != kShmRingMagic || h->version != kShmRingVersion ||
+        h->dataOffset + h->slotSize * h->slotCount > size_) {
+      close();
+      return false;
+    }
+
+    return true;
+  }
+
+  void close() {
+    if (base_)
+      munmap(const_cast<uint8_t *>(base_), size_);
+    base_ = nullptr;
+    size_ = 0;
+  }
+
+  bool isOpen() const { return base_ != nullptr; }
+
+  const ShmRingHeader *header() const {
+    return reinterpret_cast<const ShmRingHeader *>(base_);
+  }
+
+  uint64_t writeIndex() const {
+    return header()->writeIndex.load(std::memory_order_acquire);
+  }
+
+  // Snapshot the most recent frame. Returns false if nothing has been
+  // published yet or the slot is being rewritten right now.
+  bool latest(FrameRef &ref) const {
+    uint64_t index = writeIndex();
+    if (!index)
+      return false;
+
+    return snapshot(index - 1, ref);
+  }
+
+  // Snapshot the frame at publication index `cursor`, and advance the
+  // cursor. Frames already overwritten are skipped: the cursor jumps to
+  // the oldest frame still in the ring. Returns false when caught up.
+  bool next(uint64_t &cursor, FrameRef &ref) const {
+    uint64_t index = writeIndex();
+    uint32_t slots = header()->slotCount;
+
+    while (cursor < index) {
+      if (index - cursor > slots)
+        cursor = index - slots;
+
+      if (snapshot(cursor++, ref))
+        return true;
+    }
+
+    return false;
+  }
+
+  // True if the frame data read since the snapshot is consistent.
+  bool valid(const FrameRef &ref) const {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return descriptor(ref.slot)->seq.load(std::memory_order_relaxed) == ref.seq;
+  }
+
+  // Copy the latest frame out, retrying if the publisher overwrote it
+  // during the copy.
+  bool copyLatest(void *dst, size_t size, FrameRef &ref) const {
+    for (unsigned int retry = 0; retry < 8; ++retry) {
+      if (!latest(ref))
+        return false;
+
+      memcpy(dst, ref.data, std::min(size, ref.size));
+      if (valid(ref))
+        return true;
+    }
+
+    return false;
+  }
+
+private:
+  const ShmSlotDescriptor *descriptor(uint32_t slot) const {
+    return reinterpret_cast<const ShmSlotDescriptor *>(
+               base_ + sizeof(ShmRingHeader)) +
+           slot;
+  }
+
+  bool snapshot(uint64_t index, FrameRef &ref) const {
+    const ShmRingHeader *h = header();
+    uint32_t slot = index % h->slotCount;
+    const ShmSlotDescriptor *desc = descriptor(slot);
+
+    uint64_t seq = desc->seq.load(std::memory_order_acquire);
+    if (seq & 1)
+      return false;
+
+    ref.slot = slot;
+    ref.seq = seq;
+    ref.frameIndex = desc->frameIndex;
+    ref.sequence = desc->sequence;
+    ref.timestamp = desc->timestamp;
+    ref.size = desc->bytesUsed;
+    ref.data = base_ + h->dataOffset + slot * h->slotSize;
+
+    // The slot must still hold the requested frame.
+    return valid(ref) && ref.frameIndex == index;
+  }
+
+  const uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+};
+
+#endif // SHM_RING_H
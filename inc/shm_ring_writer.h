@@ -0,0 +1,36 @@
+#ifndef SHM_RING_WRITER_H
+#define SHM_RING_WRITER_H
+
+#include <string>
+
+#include "frame_view.h"
+#include "shm_ring.h"
+
+// Publisher side of the shared-memory frame ring (see shm_ring.h).
+class ShmRingWriter {
+public:
+  ShmRingWriter() = default;
+  ~ShmRingWriter();
+
+  ShmRingWriter(const ShmRingWriter &) = delete;
+  ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+  // Create /dev/shm/<name> sized for slotCount frames of the given layout.
+  int open(const std::string &name, unsigned int slotCount,
+           FrameFormat format, unsigned int width, unsigned int height);
+  void close();
+
+  // Copy a frame into the next slot and publish it. The view must match
+  // the format and size the ring was opened with.
+  void write(const FrameView &view, uint64_t sequence, uint64_t timestamp);
+
+private:
+  ShmSlotDescriptor *descriptor(uint32_t slot);
+
+  std::string name_;
+  uint8_t *base_ = nullptr;
+  size_t size_ = 0;
+  ShmRingHeader *header_ = nullptr;
+};
+
+#endif // SHM_RING_WRITER_H
@@ -0,0 +1,113 @@
+#ifndef TEMPORAL_DENOISE_H
+#define TEMPORAL_DENOISE_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "frame_view.h"
+
+struct DenoiseConfig {
+  unsigned int frames = 8;     // frames averaged into each output, 2-256
+  unsigned int tileSize = 32;  // pixels, rounded down to a multiple of 2
+  unsigned int threshold = 6;  // mean sample difference of a still tile,
+                               // 0 weights every frame the same
+};
+
+// Temporal denoising by stacking frames of a static scene: every sample
+// is summed over a stack of frames, and the average is emitted once the
+// stack is full, at 1/frames of the input rate.
+//
+// The first frame of a stack is its reference. With a threshold, later
+// frames are weighted per tile by their mean absolute difference to it:
+// fully up to the threshold, down to nothing at twice the threshold, so
+// moving tiles keep the reference instead of ghosting.
+//
+// Samples are summed in 16 bit accumulators when the stack can't
+// overflow them, 8 bit samples in stacks of up to 64 weighted or 256
+// unweighted frames, otherwise in 32 bit ones, 8 or 16 samples at a time
+// in vector registers. Rows of tiles are processed in parallel on the
+// shared thread pool. The accumulators, reference, tile weights and
+// output live in one arena allocated by configure(), so frames are
+// stacked without allocating.
+class TemporalDenoiser {
+public:
+  TemporalDenoiser() = default;
+  ~TemporalDenoiser();
+
+  TemporalDenoiser(const TemporalDenoiser &) = delete;
+  TemporalDenoiser &operator=(const TemporalDenoiser &) = delete;
+
+  // Returns 0, -EINVAL for packed RAW or unknown formats, an empty size or
+  // a stack size outside 2-256, or -ENOMEM.
+  int configure(const DenoiseConfig &config, FrameFormat format,
+                unsigned int width, unsigned int height);
+
+  bool isConfigured() const { return arena_ != nullptr; }
+
+  // Stack a frame of the configured format and size. Returns 1 when it
+  // completed a stack, whose average is then in output() until the next
+  // stack completes, 0 otherwise, or -EINVAL.
+  int add(const FrameView &view);
+
+  // Start a new stack, dropping the frames stacked so far.
+  void reset();
+
+  const FrameView &output() const { return output_; }
+
+  // Frames in the current stack.
+  unsigned int stacked() const { return count_; }
+
+  // Share of the full weight of its frames the last output was averaged
+  // from; 1 when nothing moved.
+  double stackedFraction() const { return stackedFraction_; }
+
+  bool wideAccumulators() const { return wide_; }
+  size_t arenaSize() const { return arenaSize_; }
+
+private:
+  struct Plane {
+    unsigned int width;  // samples per row
+    unsigned int height;
+    unsigned int hSub;
+    unsigned int vSub;
+    unsigned int groupSamples; // samples per sample group
+    void *acc;                 // width x height accumulators
+  };
+
+  // Sample range of tile column tx, or tile row ty, in a plane.
+  unsigned int tileX(const Plane &plane, unsigned int tx) const;
+  unsigned int tileY(const Plane &plane, unsigned int ty) const;
+
+  uint8_t tileWeight(const FrameView &view, unsigned int tx,
+                     unsigned int ty) const;
+  void accumulateRow(const Plane &plane, const uint8_t *src,
+                     unsigned int y, const uint8_t *weights) const;
+  void averageRow(const Plane &plane, const FrameView &output,
+                  unsigned int p, unsigned int y, unsigned int ty) const;
+  void free();
+
+  DenoiseConfig config_;
+  FrameFormat format_ = FrameFormat::Unknown;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  unsigned int sampleBytes_ = 1;
+  unsigned int fullWeight_ = 1;
+  bool wide_ = false;
+
+  unsigned int tilesX_ = 0;
+  unsigned int tilesY_ = 0;
+  Plane planes_[3] = {};
+  unsigned int numPlanes_ = 0;
+
+  uint8_t *arena_ = nullptr;
+  size_t arenaSize_ = 0;
+  uint8_t *weights_ = nullptr;     // of the current frame, per tile
+  uint16_t *tileSums_ = nullptr;   // of the stack, per tile
+  FrameView reference_;
+  FrameView output_;
+
+  unsigned int count_ = 0;
+  double stackedFraction_ = 0.0;
+};
+
+#endif // TEMPORAL_DENOISE_H
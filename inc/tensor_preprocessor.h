@@ -0,0 +1,141 @@
+#ifndef TENSOR_PREPROCESSOR_H
+#define TENSOR_PREPROCESSOR_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+#include "resampler.h"
+
+enum class TensorLayout {
+  NCHW, // channel planes
+  NHWC, // interleaved channels
+};
+
+enum class TensorType {
+  Float32,
+  Float16, // IEEE half, stored as uint16_t
+  Int8,    // quantised, see TensorConfig::quantScale
+};
+
+bool parseTensorLayout(const std::string &name, TensorLayout &layout);
+const char *tensorLayoutName(TensorLayout layout);
+bool parseTensorType(const std::string &name, TensorType &type);
+const char *tensorTypeName(TensorType type);
+size_t tensorTypeSize(TensorType type);
+
+// Input tensor of a model: three channels, R G B unless bgr is set.
+// Values are (pixel - mean) / std per channel, pixels being 0-255 and mean
+// and std in the order of the tensor channels. Int8 values are then
+// quantised to round(value / quantScale) + zeroPoint.
+struct TensorConfig {
+  unsigned int width = 224;
+  unsigned int height = 224;
+  TensorLayout layout = TensorLayout::NCHW;
+  TensorType type = TensorType::Float32;
+  bool bgr = false;
+  bool letterbox = true; // keep the aspect ratio, pad the borders
+  uint8_t pad = 114;     // pixel value of the padding, on every channel
+  float mean[3] = { 0.0f, 0.0f, 0.0f };
+  float std[3] = { 255.0f, 255.0f, 255.0f };
+  float quantScale = 1.0f / 128;
+  int zeroPoint = 0;
+};
+
+// Parse "R,G,B", or a single value for all channels.
+bool parseTensorChannels(const std::string &arg, float (&values)[3]);
+
+// Where the frame landed in the tensor: tensor x = frame x * scaleX + x.
+struct TensorPlacement {
+  unsigned int x;
+  unsigned int y;
+  unsigned int width;
+  unsigned int height;
+  double scaleX;
+  double scaleY;
+};
+
+// Contiguous, 64 byte aligned memory for a batch of input tensors, e.g.
+// one per camera, laid out as the runtime expects so that data() can be
+// handed over as is.
+class TensorArena {
+public:
+  TensorArena() = default;
+  ~TensorArena();
+
+  TensorArena(const TensorArena &) = delete;
+  TensorArena &operator=(const TensorArena &) = delete;
+
+  // Returns 0, -EINVAL for an empty batch or tensor, or -ENOMEM.
+  int allocate(const TensorConfig &config, unsigned int batch);
+  void free();
+
+  const TensorConfig &config() const { return config_; }
+  unsigned int batch() const { return batch_; }
+
+  uint8_t *data() const { return data_; }
+  size_t size() const { return sampleSize_ * batch_; }
+  size_t sampleSize() const { return sampleSize_; }
+  uint8_t *sample(unsigned int index) const {
+    return data_ + sampleSize_ * index;
+  }
+
+  // N, C, H, W or N, H, W, C.
+  std::vector<unsigned int> shape() const;
+
+  // Store the batch as a NumPy .npy file. Returns false on stream error.
+  bool writeNpy(std::ostream &out) const;
+
+private:
+  TensorConfig config_;
+  unsigned int batch_ = 0;
+  size_t sampleSize_ = 0;
+  uint8_t *data_ = nullptr;
+};
+
+// Frame to input tensor conversion, straight from mapped frame memory.
+//
+// The frame is first scaled to its size in the tensor in its own pixel
+// format, so only the resampler reads the full frame, once. The small
+// scaled frame is then converted to RGB (full range BT.601 for YUV) and
+// normalised with per-channel lookup tables in the output type, writing
+// every tensor element exactly once, padding included, in parallel bands
+// of rows.
+class TensorPreprocessor {
+public:
+  explicit TensorPreprocessor(
+      const TensorConfig &config = TensorConfig(),
+      ResampleFilter filter = ResampleFilter::Bilinear);
+
+  const TensorConfig &config() const { return config_; }
+  size_t sampleSize() const;
+
+  // Where a frame lands in the tensor. Its size there is rounded down to
+  // what the format can represent, e.g. even for NV12.
+  TensorPlacement placement(FrameFormat format, unsigned int width,
+                            unsigned int height) const;
+
+  // Convert one frame into a tensor of sampleSize() bytes. Returns 0, or
+  // -EINVAL for unsupported formats.
+  int process(const FrameView &view, void *tensor,
+              TensorPlacement *placement = nullptr);
+
+  // Convert count frames, e.g. of several cameras, into the samples of an
+  // arena allocated with this configuration.
+  int process(const FrameView *views, size_t count, TensorArena &arena);
+
+private:
+  template<typename T>
+  void store(const FrameView &content, const TensorPlacement &placement,
+             T *tensor) const;
+
+  TensorConfig config_;
+  Resampler resampler_;
+  std::vector<uint8_t> lut_; // 3 x 256 elements of the output type
+  std::vector<uint8_t> scaled_;
+};
+
+#endif // TENSOR_PREPROCESSOR_H
@@ -0,0 +1,89 @@
+#ifndef TEXT_OVERLAY_H
+#define TEXT_OVERLAY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_view.h"
+
+struct OverlayConfig {
+  unsigned int x = 16;     // top left corner of the text, in pixels
+  unsigned int y = 16;
+  unsigned int scale = 0;  // glyph scale, 0 to pick one from the height
+  uint8_t foreground = 255; // grey level of the text
+  bool outline = true;     // dark outline, legible on bright scenes
+};
+
+// Anti-aliased coverage of the printable ASCII characters, rasterised
+// once from a built-in 5x7 bitmap font at an integer scale.
+class GlyphAtlas {
+public:
+  GlyphAtlas() = default;
+
+  void rasterise(unsigned int scale, bool outline);
+
+  // Every glyph cell is this size, spacing included.
+  unsigned int cellWidth() const { return cellWidth_; }
+  unsigned int cellHeight() const { return cellHeight_; }
+
+  // Coverage of the text and of its outline, 0 to 255, cellWidth() by
+  // cellHeight() bytes. Characters outside the font map to '?'.
+  const uint8_t *text(char c) const;
+  const uint8_t *outline(char c) const;
+
+private:
+  unsigned int cellWidth_ = 0;
+  unsigned int cellHeight_ = 0;
+  std::vector<uint8_t> text_;
+  std::vector<uint8_t> outline_;
+};
+
+// Text burnt into frames, e.g. a timestamp.
+//
+// The text is rendered from the atlas into a blend layer only when it
+// changes. The layer holds, for every byte of every plane under the text,
+// the 8 bit blend factors of the frame and premultiplied text, so apply()
+// is one multiply-add per byte, in vector registers, over the text
+// rectangle only: its cost doesn't depend on the frame size.
+class TextOverlay {
+public:
+  TextOverlay() = default;
+
+  // Rasterise the atlas for frames of this format and size. Returns 0, or
+  // -EINVAL for unsupported formats.
+  int configure(const OverlayConfig &config, FrameFormat format,
+                unsigned int width, unsigned int height);
+
+  // Render the text into the layer, unless it is the current text.
+  // Returns true when the layer changed.
+  bool setText(const std::string &text);
+  const std::string &text() const { return text_; }
+
+  // Blend the text into a frame of the configured format and size, in
+  // place; text past the frame edges is clipped. Returns 0 or -EINVAL.
+  int apply(const FrameView &view) const;
+
+private:
+  // Blend factors of one plane under the text: the frame byte b becomes
+  // (b * keep + text) >> 8.
+  struct Layer {
+    unsigned int x; // in sample groups
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+    unsigned int bytesPerPixel;
+    std::vector<uint16_t> keep;
+    std::vector<uint16_t> text;
+  };
+
+  OverlayConfig config_;
+  FrameFormat format_ = FrameFormat::Unknown;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  GlyphAtlas atlas_;
+  std::string text_;
+  std::vector<Layer> layers_;
+};
+
+#endif // TEXT_OVERLAY_H
@@ -0,0 +1,54 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads for data-parallel frame processing. Jobs
+// from different threads are serialised; a parallelFor() issued from
+// inside a job runs inline on the calling worker.
+class ThreadPool {
+public:
+  // threads == 0 uses one thread per CPU (the caller counts as one).
+  explicit ThreadPool(unsigned int threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  unsigned int size() const { return workers_.size() + 1; }
+
+  // Run fn(i) for every i in [0, count) and wait for all to complete.
+  void parallelFor(unsigned int count,
+                   const std::function<void(unsigned int)> &fn);
+
+  static ThreadPool &shared();
+
+private:
+  void worker();
+  void runTasks(uint32_t generation, unsigned int count,
+                const std::function<void(unsigned int)> &fn);
+
+  std::vector<std::thread> workers_;
+
+  std::mutex jobLock_; // one job at a time
+  std::mutex lock_;
+  std::condition_variable start_;
+  std::condition_variable done_;
+
+  // Current job. Task claims pack the job generation in the upper half of
+  // next_, so a worker waking late can never take a task of a later job.
+  const std::function<void(unsigned int)> *fn_ = nullptr;
+  unsigned int count_ = 0;
+  uint32_t generation_ = 0;
+  std::atomic<uint64_t> next_{ 0 };
+  unsigned int finished_ = 0;
+  bool stopping_ = false;
+};
+
+#endif // THREAD_POOL_H
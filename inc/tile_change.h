@@ -0,0 +1,71 @@
+#ifndef TILE_CHANGE_H
+#define TILE_CHANGE_H
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_view.h"
+#include "roi.h"
+
+// Finds the tiles of a frame that differ from a reference frame, using
+// the sum of absolute differences over all planes of each tile.
+//
+// The reference is what a decoder of the changed tiles reconstructs: only
+// tiles reported as changed are copied into it by update(). Comparing
+// against it rather than the previous frame keeps slow changes from being
+// missed, and bounds the error of a thresholded recording by the
+// threshold.
+class TileChangeDetector {
+public:
+  // tileSize is in pixels and must be a multiple of the chroma
+  // subsampling. A tile changed when its SAD exceeds threshold times its
+  // size in bytes; 0 reports any difference.
+  explicit TileChangeDetector(unsigned int tileSize = 16,
+                              unsigned int threshold = 0);
+
+  // Compare a frame against the reference and return the number of
+  // changed tiles. Everything is changed after reset() or when the
+  // format or size differs from the reference.
+  unsigned int detect(const FrameView &view);
+
+  // Copy the tiles found changed by the last detect() into the reference.
+  void update(const FrameView &view);
+
+  // Forget the reference.
+  void reset();
+
+  unsigned int tileSize() const { return tileSize_; }
+  unsigned int tilesX() const { return tilesX_; }
+  unsigned int tilesY() const { return tilesY_; }
+
+  // One bit per tile in raster order, least significant bit first.
+  const std::vector<uint8_t> &bitmap() const { return bitmap_; }
+  bool changed(unsigned int tx, unsigned int ty) const {
+    unsigned int i = ty * tilesX_ + tx;
+    return bitmap_[i / 8] & (1 << (i % 8));
+  }
+
+  // Pixel rectangle of a tile, clipped to the frame.
+  Roi tile(unsigned int tx, unsigned int ty) const;
+
+private:
+  unsigned int tileSize_;
+  unsigned int threshold_;
+  unsigned int tilesX_ = 0;
+  unsigned int tilesY_ = 0;
+  std::vector<uint8_t> bitmap_;
+
+  std::vector<uint8_t> memory_;
+  FrameView reference_;
+  bool valid_ = false;
+};
+
+// Pixel rectangle of tile (tx, ty) of a width x height frame, clipped to
+// the frame.
+Roi tileRoi(unsigned int tx, unsigned int ty, unsigned int tileSize,
+            unsigned int width, unsigned int height);
+
+// Sum of absolute differences of two byte ranges.
+uint64_t sumAbsDiff(const uint8_t *a, const uint8_t *b, size_t size);
+
+#endif // TILE_CHANGE_H
@@ -0,0 +1,103 @@
+#include "buffer_access.h"
+
+#include <cerrno>
+#include <cstring>
+#include <linux/dma-buf.h>
+#include <sys/ioctl.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_STREAM_LOAD 1
+#endif
+
+static int dmaBufSync(int fd, uint64_t flags) {
+  struct dma_buf_sync sync = {};
+  sync.flags = flags;
+
+  int ret;
+  do {
+    ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+  } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+  // Not a dmabuf: nothing to synchronise.
+  if (ret < 0 && errno == ENOTTY)
+    return 0;
+
+  return ret < 0 ? -errno : 0;
+}
+
+static uint64_t syncFlags(BufferAccess access) {
+  switch (access) {
+  case BufferAccess::Read:
+    return DMA_BUF_SYNC_READ;
+  case BufferAccess::Write:
+    return DMA_BUF_SYNC_WRITE;
+  case BufferAccess::ReadWrite:
+  default:
+    return DMA_BUF_SYNC_RW;
+  }
+}
+
+int beginCpuAccess(int fd, BufferAccess access) {
+  return dmaBufSync(fd, DMA_BUF_SYNC_START | syncFlags(access));
+}
+
+int endCpuAccess(int fd, BufferAccess access) {
+  return dmaBufSync(fd, DMA_BUF_SYNC_END | syncFlags(access));
+}
+
+#ifdef HAVE_STREAM_LOAD
+__attribute__((target("sse4.1")))
+static void streamCopySse41(uint8_t *dst, const uint8_t *src, size_t length) {
+  // Streaming loads need 16-byte aligned sources.
+  size_t head = (16 - (reinterpret_cast<uintptr_t>(src) & 15)) & 15;
+  if (head > length)
+    head = length;
+  memcpy(dst, src, head);
+  dst += head;
+  src += head;
+  length -= head;
+
+  // Four loads per iteration fill one 64-byte line buffer at a time.
+  for (; length >= 64; length -= 64, src += 64, dst += 64) {
+    __m128i *s = reinterpret_cast<__m128i *>(const_cast<uint8_t *>(src));
+    __m128i a = _mm_stream_load_si128(s + 0);
+    __m128i b = _mm_stream_load_si128(s + 1);
+    __m128i c = _mm_stream_load_si128(s + 2);
+    __m128i d = _mm_stream_load_si128(s + 3);
+
+    __m128i *o = reinterpret_cast<__m128i *>(dst);
+    _mm_storeu_si128(o + 0, a);
+    _mm_storeu_si128(o + 1, b);
+    _mm_storeu_si128(o + 2, c);
+    _mm_storeu_si128(o + 3, d);
+  }
+
+  memcpy(dst, src, length);
+}
+
+static bool haveSse41() {
+  static const bool supported = __builtin_cpu_supports("sse4.1");
+  return supported;
+}
+#endif
+
+void streamCopy(void *dst, const void *src, size_t length) {
+#ifdef HAVE_STREAM_LOAD
+  if (length >= 256 && haveSse41()) {
+    streamCopySse41(static_cast<uint8_t *>(dst),
+                    static_cast<const uint8_t *>(src), length);
+    return;
+  }
+#endif
+
+  memcpy(dst, src, length);
+}
+
+const char *streamCopyImplementation() {
+#ifdef HAVE_STREAM_LOAD
+  if (haveSse41())
+    return "sse4.1 movntdqa";
+#endif
+  return "memcpy";
+}
@@ -0,0 +1,267 @@
+#include "buffer_pool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <fcntl.h>
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "frame_view.h"
+#include "mapped_frame.h"
+
+using namespace libcamera;
+
+static constexpr size_t kPageSize = 4096;
+static constexpr size_t kHugePageSize = 2 * 1024 * 1024;
+
+static size_t alignUp(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+bool parsePoolSource(const std::string &name, PoolSource &source) {
+  static const PoolSource sources[] = {
+    PoolSource::Auto, PoolSource::Udmabuf, PoolSource::DmaHeap,
+    PoolSource::Memfd,
+  };
+
+  for (PoolSource s : sources) {
+    if (name == poolSourceName(s)) {
+      source = s;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *poolSourceName(PoolSource source) {
+  switch (source) {
+  case PoolSource::Udmabuf:
+    return "udmabuf";
+  case PoolSource::DmaHeap:
+    return "dma-heap";
+  case PoolSource::Memfd:
+    return "memfd";
+  case PoolSource::Auto:
+  default:
+    return "auto";
+  }
+}
+
+// Create a sealed memfd, backed by hugepages when requested and available.
+static int createMemfd(size_t &size, bool hugepages) {
+  int fd = -1;
+
+  if (hugepages) {
+    size_t hugeSize = alignUp(size, kHugePageSize);
+    fd = memfd_create("frame-pool", MFD_CLOEXEC | MFD_ALLOW_SEALING |
+                                        MFD_HUGETLB);
+    // Populate the pages now: hugetlb reservations otherwise only fail
+    // at mmap() time when the hugepage pool is exhausted.
+    if (fd >= 0 && (ftruncate(fd, hugeSize) < 0 ||
+                    fallocate(fd, 0, 0, hugeSize) < 0)) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0)
+      size = hugeSize;
+  }
+
+  if (fd < 0) {
+    size = alignUp(size, kPageSize);
+    fd = memfd_create("frame-pool", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+      return -errno;
+    if (ftruncate(fd, size) < 0) {
+      int ret = -errno;
+      close(fd);
+      return ret;
+    }
+  }
+
+  // udmabuf requires the memfd to be unable to shrink under the device.
+  if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+    int ret = -errno;
+    close(fd);
+    return ret;
+  }
+
+  return fd;
+}
+
+static int exportUdmabuf(int memfd, size_t size) {
+  int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+  if (dev < 0)
+    return -errno;
+
+  struct udmabuf_create create = {};
+  create.memfd = memfd;
+  create.flags = UDMABUF_FLAGS_CLOEXEC;
+  create.offset = 0;
+  create.size = size;
+
+  int fd = ioctl(dev, UDMABUF_CREATE, &create);
+  int ret = fd < 0 ? -errno : fd;
+  close(dev);
+
+  return ret;
+}
+
+static int allocateDmaHeap(size_t size) {
+  int heap = open("/dev/dma_heap/system", O_RDWR | O_CLOEXEC);
+  if (heap < 0)
+    return -errno;
+
+  struct dma_heap_allocation_data alloc = {};
+  alloc.len = size;
+  alloc.fd_flags = O_RDWR | O_CLOEXEC;
+
+  int ret = ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &alloc);
+  ret = ret < 0 ? -errno : static_cast<int>(alloc.fd);
+  close(heap);
+
+  return ret;
+}
+
+// Allocate one buffer of at least size bytes and return its fd. The
+// size is updated with the actual (page rounded) allocation size.
+int BufferPool::allocateMemory(PoolSource source, size_t &size,
+                               bool hugepages) {
+  switch (source) {
+  case PoolSource::Udmabuf: {
+    size_t requested = size;
+    int memfd = createMemfd(size, hugepages);
+    if (memfd < 0)
+      return memfd;
+
+    // The udmabuf holds its own reference on the memfd pages.
+    int fd = exportUdmabuf(memfd, size);
+    close(memfd);
+
+    // Older kernels only accept shmem-backed memfds: when the device is
+    // there but refuses the hugepage memfd, retry with regular pages.
+    if (fd < 0 && fd != -ENOENT && hugepages) {
+      size = requested;
+      return allocateMemory(source, size, false);
+    }
+    return fd;
+  }
+
+  case PoolSource::DmaHeap:
+    size = alignUp(size, kPageSize);
+    return allocateDmaHeap(size);
+
+  case PoolSource::Memfd:
+    return createMemfd(size, hugepages);
+
+  case PoolSource::Auto:
+  default:
+    return -EINVAL;
+  }
+}
+
+int BufferPool::allocate(const StreamConfiguration &config,
+                         const PoolConfig &poolConfig) {
+  free();
+
+  // Lay the planes out back to back in one buffer, each plane starting
+  // on an aligned offset.
+  std::vector<FrameBuffer::Plane> layout;
+  FrameFormat format = frameFormatFromPixelFormat(config.pixelFormat);
+  const FormatInfo &info = formatInfo(format);
+  size_t alignment = std::max<size_t>(poolConfig.alignment, 1);
+  size_t size = 0;
+
+  if (format == FrameFormat::Unknown) {
+    layout.push_back({ SharedFD(), 0, config.frameSize });
+    size = config.frameSize;
+  } else {
+    for (unsigned int i = 0; i < info.numPlanes; ++i) {
+      size_t length = planeStride(format, i, config.stride) *
+                      (config.size.height / info.vSub[i]);
+
+      size = alignUp(size, alignment);
+      layout.push_back({ SharedFD(), static_cast<unsigned int>(size),
+                         static_cast<unsigned int>(length) });
+      size += length;
+    }
+  }
+
+  unsigned int count = poolConfig.count ? poolConfig.count
+                                        : config.bufferCount;
+  std::vector<PoolSource> candidates = { poolConfig.source };
+  if (poolConfig.source == PoolSource::Auto)
+    candidates = { PoolSource::Udmabuf, PoolSource::DmaHeap };
+
+  for (unsigned int i = 0; i < count; ++i) {
+    size_t bufferSize = size;
+    int fd = -ENODEV;
+
+    // The first buffer picks the source, the others must use the same.
+    if (i == 0) {
+      for (PoolSource source : candidates) {
+        bufferSize = size;
+        fd = allocateMemory(source, bufferSize, poolConfig.hugepages);
+        if (fd >= 0) {
+          source_ = source;
+          break;
+        }
+      }
+    } else {
+      fd = allocateMemory(source_, bufferSize, poolConfig.hugepages);
+    }
+
+    if (fd < 0) {
+      free();
+      return fd;
+    }
+
+    void *memory = mmap(NULL, bufferSize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                        fd, 0);
+    if (memory == MAP_FAILED) {
+      int ret = -errno;
+      close(fd);
+      free();
+      return ret;
+    }
+
+    // SharedFD(int) dups the fd: make one and share it between the planes,
+    // so they keep the same fd number and read as one contiguous buffer.
+    SharedFD sharedFd(fd);
+    std::vector<FrameBuffer::Plane> planes = layout;
+    for (FrameBuffer::Plane &plane : planes)
+      plane.fd = sharedFd;
+
+    buffers_.push_back({ fd, bufferSize, static_cast<uint8_t *>(memory),
+                         std::make_unique<FrameBuffer>(planes, i) });
+  }
+
+  return buffers_.size();
+}
+
+void BufferPool::free() {
+  for (Buffer &buffer : buffers_) {
+    buffer.frameBuffer.reset();
+    munmap(buffer.memory, buffer.size);
+    close(buffer.fd);
+  }
+
+  buffers_.clear();
+}
+
+BufferPool::~BufferPool() {
+  free();
+}
+
+const BufferPool::Buffer *BufferPool::find(const FrameBuffer *frameBuffer) const {
+  for (const Buffer &buffer : buffers_) {
+    if (buffer.frameBuffer.get() == frameBuffer)
+      return &buffer;
+  }
+
+  return nullptr;
+}
@@ -0,0 +1,115 @@
+#include "depth_controller.h"
+
+#include <algorithm>
+
+bool parseDepthPolicy(const std::string &name, DepthPolicy &policy) {
+  for (DepthPolicy p : { DepthPolicy::Fixed, DepthPolicy::Latency,
+                         DepthPolicy::Throughput }) {
+    if (name == depthPolicyName(p)) {
+      policy = p;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *depthPolicyName(DepthPolicy policy) {
+  switch (policy) {
+  case DepthPolicy::Latency:
+    return "latency";
+  case DepthPolicy::Throughput:
+    return "throughput";
+  case DepthPolicy::Fixed:
+  default:
+    return "fixed";
+  }
+}
+
+DepthController::DepthController(DepthPolicy policy, unsigned int minDepth,
+                                 unsigned int maxDepth)
+    : policy_(policy), minDepth_(std::max(1u, std::min(minDepth, maxDepth))),
+      maxDepth_(std::max(1u, maxDepth)) {
+  // Latency-first starts shallow and grows on demand, the others start
+  // with everything in flight.
+  depth_ = policy_ == DepthPolicy::Latency ? minDepth_ : maxDepth_;
+  holdTimes_.reserve(kWindow);
+}
+
+void DepthController::frameCompleted(uint32_t sequence, uint64_t timestamp) {
+  if (!first_) {
+    // Sequence numbers are contiguous unless the pipeline had no buffer
+    // to capture into.
+    uint32_t gap = sequence - lastSequence_;
+    if (gap > 1) {
+      windowDrops_ += gap - 1;
+      totalDrops_ += gap - 1;
+    }
+
+    if (timestamp > lastTimestamp_) {
+      uint64_t interval = (timestamp - lastTimestamp_) / std::max(gap, 1u);
+      frameInterval_ = frameInterval_ ? (frameInterval_ * 7 + interval) / 8
+                                      : interval;
+    }
+  }
+
+  first_ = false;
+  lastSequence_ = sequence;
+  lastTimestamp_ = timestamp;
+
+  if (++frames_ >= kWindow)
+    update();
+}
+
+void DepthController::requestRequeued(std::chrono::nanoseconds holdTime) {
+  if (holdTimes_.size() < kWindow)
+    holdTimes_.push_back(holdTime);
+}
+
+std::chrono::nanoseconds DepthController::holdPercentile(unsigned int percent) {
+  if (holdTimes_.empty())
+    return std::chrono::nanoseconds(0);
+
+  size_t index = (holdTimes_.size() - 1) * percent / 100;
+  std::nth_element(holdTimes_.begin(), holdTimes_.begin() + index,
+                   holdTimes_.end());
+  return holdTimes_[index];
+}
+
+void DepthController::update() {
+  frames_ = 0;
+
+  if (policy_ != DepthPolicy::Fixed && frameInterval_) {
+    // Each frame period a request is held by the application, one more
+    // request has to be queued to keep the camera fed.
+    unsigned int percent = policy_ == DepthPolicy::Latency ? 95 : 99;
+    uint64_t hold = holdPercentile(percent).count();
+    unsigned int needed = minDepth_ +
+                          (hold + frameInterval_ - 1) / frameInterval_;
+
+    if (policy_ == DepthPolicy::Latency) {
+      if (windowDrops_)
+        depth_ = std::max(depth_ + 1, needed);
+      else if (depth_ > needed)
+        depth_--;
+      else
+        depth_ = needed;
+    } else {
+      // Throughput-first: jump to the full pool on any drop and only give
+      // buffers back after a sustained clean period.
+      if (windowDrops_) {
+        depth_ = maxDepth_;
+        cleanWindows_ = 0;
+      } else if (++cleanWindows_ >= kCleanWindowsToShrink &&
+                 depth_ > needed + 1) {
+        depth_--;
+        cleanWindows_ = 0;
+      }
+    }
+
+    depth_ = std::clamp(depth_, minDepth_, maxDepth_);
+  }
+
+  windowDrops_ = 0;
+  holdTimes_.clear();
+}
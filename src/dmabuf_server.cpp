@@ -0,0 +1,278 @@
+#include "dmabuf_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+DmabufServer::~DmabufServer() {
+  stop();
+}
+
+int DmabufServer::start(const std::string &path, const Layout &layout,
+                        const std::vector<BufferDesc> &buffers,
+                        unsigned int maxOutstanding) {
+  struct sockaddr_un addr = {};
+
+  if (path.size() >= sizeof(addr.sun_path))
+    return -ENAMETOOLONG;
+
+  listenFd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (listenFd_ < 0)
+    return -errno;
+
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+  unlink(path.c_str());
+
+  if (bind(listenFd_, reinterpret_cast<struct sockaddr *>(&addr),
+           sizeof(addr)) < 0 ||
+      listen(listenFd_, 8) < 0) {
+    int ret = -errno;
+    close(listenFd_);
+    listenFd_ = -1;
+    return ret;
+  }
+
+  wakeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (wakeFd_ < 0) {
+    int ret = -errno;
+    close(listenFd_);
+    listenFd_ = -1;
+    unlink(path.c_str());
+    return ret;
+  }
+
+  path_ = path;
+  layout_ = layout;
+  buffers_ = buffers;
+  maxOutstanding_ = std::max(maxOutstanding, 1u);
+  slots_.assign(buffers.size(), Slot());
+
+  running_ = true;
+  thread_ = std::thread(&DmabufServer::run, this);
+
+  return 0;
+}
+
+void DmabufServer::stop() {
+  if (!running_.exchange(false))
+    return;
+
+  uint64_t one = 1;
+  if (write(wakeFd_, &one, sizeof(one)) < 0)
+    perror("eventfd write");
+  thread_.join();
+
+  std::vector<std::shared_ptr<const void>> released;
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+
+    for (Client &client : clients_)
+      close(client.fd);
+    clients_.clear();
+
+    for (Slot &slot : slots_) {
+      released.push_back(std::move(slot.hold));
+      slot.pending.clear();
+    }
+  }
+
+  close(wakeFd_);
+  close(listenFd_);
+  unlink(path_.c_str());
+  wakeFd_ = listenFd_ = -1;
+}
+
+unsigned int DmabufServer::clients() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return clients_.size();
+}
+
+void DmabufServer::publish(unsigned int index, uint64_t sequence,
+                           uint64_t timestamp,
+                           std::shared_ptr<const void> hold) {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  if (index >= slots_.size() || slots_[index].hold)
+    return;
+
+  // Clients between them never hold more than their share of the pool.
+  unsigned int held = std::count_if(slots_.begin(), slots_.end(),
+                                    [](const Slot &s) { return !!s.hold; });
+  if (held >= maxOutstanding_) {
+    skipped_ += clients_.size();
+    return;
+  }
+
+  DmabufMessage msg = {};
+  msg.type = DmabufMessageType::Ready;
+  msg.index = index;
+  msg.sequence = sequence;
+  msg.timestamp = timestamp;
+
+  Slot &slot = slots_[index];
+  for (Client &client : clients_) {
+    // A client still busy with older frames skips this one rather than
+    // pinning more buffers away from the camera.
+    if (client.outstanding.size() >= maxOutstanding_) {
+      skipped_++;
+      continue;
+    }
+
+    if (send(client.fd, &msg, sizeof(msg), MSG_DONTWAIT | MSG_NOSIGNAL) !=
+        sizeof(msg)) {
+      skipped_++;
+      continue;
+    }
+
+    client.outstanding.insert(index);
+    slot.pending.insert(client.fd);
+  }
+
+  if (!slot.pending.empty())
+    slot.hold = std::move(hold);
+}
+
+void DmabufServer::run() {
+  std::vector<struct pollfd> fds;
+
+  while (running_) {
+    fds.clear();
+    fds.push_back({ wakeFd_, POLLIN, 0 });
+    fds.push_back({ listenFd_, POLLIN, 0 });
+    {
+      std::unique_lock<std::mutex> locker(lock_);
+      for (const Client &client : clients_)
+        fds.push_back({ client.fd, POLLIN, 0 });
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[0].revents)
+      break;
+
+    if (fds[1].revents & POLLIN)
+      acceptClient();
+
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+
+      DmabufMessage msg;
+      ssize_t len = recv(fds[i].fd, &msg, sizeof(msg), MSG_DONTWAIT);
+      if (len == sizeof(msg) && msg.type == DmabufMessageType::Release) {
+        std::unique_lock<std::mutex> locker(lock_);
+
+        for (Client &client : clients_) {
+          if (client.fd == fds[i].fd)
+            handleRelease(client, msg.index);
+        }
+      } else if (len < 0 && (errno == EAGAIN || errno == EINTR)) {
+        continue;
+      } else if (len <= 0 || (fds[i].revents & (POLLHUP | POLLERR))) {
+        dropClient(fds[i].fd);
+      }
+    }
+  }
+}
+
+void DmabufServer::acceptClient() {
+  int fd = accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0)
+    return;
+
+  // The buffer set is sent once, up front; frames then only cost a
+  // Ready/Release message pair.
+  if (!sendBuffers(fd)) {
+    close(fd);
+    return;
+  }
+
+  std::unique_lock<std::mutex> locker(lock_);
+  clients_.push_back({ fd, {} });
+  printf("dmabuf client connected (%zu total)\n", clients_.size());
+}
+
+bool DmabufServer::sendBuffers(int fd) {
+  DmabufMessage msg = {};
+  msg.type = DmabufMessageType::Hello;
+  msg.index = buffers_.size();
+  msg.format = static_cast<uint32_t>(layout_.format);
+  msg.width = layout_.width;
+  msg.height = layout_.height;
+  msg.stride = layout_.stride;
+
+  if (send(fd, &msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg))
+    return false;
+
+  for (unsigned int i = 0; i < buffers_.size(); ++i) {
+    const BufferDesc &buffer = buffers_[i];
+
+    msg.type = DmabufMessageType::Buffer;
+    msg.index = i;
+    msg.numPlanes = buffer.numPlanes;
+    for (unsigned int p = 0; p < 3; ++p) {
+      msg.offset[p] = p < buffer.numPlanes ? buffer.offset[p] : 0;
+      msg.length[p] = p < buffer.numPlanes ? buffer.length[p] : 0;
+    }
+
+    struct iovec iov = { &msg, sizeof(msg) };
+    char control[CMSG_SPACE(sizeof(int) * 3)] = {};
+    struct msghdr hdr = {};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * buffer.numPlanes);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * buffer.numPlanes);
+    memcpy(CMSG_DATA(cmsg), buffer.fd, sizeof(int) * buffer.numPlanes);
+
+    if (sendmsg(fd, &hdr, MSG_NOSIGNAL) != sizeof(msg))
+      return false;
+  }
+
+  return true;
+}
+
+// Called with lock_ held.
+void DmabufServer::handleRelease(Client &client, unsigned int index) {
+  if (!client.outstanding.erase(index))
+    return;
+
+  Slot &slot = slots_[index];
+  slot.pending.erase(client.fd);
+  if (slot.pending.empty())
+    slot.hold.reset();
+}
+
+void DmabufServer::dropClient(int fd) {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  for (auto it = clients_.begin(); it != clients_.end(); ++it) {
+    if (it->fd != fd)
+      continue;
+
+    // A departed client releases everything it was holding.
+    for (unsigned int index : std::set<unsigned int>(it->outstanding))
+      handleRelease(*it, index);
+
+    close(fd);
+    clients_.erase(it);
+    printf("dmabuf client disconnected (%zu left)\n", clients_.size());
+    break;
+  }
+}
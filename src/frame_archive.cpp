@@ -0,0 +1,418 @@
+#include "frame_archive.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------
+ * Writer
+ */
+
+ArchiveWriter::~ArchiveWriter() {
+  close();
+}
+
+int ArchiveWriter::open(const std::string &path, FrameFormat format,
+                        unsigned int width, unsigned int height) {
+  close();
+
+  if (!formatInfo(format).numPlanes || !width || !height)
+    return -EINVAL;
+
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd_ < 0)
+    return -errno;
+
+  header_ = {};
+  header_.magic = kArchiveMagic;
+  header_.version = kArchiveVersion;
+  header_.format = static_cast<uint32_t>(format);
+  header_.width = width;
+  header_.height = height;
+
+  offset_ = 0;
+  rawBytes_ = 0;
+  keyframes_ = 0;
+  index_.clear();
+  sinceKeyframe_ = 0;
+  detector_.reset();
+
+  int ret = append(&header_, sizeof(header_));
+  if (ret < 0)
+    close();
+  return ret;
+}
+
+void ArchiveWriter::close() {
+  if (fd_ < 0)
+    return;
+
+  // A failed index write leaves a file the reader can still scan.
+  ArchiveFooter footer = {};
+  footer.magic = kArchiveIndexMagic;
+  footer.count = index_.size();
+  footer.indexOffset = offset_;
+  if (append(index_.data(), index_.size() * sizeof(uint64_t)) == 0)
+    append(&footer, sizeof(footer));
+
+  ::close(fd_);
+  fd_ = -1;
+}
+
+int ArchiveWriter::append(const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+  while (size) {
+    ssize_t ret = ::write(fd_, bytes, size);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    bytes += ret;
+    size -= ret;
+    offset_ += ret;
+  }
+
+  return 0;
+}
+
+void ArchiveWriter::setDeltaFrames(unsigned int keyframeInterval,
+                                   unsigned int tileSize,
+                                   unsigned int threshold) {
+  keyframeInterval_ = keyframeInterval;
+  sinceKeyframe_ = 0;
+  detector_ = TileChangeDetector(tileSize, threshold);
+}
+
+// Encode the tiles the detector found changed as a delta payload, or
+// return false if so many changed that a key frame is cheaper.
+bool ArchiveWriter::encodeDelta(const FrameView &view) {
+  if (sinceKeyframe_ == 0 || sinceKeyframe_ >= keyframeInterval_)
+    return false;
+
+  unsigned int changed = detector_.detect(view);
+  unsigned int tiles = detector_.tilesX() * detector_.tilesY();
+  if (changed * 2 > tiles)
+    return false;
+
+  ArchiveDelta delta = {};
+  delta.tileSize = detector_.tileSize();
+  delta.tilesX = detector_.tilesX();
+  delta.tilesY = detector_.tilesY();
+  delta.changed = changed;
+
+  const std::vector<uint8_t> &bitmap = detector_.bitmap();
+  payload_.resize(sizeof(delta) + bitmap.size());
+  memcpy(payload_.data(), &delta, sizeof(delta));
+  memcpy(payload_.data() + sizeof(delta), bitmap.data(), bitmap.size());
+
+  if (changed) {
+    // Stack the changed tiles into a column and compress it as a frame.
+    unsigned int size = delta.tileSize;
+    FrameView strip = allocateFrameView(view.format, size, size * changed,
+                                        tileMemory_);
+    std::fill(tileMemory_.begin(), tileMemory_.end(), 0);
+
+    unsigned int k = 0;
+    for (unsigned int ty = 0; ty < delta.tilesY; ++ty) {
+      for (unsigned int tx = 0; tx < delta.tilesX; ++tx) {
+        if (!detector_.changed(tx, ty))
+          continue;
+
+        Roi roi = detector_.tile(tx, ty);
+        Roi slot = { 0, k++ * size, roi.width, roi.height };
+        copyFrameView(cropFrameView(view, roi), cropFrameView(strip, slot));
+      }
+    }
+
+    tileEncoder_.encode(strip, tilePayload_);
+    payload_.insert(payload_.end(), tilePayload_.begin(), tilePayload_.end());
+  }
+
+  detector_.update(view);
+  return true;
+}
+
+int ArchiveWriter::write(const FrameView &view, uint64_t sequence,
+                         uint64_t timestamp) {
+  if (fd_ < 0)
+    return -EBADF;
+
+  if (static_cast<uint32_t>(view.format) != header_.format ||
+      view.width != header_.width || view.height != header_.height)
+    return -EINVAL;
+
+  bool delta = keyframeInterval_ && encodeDelta(view);
+  if (!delta) {
+    encoder_.encode(view, payload_);
+
+    // The detector's reference must be exactly the decoded key frame.
+    if (keyframeInterval_) {
+      detector_.reset();
+      detector_.detect(view);
+      detector_.update(view);
+    }
+  }
+
+  ArchiveRecord record = {};
+  record.magic = kArchiveRecordMagic;
+  record.flags = delta ? kArchiveDeltaFrame : 0;
+  record.sequence = sequence;
+  record.timestamp = timestamp;
+  record.size = payload_.size();
+
+  uint64_t offset = offset_;
+  int ret = append(&record, sizeof(record));
+  if (ret == 0)
+    ret = append(payload_.data(), payload_.size());
+  if (ret < 0)
+    return ret;
+
+  index_.push_back(offset);
+  rawBytes_ += view.packedSize();
+
+  if (delta) {
+    ++sinceKeyframe_;
+  } else {
+    ++keyframes_;
+    sinceKeyframe_ = 1;
+  }
+
+  return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Reader
+ */
+
+static bool readAt(int fd, void *data, size_t size, uint64_t offset) {
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+
+  while (size) {
+    ssize_t ret = pread(fd, bytes, size, offset);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    bytes += ret;
+    size -= ret;
+    offset += ret;
+  }
+
+  return true;
+}
+
+ArchiveReader::~ArchiveReader() {
+  close();
+}
+
+int ArchiveReader::open(const std::string &path) {
+  close();
+
+  fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd_ < 0)
+    return -errno;
+
+  struct stat st;
+  if (fstat(fd_, &st) < 0) {
+    int ret = -errno;
+    close();
+    return ret;
+  }
+
+  if (!readAt(fd_, &header_, sizeof(header_), 0) ||
+      header_.magic != kArchiveMagic || header_.version != kArchiveVersion ||
+      !formatInfo(format()).numPlanes) {
+    close();
+    return -EINVAL;
+  }
+
+  if (!loadIndex(st.st_size))
+    scanRecords(st.st_size);
+
+  return 0;
+}
+
+void ArchiveReader::close() {
+  if (fd_ >= 0)
+    ::close(fd_);
+  fd_ = -1;
+  index_.clear();
+  current_ = SIZE_MAX;
+}
+
+bool ArchiveReader::loadIndex(uint64_t fileSize) {
+  ArchiveFooter footer;
+
+  if (fileSize < sizeof(header_) + sizeof(footer) ||
+      !readAt(fd_, &footer, sizeof(footer), fileSize - sizeof(footer)))
+    return false;
+
+  if (footer.magic != kArchiveIndexMagic ||
+      footer.indexOffset + footer.count * sizeof(uint64_t) + sizeof(footer) !=
+          fileSize)
+    return false;
+
+  index_.resize(footer.count);
+  if (!readAt(fd_, index_.data(), footer.count * sizeof(uint64_t),
+              footer.indexOffset)) {
+    index_.clear();
+    return false;
+  }
+
+  return true;
+}
+
+// Walk the records from the start until the first incomplete one.
+void ArchiveReader::scanRecords(uint64_t fileSize) {
+  uint64_t offset = sizeof(header_);
+  ArchiveRecord record;
+
+  index_.clear();
+  while (offset + sizeof(record) <= fileSize &&
+         readAt(fd_, &record, sizeof(record), offset) &&
+         record.magic == kArchiveRecordMagic &&
+         record.size <= fileSize - offset - sizeof(record)) {
+    index_.push_back(offset);
+    offset += sizeof(record) + record.size;
+  }
+}
+
+int ArchiveReader::record(size_t i, ArchiveRecord &record) const {
+  if (i >= index_.size())
+    return -ERANGE;
+
+  if (!readAt(fd_, &record, sizeof(record), index_[i]) ||
+      record.magic != kArchiveRecordMagic)
+    return -EINVAL;
+
+  return 0;
+}
+
+int ArchiveReader::loadPayload(size_t i, ArchiveRecord &record) {
+  int ret = this->record(i, record);
+  if (ret < 0)
+    return ret;
+
+  payload_.resize(record.size);
+  if (!readAt(fd_, payload_.data(), payload_.size(),
+              index_[i] + sizeof(record)))
+    return -EIO;
+
+  return 0;
+}
+
+// Copy the tiles of the delta payload in payload_ over frame_.
+int ArchiveReader::applyDelta() {
+  ArchiveDelta delta;
+  if (payload_.size() < sizeof(delta))
+    return -EINVAL;
+  memcpy(&delta, payload_.data(), sizeof(delta));
+
+  unsigned int size = delta.tileSize;
+  if (!size || delta.tilesX != (width() + size - 1) / size ||
+      delta.tilesY != (height() + size - 1) / size ||
+      delta.changed > delta.tilesX * delta.tilesY)
+    return -EINVAL;
+
+  const uint8_t *bitmap = payload_.data() + sizeof(delta);
+  size_t bitmapSize = (size_t(delta.tilesX) * delta.tilesY + 7) / 8;
+  if (payload_.size() < sizeof(delta) + bitmapSize)
+    return -EINVAL;
+  if (!delta.changed)
+    return 0;
+
+  FrameView strip = allocateFrameView(format(), size, size * delta.changed,
+                                      tileMemory_);
+  if (!decodeLossless(bitmap + bitmapSize,
+                      payload_.size() - sizeof(delta) - bitmapSize, strip))
+    return -EINVAL;
+
+  unsigned int k = 0;
+  for (unsigned int ty = 0; ty < delta.tilesY; ++ty) {
+    for (unsigned int tx = 0; tx < delta.tilesX; ++tx) {
+      unsigned int t = ty * delta.tilesX + tx;
+      if (!(bitmap[t / 8] & (1 << (t % 8))))
+        continue;
+      if (k == delta.changed)
+        return -EINVAL;
+
+      Roi roi = tileRoi(tx, ty, size, width(), height());
+      Roi slot = { 0, k++ * size, roi.width, roi.height };
+      copyFrameView(cropFrameView(strip, slot), cropFrameView(frame_, roi));
+    }
+  }
+
+  return k == delta.changed ? 0 : -EINVAL;
+}
+
+int ArchiveReader::read(size_t i, const FrameView &view,
+                        ArchiveRecord *record) {
+  if (view.format != format() || view.width != width() ||
+      view.height != height())
+    return -EINVAL;
+
+  ArchiveRecord header;
+  int ret = this->record(i, header);
+  if (ret < 0)
+    return ret;
+
+  if (!(header.flags & kArchiveDeltaFrame)) {
+    ret = loadPayload(i, header);
+    if (ret < 0)
+      return ret;
+    if (!decodeLossless(payload_.data(), payload_.size(), view))
+      return -EINVAL;
+
+    if (record)
+      *record = header;
+    return 0;
+  }
+
+  // Walk back to the key frame, or to the last frame read if that is
+  // closer, since frame_ still holds it.
+  size_t first = i;
+  ArchiveRecord previous = header;
+  while (previous.flags & kArchiveDeltaFrame) {
+    if (first == 0)
+      return -EINVAL;
+    if (current_ == first - 1)
+      break;
+    ret = this->record(--first, previous);
+    if (ret < 0)
+      return ret;
+  }
+
+  if (!(previous.flags & kArchiveDeltaFrame)) {
+    current_ = SIZE_MAX;
+    frame_ = allocateFrameView(format(), width(), height(), frameMemory_);
+    ret = loadPayload(first, previous);
+    if (ret < 0)
+      return ret;
+    if (!decodeLossless(payload_.data(), payload_.size(), frame_))
+      return -EINVAL;
+    ++first;
+  }
+
+  for (size_t j = first; j <= i; ++j) {
+    current_ = SIZE_MAX;
+    ret = loadPayload(j, header);
+    if (ret < 0)
+      return ret;
+    ret = applyDelta();
+    if (ret < 0)
+      return ret;
+  }
+
+  current_ = i;
+  copyFrameView(frame_, view);
+
+  if (record)
+    *record = header;
+
+  return 0;
+}
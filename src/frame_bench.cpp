@@ -0,0 +1,994 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <linux/dma-heap.h>
+#include <memory>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "buffer_access.h"
+#include "dmabuf_client.h"
+#include "dmabuf_server.h"
+#include "frame_stats.h"
+#include "frame_transform.h"
+#include "hdr_merge.h"
+#include "jpeg_encoder.h"
+#include "lens_remap.h"
+#include "lossless_codec.h"
+#include "privacy_mask.h"
+#include "raw_correction.h"
+#include "raw_packing.h"
+#include "resampler.h"
+#include "row_pipeline.h"
+#include "temporal_denoise.h"
+#include "tensor_preprocessor.h"
+#include "text_overlay.h"
+#include "thread_pool.h"
+
+// Run fn repeatedly for roughly half a second and return the achieved
+// bandwidth in GB/s for the given number of bytes per call.
+static double measureBandwidth(const std::function<void()> &fn, size_t bytes) {
+  using clock = std::chrono::steady_clock;
+
+  fn(); // warm up
+
+  unsigned int iterations = 0;
+  auto start = clock::now();
+  auto end = start;
+  do {
+    fn();
+    iterations++;
+    end = clock::now();
+  } while (end - start < std::chrono::milliseconds(500));
+
+  double seconds = std::chrono::duration<double>(end - start).count();
+  return bytes * static_cast<double>(iterations) / seconds / 1e9;
+}
+
+static void benchCopyFrom(const char *name, int fd, size_t size) {
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    printf("%-24s mmap failed: %s\n", name, strerror(errno));
+    return;
+  }
+
+  memset(mem, 0x5a, size);
+  std::vector<uint8_t> dst(size);
+
+  auto bracketed = [&](void (*copy)(void *, const void *, size_t)) {
+    return [&, copy]() {
+      beginCpuAccess(fd, BufferAccess::Read);
+      copy(dst.data(), mem, size);
+      endCpuAccess(fd, BufferAccess::Read);
+    };
+  };
+
+  double plain = measureBandwidth(
+      bracketed([](void *d, const void *s, size_t n) { memcpy(d, s, n); }),
+      size);
+  double streaming = measureBandwidth(bracketed(streamCopy), size);
+
+  printf("%-24s memcpy %6.2f GB/s | streamCopy %6.2f GB/s\n", name, plain,
+         streaming);
+
+  munmap(mem, size);
+}
+
+static int allocateDmaHeap(const char *heap, size_t size) {
+  std::string path = std::string("/dev/dma_heap/") + heap;
+  int heapFd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+  if (heapFd < 0)
+    return -1;
+
+  struct dma_heap_allocation_data alloc = {};
+  alloc.len = size;
+  alloc.fd_flags = O_RDWR | O_CLOEXEC;
+
+  int ret = ioctl(heapFd, DMA_HEAP_IOCTL_ALLOC, &alloc);
+  close(heapFd);
+
+  return ret < 0 ? -1 : static_cast<int>(alloc.fd);
+}
+
+// Compare read bandwidth out of cached memory (memfd) and, when the
+// platform exposes them, dma-heap buffers which may be uncached.
+static int benchCopy(int argc, char *argv[]) {
+  size_t size = (argc > 0 ? strtoul(argv[0], NULL, 0) : 32) << 20;
+
+  printf("Copy-out benchmark, %zu MiB, streamCopy uses %s\n", size >> 20,
+         streamCopyImplementation());
+
+  int fd = memfd_create("frame_bench", MFD_CLOEXEC);
+  if (fd < 0 || ftruncate(fd, size) < 0) {
+    printf("Failed to create memfd buffer\n");
+    return EXIT_FAILURE;
+  }
+  benchCopyFrom("memfd (cached)", fd, size);
+  close(fd);
+
+  for (const char *heap : { "system", "system-uncached" }) {
+    fd = allocateDmaHeap(heap, size);
+    if (fd < 0) {
+      printf("%-24s not available\n", (std::string("dma-heap ") + heap).c_str());
+      continue;
+    }
+    benchCopyFrom((std::string("dma-heap ") + heap).c_str(), fd, size);
+    close(fd);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Synthetic frame content with some texture so the entropy coder has
+// realistic work to do.
+static void fillTestPattern(const FrameView &view) {
+  for (unsigned int p = 0; p < view.numPlanes; ++p) {
+    const PlaneView &plane = view.planes[p];
+    for (unsigned int y = 0; y < plane.height; ++y) {
+      uint8_t *row = plane.row(y);
+      for (unsigned int x = 0; x < plane.rowBytes(); ++x)
+        row[x] = (x * 7 + y * 3 + ((x ^ y) & 0x1f)) & 0xff;
+    }
+  }
+}
+
+// Colour conversion and encoding throughput of the built-in JPEG encoder.
+static int benchJpeg(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  double megapixels = width * static_cast<double>(height) / 1e6;
+
+  printf("JPEG benchmark, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    const FormatInfo &info = formatInfo(format);
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    YuvImage image;
+    std::vector<uint8_t> jpeg;
+    JpegEncoder encoder(80);
+
+    convertToYuv420(view, 1, image);
+    double convert = measureBandwidth(
+        [&]() { convertToYuv420(view, 1, image); }, width * height);
+    double encode = measureBandwidth([&]() { encoder.encode(image, jpeg); },
+                                     width * height);
+
+    // measureBandwidth() reports GB/s, i.e. thousands of MP/s here.
+    printf("%-10s convert %7.1f MP/s | encode %7.1f MP/s | %5.1f fps | "
+           "%zu bytes\n",
+           info.name, convert * 1e3, encode * 1e3,
+           1.0 / (1.0 / (convert * 1e3) + 1.0 / (encode * 1e3)) / megapixels,
+           jpeg.size());
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Lossless archive codec: encode and decode throughput, and compression
+// ratio on the synthetic pattern.
+static int benchLossless(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  double megapixels = width * static_cast<double>(height) / 1e6;
+
+  printf("Lossless codec benchmark, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    std::vector<uint8_t> memory, decoded;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    FrameView output = allocateFrameView(format, width, height, decoded);
+    fillTestPattern(view);
+
+    LosslessEncoder encoder;
+    std::vector<uint8_t> payload;
+    encoder.encode(view, payload);
+
+    double encode = measureBandwidth([&]() { encoder.encode(view, payload); },
+                                     width * height);
+    double decode = measureBandwidth(
+        [&]() { decodeLossless(payload.data(), payload.size(), output); },
+        width * height);
+
+    bool exact = memory == decoded;
+
+    printf("%-10s encode %7.1f MP/s (%5.1f fps) | decode %7.1f MP/s | "
+           "ratio %.2fx%s\n",
+           formatInfo(format).name, encode * 1e3, encode * 1e3 / megapixels,
+           decode * 1e3, static_cast<double>(view.packedSize()) / payload.size(),
+           exact ? "" : " | MISMATCH");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchStats(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+
+  printf("Frame statistics benchmark, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    FrameStats stats;
+    double rate = measureBandwidth([&]() { stats = computeFrameStats(view); },
+                                   view.packedSize());
+
+    printf("%-10s %6.2f GB/s (%6.1f fps) | luma %.1f | sharpness %.0f\n",
+           formatInfo(format).name, rate,
+           rate * 1e9 / view.packedSize(), stats.luma, stats.sharpness);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// The same gray -> 2x -> 2x -> histogram chain, one whole frame at a time.
+static void separatePasses(const FrameView &view, std::vector<uint8_t> &gray,
+                           std::vector<uint8_t> &half,
+                           std::vector<uint8_t> &quarter,
+                           uint32_t (&histogram)[256]) {
+  unsigned int width = view.width, height = view.height;
+
+  dispatchFormat(view.format, [&](auto format) {
+    width = grayWidth<decltype(format)::value>(view);
+    gray.resize(size_t(width) * height);
+    for (unsigned int y = 0; y < height; ++y) {
+      uint8_t *row = &gray[size_t(y) * width];
+      const uint8_t *src = grayRow<decltype(format)::value>(view, y, row);
+      if (src != row)
+        std::copy_n(src, width, row);
+    }
+  });
+
+  auto downscale = [](const std::vector<uint8_t> &src, unsigned int &w,
+                      unsigned int &h, std::vector<uint8_t> &dst) {
+    dst.resize(size_t(w / 2) * (h / 2));
+    for (unsigned int y = 0; y < h / 2; ++y) {
+      const uint8_t *a = &src[size_t(2 * y) * w], *b = a + w;
+      for (unsigned int x = 0; x < w / 2; ++x)
+        dst[size_t(y) * (w / 2) + x] =
+            (a[2 * x] + a[2 * x + 1] + b[2 * x] + b[2 * x + 1] + 2) >> 2;
+    }
+    w /= 2;
+    h /= 2;
+  };
+  downscale(gray, width, height, half);
+  downscale(half, width, height, quarter);
+
+  for (uint8_t value : quarter)
+    histogram[value]++;
+}
+
+static int benchPipeline(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+
+  printf("Fused gray/2x/2x/histogram pipeline, %ux%u\n", width, height);
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    std::vector<uint8_t> memory, gray, half, quarter;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    uint32_t fused[256], separate[256];
+    auto pipeline = makeRowPipeline(Downscale2x(), Downscale2x(),
+                                    Histogram(fused));
+
+    double fusedRate = measureBandwidth([&]() {
+      std::fill_n(fused, 256, 0);
+      dispatchFormat(format, [&](auto tag) {
+        runGray<decltype(tag)::value>(view, pipeline);
+      });
+    }, view.packedSize());
+
+    double separateRate = measureBandwidth([&]() {
+      std::fill_n(separate, 256, 0);
+      separatePasses(view, gray, half, quarter, separate);
+    }, view.packedSize());
+
+    bool same = std::equal(fused, fused + 256, separate);
+
+    printf("%-10s fused %6.2f GB/s (%6.1f fps) | separate %6.2f GB/s "
+           "(%6.1f fps)%s\n",
+           formatInfo(format).name, fusedRate,
+           fusedRate * 1e9 / view.packedSize(), separateRate,
+           separateRate * 1e9 / view.packedSize(), same ? "" : " | MISMATCH");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchResample(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  const ResampleSize sizes[] = {
+    { width * 2 / 3, height * 2 / 3 },
+    { width / 3, height / 3 },
+    { width / 6, height / 6 },
+  };
+
+  printf("Resampling %ux%u to %ux%u, %ux%u and %ux%u, %u threads\n", width,
+         height, sizes[0].width, sizes[0].height, sizes[1].width,
+         sizes[1].height, sizes[2].width, sizes[2].height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    const FormatInfo &info = formatInfo(format);
+    std::vector<uint8_t> memory, outputMemory[3];
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    FrameView outputs[3];
+    for (unsigned int i = 0; i < 3; ++i)
+      outputs[i] = allocateFrameView(
+          format, sizes[i].width / info.hAlign * info.hAlign,
+          sizes[i].height / info.vAlign * info.vAlign, outputMemory[i]);
+
+    for (ResampleFilter filter : { ResampleFilter::Box,
+                                   ResampleFilter::Bilinear,
+                                   ResampleFilter::Lanczos }) {
+      Resampler resampler(filter);
+
+      double together = measureBandwidth(
+          [&]() { resampler.resample(view, outputs, 3); }, view.packedSize());
+      double apart = measureBandwidth([&]() {
+        for (const FrameView &output : outputs)
+          resampler.resample(view, output);
+      }, view.packedSize());
+
+      printf("%-10s %-8s one pass %6.1f fps | one per size %6.1f fps\n",
+             info.name, resampleFilterName(filter),
+             together * 1e9 / view.packedSize(),
+             apart * 1e9 / view.packedSize());
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchTensor(int argc, char *argv[]) {
+  unsigned int batch = argc > 0 ? strtoul(argv[0], NULL, 10) : 4;
+  unsigned int size = argc > 1 ? strtoul(argv[1], NULL, 10) : 640;
+  if (!batch || !size)
+    return EXIT_FAILURE;
+
+  printf("Tensor preprocessing, %u 1920x1080 frames to %ux%u letterboxed\n",
+         batch, size, size);
+
+  for (FrameFormat format : { FrameFormat::XRGB8888, FrameFormat::NV12 }) {
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(format, 1920, 1080, memory);
+    fillTestPattern(view);
+    std::vector<FrameView> views(batch, view);
+
+    for (TensorLayout layout : { TensorLayout::NCHW, TensorLayout::NHWC }) {
+      for (TensorType type :
+           { TensorType::Float32, TensorType::Float16, TensorType::Int8 }) {
+        TensorConfig config;
+        config.width = config.height = size;
+        config.layout = layout;
+        config.type = type;
+
+        TensorArena arena;
+        if (arena.allocate(config, batch))
+          return EXIT_FAILURE;
+        TensorPreprocessor preprocessor(config);
+
+        double rate = measureBandwidth([&]() {
+          preprocessor.process(views.data(), views.size(), arena);
+        }, view.packedSize() * batch);
+
+        printf("%-10s %s %s %6.1f frames/s | %zu byte arena\n",
+               formatInfo(format).name, tensorLayoutName(layout),
+               tensorTypeName(type), rate * 1e9 / view.packedSize(),
+               arena.size());
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchUndistort(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+
+  // A wide angle lens with strong barrel distortion.
+  LensModel model;
+  model.fx = model.fy = width * 0.55;
+  model.cx = width / 2.0;
+  model.cy = height / 2.0;
+  model.k1 = -0.3;
+  model.k2 = 0.08;
+  model.zoom = 0.8;
+
+  printf("Lens undistortion, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::XRGB8888, FrameFormat::NV12, FrameFormat::YUYV }) {
+    std::vector<uint8_t> memory, outputMemory;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    FrameView output = allocateFrameView(format, width, height, outputMemory);
+    fillTestPattern(view);
+
+    LensRemap remap;
+    auto start = std::chrono::steady_clock::now();
+    if (remap.configure(model, format, width, height))
+      return EXIT_FAILURE;
+    double build = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    double rate = measureBandwidth([&]() { remap.apply(view, output); },
+                                   view.packedSize());
+
+    printf("%-10s %6.1f fps | map %zu bytes, built in %.1f ms\n",
+           formatInfo(format).name, rate * 1e9 / view.packedSize(),
+           remap.mapBytes(), build * 1e3);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchOverlay(int, char *[]) {
+  const char *text = "2026-01-01 00:00:00 camera0";
+
+  printf("Timestamp overlay, NV12\n");
+
+  for (unsigned int height : { 480u, 1080u, 2160u }) {
+    unsigned int width = height * 16 / 9 / 2 * 2;
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(FrameFormat::NV12, width, height,
+                                       memory);
+    fillTestPattern(view);
+
+    // Same text at the same size on every frame size: the cost of a frame
+    // is the blend of the text rectangle alone.
+    OverlayConfig config;
+    config.scale = 3;
+    TextOverlay overlay;
+    if (overlay.configure(config, view.format, width, height))
+      return EXIT_FAILURE;
+
+    auto start = std::chrono::steady_clock::now();
+    overlay.setText(text);
+    double render = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    double rate = measureBandwidth([&]() { overlay.apply(view); },
+                                   view.packedSize());
+    printf("%5ux%-5u blend %6.2f us | render %6.1f us\n", width, height,
+           1e6 * view.packedSize() / (rate * 1e9), render * 1e6);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchTransform(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 3840;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 2160;
+
+  printf("Rotation and mirroring, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::R8, FrameFormat::NV12, FrameFormat::XRGB8888 }) {
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    printf("%-10s", formatInfo(format).name);
+    for (FrameTransform transform :
+         { FrameTransform::Rot90, FrameTransform::Rot180,
+           FrameTransform::HFlip }) {
+      bool swap = transposes(transform);
+      std::vector<uint8_t> outputMemory;
+      FrameView output = allocateFrameView(format, swap ? height : width,
+                                           swap ? width : height,
+                                           outputMemory);
+      if (transformFrame(view, output, transform))
+        return EXIT_FAILURE;
+
+      double rate = measureBandwidth(
+          [&]() { transformFrame(view, output, transform); },
+          view.packedSize());
+      double fps = rate * 1e9 / view.packedSize();
+      printf(" | %s %6.2f ms", frameTransformName(transform), 1e3 / fps);
+    }
+    printf("\n");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static int benchMask(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+
+  // A large rectangle and a polygon, most of the frame in total.
+  std::vector<MaskRegion> regions(2);
+  regions[0].points = { { 0, 0 }, { int(width / 2), 0 },
+                        { int(width / 2), int(height) }, { 0, int(height) } };
+  regions[1].points = { { int(width * 5 / 8), int(height / 10) },
+                        { int(width * 15 / 16), int(height * 3 / 10) },
+                        { int(width * 25 / 32), int(height * 9 / 10) } };
+
+  printf("Privacy masking, %ux%u, %u threads\n", width, height,
+         ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::NV12, FrameFormat::YUYV, FrameFormat::XRGB8888 }) {
+    std::vector<uint8_t> memory;
+    FrameView view = allocateFrameView(format, width, height, memory);
+    fillTestPattern(view);
+
+    printf("%-10s", formatInfo(format).name);
+    for (MaskStyle style : { MaskStyle::Fill, MaskStyle::Blur }) {
+      MaskConfig config;
+      config.style = style;
+      PrivacyMask mask;
+      if (mask.configure(regions, config, format, width, height))
+        return EXIT_FAILURE;
+
+      double rate = measureBandwidth([&]() { mask.apply(view); },
+                                     view.packedSize());
+      double fps = rate * 1e9 / view.packedSize();
+      printf(" | %s %6.2f ms", maskStyleName(style), 1e3 / fps);
+      if (style == MaskStyle::Blur)
+        printf(" | %.0f%% masked",
+               100.0 * mask.maskedPixels() / (size_t(width) * height));
+    }
+    printf("\n");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Raw sensor corrections on 12 bit Bayer frames, from a calibration of
+// synthetic dark frames with one hot pixel in a thousand.
+static int benchRaw(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+
+  std::vector<uint8_t> memory;
+  FrameView view = allocateFrameView(FrameFormat::RAW16, width, height,
+                                     memory);
+  const PlaneView &plane = view.planes[0];
+
+  RawCalibrator calibrator;
+  if (calibrator.configure(width, height, 12))
+    return EXIT_FAILURE;
+
+  uint32_t seed = 1;
+  for (unsigned int frame = 0; frame < 4; ++frame) {
+    for (unsigned int y = 0; y < height; ++y) {
+      uint16_t *row = reinterpret_cast<uint16_t *>(plane.row(y));
+      for (unsigned int x = 0; x < width; ++x) {
+        seed = seed * 1664525 + 1013904223;
+        bool hot = (size_t(y) * width + x) % 997 == 0;
+        row[x] = 256 + (x & 1) * 8 + (seed >> 29) + (hot ? 900 : 0);
+      }
+    }
+    calibrator.add(view);
+  }
+
+  std::string path = "/tmp/frame_bench_calibration." +
+                     std::to_string(getpid());
+  RawCalibration calibration;
+  int ret = calibrator.save(path);
+  if (!ret)
+    ret = calibration.load(path);
+  unlink(path.c_str());
+  if (ret) {
+    fprintf(stderr, "Can't write calibration: %s\n", strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  printf("Raw corrections, %ux%u 12 bit, %zu defects, %u threads\n", width,
+         height, calibration.defectCount(), ThreadPool::shared().size());
+
+  const uint16_t blackLevel[4] = { 256, 264, 256, 264 };
+  const struct {
+    const char *name;
+    const uint16_t *blackLevel;
+    const RawCalibration *calibration;
+  } modes[] = {
+    { "black level", blackLevel, nullptr },
+    { "calibration", nullptr, &calibration },
+  };
+
+  for (const auto &mode : modes) {
+    RawCorrector corrector;
+    if (corrector.configure(width, height, mode.blackLevel,
+                            mode.calibration))
+      return EXIT_FAILURE;
+
+    // Corrections saturate at 0, so a frame corrected in place keeps
+    // being worked on as a fresh one.
+    fillTestPattern(view);
+    double rate = measureBandwidth([&]() { corrector.apply(view); },
+                                   view.packedSize());
+    printf("%-12s %6.2f GB/s | %6.2f ms/frame\n", mode.name, rate,
+           1e3 * view.packedSize() / (rate * 1e9));
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// CSI-2 packed RAW10 and RAW12 unpack and repack, with rates counted in
+// unpacked bytes.
+static int benchPacking(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 4056;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 3040;
+
+  printf("Raw packing, %ux%u, %s kernels, %u threads\n", width, height,
+         rawPackingImplementation(), ThreadPool::shared().size());
+
+  for (unsigned int bitDepth : { 10, 12 }) {
+    FrameFormat format = packedRawFormat(bitDepth);
+    std::vector<uint8_t> packedMemory, unpackedMemory, repackedMemory;
+    FrameView packed = allocateFrameView(format, width, height, packedMemory);
+    FrameView unpacked = allocateFrameView(FrameFormat::RAW16, width, height,
+                                           unpackedMemory);
+    FrameView repacked = allocateFrameView(format, width, height,
+                                           repackedMemory);
+    fillTestPattern(packed);
+
+    if (unpackRaw(packed, unpacked) || packRaw(unpacked, repacked))
+      return EXIT_FAILURE;
+    bool same = packedMemory == repackedMemory;
+
+    double unpack = measureBandwidth([&]() { unpackRaw(packed, unpacked); },
+                                     unpacked.packedSize());
+    double pack = measureBandwidth([&]() { packRaw(unpacked, repacked); },
+                                   unpacked.packedSize());
+
+    printf("%-7s unpack %6.2f GB/s | pack %6.2f GB/s | %.1f%% smaller%s\n",
+           formatInfo(format).name, unpack, pack,
+           100.0 - 100.0 * packed.packedSize() / unpacked.packedSize(),
+           same ? "" : " | MISMATCH");
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Temporal denoising of a still scene with sensor-like noise, alternating
+// between two noisy copies of the pattern, with and without motion
+// weighting. Rates are of input frames.
+static int benchDenoise(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  unsigned int frames = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+
+  printf("Temporal denoise, %ux%u, stacks of %u, %u threads\n", width,
+         height, frames, ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::NV12, FrameFormat::XRGB8888, FrameFormat::RAW16 }) {
+    std::vector<uint8_t> memory[2];
+    FrameView views[2];
+    uint32_t seed = 1;
+
+    // Noise goes into the low byte of 16 bit samples only.
+    unsigned int sampleBytes = format == FrameFormat::RAW16 ? 2 : 1;
+    for (unsigned int i = 0; i < 2; ++i) {
+      views[i] = allocateFrameView(format, width, height, memory[i]);
+      fillTestPattern(views[i]);
+      for (size_t j = 0; j < memory[i].size(); j += sampleBytes) {
+        seed = seed * 1664525 + 1013904223;
+        memory[i][j] = std::min(memory[i][j] + (seed >> 29), 255u);
+      }
+    }
+
+    for (unsigned int threshold : { 0, 6 }) {
+      DenoiseConfig config;
+      config.frames = frames;
+      config.threshold = threshold;
+
+      TemporalDenoiser denoiser;
+      if (denoiser.configure(config, format, width, height))
+        return EXIT_FAILURE;
+
+      unsigned int index = 0;
+      double rate = measureBandwidth(
+          [&]() { denoiser.add(views[index++ & 1]); },
+          views[0].packedSize());
+
+      printf("%-9s %-8s %7.1f fps | %s bit accumulators, arena %zu KiB\n",
+             formatInfo(format).name, threshold ? "weighted" : "plain",
+             rate * 1e9 / views[0].packedSize(),
+             denoiser.wideAccumulators() ? "32" : "16",
+             denoiser.arenaSize() / 1024);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Exposure fusion of brackets of N frames, the test pattern scaled two
+// stops apart and clipped. The sensor rate it keeps up with is N times
+// the rate of fused frames.
+static int benchHdr(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  unsigned int frames = argc > 2 ? strtoul(argv[2], NULL, 10) : 3;
+
+  printf("HDR fusion, %ux%u, brackets of %u, %u threads\n", width, height,
+         frames, ThreadPool::shared().size());
+
+  for (FrameFormat format :
+       { FrameFormat::NV12, FrameFormat::YUYV, FrameFormat::XRGB8888 }) {
+    HdrMerger merger;
+    if (merger.configure(format, width, height, frames))
+      return EXIT_FAILURE;
+
+    std::vector<std::vector<uint8_t>> memory(frames);
+    std::vector<FrameView> views(frames);
+    for (unsigned int i = 0; i < frames; ++i) {
+      views[i] = allocateFrameView(format, width, height, memory[i]);
+      fillTestPattern(views[i]);
+
+      double scale = std::pow(4.0, i - (frames - 1) / 2.0);
+      for (uint8_t &sample : memory[i])
+        sample = std::min(sample * scale, 255.0);
+    }
+
+    std::vector<uint8_t> outputMemory;
+    FrameView output = allocateFrameView(format, width, height, outputMemory);
+
+    double rate = measureBandwidth(
+        [&]() { merger.merge(views.data(), output); }, output.packedSize());
+    double fps = rate * 1e9 / output.packedSize();
+    printf("%-9s %6.2f ms/merge | %6.1f fused fps | keeps up with %6.1f fps\n",
+           formatInfo(format).name, 1e3 / fps, fps, fps * frames);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+// Round trip of frames shared over the dmabuf socket with an in-process
+// client, on memfd buffers holding all planes or one memfd per plane.
+// Checks that the planes the client maps match what the server wrote.
+static int benchDmabuf(int argc, char *argv[]) {
+  unsigned int width = argc > 0 ? strtoul(argv[0], NULL, 10) : 1920;
+  unsigned int height = argc > 1 ? strtoul(argv[1], NULL, 10) : 1080;
+  constexpr unsigned int kBuffers = 4;
+  constexpr unsigned int kFrames = 2000;
+
+  printf("dmabuf sharing, %ux%u, %u memfd buffers\n", width, height,
+         kBuffers);
+
+  std::string path = "/tmp/frame_bench-" + std::to_string(getpid()) +
+                     ".sock";
+  const struct {
+    FrameFormat format;
+    bool perPlane;
+  } cases[] = {
+    { FrameFormat::YUYV, false },
+    { FrameFormat::NV12, false },
+    { FrameFormat::YUV420, false },
+    { FrameFormat::YUV420, true },
+  };
+
+  for (const auto &test : cases) {
+    const FormatInfo &info = formatInfo(test.format);
+    std::vector<uint8_t> scratch;
+    FrameView layout = allocateFrameView(test.format, width, height, scratch);
+
+    std::vector<int> fds;
+    std::vector<FrameView> views;
+    std::vector<DmabufServer::BufferDesc> descs;
+    bool failed = false;
+
+    for (unsigned int i = 0; i < kBuffers && !failed; ++i) {
+      DmabufServer::BufferDesc desc = {};
+      uint8_t *planes[3] = {};
+      desc.numPlanes = info.numPlanes;
+
+      for (unsigned int p = 0; p < info.numPlanes; ++p) {
+        const PlaneView &plane = layout.planes[p];
+        size_t offset = test.perPlane ? 0 : plane.data - layout.planes[0].data;
+        size_t length = plane.stride * plane.height;
+        size_t size = test.perPlane ? length : layout.packedSize();
+
+        if (p && !test.perPlane) {
+          desc.fd[p] = desc.fd[0];
+          planes[p] = planes[0] + offset;
+        } else {
+          int fd = memfd_create("frame_bench", MFD_CLOEXEC);
+          void *mem = MAP_FAILED;
+          if (fd >= 0 && ftruncate(fd, size) == 0)
+            mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+          if (fd >= 0)
+            fds.push_back(fd);
+          if (mem == MAP_FAILED) {
+            failed = true;
+            break;
+          }
+          desc.fd[p] = fd;
+          planes[p] = static_cast<uint8_t *>(mem);
+        }
+        desc.offset[p] = offset;
+        desc.length[p] = length;
+      }
+      if (failed)
+        break;
+
+      FrameView view = makeFrameView(test.format, width, height,
+                                     layout.planes[0].stride, planes);
+      fillTestPattern(view);
+      for (unsigned int p = 0; p < view.numPlanes; ++p)
+        view.planes[p].row(0)[0] = i * 16 + p;
+
+      views.push_back(view);
+      descs.push_back(desc);
+    }
+
+    DmabufServer server;
+    DmabufServer::Layout serverLayout = {
+      test.format, width, height, uint32_t(layout.planes[0].stride)
+    };
+    DmabufClient client;
+    int ret = failed ? -ENOMEM : server.start(path, serverLayout, descs);
+    if (!ret)
+      ret = client.connect(path);
+    if (ret < 0) {
+      printf("%-6s %-9s failed: %s\n", info.name,
+             test.perPlane ? "per plane" : "shared", strerror(-ret));
+      return EXIT_FAILURE;
+    }
+
+    // The server adds the client once it has sent the buffers.
+    while (!server.clients())
+      std::this_thread::yield();
+
+    bool same = client.buffers().size() == kBuffers;
+    unsigned int mappings = 0;
+    for (unsigned int i = 0; same && i < kBuffers; ++i) {
+      const DmabufClient::Buffer &buffer = client.buffers()[i];
+      uint8_t *planes[3] = {};
+      for (unsigned int p = 0; p < buffer.numPlanes; ++p) {
+        planes[p] = const_cast<uint8_t *>(buffer.plane(p));
+        mappings += buffer.size[p] != 0;
+      }
+
+      FrameView received = makeFrameView(test.format, width, height,
+                                         client.layout().stride, planes);
+      for (unsigned int p = 0; same && p < views[i].numPlanes; ++p) {
+        const PlaneView &a = views[i].planes[p];
+        const PlaneView &b = received.planes[p];
+        for (unsigned int y = 0; same && y < a.height; ++y)
+          same = !memcmp(a.row(y), b.row(y), a.rowBytes());
+      }
+    }
+
+    // Publish, receive and release, until the server dropped the hold.
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+    for (unsigned int n = 0; same && n < kFrames; ++n) {
+      std::atomic<bool> released{ false };
+      std::shared_ptr<const void> hold(
+          &released, [](std::atomic<bool> *flag) { *flag = true; });
+
+      server.publish(n % kBuffers, n, 0, std::move(hold));
+      DmabufMessage msg = client.waitFrame();
+      same = msg.type == DmabufMessageType::Ready && msg.sequence == n &&
+             client.buffers()[msg.index].plane(0)[0] == msg.index * 16;
+      client.release(msg.index);
+      while (!released)
+        std::this_thread::yield();
+    }
+    double seconds = std::chrono::duration<double>(clock::now() - start)
+                         .count();
+
+    printf("%-6s %-9s %u mappings for %u planes | round trip %6.1f us%s\n",
+           info.name, test.perPlane ? "per plane" : "shared", mappings,
+           kBuffers * info.numPlanes, seconds * 1e6 / kFrames,
+           same ? "" : " | MISMATCH");
+
+    client.close();
+    server.stop();
+    for (const FrameView &view : views) {
+      for (unsigned int p = 0; p < view.numPlanes; ++p) {
+        if (!p || test.perPlane)
+          munmap(view.planes[p].data,
+                 test.perPlane ? view.planes[p].stride * view.planes[p].height
+                               : layout.packedSize());
+      }
+    }
+    for (int fd : fds)
+      close(fd);
+
+    if (!same)
+      return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static void usage(const char *argv0) {
+  printf("Usage: %s <benchmark> [args]\n", argv0);
+  printf("  copy [MiB]    Cached vs uncached buffer copy-out bandwidth\n");
+  printf("  jpeg [W H]    JPEG colour conversion and encode throughput\n");
+  printf("  lossless [W H] Lossless archive codec throughput and ratio\n");
+  printf("  stats [W H]   Single-pass frame statistics throughput\n");
+  printf("  pipeline [W H] Fused row pipeline against separate passes\n");
+  printf("  resample [W H] Multi-size resampling throughput per filter\n");
+  printf("  undistort [W H] Lens undistortion remap throughput\n");
+  printf("  mask [W H]    Privacy mask fill and blur cost\n");
+  printf("  overlay       Timestamp overlay cost against frame size\n");
+  printf("  raw [W H]     Raw black level, dark frame and defect correction\n");
+  printf("  packing [W H] CSI-2 packed RAW10/RAW12 unpack and repack\n");
+  printf("  denoise [W H N] Temporal denoising in stacks of N frames\n");
+  printf("  hdr [W H N]   Exposure fusion of brackets of N frames\n");
+  printf("  dmabuf [W H]  dmabuf socket round trip and plane mapping check\n");
+  printf("  transform [W H] Rotation, flip and transpose throughput\n");
+  printf("  tensor [N S]  Batches of frames to SxS model input tensors\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string bench = argv[1];
+  if (bench == "copy")
+    return benchCopy(argc - 2, argv + 2);
+  if (bench == "jpeg")
+    return benchJpeg(argc - 2, argv + 2);
+  if (bench == "lossless")
+    return benchLossless(argc - 2, argv + 2);
+  if (bench == "stats")
+    return benchStats(argc - 2, argv + 2);
+  if (bench == "pipeline")
+    return benchPipeline(argc - 2, argv + 2);
+  if (bench == "resample")
+    return benchResample(argc - 2, argv + 2);
+  if (bench == "undistort")
+    return benchUndistort(argc - 2, argv + 2);
+  if (bench == "mask")
+    return benchMask(argc - 2, argv + 2);
+  if (bench == "overlay")
+    return benchOverlay(argc - 2, argv + 2);
+  if (bench == "raw")
+    return benchRaw(argc - 2, argv + 2);
+  if (bench == "packing")
+    return benchPacking(argc - 2, argv + 2);
+  if (bench == "denoise")
+    return benchDenoise(argc - 2, argv + 2);
+  if (bench == "hdr")
+    return benchHdr(argc - 2, argv + 2);
+  if (bench == "dmabuf")
+    return benchDmabuf(argc - 2, argv + 2);
+  if (bench == "transform")
+    return benchTransform(argc - 2, argv + 2);
+  if (bench == "tensor")
+    return benchTensor(argc - 2, argv + 2);
+
+  usage(argv[0]);
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,171 @@
+#include "frame_bus.h"
+
+#include <algorithm>
+#include <cstdio>
+
+bool parseBackpressure(const std::string &name, Backpressure &policy) {
+  for (Backpressure p : { Backpressure::DropOldest, Backpressure::DropNewest,
+                          Backpressure::Block, Backpressure::LatestOnly }) {
+    if (name == backpressureName(p)) {
+      policy = p;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *backpressureName(Backpressure policy) {
+  switch (policy) {
+  case Backpressure::DropOldest:
+    return "drop-oldest";
+  case Backpressure::DropNewest:
+    return "drop-newest";
+  case Backpressure::Block:
+    return "block";
+  case Backpressure::LatestOnly:
+  default:
+    return "latest";
+  }
+}
+
+FrameBus::Subscriber::Subscriber(const std::string &name, Backpressure policy,
+                                 unsigned int capacity, Callback callback,
+                                 std::chrono::milliseconds blockTimeout)
+    : name_(name), policy_(policy),
+      capacity_(policy == Backpressure::LatestOnly ? 1
+                                                   : std::max(capacity, 1u)),
+      callback_(std::move(callback)), blockTimeout_(blockTimeout) {
+  thread_ = std::thread(&Subscriber::run, this);
+}
+
+unsigned int FrameBus::Subscriber::lag() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return queue_.size();
+}
+
+void FrameBus::Subscriber::push(const FrameHandle &frame) {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  if (stopping_)
+    return;
+
+  if (queue_.size() >= capacity_) {
+    switch (policy_) {
+    case Backpressure::DropOldest:
+    case Backpressure::LatestOnly:
+      queue_.pop_front();
+      dropped_++;
+      break;
+
+    case Backpressure::DropNewest:
+      dropped_++;
+      return;
+
+    case Backpressure::Block:
+      // The camera thread waits at most blockTimeout for this consumer.
+      if (!space_.wait_for(locker, blockTimeout_, [this]() {
+            return queue_.size() < capacity_ || stopping_;
+          }) ||
+          stopping_) {
+        dropped_++;
+        return;
+      }
+      break;
+    }
+  }
+
+  queue_.push_back(frame);
+
+  unsigned int lag = queue_.size();
+  if (lag > maxLag_)
+    maxLag_ = lag;
+
+  locker.unlock();
+  available_.notify_one();
+}
+
+void FrameBus::Subscriber::run() {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  while (true) {
+    available_.wait(locker, [this]() { return !queue_.empty() || stopping_; });
+    if (stopping_)
+      break;
+
+    FrameHandle frame = std::move(queue_.front());
+    queue_.pop_front();
+
+    locker.unlock();
+    space_.notify_one();
+
+    callback_(frame);
+    delivered_++;
+
+    // Release our reference before waiting for the next frame.
+    frame.reset();
+    locker.lock();
+  }
+
+  queue_.clear();
+}
+
+void FrameBus::Subscriber::stop() {
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    stopping_ = true;
+  }
+
+  available_.notify_all();
+  space_.notify_all();
+
+  if (thread_.joinable())
+    thread_.join();
+}
+
+FrameBus::~FrameBus() {
+  stop();
+}
+
+unsigned int FrameBus::share(Backpressure policy, unsigned int capacity) {
+  return (policy == Backpressure::LatestOnly ? 1 : std::max(capacity, 1u)) + 1;
+}
+
+FrameBus::Subscriber *FrameBus::subscribe(const std::string &name,
+                                          Backpressure policy,
+                                          unsigned int capacity,
+                                          Callback callback,
+                                          std::chrono::milliseconds blockTimeout) {
+  if (budget_) {
+    if (reserved_ + share(policy, 1) > budget_)
+      return nullptr;
+
+    capacity = std::min(capacity, budget_ - reserved_ - 1);
+    blockTimeout = std::chrono::milliseconds(0);
+  }
+  reserved_ += share(policy, capacity);
+
+  subscribers_.emplace_back(new Subscriber(name, policy, capacity,
+                                           std::move(callback), blockTimeout));
+  return subscribers_.back().get();
+}
+
+void FrameBus::publish(const FrameHandle &frame) {
+  for (std::unique_ptr<Subscriber> &subscriber : subscribers_)
+    subscriber->push(frame);
+}
+
+void FrameBus::stop() {
+  for (std::unique_ptr<Subscriber> &subscriber : subscribers_)
+    subscriber->stop();
+}
+
+void FrameBus::printStats() const {
+  for (const std::unique_ptr<Subscriber> &subscriber : subscribers_) {
+    printf("  %-12s %-11s delivered: %llu | dropped: %llu | max lag: %u\n",
+           subscriber->name().c_str(), backpressureName(subscriber->policy()),
+           static_cast<unsigned long long>(subscriber->delivered()),
+           static_cast<unsigned long long>(subscriber->dropped()),
+           subscriber->maxLag());
+  }
+}
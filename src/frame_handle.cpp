@@ -0,0 +1,29 @@
+#include "frame_handle.h"
+
+#include "buffer_pool.h"
+
+using namespace libcamera;
+
+Frame::Frame(Request *request, const StreamConfiguration &config, int prot,
+             const BufferPool *pool)
+    : request_(request), buffer_(request->findBuffer(config.stream())),
+      config_(config), prot_(prot), pool_(pool) {
+  if (!buffer_ && !request->buffers().empty())
+    buffer_ = request->buffers().begin()->second;
+}
+
+const FrameView &Frame::view() const {
+  std::call_once(mapOnce_, [this]() {
+    const BufferPool::Buffer *pooled = pool_ ? pool_->find(buffer_) : nullptr;
+    mapped_ = std::make_unique<MappedFrame>(buffer_, config_, prot_,
+                                            pooled ? pooled->memory : nullptr);
+  });
+
+  return mapped_->view();
+}
+
+const FrameStats &Frame::stats() const {
+  std::call_once(statsOnce_, [this]() { stats_ = computeFrameStats(view()); });
+
+  return stats_;
+}
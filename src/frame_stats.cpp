@@ -0,0 +1,369 @@
+#include "frame_stats.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+namespace {
+
+constexpr unsigned int kBandRows = 32;
+
+struct BandStats {
+  uint32_t histogram[4][256]; // interleaved to avoid store forwarding stalls
+  uint64_t sums[3];
+  int64_t laplacian;
+  uint64_t laplacianSquares;
+  uint64_t laplacianCount;
+};
+
+/* -------------------------------------------------------------------------
+ * Luma and channel sums
+ */
+
+// Extract the luma of a packed row and add up its channels.
+typedef void (*ExtractFunction)(const uint8_t *src, unsigned int width,
+                                uint8_t *luma, uint64_t sums[3]);
+
+template<unsigned int Bpp, unsigned int R, unsigned int B>
+void extractRgb(const uint8_t *src, unsigned int width, uint8_t *luma,
+                uint64_t sums[3]) {
+  uint32_t r = 0, g = 0, b = 0;
+
+  for (unsigned int x = 0; x < width; ++x, src += Bpp) {
+    r += src[R];
+    g += src[1];
+    b += src[B];
+    luma[x] = (77 * src[R] + 150 * src[1] + 29 * src[B]) >> 8;
+  }
+
+  sums[0] += r;
+  sums[1] += g;
+  sums[2] += b;
+}
+
+template<unsigned int Y, unsigned int U, unsigned int V>
+void extractPackedYuv(const uint8_t *src, unsigned int width, uint8_t *luma,
+                      uint64_t sums[3]) {
+  uint32_t u = 0, v = 0;
+
+  for (unsigned int x = 0; x + 1 < width; x += 2, src += 4) {
+    luma[x] = src[Y];
+    luma[x + 1] = src[Y + 2];
+    u += src[U];
+    v += src[V];
+  }
+
+  sums[1] += u;
+  sums[2] += v;
+}
+
+ExtractFunction extractFunction(FrameFormat format) {
+  switch (format) {
+  case FrameFormat::XRGB8888: // B G R X in memory
+    return extractRgb<4, 2, 0>;
+  case FrameFormat::XBGR8888: // R G B X
+    return extractRgb<4, 0, 2>;
+  case FrameFormat::RGB888: // B G R
+    return extractRgb<3, 2, 0>;
+  case FrameFormat::BGR888: // R G B
+    return extractRgb<3, 0, 2>;
+  case FrameFormat::YUYV:
+    return extractPackedYuv<0, 1, 3>;
+  case FrameFormat::UYVY:
+    return extractPackedYuv<1, 0, 2>;
+  default:
+    return nullptr;
+  }
+}
+
+// Sum of the even and odd bytes of size byte pairs.
+void sumPairs(const uint8_t *src, size_t size, uint64_t &even, uint64_t &odd) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i low = _mm_set1_epi16(0x00ff);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i evens = zero, odds = zero;
+
+  for (; i + 8 <= size; i += 8) {
+    __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+    evens = _mm_add_epi64(evens, _mm_sad_epu8(_mm_and_si128(v, low), zero));
+    odds = _mm_add_epi64(odds, _mm_sad_epu8(_mm_srli_epi16(v, 8), zero));
+  }
+
+  alignas(16) uint64_t lanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), evens);
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes + 2), odds);
+  even += lanes[0] + lanes[1];
+  odd += lanes[2] + lanes[3];
+#endif
+
+  for (; i < size; ++i) {
+    even += src[2 * i];
+    odd += src[2 * i + 1];
+  }
+}
+
+uint64_t sumBytes(const uint8_t *src, size_t size) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+
+  for (; i + 16 <= size; i += 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(v, zero));
+  }
+
+  alignas(16) uint64_t lanes[2];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  sum = lanes[0] + lanes[1];
+#endif
+
+  for (; i < size; ++i)
+    sum += src[i];
+
+  return sum;
+}
+
+/* -------------------------------------------------------------------------
+ * Histogram and sharpness
+ */
+
+void addHistogram(const uint8_t *luma, unsigned int width,
+                  uint32_t (&histogram)[4][256]) {
+  unsigned int x = 0;
+
+  for (; x + 4 <= width; x += 4) {
+    histogram[0][luma[x]]++;
+    histogram[1][luma[x + 1]]++;
+    histogram[2][luma[x + 2]]++;
+    histogram[3][luma[x + 3]]++;
+  }
+
+  for (; x < width; ++x)
+    histogram[0][luma[x]]++;
+}
+
+typedef uint8_t Bytes8 __attribute__((vector_size(8)));
+typedef int16_t Shorts8 __attribute__((vector_size(16)));
+
+// Accumulate the Laplacian 4c - l - r - u - d over the inner pixels of a
+// row. It stays within int16, and its square within the int32 pair sums
+// of pmaddwd.
+void addLaplacian(const uint8_t *up, const uint8_t *row, const uint8_t *down,
+                  unsigned int width, BandStats &stats) {
+  if (width < 3)
+    return;
+
+  unsigned int x = 1;
+  int64_t sum = 0;
+  uint64_t squares = 0;
+
+#if defined(__SSE2__)
+  const __m128i ones = _mm_set1_epi16(1);
+  __m128i sums = _mm_setzero_si128(), squareSums = _mm_setzero_si128();
+#elif defined(__aarch64__)
+  int32x4_t sums = vdupq_n_s32(0);
+  uint32x4_t squareSums = vdupq_n_u32(0);
+#endif
+
+  for (; x + 8 < width; x += 8) {
+    Bytes8 c, l, r, u, d;
+    memcpy(&c, row + x, sizeof(c));
+    memcpy(&l, row + x - 1, sizeof(l));
+    memcpy(&r, row + x + 1, sizeof(r));
+    memcpy(&u, up + x, sizeof(u));
+    memcpy(&d, down + x, sizeof(d));
+
+    Shorts8 lap = 4 * __builtin_convertvector(c, Shorts8) -
+                  __builtin_convertvector(l, Shorts8) -
+                  __builtin_convertvector(r, Shorts8) -
+                  __builtin_convertvector(u, Shorts8) -
+                  __builtin_convertvector(d, Shorts8);
+
+#if defined(__SSE2__)
+    __m128i v;
+    memcpy(&v, &lap, sizeof(v));
+    sums = _mm_add_epi32(sums, _mm_madd_epi16(v, ones));
+    squareSums = _mm_add_epi32(squareSums, _mm_madd_epi16(v, v));
+#elif defined(__aarch64__)
+    int16x8_t v;
+    memcpy(&v, &lap, sizeof(v));
+    sums = vpadalq_s16(sums, v);
+    squareSums = vaddq_u32(squareSums, vreinterpretq_u32_s32(vmull_s16(
+                                           vget_low_s16(v), vget_low_s16(v))));
+    squareSums = vaddq_u32(squareSums,
+                           vreinterpretq_u32_s32(vmull_high_s16(v, v)));
+#else
+    for (unsigned int i = 0; i < 8; ++i) {
+      sum += lap[i];
+      squares += lap[i] * lap[i];
+    }
+#endif
+  }
+
+  // Squares are non-negative: their lanes are read back as unsigned, which
+  // holds a row of up to 16k pixels.
+#if defined(__SSE2__)
+  alignas(16) int32_t sumLanes[4];
+  alignas(16) uint32_t squareLanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(sumLanes), sums);
+  _mm_store_si128(reinterpret_cast<__m128i *>(squareLanes), squareSums);
+  for (unsigned int i = 0; i < 4; ++i) {
+    sum += sumLanes[i];
+    squares += squareLanes[i];
+  }
+#elif defined(__aarch64__)
+  sum += vaddlvq_s32(sums);
+  squares += vaddlvq_u32(squareSums);
+#endif
+
+  for (; x + 1 < width; ++x) {
+    int lap = 4 * row[x] - row[x - 1] - row[x + 1] - up[x] - down[x];
+    sum += lap;
+    squares += lap * lap;
+  }
+
+  stats.laplacian += sum;
+  stats.laplacianSquares += squares;
+  stats.laplacianCount += width - 2;
+}
+
+} /* namespace */
+
+FrameStats computeFrameStats(const FrameView &view) {
+  FrameStats stats = {};
+  if (!view.isValid() || !view.width || !view.height)
+    return stats;
+
+  ExtractFunction extract = extractFunction(view.format);
+  const PlaneView &plane = view.planes[0];
+  unsigned int width = view.width;
+  unsigned int height = view.height;
+  unsigned int bands = (height + kBandRows - 1) / kBandRows;
+
+  std::vector<BandStats> results(bands);
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    BandStats &s = results[band];
+    unsigned int first = band * kBandRows;
+    unsigned int last = std::min(height, first + kBandRows);
+
+    // Packed rows are converted to luma in a ring of three rows. Rows
+    // outside the band only feed the Laplacian, not the sums.
+    thread_local std::vector<uint8_t> ring;
+    uint64_t unused[3];
+    if (extract)
+      ring.resize(size_t(width) * 3);
+
+    auto lumaRow = [&](unsigned int y, bool inBand) -> const uint8_t * {
+      if (!extract)
+        return plane.row(y);
+      uint8_t *luma = &ring[size_t(y % 3) * width];
+      extract(plane.row(y), width, luma, inBand ? s.sums : unused);
+      return luma;
+    };
+
+    const uint8_t *up = first ? lumaRow(first - 1, false) : nullptr;
+    const uint8_t *row = lumaRow(first, true);
+
+    for (unsigned int y = first; y < last; ++y) {
+      const uint8_t *down = y + 1 < height ? lumaRow(y + 1, y + 1 < last)
+                                           : nullptr;
+
+      addHistogram(row, width, s.histogram);
+      if (up && down)
+        addLaplacian(up, row, down, width, s);
+
+      // Subsampled chroma planes, one row per two luma rows.
+      if (!extract && view.numPlanes > 1 && y % 2 == 0 &&
+          y / 2 < view.planes[1].height) {
+        const PlaneView &chroma = view.planes[1];
+        if (view.numPlanes == 3) {
+          s.sums[1] += sumBytes(chroma.row(y / 2), chroma.width);
+          s.sums[2] += sumBytes(view.planes[2].row(y / 2),
+                                view.planes[2].width);
+        } else if (view.format == FrameFormat::NV21) {
+          sumPairs(chroma.row(y / 2), chroma.width, s.sums[2], s.sums[1]);
+        } else {
+          sumPairs(chroma.row(y / 2), chroma.width, s.sums[1], s.sums[2]);
+        }
+      }
+
+      up = row;
+      row = down;
+    }
+  });
+
+  uint64_t sums[3] = {};
+  int64_t laplacian = 0;
+  uint64_t laplacianSquares = 0, laplacianCount = 0;
+
+  for (const BandStats &s : results) {
+    for (unsigned int i = 0; i < 256; ++i)
+      stats.histogram[i] += s.histogram[0][i] + s.histogram[1][i] +
+                            s.histogram[2][i] + s.histogram[3][i];
+    for (unsigned int c = 0; c < 3; ++c)
+      sums[c] += s.sums[c];
+    laplacian += s.laplacian;
+    laplacianSquares += s.laplacianSquares;
+    laplacianCount += s.laplacianCount;
+  }
+
+  stats.pixels = uint64_t(width) * height;
+  double pixels = static_cast<double>(stats.pixels);
+
+  uint64_t lumaSum = 0, low = 0, high = 0;
+  for (unsigned int i = 0; i < 256; ++i) {
+    lumaSum += uint64_t(i) * stats.histogram[i];
+    if (i <= kClipLow)
+      low += stats.histogram[i];
+    if (i >= kClipHigh)
+      high += stats.histogram[i];
+  }
+  stats.luma = lumaSum / pixels;
+  stats.clippedLow = 100.0 * low / pixels;
+  stats.clippedHigh = 100.0 * high / pixels;
+
+  const FormatInfo &info = formatInfo(view.format);
+  bool rgb = extract && info.hSub[0] == 1;
+
+  if (rgb) {
+    for (unsigned int c = 0; c < 3; ++c)
+      stats.mean[c] = sums[c] / pixels;
+  } else {
+    stats.mean[0] = stats.luma;
+
+    double chromaSamples = 0;
+    if (extract)
+      chromaSamples = static_cast<double>(width / 2) * height;
+    else if (view.numPlanes > 1)
+      chromaSamples = static_cast<double>(view.planes[1].width) *
+                      view.planes[1].height;
+
+    if (chromaSamples) {
+      stats.mean[1] = sums[1] / chromaSamples;
+      stats.mean[2] = sums[2] / chromaSamples;
+    }
+  }
+
+  if (laplacianCount) {
+    double mean = static_cast<double>(laplacian) / laplacianCount;
+    stats.sharpness =
+        static_cast<double>(laplacianSquares) / laplacianCount - mean * mean;
+  }
+
+  return stats;
+}
@@ -0,0 +1,364 @@
+#include "frame_transform.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "thread_pool.h"
+
+namespace {
+
+const struct {
+  FrameTransform transform;
+  const char *name;
+} kTransformNames[] = {
+  { FrameTransform::Identity, "identity" },
+  { FrameTransform::HFlip, "hflip" },
+  { FrameTransform::VFlip, "vflip" },
+  { FrameTransform::Rot180, "rot180" },
+  { FrameTransform::Transpose, "transpose" },
+  { FrameTransform::Rot270, "rot270" },
+  { FrameTransform::Rot90, "rot90" },
+  { FrameTransform::Rot180Transpose, "rot180transpose" },
+};
+
+// Transposes walk the output in kTile x kTile tiles, a band of tiles per
+// task; mirrors copy bands of kBandRows rows.
+constexpr unsigned int kTile = 64;
+constexpr unsigned int kBandRows = 32;
+
+/* -------------------------------------------------------------------------
+ * Transposes
+ *
+ * Output pixel (x, y) comes from source pixel (sx(y), sy(x)), with
+ * sx(y) = y and sy(x) = x mirrored by the flips.
+ */
+
+template<unsigned int E>
+void transposeBlockScalar(const PlaneView &src, const PlaneView &dst,
+                          unsigned int bx, unsigned int by, unsigned int w,
+                          unsigned int h, bool hflip, bool vflip) {
+  for (unsigned int y = by; y < by + h; ++y) {
+    unsigned int sx = hflip ? src.width - 1 - y : y;
+    uint8_t *out = dst.row(y) + bx * E;
+
+    for (unsigned int x = bx; x < bx + w; ++x, out += E) {
+      unsigned int sy = vflip ? src.height - 1 - x : x;
+      const uint8_t *in = src.row(sy) + sx * E;
+      for (unsigned int e = 0; e < E; ++e)
+        out[e] = in[e];
+    }
+  }
+}
+
+#if defined(__SSE2__)
+// One full block: B source rows of B pixels, starting at column first,
+// transposed into B output rows. Output row by + j holds source column
+// first + j, or first + B - 1 - j when mirrored.
+template<unsigned int E>
+void transposeBlock(const PlaneView &src, const PlaneView &dst,
+                    unsigned int bx, unsigned int by, bool hflip, bool vflip) {
+  constexpr unsigned int B = E == 4 ? 4 : 8;
+  unsigned int first = hflip ? src.width - by - B : by;
+
+  __m128i r[B];
+  for (unsigned int i = 0; i < B; ++i) {
+    unsigned int sy = vflip ? src.height - 1 - (bx + i) : bx + i;
+    const __m128i *in =
+        reinterpret_cast<const __m128i *>(src.row(sy) + first * E);
+    r[i] = E == 1 ? _mm_loadl_epi64(in) : _mm_loadu_si128(in);
+  }
+
+  __m128i col[B];
+  if constexpr (E == 1) {
+    // Bytes of row pairs, then words of row quads, then the 8 byte
+    // columns, two per register.
+    __m128i a0 = _mm_unpacklo_epi8(r[0], r[1]);
+    __m128i a1 = _mm_unpacklo_epi8(r[2], r[3]);
+    __m128i a2 = _mm_unpacklo_epi8(r[4], r[5]);
+    __m128i a3 = _mm_unpacklo_epi8(r[6], r[7]);
+    __m128i b0 = _mm_unpacklo_epi16(a0, a1);
+    __m128i b1 = _mm_unpackhi_epi16(a0, a1);
+    __m128i b2 = _mm_unpacklo_epi16(a2, a3);
+    __m128i b3 = _mm_unpackhi_epi16(a2, a3);
+    __m128i c[4] = {
+      _mm_unpacklo_epi32(b0, b2), _mm_unpackhi_epi32(b0, b2),
+      _mm_unpacklo_epi32(b1, b3), _mm_unpackhi_epi32(b1, b3),
+    };
+    for (unsigned int j = 0; j < 8; ++j)
+      col[j] = j & 1 ? _mm_unpackhi_epi64(c[j / 2], c[j / 2]) : c[j / 2];
+  } else if constexpr (E == 2) {
+    __m128i a[8], b[8];
+    for (unsigned int i = 0; i < 4; ++i) {
+      a[2 * i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+      a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
+    }
+    for (unsigned int i = 0; i < 2; ++i) {
+      b[4 * i] = _mm_unpacklo_epi32(a[4 * i], a[4 * i + 2]);
+      b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i], a[4 * i + 2]);
+      b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1], a[4 * i + 3]);
+      b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1], a[4 * i + 3]);
+    }
+    for (unsigned int j = 0; j < 4; ++j) {
+      col[2 * j] = _mm_unpacklo_epi64(b[j], b[j + 4]);
+      col[2 * j + 1] = _mm_unpackhi_epi64(b[j], b[j + 4]);
+    }
+  } else {
+    __m128i t0 = _mm_unpacklo_epi32(r[0], r[1]);
+    __m128i t1 = _mm_unpackhi_epi32(r[0], r[1]);
+    __m128i t2 = _mm_unpacklo_epi32(r[2], r[3]);
+    __m128i t3 = _mm_unpackhi_epi32(r[2], r[3]);
+    col[0] = _mm_unpacklo_epi64(t0, t2);
+    col[1] = _mm_unpackhi_epi64(t0, t2);
+    col[2] = _mm_unpacklo_epi64(t1, t3);
+    col[3] = _mm_unpackhi_epi64(t1, t3);
+  }
+
+  for (unsigned int j = 0; j < B; ++j) {
+    unsigned int y = hflip ? by + B - 1 - j : by + j;
+    __m128i *out = reinterpret_cast<__m128i *>(dst.row(y) + bx * E);
+    if (E == 1)
+      _mm_storel_epi64(out, col[j]);
+    else
+      _mm_storeu_si128(out, col[j]);
+  }
+}
+#endif
+
+template<unsigned int E>
+void transposePlane(const PlaneView &src, const PlaneView &dst, bool hflip,
+                    bool vflip) {
+  constexpr unsigned int B = E == 4 ? 4 : 8;
+  unsigned int bands = (dst.height + kTile - 1) / kTile;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int y0 = band * kTile;
+    unsigned int y1 = std::min(y0 + kTile, dst.height);
+
+    for (unsigned int x0 = 0; x0 < dst.width; x0 += kTile) {
+      unsigned int x1 = std::min(x0 + kTile, dst.width);
+
+      for (unsigned int by = y0; by < y1; by += B) {
+        unsigned int h = std::min(B, y1 - by);
+        for (unsigned int bx = x0; bx < x1; bx += B) {
+          unsigned int w = std::min(B, x1 - bx);
+#if defined(__SSE2__)
+          if constexpr (E != 3) {
+            if (w == B && h == B) {
+              transposeBlock<E>(src, dst, bx, by, hflip, vflip);
+              continue;
+            }
+          }
+#endif
+          transposeBlockScalar<E>(src, dst, bx, by, w, h, hflip, vflip);
+        }
+      }
+    }
+  });
+}
+
+// Packed 4:2:2 keeps its horizontal chroma subsampling, so the two pixels
+// of an output pair come from two source rows with their own chroma:
+// average it.
+void transposePacked(const PlaneView &src, const PlaneView &dst,
+                     FrameFormat format, bool hflip, bool vflip) {
+  unsigned int luma = format == FrameFormat::UYVY;
+  unsigned int cb = 1 - luma, cr = 3 - luma;
+  unsigned int srcWidth = src.width * 2, srcHeight = src.height;
+  unsigned int pairs = dst.width;
+  unsigned int bands = (dst.height + kTile - 1) / kTile;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int y0 = band * kTile;
+    unsigned int y1 = std::min(y0 + kTile, dst.height);
+
+    for (unsigned int p0 = 0; p0 < pairs; p0 += kTile / 2) {
+      unsigned int p1 = std::min(p0 + kTile / 2, pairs);
+
+      for (unsigned int y = y0; y < y1; ++y) {
+        unsigned int sx = hflip ? srcWidth - 1 - y : y;
+        unsigned int group = sx / 2 * 4, sample = luma + (sx & 1) * 2;
+        uint8_t *out = dst.row(y) + p0 * 4;
+
+        for (unsigned int p = p0; p < p1; ++p, out += 4) {
+          unsigned int x = 2 * p;
+          const uint8_t *a = src.row(vflip ? srcHeight - 1 - x : x) + group;
+          const uint8_t *b =
+              src.row(vflip ? srcHeight - 2 - x : x + 1) + group;
+          out[luma] = a[sample];
+          out[luma + 2] = b[sample];
+          out[cb] = (a[cb] + b[cb] + 1) >> 1;
+          out[cr] = (a[cr] + b[cr] + 1) >> 1;
+        }
+      }
+    }
+  });
+}
+
+/* -------------------------------------------------------------------------
+ * Mirrors
+ */
+
+// dst[i] = src[width - 1 - i], for E byte pixels.
+template<unsigned int E>
+void reverseRow(const uint8_t *src, uint8_t *dst, unsigned int width) {
+  unsigned int i = 0;
+
+#if defined(__SSE2__)
+  if constexpr (E != 3) {
+    constexpr unsigned int n = 16 / E;
+    for (; i + n <= width; i += n) {
+      __m128i v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(src + (width - i - n) * E));
+      if (E == 1)
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      if (E <= 2) {
+        v = _mm_shufflelo_epi16(v, 0x1b);
+        v = _mm_shufflehi_epi16(v, 0x1b);
+        v = _mm_shuffle_epi32(v, 0x4e);
+      } else {
+        v = _mm_shuffle_epi32(v, 0x1b);
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i * E), v);
+    }
+  }
+#endif
+
+  for (; i < width; ++i) {
+    const uint8_t *in = src + (width - 1 - i) * E;
+    for (unsigned int e = 0; e < E; ++e)
+      dst[i * E + e] = in[e];
+  }
+}
+
+template<unsigned int E>
+void flipPlane(const PlaneView &src, const PlaneView &dst, bool hflip,
+               bool vflip) {
+  unsigned int bands = (dst.height + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int last = std::min((band + 1) * kBandRows, dst.height);
+    for (unsigned int y = band * kBandRows; y < last; ++y) {
+      const uint8_t *in = src.row(vflip ? src.height - 1 - y : y);
+      if (hflip)
+        reverseRow<E>(in, dst.row(y), src.width);
+      else
+        memcpy(dst.row(y), in, src.rowBytes());
+    }
+  });
+}
+
+// Mirroring packed 4:2:2 reverses the pairs and swaps their two lumas.
+void flipPacked(const PlaneView &src, const PlaneView &dst,
+                FrameFormat format, bool hflip, bool vflip) {
+  unsigned int luma = format == FrameFormat::UYVY;
+
+  flipPlane<4>(src, dst, hflip, vflip);
+  if (!hflip)
+    return;
+
+  for (unsigned int y = 0; y < dst.height; ++y) {
+    uint8_t *pair = dst.row(y);
+    for (unsigned int x = 0; x < dst.width; ++x, pair += 4)
+      std::swap(pair[luma], pair[luma + 2]);
+  }
+}
+
+template<template<unsigned int> class Fn, typename... Args>
+void dispatchSize(unsigned int bytesPerPixel, Args &&...args) {
+  switch (bytesPerPixel) {
+  case 1:
+    Fn<1>::run(args...);
+    break;
+  case 2:
+    Fn<2>::run(args...);
+    break;
+  case 3:
+    Fn<3>::run(args...);
+    break;
+  case 4:
+    Fn<4>::run(args...);
+    break;
+  }
+}
+
+template<unsigned int E>
+struct Transpose {
+  static void run(const PlaneView &src, const PlaneView &dst, bool hflip,
+                  bool vflip) {
+    transposePlane<E>(src, dst, hflip, vflip);
+  }
+};
+
+template<unsigned int E>
+struct Flip {
+  static void run(const PlaneView &src, const PlaneView &dst, bool hflip,
+                  bool vflip) {
+    flipPlane<E>(src, dst, hflip, vflip);
+  }
+};
+
+} /* namespace */
+
+bool parseFrameTransform(const std::string &name, FrameTransform &transform) {
+  for (const auto &entry : kTransformNames) {
+    if (name == entry.name) {
+      transform = entry.transform;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+const char *frameTransformName(FrameTransform transform) {
+  for (const auto &entry : kTransformNames) {
+    if (entry.transform == transform)
+      return entry.name;
+  }
+
+  return "unknown";
+}
+
+int transformFrame(const FrameView &src, const FrameView &dst,
+                   FrameTransform transform) {
+  const FormatInfo &info = formatInfo(src.format);
+  bool transpose = transposes(transform);
+  bool hflip = static_cast<int>(transform) & 1;
+  bool vflip = static_cast<int>(transform) & 2;
+
+  unsigned int width = transpose ? src.height : src.width;
+  unsigned int height = transpose ? src.width : src.height;
+  if (!src.isValid() || dst.format != src.format || dst.width != width ||
+      dst.height != height || width % info.hAlign || height % info.vAlign)
+    return -EINVAL;
+
+  bool packed = src.format == FrameFormat::YUYV ||
+                src.format == FrameFormat::UYVY;
+  if (packed) {
+    if (transpose)
+      transposePacked(src.planes[0], dst.planes[0], src.format, hflip, vflip);
+    else
+      flipPacked(src.planes[0], dst.planes[0], src.format, hflip, vflip);
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < src.numPlanes; ++i) {
+    const PlaneView &from = src.planes[i];
+    const PlaneView &to = dst.planes[i];
+    if (transpose)
+      dispatchSize<Transpose>(from.bytesPerPixel, from, to, hflip, vflip);
+    else
+      dispatchSize<Flip>(from.bytesPerPixel, from, to, hflip, vflip);
+  }
+
+  return 0;
+}
+
+void transposeSamples(const PlaneView &src, const PlaneView &dst) {
+  dispatchSize<Transpose>(src.bytesPerPixel, src, dst, false, false);
+}
@@ -0,0 +1,142 @@
+#include "frame_view.h"
+
+#include <algorithm>
+#include <vector>
+
+#include "buffer_access.h"
+
+static const FormatInfo formatTable[] = {
+  // name       planes  bpp        hSub       vSub       hAlign vAlign
+  { "unknown",  0, { 0, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "XRGB8888", 1, { 4, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "XBGR8888", 1, { 4, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "RGB888",   1, { 3, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "BGR888",   1, { 3, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "YUYV",     1, { 4, 0, 0 }, { 2, 1, 1 }, { 1, 1, 1 }, 2, 1 },
+  { "UYVY",     1, { 4, 0, 0 }, { 2, 1, 1 }, { 1, 1, 1 }, 2, 1 },
+  { "NV12",     2, { 1, 2, 0 }, { 1, 2, 1 }, { 1, 2, 1 }, 2, 2 },
+  { "NV21",     2, { 1, 2, 0 }, { 1, 2, 1 }, { 1, 2, 1 }, 2, 2 },
+  { "YUV420",   3, { 1, 1, 1 }, { 1, 2, 2 }, { 1, 2, 2 }, 2, 2 },
+  { "R8",       1, { 1, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 1, 1 },
+  { "RAW16",    1, { 2, 0, 0 }, { 1, 1, 1 }, { 1, 1, 1 }, 2, 2 },
+  { "RAW10P",   1, { 5, 0, 0 }, { 4, 1, 1 }, { 1, 1, 1 }, 4, 2 },
+  { "RAW12P",   1, { 3, 0, 0 }, { 2, 1, 1 }, { 1, 1, 1 }, 2, 2 },
+};
+
+const FormatInfo &formatInfo(FrameFormat format) {
+  return formatTable[static_cast<unsigned int>(format)];
+}
+
+size_t planeStride(FrameFormat format, unsigned int plane, size_t stride) {
+  const FormatInfo &info = formatInfo(format);
+
+  // Planar chroma planes use a stride scaled by their subsampling, the
+  // semi-planar UV plane keeps the luma stride.
+  return stride * info.bytesPerPixel[plane] * info.hSub[0] /
+         (info.hSub[plane] * info.bytesPerPixel[0]);
+}
+
+size_t FrameView::packedSize() const {
+  size_t size = 0;
+  for (unsigned int i = 0; i < numPlanes; ++i)
+    size += planes[i].rowBytes() * planes[i].height;
+  return size;
+}
+
+FrameView makeFrameView(FrameFormat format, unsigned int width,
+                        unsigned int height, size_t stride,
+                        uint8_t *const planes[3]) {
+  const FormatInfo &info = formatInfo(format);
+  FrameView view;
+
+  if (!info.numPlanes || !planes[0])
+    return view;
+
+  view.format = format;
+  view.width = width;
+  view.height = height;
+  view.numPlanes = info.numPlanes;
+
+  uint8_t *next = planes[0];
+  for (unsigned int i = 0; i < info.numPlanes; ++i) {
+    PlaneView &plane = view.planes[i];
+
+    plane.stride = planeStride(format, i, stride);
+    plane.width = width / info.hSub[i];
+    plane.height = height / info.vSub[i];
+    plane.bytesPerPixel = info.bytesPerPixel[i];
+    plane.data = planes[i] ? planes[i] : next;
+
+    next = plane.data + plane.stride * plane.height;
+  }
+
+  return view;
+}
+
+FrameView allocateFrameView(FrameFormat format, unsigned int width,
+                            unsigned int height, std::vector<uint8_t> &memory) {
+  const FormatInfo &info = formatInfo(format);
+  size_t stride = size_t(width) / info.hSub[0] * info.bytesPerPixel[0];
+
+  size_t size = 0;
+  for (unsigned int i = 0; i < info.numPlanes; ++i)
+    size += planeStride(format, i, stride) * (height / info.vSub[i]);
+
+  memory.resize(size);
+  uint8_t *planes[3] = { memory.data() };
+  return makeFrameView(format, width, height, stride, planes);
+}
+
+void copyFrameView(const FrameView &src, const FrameView &dst) {
+  for (unsigned int i = 0; i < src.numPlanes; ++i) {
+    const PlaneView &from = src.planes[i];
+    const PlaneView &to = dst.planes[i];
+    for (unsigned int y = 0; y < from.height; ++y)
+      std::copy_n(from.row(y), from.rowBytes(), to.row(y));
+  }
+}
+
+size_t writeFrameView(std::ostream &out, const FrameView &view,
+                      bool streaming) {
+  static constexpr size_t kStagingSize = 256 * 1024;
+  std::vector<char> staging;
+  size_t written = 0;
+
+  if (streaming)
+    staging.resize(kStagingSize);
+
+  for (unsigned int i = 0; i < view.numPlanes; ++i) {
+    const PlaneView &plane = view.planes[i];
+    size_t rowBytes = plane.rowBytes();
+
+    if (streaming && rowBytes <= kStagingSize) {
+      // Batch as many rows as fit in the staging buffer per write.
+      size_t rowsPerChunk = kStagingSize / rowBytes;
+      for (unsigned int y = 0; y < plane.height; y += rowsPerChunk) {
+        size_t rows = std::min<size_t>(rowsPerChunk, plane.height - y);
+        if (plane.stride == rowBytes) {
+          streamCopy(staging.data(), plane.row(y), rows * rowBytes);
+        } else {
+          for (size_t r = 0; r < rows; ++r)
+            streamCopy(staging.data() + r * rowBytes, plane.row(y + r),
+                       rowBytes);
+        }
+        out.write(staging.data(), rows * rowBytes);
+      }
+    } else if (plane.stride == rowBytes) {
+      // Tightly packed planes go out in a single write.
+      out.write(reinterpret_cast<const char *>(plane.data),
+                rowBytes * plane.height);
+    } else {
+      for (unsigned int y = 0; y < plane.height; ++y)
+        out.write(reinterpret_cast<const char *>(plane.row(y)), rowBytes);
+    }
+
+    if (!out)
+      return 0;
+
+    written += rowBytes * plane.height;
+  }
+
+  return written;
+}
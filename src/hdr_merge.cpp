@@ -0,0 +1,316 @@
+#include "hdr_merge.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+bool parseBracket(const std::string &arg,
+                  std::vector<BracketExposure> &exposures) {
+  std::vector<BracketExposure> result;
+  size_t pos = 0;
+
+  while (pos <= arg.size()) {
+    size_t end = arg.find(',', pos);
+    if (end == std::string::npos)
+      end = arg.size();
+
+    std::string item = arg.substr(pos, end - pos);
+    BracketExposure exposure = { 0, 1.0f };
+    char trailing;
+    int count = sscanf(item.c_str(), "%dx%f%c", &exposure.exposureTime,
+                       &exposure.analogueGain, &trailing);
+    if ((count != 1 && count != 2) || exposure.exposureTime <= 0 ||
+        !(exposure.analogueGain >= 1.0f))
+      return false;
+
+    result.push_back(exposure);
+    pos = end + 1;
+  }
+
+  if (result.size() < 2 || result.size() > kMaxBracket)
+    return false;
+
+  exposures = result;
+  return true;
+}
+
+/* -----------------------------------------------------------------------------
+ * HdrBracket
+ */
+
+HdrBracket::HdrBracket(const std::vector<BracketExposure> &exposures)
+  : exposures_(exposures) {}
+
+const BracketExposure &HdrBracket::next() {
+  const BracketExposure &exposure = exposures_[next_];
+  next_ = (next_ + 1) % exposures_.size();
+  return exposure;
+}
+
+int HdrBracket::match(int32_t exposureTime, float analogueGain) const {
+  constexpr double kTolerance = 0.2;
+
+  if (exposureTime <= 0 || analogueGain <= 0.0f)
+    return -1;
+
+  int best = -1;
+  double bestError = 0.0;
+  for (unsigned int i = 0; i < exposures_.size(); ++i) {
+    double time = std::abs(std::log(double(exposureTime) /
+                                    exposures_[i].exposureTime));
+    double gain = std::abs(std::log(double(analogueGain) /
+                                    exposures_[i].analogueGain));
+    if (time > kTolerance || gain > kTolerance)
+      continue;
+
+    if (best < 0 || time + gain < bestError) {
+      best = i;
+      bestError = time + gain;
+    }
+  }
+
+  return best;
+}
+
+/* -----------------------------------------------------------------------------
+ * HdrMerger
+ */
+
+namespace {
+
+// Rows per band, a multiple of the chroma subsampling.
+constexpr unsigned int kBandRows = 16;
+
+// Sigma of the well-exposedness Gaussian, on samples scaled to 0-1.
+constexpr double kExposureSigma = 0.2;
+
+bool isFusable(FrameFormat format) {
+  switch (format) {
+  case FrameFormat::XRGB8888:
+  case FrameFormat::XBGR8888:
+  case FrameFormat::RGB888:
+  case FrameFormat::BGR888:
+  case FrameFormat::YUYV:
+  case FrameFormat::UYVY:
+  case FrameFormat::NV12:
+  case FrameFormat::NV21:
+  case FrameFormat::YUV420:
+  case FrameFormat::R8:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// dst = sum(weights * src) / sum(weights) over the frames, per sample.
+void blendRow(const uint8_t *const *src, const float *const *weights,
+              unsigned int frames, uint8_t *dst, unsigned int count) {
+  unsigned int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; x + 16 <= count; x += 16) {
+    __m128 num[4], den[4];
+    for (unsigned int i = 0; i < 4; ++i)
+      num[i] = den[i] = _mm_setzero_ps();
+
+    for (unsigned int f = 0; f < frames; ++f) {
+      __m128i v = _mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(src[f] + x));
+      __m128i lo = _mm_unpacklo_epi8(v, zero);
+      __m128i hi = _mm_unpackhi_epi8(v, zero);
+      const __m128i samples[4] = {
+        _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+        _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+      };
+
+      for (unsigned int i = 0; i < 4; ++i) {
+        __m128 w = _mm_loadu_ps(weights[f] + x + 4 * i);
+        num[i] = _mm_add_ps(num[i],
+                            _mm_mul_ps(_mm_cvtepi32_ps(samples[i]), w));
+        den[i] = _mm_add_ps(den[i], w);
+      }
+    }
+
+    __m128i out[4];
+    for (unsigned int i = 0; i < 4; ++i)
+      out[i] = _mm_cvtps_epi32(_mm_div_ps(num[i], den[i]));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x),
+                     _mm_packus_epi16(_mm_packs_epi32(out[0], out[1]),
+                                      _mm_packs_epi32(out[2], out[3])));
+  }
+#elif defined(__aarch64__)
+  for (; x + 16 <= count; x += 16) {
+    float32x4_t num[4], den[4];
+    for (unsigned int i = 0; i < 4; ++i)
+      num[i] = den[i] = vdupq_n_f32(0.0f);
+
+    for (unsigned int f = 0; f < frames; ++f) {
+      uint8x16_t v = vld1q_u8(src[f] + x);
+      uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+      uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+      const uint32x4_t samples[4] = {
+        vmovl_u16(vget_low_u16(lo)), vmovl_u16(vget_high_u16(lo)),
+        vmovl_u16(vget_low_u16(hi)), vmovl_u16(vget_high_u16(hi)),
+      };
+
+      for (unsigned int i = 0; i < 4; ++i) {
+        float32x4_t w = vld1q_f32(weights[f] + x + 4 * i);
+        num[i] = vmlaq_f32(num[i], vcvtq_f32_u32(samples[i]), w);
+        den[i] = vaddq_f32(den[i], w);
+      }
+    }
+
+    uint32x4_t out[4];
+    for (unsigned int i = 0; i < 4; ++i)
+      out[i] = vcvtnq_u32_f32(vdivq_f32(num[i], den[i]));
+    uint16x8_t lo = vcombine_u16(vqmovn_u32(out[0]), vqmovn_u32(out[1]));
+    uint16x8_t hi = vcombine_u16(vqmovn_u32(out[2]), vqmovn_u32(out[3]));
+    vst1q_u8(dst + x, vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+  }
+#endif
+
+  for (; x < count; ++x) {
+    float num = 0.0f, den = 0.0f;
+    for (unsigned int f = 0; f < frames; ++f) {
+      num += src[f][x] * weights[f][x];
+      den += weights[f][x];
+    }
+    dst[x] = std::min(std::lround(num / den), 255l);
+  }
+}
+
+} /* namespace */
+
+int HdrMerger::configure(FrameFormat format, unsigned int width,
+                         unsigned int height, unsigned int frames) {
+  frames_ = 0;
+
+  if (!isFusable(format) || !width || !height || frames < 2 ||
+      frames > kMaxBracket)
+    return -EINVAL;
+
+  format_ = format;
+  width_ = width;
+  height_ = height;
+  frames_ = frames;
+
+  for (unsigned int v = 0; v < 256; ++v) {
+    double d = v / 255.0 - 0.5;
+    weight_[v] = std::exp(-d * d / (2 * kExposureSigma * kExposureSigma));
+  }
+
+  const FormatInfo &info = formatInfo(format);
+  rowSamples_ = 0;
+  for (unsigned int p = 0; p < info.numPlanes; ++p)
+    rowSamples_ = std::max<size_t>(rowSamples_, size_t(width) /
+                                   info.hSub[p] * info.bytesPerPixel[p]);
+
+  unsigned int bands = (height + kBandRows - 1) / kBandRows;
+  scratch_.resize(size_t(bands) * frames * rowSamples_);
+  return 0;
+}
+
+// The weight of a pixel comes from its luma; RGB luma is approximated as
+// (R + 2G + B) / 4, which doesn't care about the channel order. Chroma
+// samples take the weight of the top left luma they cover, or of the mean
+// of the two lumas of their 4:2:2 pair.
+void HdrMerger::weightRow(const FrameView &view, unsigned int plane,
+                          unsigned int y, float *weights) const {
+  const PlaneView &pv = view.planes[plane];
+  const uint8_t *row = pv.row(y);
+
+  switch (format_) {
+  case FrameFormat::XRGB8888:
+  case FrameFormat::XBGR8888:
+  case FrameFormat::RGB888:
+  case FrameFormat::BGR888: {
+    unsigned int bpp = pv.bytesPerPixel;
+    for (unsigned int x = 0; x < pv.width; ++x, row += bpp) {
+      float w = weight_[(row[0] + 2 * row[1] + row[2] + 2) / 4];
+      std::fill_n(weights + x * bpp, bpp, w);
+    }
+    break;
+  }
+
+  case FrameFormat::YUYV:
+  case FrameFormat::UYVY: {
+    unsigned int luma = format_ == FrameFormat::YUYV ? 0 : 1;
+    for (unsigned int x = 0; x < pv.width; ++x, row += 4, weights += 4) {
+      uint8_t y0 = row[luma], y1 = row[luma + 2];
+      float chroma = weight_[(y0 + y1 + 1) / 2];
+      weights[luma] = weight_[y0];
+      weights[luma + 2] = weight_[y1];
+      weights[1 - luma] = chroma;
+      weights[3 - luma] = chroma;
+    }
+    break;
+  }
+
+  default: {
+    if (plane == 0) {
+      for (unsigned int x = 0; x < pv.width; ++x)
+        weights[x] = weight_[row[x]];
+      break;
+    }
+
+    // Chroma planes, subsampled by two both ways.
+    const uint8_t *luma = view.planes[0].row(y * 2);
+    for (unsigned int x = 0; x < pv.width; ++x) {
+      float w = weight_[luma[x * 2]];
+      std::fill_n(weights + x * pv.bytesPerPixel, pv.bytesPerPixel, w);
+    }
+    break;
+  }
+  }
+}
+
+int HdrMerger::merge(const FrameView *views, const FrameView &output) const {
+  if (!isConfigured())
+    return -EINVAL;
+
+  for (unsigned int f = 0; f <= frames_; ++f) {
+    const FrameView &view = f < frames_ ? views[f] : output;
+    if (view.format != format_ || view.width != width_ ||
+        view.height != height_)
+      return -EINVAL;
+  }
+
+  const FormatInfo &info = formatInfo(format_);
+  unsigned int bands = (height_ + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    float *scratch = scratch_.data() + size_t(band) * frames_ * rowSamples_;
+    const uint8_t *src[kMaxBracket];
+    const float *weights[kMaxBracket];
+
+    for (unsigned int p = 0; p < info.numPlanes; ++p) {
+      const PlaneView &plane = output.planes[p];
+      unsigned int first = band * kBandRows / info.vSub[p];
+      unsigned int last = std::min((band + 1) * kBandRows / info.vSub[p],
+                                   plane.height);
+
+      for (unsigned int y = first; y < last; ++y) {
+        for (unsigned int f = 0; f < frames_; ++f) {
+          float *w = scratch + f * rowSamples_;
+          weightRow(views[f], p, y, w);
+          src[f] = views[f].planes[p].row(y);
+          weights[f] = w;
+        }
+        blendRow(src, weights, frames_, plane.row(y), plane.rowBytes());
+      }
+    }
+  });
+
+  return 0;
+}
@@ -0,0 +1,350 @@
+#include "http_preview.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netinet/in.h>
+#include <poll.h>
+#include <set>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static const char streamHeader[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Cache-Control: no-cache\r\n"
+    "Connection: close\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n\r\n";
+
+static const char indexPage[] =
+    "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/html\r\n"
+    "Connection: close\r\n\r\n"
+    "<html><body style=\"margin:0;background:#000\">"
+    "<img src=\"/stream\" style=\"max-width:100%\"></body></html>\n";
+
+static const char notFound[] =
+    "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n";
+
+HttpPreviewServer::HttpPreviewServer(int quality) : encoder_(quality) {
+}
+
+HttpPreviewServer::~HttpPreviewServer() {
+  stop();
+}
+
+int HttpPreviewServer::start(const std::string &address) {
+  if (address.compare(0, 5, "unix:") == 0) {
+    struct sockaddr_un addr = {};
+    std::string path = address.substr(5);
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+      return -EINVAL;
+
+    listenFd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0)
+      return -errno;
+
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(path.c_str());
+    if (bind(listenFd_, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) < 0) {
+      int ret = -errno;
+      close(listenFd_);
+      listenFd_ = -1;
+      return ret;
+    }
+    unixPath_ = path;
+  } else {
+    // Preview is a local facility: only listen on loopback.
+    char *end;
+    errno = 0;
+    unsigned long port = strtoul(address.c_str(), &end, 10);
+    if (!isdigit(static_cast<unsigned char>(address[0])) || *end || errno ||
+        port < 1 || port > 65535)
+      return -EINVAL;
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listenFd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd_ < 0)
+      return -errno;
+
+    int one = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(listenFd_, reinterpret_cast<struct sockaddr *>(&addr),
+             sizeof(addr)) < 0) {
+      int ret = -errno;
+      close(listenFd_);
+      listenFd_ = -1;
+      return ret;
+    }
+  }
+
+  wakeFd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (listen(listenFd_, 8) < 0 || wakeFd_ < 0) {
+    int ret = -errno;
+    stop();
+    return ret;
+  }
+
+  running_ = true;
+  thread_ = std::thread(&HttpPreviewServer::run, this);
+
+  return 0;
+}
+
+void HttpPreviewServer::stop() {
+  if (running_.exchange(false)) {
+    wake();
+    thread_.join();
+  }
+
+  std::unique_lock<std::mutex> locker(lock_);
+  for (Client &client : clients_)
+    close(client.fd);
+  clients_.clear();
+
+  if (wakeFd_ >= 0)
+    close(wakeFd_);
+  if (listenFd_ >= 0)
+    close(listenFd_);
+  if (!unixPath_.empty())
+    unlink(unixPath_.c_str());
+  wakeFd_ = listenFd_ = -1;
+}
+
+unsigned int HttpPreviewServer::clients() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return std::count_if(clients_.begin(), clients_.end(),
+                       [](const Client &c) { return c.streaming; });
+}
+
+void HttpPreviewServer::wake() {
+  uint64_t one = 1;
+  if (write(wakeFd_, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd write");
+}
+
+// Scale factor giving an output no wider than requested.
+static unsigned int scaleFor(unsigned int width, unsigned int requested) {
+  if (!requested || requested >= width)
+    return 1;
+  return std::min((width + requested - 1) / requested, 8u);
+}
+
+void HttpPreviewServer::publish(const FrameView &view) {
+  std::set<unsigned int> scales;
+
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    for (Client &client : clients_) {
+      if (!client.streaming)
+        continue;
+
+      // Still sending the previous frame: this client skips one.
+      if (client.pending) {
+        client.skipped++;
+        continue;
+      }
+      scales.insert(scaleFor(view.width, client.width));
+    }
+  }
+
+  if (scales.empty())
+    return;
+
+  // Encode once per distinct size, outside of the lock.
+  std::map<unsigned int, Part> parts;
+  for (unsigned int scale : scales) {
+    YuvImage &image = images_[scale];
+    std::vector<uint8_t> jpeg;
+
+    if (convertToYuv420(view, scale, image))
+      return;
+    encoder_.encode(image, jpeg);
+    encodes_++;
+
+    char header[128];
+    int len = snprintf(header, sizeof(header),
+                       "--frame\r\nContent-Type: image/jpeg\r\n"
+                       "Content-Length: %zu\r\n\r\n",
+                       jpeg.size());
+
+    auto part = std::make_shared<std::vector<uint8_t>>(header, header + len);
+    part->insert(part->end(), jpeg.begin(), jpeg.end());
+    part->push_back('\r');
+    part->push_back('\n');
+    parts[scale] = part;
+  }
+
+  bool blocked = false;
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    for (Client &client : clients_) {
+      if (!client.streaming || client.pending)
+        continue;
+
+      auto it = parts.find(scaleFor(view.width, client.width));
+      if (it == parts.end())
+        continue;
+
+      client.pending = it->second;
+      client.offset = 0;
+      if (!flush(client))
+        blocked = true;
+    }
+  }
+
+  // Let the server thread finish partial sends when sockets drain.
+  if (blocked)
+    wake();
+}
+
+// Send as much of the pending part as the socket takes without blocking.
+// Returns true when the part is fully sent. Called with lock_ held.
+bool HttpPreviewServer::flush(Client &client) {
+  while (client.pending && client.offset < client.pending->size()) {
+    ssize_t ret = send(client.fd, client.pending->data() + client.offset,
+                       client.pending->size() - client.offset,
+                       MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (ret < 0)
+      return false;
+    client.offset += ret;
+  }
+
+  if (client.pending) {
+    client.pending.reset();
+    client.sent++;
+  }
+
+  return true;
+}
+
+void HttpPreviewServer::readRequest(Client &client) {
+  char buf[1024];
+  ssize_t len = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+  if (len <= 0) {
+    if (len == 0 || (errno != EAGAIN && errno != EINTR))
+      client.closing = true;
+    return;
+  }
+
+  // Streaming clients have nothing more to say; ignore what they send.
+  if (client.streaming)
+    return;
+
+  client.request.append(buf, len);
+  if (client.request.find("\r\n\r\n") == std::string::npos) {
+    if (client.request.size() > 8192)
+      client.closing = true;
+    return;
+  }
+
+  char path[256] = {};
+  if (sscanf(client.request.c_str(), "GET %255s", path) != 1) {
+    client.closing = true;
+    return;
+  }
+
+  std::string target = path;
+  std::string query;
+  size_t q = target.find('?');
+  if (q != std::string::npos) {
+    query = target.substr(q + 1);
+    target = target.substr(0, q);
+  }
+
+  const char *response = notFound;
+  if (target == "/stream") {
+    size_t w = query.find("width=");
+    if (w != std::string::npos)
+      client.width = strtoul(query.c_str() + w + 6, NULL, 10);
+    client.streaming = true;
+    response = streamHeader;
+  } else if (target == "/") {
+    response = indexPage;
+  }
+
+  if (send(client.fd, response, strlen(response), MSG_NOSIGNAL) < 0 ||
+      !client.streaming)
+    client.closing = true;
+}
+
+void HttpPreviewServer::closeClient(int fd) {
+  auto it = std::find_if(clients_.begin(), clients_.end(),
+                         [fd](const Client &c) { return c.fd == fd; });
+  if (it == clients_.end())
+    return;
+
+  close(fd);
+  clients_.erase(it);
+}
+
+void HttpPreviewServer::run() {
+  std::vector<struct pollfd> fds;
+
+  while (running_) {
+    fds.clear();
+    fds.push_back({ wakeFd_, POLLIN, 0 });
+    fds.push_back({ listenFd_, POLLIN, 0 });
+    {
+      std::unique_lock<std::mutex> locker(lock_);
+      for (const Client &client : clients_) {
+        short events = POLLIN;
+        if (client.pending)
+          events |= POLLOUT;
+        fds.push_back({ client.fd, events, 0 });
+      }
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if (fds[0].revents) {
+      uint64_t count;
+      if (read(wakeFd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+    }
+
+    std::unique_lock<std::mutex> locker(lock_);
+
+    if (fds[1].revents & POLLIN) {
+      int fd = accept4(listenFd_, NULL, NULL, SOCK_CLOEXEC);
+      if (fd >= 0) {
+        Client client;
+        client.fd = fd;
+        clients_.push_back(std::move(client));
+      }
+    }
+
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (!fds[i].revents)
+        continue;
+
+      auto it = std::find_if(clients_.begin(), clients_.end(),
+                             [&](const Client &c) { return c.fd == fds[i].fd; });
+      if (it == clients_.end())
+        continue;
+
+      if (fds[i].revents & POLLIN)
+        readRequest(*it);
+      if (fds[i].revents & POLLOUT && !flush(*it) && errno != EAGAIN)
+        it->closing = true;
+
+      if (it->closing || fds[i].revents & (POLLHUP | POLLERR))
+        closeClient(fds[i].fd);
+    }
+  }
+}
@@ -0,0 +1,706 @@
+#include "jpeg_encoder.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#include "thread_pool.h"
+
+/* -------------------------------------------------------------------------
+ * Tables (ITU-T T.81 Annex K)
+ */
+
+static const uint8_t zigzag[64] = {
+  0, 1, 8, 16, 9, 2, 3, 10, 17, 24, 32, 25, 18, 11, 4, 5,
+  12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6, 7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+static const uint8_t lumaQuant[64] = {
+  16, 11, 10, 16, 24, 40, 51, 61, 12, 12, 14, 19, 26, 58, 60, 55,
+  14, 13, 16, 24, 40, 57, 69, 56, 14, 17, 22, 29, 51, 87, 80, 62,
+  18, 22, 37, 56, 68, 109, 103, 77, 24, 35, 55, 64, 81, 104, 113, 92,
+  49, 64, 78, 87, 103, 121, 120, 101, 72, 92, 95, 98, 112, 100, 103, 99,
+};
+
+static const uint8_t chromaQuant[64] = {
+  17, 18, 24, 47, 99, 99, 99, 99, 18, 21, 26, 66, 99, 99, 99, 99,
+  24, 26, 56, 99, 99, 99, 99, 99, 47, 66, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+  99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99, 99,
+};
+
+static const uint8_t dcLumaBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t dcChromaBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t dcValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+
+static const uint8_t acLumaBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t acLumaValues[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+  0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+  0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+  0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+  0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+  0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+  0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+  0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+  0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+  0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+  0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+static const uint8_t acChromaBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t acChromaValues[162] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+  0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+  0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+  0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+  0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+  0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+  0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+  0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+  0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+  0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+  0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+};
+
+struct HuffmanCode {
+  uint16_t code;
+  uint8_t length;
+};
+
+struct HuffmanTable {
+  HuffmanCode codes[256];
+
+  HuffmanTable(const uint8_t bits[16], const uint8_t *values) {
+    uint16_t code = 0;
+    unsigned int k = 0;
+
+    for (unsigned int length = 1; length <= 16; ++length) {
+      for (unsigned int i = 0; i < bits[length - 1]; ++i)
+        codes[values[k++]] = { code++, static_cast<uint8_t>(length) };
+      code <<= 1;
+    }
+  }
+};
+
+static const HuffmanTable dcLuma(dcLumaBits, dcValues);
+static const HuffmanTable dcChroma(dcChromaBits, dcValues);
+static const HuffmanTable acLuma(acLumaBits, acLumaValues);
+static const HuffmanTable acChroma(acChromaBits, acChromaValues);
+
+/* -------------------------------------------------------------------------
+ * Colour conversion
+ */
+
+void YuvImage::resize(unsigned int w, unsigned int h) {
+  width = w;
+  height = h;
+  yStride = (w + 15) & ~15u;
+  cStride = yStride / 2;
+
+  unsigned int paddedHeight = (h + 15) & ~15u;
+  y.resize(yStride * paddedHeight);
+  cb.resize(cStride * paddedHeight / 2);
+  cr.resize(cStride * paddedHeight / 2);
+}
+
+// JFIF (full range BT.601) conversion in 16.16 fixed point.
+static inline void rgbToYuv(int r, int g, int b, uint8_t &y, int &u, int &v) {
+  y = static_cast<uint8_t>((19595 * r + 38470 * g + 7471 * b + 32768) >> 16);
+  u = ((-11059 * r - 21709 * g + 32768 * b + 32768) >> 16) + 128;
+  v = ((32768 * r - 27439 * g - 5329 * b + 32768) >> 16) + 128;
+}
+
+// Average of the scale x scale source block at output pixel (x, y), for
+// each of the three components.
+static void sampleBlock(const FrameView &view, unsigned int x, unsigned int y,
+                        unsigned int scale, int &c0, int &c1, int &c2) {
+  const FormatInfo &info = formatInfo(view.format);
+  unsigned int sx = x * scale, sy = y * scale;
+  int sum[3] = {};
+
+  for (unsigned int dy = 0; dy < scale; ++dy) {
+    for (unsigned int dx = 0; dx < scale; ++dx) {
+      unsigned int px = sx + dx, py = sy + dy;
+      const uint8_t *p;
+
+      switch (view.format) {
+      case FrameFormat::XRGB8888: // B G R X in memory
+      case FrameFormat::RGB888:   // B G R
+        p = view.planes[0].row(py) + px * info.bytesPerPixel[0];
+        sum[0] += p[2], sum[1] += p[1], sum[2] += p[0];
+        break;
+      case FrameFormat::XBGR8888: // R G B X
+      case FrameFormat::BGR888:   // R G B
+        p = view.planes[0].row(py) + px * info.bytesPerPixel[0];
+        sum[0] += p[0], sum[1] += p[1], sum[2] += p[2];
+        break;
+      case FrameFormat::YUYV:
+        p = view.planes[0].row(py) + (px & ~1u) * 2;
+        sum[0] += p[(px & 1) * 2], sum[1] += p[1], sum[2] += p[3];
+        break;
+      case FrameFormat::UYVY:
+        p = view.planes[0].row(py) + (px & ~1u) * 2;
+        sum[0] += p[(px & 1) * 2 + 1], sum[1] += p[0], sum[2] += p[2];
+        break;
+      case FrameFormat::NV12:
+      case FrameFormat::NV21: {
+        p = view.planes[1].row(py / 2) + (px / 2) * 2;
+        bool swap = view.format == FrameFormat::NV21;
+        sum[0] += view.planes[0].row(py)[px];
+        sum[1] += p[swap ? 1 : 0], sum[2] += p[swap ? 0 : 1];
+        break;
+      }
+      case FrameFormat::YUV420:
+        sum[0] += view.planes[0].row(py)[px];
+        sum[1] += view.planes[1].row(py / 2)[px / 2];
+        sum[2] += view.planes[2].row(py / 2)[px / 2];
+        break;
+      case FrameFormat::R8:
+      default:
+        sum[0] += view.planes[0].row(py)[px];
+        sum[1] += 128, sum[2] += 128;
+        break;
+      }
+    }
+  }
+
+  unsigned int n = scale * scale;
+  c0 = sum[0] / n, c1 = sum[1] / n, c2 = sum[2] / n;
+}
+
+static bool isConvertible(FrameFormat format) {
+  switch (format) {
+  case FrameFormat::RAW16:
+  case FrameFormat::RAW10P:
+  case FrameFormat::RAW12P:
+  case FrameFormat::Unknown:
+    return false;
+  default:
+    return true;
+  }
+}
+
+static bool isRgb(FrameFormat format) {
+  return format == FrameFormat::XRGB8888 || format == FrameFormat::XBGR8888 ||
+         format == FrameFormat::RGB888 || format == FrameFormat::BGR888;
+}
+
+// Replicate the last row/column into the MCU padding.
+static void padPlane(uint8_t *plane, unsigned int stride, unsigned int width,
+                     unsigned int height, unsigned int paddedHeight) {
+  for (unsigned int y = 0; y < height; ++y) {
+    uint8_t *row = plane + y * stride;
+    std::fill(row + width, row + stride, row[width - 1]);
+  }
+  for (unsigned int y = height; y < paddedHeight; ++y)
+    std::copy(plane + (height - 1) * stride, plane + height * stride,
+              plane + y * stride);
+}
+
+// Fast paths for unscaled input, one pair of output rows at a time. The
+// inner loops are kept free of per-pixel format switches so the compiler
+// can vectorise them.
+template<unsigned int Bpp, unsigned int R, unsigned int B>
+static void convertRgbRows(const FrameView &view, YuvImage &image,
+                           unsigned int y) {
+  const uint8_t *s0 = view.planes[0].row(y);
+  const uint8_t *s1 = view.planes[0].row(y + 1);
+  uint8_t *y0 = image.y.data() + y * image.yStride;
+  uint8_t *y1 = y0 + image.yStride;
+  uint8_t *cb = image.cb.data() + (y / 2) * image.cStride;
+  uint8_t *cr = image.cr.data() + (y / 2) * image.cStride;
+
+  for (unsigned int x = 0; x < image.width; ++x) {
+    const uint8_t *p0 = s0 + x * Bpp, *p1 = s1 + x * Bpp;
+    y0[x] = (19595 * p0[R] + 38470 * p0[1] + 7471 * p0[B] + 32768) >> 16;
+    y1[x] = (19595 * p1[R] + 38470 * p1[1] + 7471 * p1[B] + 32768) >> 16;
+  }
+
+  for (unsigned int x = 0; x < image.width / 2; ++x) {
+    const uint8_t *p0 = s0 + x * 2 * Bpp, *p1 = s1 + x * 2 * Bpp;
+    int r = (p0[R] + p0[Bpp + R] + p1[R] + p1[Bpp + R] + 2) >> 2;
+    int g = (p0[1] + p0[Bpp + 1] + p1[1] + p1[Bpp + 1] + 2) >> 2;
+    int b = (p0[B] + p0[Bpp + B] + p1[B] + p1[Bpp + B] + 2) >> 2;
+    cb[x] = ((-11059 * r - 21709 * g + 32768 * b + 32768) >> 16) + 128;
+    cr[x] = ((32768 * r - 27439 * g - 5329 * b + 32768) >> 16) + 128;
+  }
+}
+
+// Packed 4:2:2, Y at offset L in each byte pair and U/V at U/V within the
+// four byte group.
+template<unsigned int L, unsigned int U, unsigned int V>
+static void convertPackedYuvRows(const FrameView &view, YuvImage &image,
+                                 unsigned int y) {
+  const uint8_t *s0 = view.planes[0].row(y);
+  const uint8_t *s1 = view.planes[0].row(y + 1);
+  uint8_t *y0 = image.y.data() + y * image.yStride;
+  uint8_t *y1 = y0 + image.yStride;
+  uint8_t *cb = image.cb.data() + (y / 2) * image.cStride;
+  uint8_t *cr = image.cr.data() + (y / 2) * image.cStride;
+
+  for (unsigned int x = 0; x < image.width; ++x) {
+    y0[x] = s0[x * 2 + L];
+    y1[x] = s1[x * 2 + L];
+  }
+  for (unsigned int x = 0; x < image.width / 2; ++x) {
+    cb[x] = (s0[x * 4 + U] + s1[x * 4 + U] + 1) >> 1;
+    cr[x] = (s0[x * 4 + V] + s1[x * 4 + V] + 1) >> 1;
+  }
+}
+
+static void convertPlanarRows(const FrameView &view, YuvImage &image,
+                              unsigned int y) {
+  for (unsigned int i = 0; i < 2; ++i)
+    std::copy_n(view.planes[0].row(y + i), image.width,
+                image.y.data() + (y + i) * image.yStride);
+
+  unsigned int ci = (y / 2) * image.cStride;
+  const uint8_t *c = view.planes[1].row(y / 2);
+
+  switch (view.format) {
+  case FrameFormat::NV12:
+  case FrameFormat::NV21: {
+    bool swap = view.format == FrameFormat::NV21;
+    uint8_t *cb = image.cb.data() + ci, *cr = image.cr.data() + ci;
+    if (swap)
+      std::swap(cb, cr);
+    for (unsigned int x = 0; x < image.width / 2; ++x) {
+      cb[x] = c[x * 2];
+      cr[x] = c[x * 2 + 1];
+    }
+    break;
+  }
+  default: // YUV420
+    std::copy_n(c, image.width / 2, image.cb.data() + ci);
+    std::copy_n(view.planes[2].row(y / 2), image.width / 2,
+                image.cr.data() + ci);
+    break;
+  }
+}
+
+// Any format and scale, one source block per output pixel.
+static void convertGenericRows(const FrameView &view, unsigned int scale,
+                               YuvImage &image, unsigned int y) {
+  bool rgb = isRgb(view.format);
+
+  for (unsigned int x = 0; x < image.width; x += 2) {
+    int u = 0, v = 0;
+
+    for (unsigned int i = 0; i < 4; ++i) {
+      unsigned int px = x + (i & 1), py = y + (i >> 1);
+      int c0, c1, c2, cu, cv;
+      uint8_t luma;
+
+      sampleBlock(view, px, py, scale, c0, c1, c2);
+      if (rgb) {
+        rgbToYuv(c0, c1, c2, luma, cu, cv);
+      } else {
+        luma = c0;
+        cu = c1;
+        cv = c2;
+      }
+
+      image.y[py * image.yStride + px] = luma;
+      u += cu;
+      v += cv;
+    }
+
+    unsigned int ci = (y / 2) * image.cStride + x / 2;
+    image.cb[ci] = std::clamp((u + 2) / 4, 0, 255);
+    image.cr[ci] = std::clamp((v + 2) / 4, 0, 255);
+  }
+}
+
+using RowConverter = void (*)(const FrameView &, YuvImage &, unsigned int);
+
+static RowConverter rowConverter(FrameFormat format) {
+  switch (format) {
+  case FrameFormat::XRGB8888:
+    return convertRgbRows<4, 2, 0>;
+  case FrameFormat::XBGR8888:
+    return convertRgbRows<4, 0, 2>;
+  case FrameFormat::RGB888:
+    return convertRgbRows<3, 2, 0>;
+  case FrameFormat::BGR888:
+    return convertRgbRows<3, 0, 2>;
+  case FrameFormat::YUYV:
+    return convertPackedYuvRows<0, 1, 3>;
+  case FrameFormat::UYVY:
+    return convertPackedYuvRows<1, 0, 2>;
+  case FrameFormat::NV12:
+  case FrameFormat::NV21:
+  case FrameFormat::YUV420:
+    return convertPlanarRows;
+  default:
+    return nullptr;
+  }
+}
+
+int convertToYuv420(const FrameView &view, unsigned int scale,
+                    YuvImage &image) {
+  if (!isConvertible(view.format) || view.width < 2 || view.height < 2)
+    return -EINVAL;
+
+  // Every sampled block must lie within the frame.
+  scale = std::clamp(scale, 1u, std::min(view.width, view.height) / 2);
+  unsigned int width = view.width / scale & ~1u;
+  unsigned int height = view.height / scale & ~1u;
+  RowConverter convert = scale == 1 ? rowConverter(view.format) : nullptr;
+
+  image.resize(width, height);
+
+  // Bands of 16 rows, matching the encoder's MCU rows.
+  ThreadPool::shared().parallelFor((height + 15) / 16, [&](unsigned int band) {
+    unsigned int end = std::min(band * 16 + 16, height);
+    for (unsigned int y = band * 16; y < end; y += 2) {
+      if (convert)
+        convert(view, image, y);
+      else
+        convertGenericRows(view, scale, image, y);
+    }
+  });
+
+  unsigned int paddedHeight = (height + 15) & ~15u;
+  padPlane(image.y.data(), image.yStride, width, height, paddedHeight);
+  padPlane(image.cb.data(), image.cStride, width / 2, height / 2,
+           paddedHeight / 2);
+  padPlane(image.cr.data(), image.cStride, width / 2, height / 2,
+           paddedHeight / 2);
+  return 0;
+}
+
+/* -------------------------------------------------------------------------
+ * Encoder
+ */
+
+namespace {
+
+// Entropy coded segment writer. Bits collect in a 64-bit accumulator and
+// are emitted a byte at a time with 0xff byte stuffing.
+class BitWriter {
+public:
+  explicit BitWriter(std::vector<uint8_t> &out) : out_(out) {}
+
+  void write(uint32_t bits, unsigned int count) {
+    buffer_ = (buffer_ << count) | (bits & ((1u << count) - 1));
+    count_ += count;
+
+    if (count_ < 32)
+      return;
+
+    while (count_ >= 8) {
+      uint8_t byte = buffer_ >> (count_ - 8);
+      out_.push_back(byte);
+      if (byte == 0xff)
+        out_.push_back(0x00); // byte stuffing
+      count_ -= 8;
+    }
+  }
+
+  void flush() {
+    if (count_ & 7)
+      write(0x7f, 8 - (count_ & 7)); // pad with ones
+    while (count_) {
+      uint8_t byte = buffer_ >> (count_ - 8);
+      out_.push_back(byte);
+      if (byte == 0xff)
+        out_.push_back(0x00);
+      count_ -= 8;
+    }
+  }
+
+private:
+  std::vector<uint8_t> &out_;
+  uint64_t buffer_ = 0;
+  unsigned int count_ = 0;
+};
+
+// Eight lanes of floats, one 8x8 block row. GCC/Clang lower this to
+// AVX, SSE or NEON depending on the target.
+typedef float Row8 __attribute__((vector_size(32)));
+typedef int32_t Row8i __attribute__((vector_size(32)));
+
+} /* namespace */
+
+// AAN scale factors, cos(k * pi / 16) * sqrt(2) with aan[0] = 1. The
+// scaled DCT output is corrected for these in the quantizer divisors.
+static const float aanScale[8] = {
+  1.0f, 1.387039845f, 1.306562965f, 1.175875602f,
+  1.0f, 0.785694958f, 0.541196100f, 0.275899379f,
+};
+
+// One dimensional AAN DCT (Arai, Agui, Nakajima) applied to eight
+// columns at once: d[i] is row i of the block.
+static inline void dct8(Row8 d[8]) {
+  Row8 tmp0 = d[0] + d[7], tmp7 = d[0] - d[7];
+  Row8 tmp1 = d[1] + d[6], tmp6 = d[1] - d[6];
+  Row8 tmp2 = d[2] + d[5], tmp5 = d[2] - d[5];
+  Row8 tmp3 = d[3] + d[4], tmp4 = d[3] - d[4];
+
+  // Even part
+  Row8 tmp10 = tmp0 + tmp3, tmp13 = tmp0 - tmp3;
+  Row8 tmp11 = tmp1 + tmp2, tmp12 = tmp1 - tmp2;
+
+  d[0] = tmp10 + tmp11;
+  d[4] = tmp10 - tmp11;
+
+  Row8 z1 = (tmp12 + tmp13) * 0.707106781f;
+  d[2] = tmp13 + z1;
+  d[6] = tmp13 - z1;
+
+  // Odd part
+  tmp10 = tmp4 + tmp5;
+  tmp11 = tmp5 + tmp6;
+  tmp12 = tmp6 + tmp7;
+
+  Row8 z5 = (tmp10 - tmp12) * 0.382683433f;
+  Row8 z2 = tmp10 * 0.541196100f + z5;
+  Row8 z4 = tmp12 * 1.306562965f + z5;
+  Row8 z3 = tmp11 * 0.707106781f;
+
+  Row8 z11 = tmp7 + z3, z13 = tmp7 - z3;
+
+  d[5] = z13 + z2;
+  d[3] = z13 - z2;
+  d[1] = z11 + z4;
+  d[7] = z11 - z4;
+}
+
+static inline void transpose(Row8 d[8]) {
+  float t[64];
+
+  __builtin_memcpy(t, d, sizeof(t));
+  for (unsigned int i = 0; i < 8; ++i)
+    for (unsigned int j = 0; j < 8; ++j)
+      d[i][j] = t[j * 8 + i];
+}
+
+static inline unsigned int magnitudeBits(int value) {
+  unsigned int v = value < 0 ? -value : value;
+  return v ? 32 - __builtin_clz(v) : 0;
+}
+
+static void encodeBlock(BitWriter &bits, const uint8_t *src,
+                        unsigned int stride, const float divisor[64],
+                        const HuffmanTable &dc, const HuffmanTable &ac,
+                        int &lastDc) {
+  Row8 rows[8];
+
+  for (unsigned int y = 0; y < 8; ++y)
+    for (unsigned int x = 0; x < 8; ++x)
+      rows[y][x] = src[y * stride + x];
+
+  for (unsigned int y = 0; y < 8; ++y)
+    rows[y] -= 128.0f;
+
+  dct8(rows); // columns
+  transpose(rows);
+  dct8(rows); // rows, result is transposed
+  transpose(rows);
+
+  // Quantize and round half away from zero, eight coefficients at a time.
+  int32_t natural[64];
+  for (unsigned int y = 0; y < 8; ++y) {
+    Row8 d;
+    __builtin_memcpy(&d, divisor + y * 8, sizeof(d));
+    Row8 v = rows[y] * d;
+    v += v < 0 ? -0.5f : 0.5f;
+    Row8i q = __builtin_convertvector(v, Row8i);
+    __builtin_memcpy(natural + y * 8, &q, sizeof(q));
+  }
+
+  // DC: difference to the previous block of the same component.
+  int diff = natural[0] - lastDc;
+  lastDc = natural[0];
+  unsigned int size = magnitudeBits(diff);
+  if (size)
+    bits.write((dc.codes[size].code << size) |
+                   ((diff < 0 ? diff - 1 : diff) & ((1u << size) - 1)),
+               dc.codes[size].length + size);
+  else
+    bits.write(dc.codes[0].code, dc.codes[0].length);
+
+  // AC: run-length of zeros + magnitude category.
+  unsigned int run = 0;
+  for (unsigned int i = 1; i < 64; ++i) {
+    int value = natural[zigzag[i]];
+    if (!value) {
+      run++;
+      continue;
+    }
+
+    while (run >= 16) {
+      bits.write(ac.codes[0xf0].code, ac.codes[0xf0].length);
+      run -= 16;
+    }
+
+    size = magnitudeBits(value);
+    const HuffmanCode &code = ac.codes[(run << 4) | size];
+    bits.write((code.code << size) |
+                   ((value < 0 ? value - 1 : value) & ((1u << size) - 1)),
+               code.length + size);
+    run = 0;
+  }
+
+  if (run)
+    bits.write(ac.codes[0x00].code, ac.codes[0x00].length); // EOB
+}
+
+JpegEncoder::JpegEncoder(int quality, unsigned int slices) : slices_(slices) {
+  quality = std::clamp(quality, 1, 100);
+  int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+
+  for (unsigned int i = 0; i < 64; ++i) {
+    const uint8_t *base[2] = { lumaQuant, chromaQuant };
+    for (unsigned int t = 0; t < 2; ++t) {
+      int q = std::clamp((base[t][i] * scale + 50) / 100, 1, 255);
+      // Base tables are in natural order, DQT stores zigzag order. The
+      // divisor also removes the AAN output scaling and the DCT gain of 8.
+      divisor_[t][i] = 1.0f / (q * aanScale[i / 8] * aanScale[i % 8] * 8.0f);
+      quant_[t][std::find(zigzag, zigzag + 64, i) - zigzag] = q;
+    }
+  }
+}
+
+static void put16(std::vector<uint8_t> &out, unsigned int value) {
+  out.push_back(value >> 8);
+  out.push_back(value & 0xff);
+}
+
+static void putHuffmanTable(std::vector<uint8_t> &out, uint8_t id,
+                            const uint8_t bits[16], const uint8_t *values) {
+  unsigned int count = 0;
+  for (unsigned int i = 0; i < 16; ++i)
+    count += bits[i];
+
+  out.push_back(id);
+  out.insert(out.end(), bits, bits + 16);
+  out.insert(out.end(), values, values + count);
+}
+
+void JpegEncoder::writeHeaders(const YuvImage &image,
+                               unsigned int restartInterval,
+                               std::vector<uint8_t> &out) const {
+  static const uint8_t jfif[] = {
+    0xff, 0xd8,                         // SOI
+    0xff, 0xe0, 0x00, 0x10, 'J', 'F', 'I', 'F', 0x00,
+    0x01, 0x01, 0x00, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00,
+  };
+  out.insert(out.end(), jfif, jfif + sizeof(jfif));
+
+  // DQT
+  out.push_back(0xff), out.push_back(0xdb);
+  put16(out, 2 + 2 * 65);
+  for (unsigned int t = 0; t < 2; ++t) {
+    out.push_back(t);
+    out.insert(out.end(), quant_[t], quant_[t] + 64);
+  }
+
+  // SOF0: 8 bit, 3 components, luma 2x2 sampled against chroma
+  static const uint8_t components[] = {
+    0x03, 0x01, 0x22, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+  };
+  out.push_back(0xff), out.push_back(0xc0);
+  put16(out, 8 + 3 * 3);
+  out.push_back(8);
+  put16(out, image.height);
+  put16(out, image.width);
+  out.insert(out.end(), components, components + sizeof(components));
+
+  // DHT
+  out.push_back(0xff), out.push_back(0xc4);
+  put16(out, 2 + 4 * 17 + 2 * 12 + 2 * 162);
+  putHuffmanTable(out, 0x00, dcLumaBits, dcValues);
+  putHuffmanTable(out, 0x10, acLumaBits, acLumaValues);
+  putHuffmanTable(out, 0x01, dcChromaBits, dcValues);
+  putHuffmanTable(out, 0x11, acChromaBits, acChromaValues);
+
+  // DRI
+  if (restartInterval) {
+    out.push_back(0xff), out.push_back(0xdd);
+    put16(out, 4);
+    put16(out, restartInterval);
+  }
+
+  // SOS
+  static const uint8_t sos[] = {
+    0xff, 0xda, 0x00, 0x0c, 0x03, 0x01, 0x00, 0x02, 0x11, 0x03, 0x11,
+    0x00, 0x3f, 0x00,
+  };
+  out.insert(out.end(), sos, sos + sizeof(sos));
+}
+
+// Encode MCU rows [first, last) as one restart interval.
+void JpegEncoder::encodeSlice(const YuvImage &image, unsigned int first,
+                              unsigned int last,
+                              std::vector<uint8_t> &out) const {
+  BitWriter bits(out);
+  int lastDc[3] = {};
+  unsigned int mcuCols = (image.width + 15) / 16;
+
+  for (unsigned int my = first; my < last; ++my) {
+    for (unsigned int mx = 0; mx < mcuCols; ++mx) {
+      const uint8_t *y = image.y.data() + my * 16 * image.yStride + mx * 16;
+      for (unsigned int i = 0; i < 4; ++i)
+        encodeBlock(bits, y + (i >> 1) * 8 * image.yStride + (i & 1) * 8,
+                    image.yStride, divisor_[0], dcLuma, acLuma, lastDc[0]);
+
+      unsigned int c = my * 8 * image.cStride + mx * 8;
+      encodeBlock(bits, image.cb.data() + c, image.cStride, divisor_[1],
+                  dcChroma, acChroma, lastDc[1]);
+      encodeBlock(bits, image.cr.data() + c, image.cStride, divisor_[1],
+                  dcChroma, acChroma, lastDc[2]);
+    }
+  }
+
+  bits.flush();
+}
+
+void JpegEncoder::encode(const YuvImage &image,
+                         std::vector<uint8_t> &out) const {
+  ThreadPool &pool = ThreadPool::shared();
+  unsigned int mcuCols = (image.width + 15) / 16;
+  unsigned int mcuRows = (image.height + 15) / 16;
+
+  // Slices are whole MCU rows separated by restart markers, which reset
+  // the DC predictors so every slice can be entropy coded independently.
+  unsigned int slices = slices_ ? slices_ : pool.size() * 2;
+  unsigned int rowsPerSlice = (mcuRows + slices - 1) / std::max(slices, 1u);
+  rowsPerSlice = std::clamp(rowsPerSlice, 1u, 65535 / mcuCols);
+  slices = (mcuRows + rowsPerSlice - 1) / rowsPerSlice;
+
+  out.clear();
+  writeHeaders(image, slices > 1 ? mcuCols * rowsPerSlice : 0, out);
+
+  if (slices == 1) {
+    encodeSlice(image, 0, mcuRows, out);
+  } else {
+    std::vector<std::vector<uint8_t>> segments(slices);
+
+    pool.parallelFor(slices, [&](unsigned int i) {
+      unsigned int first = i * rowsPerSlice;
+      unsigned int last = std::min(first + rowsPerSlice, mcuRows);
+      segments[i].reserve(image.yStride * 16 * (last - first) / 4);
+      encodeSlice(image, first, last, segments[i]);
+    });
+
+    for (unsigned int i = 0; i < slices; ++i) {
+      if (i) {
+        out.push_back(0xff);
+        out.push_back(0xd0 + (i - 1) % 8); // RSTn
+      }
+      out.insert(out.end(), segments[i].begin(), segments[i].end());
+    }
+  }
+
+  out.push_back(0xff);
+  out.push_back(0xd9); // EOI
+}
@@ -0,0 +1,531 @@
+#include "lens_remap.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+bool parseLensModel(const std::string &arg, LensModel &model) {
+  double v[9] = {};
+  char trailing;
+
+  int count = sscanf(arg.c_str(), "%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf,%lf%c",
+                     &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7],
+                     &v[8], &trailing);
+  if ((count != 6 && count != 8 && count != 9) || v[0] <= 0.0 || v[1] <= 0.0)
+    return false;
+
+  model.fx = v[0];
+  model.fy = v[1];
+  model.cx = v[2];
+  model.cy = v[3];
+  model.k1 = v[4];
+  model.k2 = v[5];
+  model.p1 = v[6];
+  model.p2 = v[7];
+  model.k3 = v[8];
+  return true;
+}
+
+std::string defaultLensCacheDir() {
+  const char *cache = getenv("XDG_CACHE_HOME");
+  if (cache && *cache)
+    return std::string(cache) + "/onecam";
+
+  const char *home = getenv("HOME");
+  if (home && *home)
+    return std::string(home) + "/.cache/onecam";
+
+  return std::string();
+}
+
+namespace {
+
+static constexpr uint32_t kLensMapMagic = 0x4d4c434f; // "OCLM"
+static constexpr uint32_t kLensMapVersion = 1;
+
+// Tile size in full resolution pixels, scaled down for subsampled planes.
+constexpr unsigned int kTileWidth = 64;
+constexpr unsigned int kTileHeight = 32;
+
+constexpr int kFractionBits = 7;
+constexpr int kOne = 1 << kFractionBits;
+constexpr int kRound = 1 << (2 * kFractionBits - 1);
+
+// Everything a map depends on. Cached maps are only used when the key in
+// the file matches byte for byte.
+struct CacheKey {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t modelWidth;
+  uint32_t modelHeight;
+  uint32_t tileWidth;
+  uint32_t tileHeight;
+  uint32_t reserved;
+  double params[10];
+};
+
+typedef LensRemap::Entry Entry;
+
+uint8_t interpolate(const uint8_t *top, const uint8_t *bottom,
+                    unsigned int next, const Entry &e) {
+  int upper = top[0] * (kOne - e.fx) + top[next] * e.fx;
+  int lower = bottom[0] * (kOne - e.fx) + bottom[next] * e.fx;
+  return (upper * (kOne - e.fy) + lower * e.fy + kRound) >>
+         (2 * kFractionBits);
+}
+
+// C interleaved bytes per sample, samples step bytes apart.
+template<unsigned int C>
+void remapRow(const Entry *entries, unsigned int count, const uint8_t *src,
+              size_t stride, unsigned int step, uint8_t *dst, uint8_t fill) {
+  for (unsigned int i = 0; i < count; ++i, dst += step) {
+    const Entry &e = entries[i];
+    if (e.x == LensRemap::kOutside) {
+      for (unsigned int c = 0; c < C; ++c)
+        dst[c] = fill;
+      continue;
+    }
+
+    const uint8_t *top = src + e.y * stride + e.x * step;
+    for (unsigned int c = 0; c < C; ++c)
+      dst[c] = interpolate(top + c, top + stride + c, step, e);
+  }
+}
+
+#if defined(__SSE2__)
+inline uint32_t weightPair(uint8_t f) {
+  return (kOne - f) | (uint32_t(f) << 16);
+}
+#endif
+
+// Four byte samples, e.g. XRGB8888, one pixel per iteration: both rows
+// of the 2x2 neighbourhood are single 8 byte loads. Smaller samples stay
+// scalar, where assembling the vectors costs more than it saves.
+void remapRow4(const Entry *entries, unsigned int count, const uint8_t *src,
+               size_t stride, uint8_t *dst, uint8_t fill) {
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(kRound);
+
+  for (unsigned int i = 0; i < count; ++i, dst += 4) {
+    const Entry &e = entries[i];
+    if (e.x == LensRemap::kOutside) {
+      memset(dst, fill, 4);
+      continue;
+    }
+
+    const uint8_t *p = src + e.y * stride + e.x * 4;
+    __m128i top = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)), zero);
+    __m128i bottom = _mm_unpacklo_epi8(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + stride)),
+        zero);
+
+    // a0 a1 a2 a3 b0 b1 b2 b3 -> a0 b0 a1 b1 a2 b2 a3 b3
+    top = _mm_unpacklo_epi16(top, _mm_srli_si128(top, 8));
+    bottom = _mm_unpacklo_epi16(bottom, _mm_srli_si128(bottom, 8));
+
+    __m128i wx = _mm_set1_epi32(weightPair(e.fx));
+    __m128i rows = _mm_packs_epi32(_mm_madd_epi16(top, wx),
+                                   _mm_madd_epi16(bottom, wx));
+    rows = _mm_unpacklo_epi16(rows, _mm_srli_si128(rows, 8));
+
+    __m128i sum = _mm_madd_epi16(rows, _mm_set1_epi32(weightPair(e.fy)));
+    sum = _mm_srai_epi32(_mm_add_epi32(sum, round), 2 * kFractionBits);
+    sum = _mm_packs_epi32(sum, sum);
+    uint32_t out = _mm_cvtsi128_si32(_mm_packus_epi16(sum, sum));
+    memcpy(dst, &out, sizeof(out));
+  }
+#elif defined(__aarch64__)
+  for (unsigned int i = 0; i < count; ++i, dst += 4) {
+    const Entry &e = entries[i];
+    if (e.x == LensRemap::kOutside) {
+      memset(dst, fill, 4);
+      continue;
+    }
+
+    const uint8_t *p = src + e.y * stride + e.x * 4;
+    uint16x8_t top = vmovl_u8(vld1_u8(p));
+    uint16x8_t bottom = vmovl_u8(vld1_u8(p + stride));
+
+    uint16x4_t upper =
+        vmla_n_u16(vmul_n_u16(vget_low_u16(top), kOne - e.fx),
+                   vget_high_u16(top), e.fx);
+    uint16x4_t lower =
+        vmla_n_u16(vmul_n_u16(vget_low_u16(bottom), kOne - e.fx),
+                   vget_high_u16(bottom), e.fx);
+    uint32x4_t sum =
+        vmlal_n_u16(vmull_n_u16(upper, kOne - e.fy), lower, e.fy);
+
+    uint8x8_t bytes =
+        vqmovn_u16(vcombine_u16(vrshrn_n_u32(sum, 2 * kFractionBits),
+                                vdup_n_u16(0)));
+    vst1_lane_u32(reinterpret_cast<uint32_t *>(dst),
+                  vreinterpret_u32_u8(bytes), 0);
+  }
+#else
+  remapRow<4>(entries, count, src, stride, 4, dst, fill);
+#endif
+}
+
+bool readAll(int fd, void *data, size_t size) {
+  uint8_t *bytes = static_cast<uint8_t *>(data);
+
+  while (size) {
+    ssize_t ret = ::read(fd, bytes, size);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return false;
+    bytes += ret;
+    size -= ret;
+  }
+
+  return true;
+}
+
+int writeAll(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+  while (size) {
+    ssize_t ret = ::write(fd, bytes, size);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    bytes += ret;
+    size -= ret;
+  }
+
+  return 0;
+}
+
+// mkdir -p
+int makeDirectories(const std::string &path) {
+  for (size_t pos = 1; pos <= path.size(); ++pos) {
+    if (pos != path.size() && path[pos] != '/')
+      continue;
+
+    if (mkdir(path.substr(0, pos).c_str(), 0755) < 0 && errno != EEXIST)
+      return -errno;
+  }
+
+  return 0;
+}
+
+} /* namespace */
+
+size_t LensRemap::mapBytes() const {
+  size_t bytes = 0;
+  for (const Map &map : maps_)
+    bytes += map.entries.size() * sizeof(Entry);
+  return bytes;
+}
+
+int LensRemap::configure(const LensModel &model, FrameFormat format,
+                         unsigned int width, unsigned int height,
+                         const std::string &cacheDir) {
+  const FormatInfo &info = formatInfo(format);
+
+  maps_.clear();
+  channels_.clear();
+  fromCache_ = false;
+  cachePath_.clear();
+
+  if (!info.numPlanes || model.fx <= 0.0 || model.fy <= 0.0 ||
+      model.zoom <= 0.0 || width % info.hAlign || height % info.vAlign ||
+      width < 2 * info.hAlign || height < 2 * info.vAlign)
+    return -EINVAL;
+
+  format_ = format;
+  width_ = width;
+  height_ = height;
+
+  // Maps are per sampling grid: chroma samples sit elsewhere than luma.
+  auto addMap = [&](unsigned int hSub, unsigned int vSub) {
+    Map map;
+    map.width = width / hSub;
+    map.height = height / vSub;
+    map.hSub = hSub;
+    map.vSub = vSub;
+    map.tileWidth = kTileWidth / hSub;
+    map.tileHeight = kTileHeight / vSub;
+    maps_.push_back(std::move(map));
+    return static_cast<unsigned int>(maps_.size() - 1);
+  };
+
+  unsigned int luma = addMap(1, 1);
+
+  switch (format) {
+  case FrameFormat::XRGB8888:
+  case FrameFormat::XBGR8888:
+  case FrameFormat::RGB888:
+  case FrameFormat::BGR888:
+  case FrameFormat::R8: {
+    unsigned int bpp = info.bytesPerPixel[0];
+    channels_.push_back({ 0, 0, bpp, bpp, luma, 0 });
+    break;
+  }
+
+  case FrameFormat::NV12:
+  case FrameFormat::NV21: {
+    unsigned int chroma = addMap(2, 2);
+    channels_.push_back({ 0, 0, 1, 1, luma, 0 });
+    channels_.push_back({ 1, 0, 2, 2, chroma, 128 });
+    break;
+  }
+
+  case FrameFormat::YUV420: {
+    unsigned int chroma = addMap(2, 2);
+    channels_.push_back({ 0, 0, 1, 1, luma, 0 });
+    channels_.push_back({ 1, 0, 1, 1, chroma, 128 });
+    channels_.push_back({ 2, 0, 1, 1, chroma, 128 });
+    break;
+  }
+
+  case FrameFormat::YUYV:
+  case FrameFormat::UYVY: {
+    // Luma every 2 bytes, Cb and Cr every 4, in the one packed plane.
+    unsigned int chroma = addMap(2, 1);
+    unsigned int y = format == FrameFormat::UYVY;
+    channels_.push_back({ 0, y, 2, 1, luma, 0 });
+    channels_.push_back({ 0, 1 - y, 4, 1, chroma, 128 });
+    channels_.push_back({ 0, 3 - y, 4, 1, chroma, 128 });
+    break;
+  }
+
+  default:
+    maps_.clear();
+    return -EINVAL;
+  }
+
+  CacheKey key = {};
+  key.magic = kLensMapMagic;
+  key.version = kLensMapVersion;
+  key.format = static_cast<uint32_t>(format);
+  key.width = width;
+  key.height = height;
+  key.modelWidth = model.width;
+  key.modelHeight = model.height;
+  key.tileWidth = kTileWidth;
+  key.tileHeight = kTileHeight;
+  const double params[10] = { model.fx, model.fy, model.cx, model.cy,
+                              model.k1, model.k2, model.p1, model.p2,
+                              model.k3, model.zoom };
+  std::copy_n(params, 10, key.params);
+  key_.assign(reinterpret_cast<const uint8_t *>(&key),
+              reinterpret_cast<const uint8_t *>(&key) + sizeof(key));
+
+  std::string path;
+  if (!cacheDir.empty()) {
+    // FNV-1a of the key names the file.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint8_t byte : key_)
+      hash = (hash ^ byte) * 0x100000001b3ull;
+
+    char name[32];
+    snprintf(name, sizeof(name), "lens_%016llx.map",
+             static_cast<unsigned long long>(hash));
+    path = cacheDir + "/" + name;
+
+    if (loadCache(path)) {
+      fromCache_ = true;
+      cachePath_ = path;
+      return 0;
+    }
+  }
+
+  for (Map &map : maps_)
+    buildMap(model, map);
+
+  // The cache only saves time: failing to write it is not an error.
+  if (!path.empty() && !makeDirectories(cacheDir) && !saveCache(path))
+    cachePath_ = path;
+
+  return 0;
+}
+
+// The same projection as OpenCV's initUndistortRectifyMap(): each output
+// pixel is a ray through an ideal pinhole camera, distorted by the lens
+// model and projected into the source.
+void LensRemap::buildMap(const LensModel &model, Map &map) const {
+  double sx = model.width ? static_cast<double>(width_) / model.width : 1.0;
+  double sy = model.height ? static_cast<double>(height_) / model.height : 1.0;
+  double fx = model.fx * sx, fy = model.fy * sy;
+  double cx = model.cx * sx, cy = model.cy * sy;
+  double outFx = fx * model.zoom, outFy = fy * model.zoom;
+
+  auto entry = [&](unsigned int u, unsigned int v) {
+    // Sample centres of this grid in full resolution pixels, and back.
+    double x = ((u + 0.5) * map.hSub - 0.5 - cx) / outFx;
+    double y = ((v + 0.5) * map.vSub - 0.5 - cy) / outFy;
+    double r2 = x * x + y * y;
+    double radial = 1.0 + r2 * (model.k1 + r2 * (model.k2 + r2 * model.k3));
+    double xd = x * radial + 2.0 * model.p1 * x * y +
+                model.p2 * (r2 + 2.0 * x * x);
+    double yd = y * radial + model.p1 * (r2 + 2.0 * y * y) +
+                2.0 * model.p2 * x * y;
+    double su = (fx * xd + cx + 0.5) / map.hSub - 0.5;
+    double sv = (fy * yd + cy + 0.5) / map.vSub - 0.5;
+
+    Entry e = { kOutside, kOutside, 0, 0 };
+    if (!(su >= -0.5 && su <= map.width - 0.5 && sv >= -0.5 &&
+          sv <= map.height - 0.5))
+      return e;
+
+    // Both neighbours must exist: the last sample is reached from the one
+    // before it with a full fraction.
+    auto split = [](double s, unsigned int size, uint16_t &i, uint8_t &f) {
+      long fixed = std::lround(std::min(std::max(s, 0.0), size - 1.0) * kOne);
+      long index = std::min<long>(fixed >> kFractionBits, size - 2);
+      i = static_cast<uint16_t>(index);
+      f = static_cast<uint8_t>(fixed - index * kOne);
+    };
+    split(su, map.width, e.x, e.fx);
+    split(sv, map.height, e.y, e.fy);
+    return e;
+  };
+
+  map.entries.clear();
+  map.entries.reserve(size_t(map.width) * map.height);
+
+  for (unsigned int y0 = 0; y0 < map.height; y0 += map.tileHeight) {
+    unsigned int y1 = std::min(y0 + map.tileHeight, map.height);
+    for (unsigned int x0 = 0; x0 < map.width; x0 += map.tileWidth) {
+      unsigned int x1 = std::min(x0 + map.tileWidth, map.width);
+      for (unsigned int v = y0; v < y1; ++v) {
+        for (unsigned int u = x0; u < x1; ++u)
+          map.entries.push_back(entry(u, v));
+      }
+    }
+  }
+}
+
+bool LensRemap::loadCache(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  size_t size = key_.size();
+  for (const Map &map : maps_)
+    size += size_t(map.width) * map.height * sizeof(Entry);
+
+  struct stat st;
+  std::vector<uint8_t> key(key_.size());
+  bool ok = fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == size &&
+            readAll(fd, key.data(), key.size()) && key == key_;
+
+  for (Map &map : maps_) {
+    if (!ok)
+      break;
+    map.entries.resize(size_t(map.width) * map.height);
+    ok = readAll(fd, map.entries.data(), map.entries.size() * sizeof(Entry));
+  }
+
+  ::close(fd);
+
+  if (!ok) {
+    for (Map &map : maps_)
+      map.entries.clear();
+  }
+
+  return ok;
+}
+
+// Written to a temporary file renamed into place, so concurrent starts
+// never see a partial map.
+int LensRemap::saveCache(const std::string &path) const {
+  std::string temporary = path + "." + std::to_string(getpid());
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0)
+    return -errno;
+
+  int ret = writeAll(fd, key_.data(), key_.size());
+  for (const Map &map : maps_) {
+    if (ret)
+      break;
+    ret = writeAll(fd, map.entries.data(), map.entries.size() * sizeof(Entry));
+  }
+
+  if (::close(fd) < 0 && !ret)
+    ret = -errno;
+  if (!ret && rename(temporary.c_str(), path.c_str()) < 0)
+    ret = -errno;
+  if (ret)
+    unlink(temporary.c_str());
+
+  return ret;
+}
+
+int LensRemap::apply(const FrameView &src, const FrameView &dst) const {
+  if (!isConfigured() || src.format != format_ || dst.format != format_ ||
+      src.width != width_ || src.height != height_ || dst.width != width_ ||
+      dst.height != height_)
+    return -EINVAL;
+
+  unsigned int tilesX = (width_ + kTileWidth - 1) / kTileWidth;
+  unsigned int tilesY = (height_ + kTileHeight - 1) / kTileHeight;
+
+  ThreadPool::shared().parallelFor(tilesX * tilesY, [&](unsigned int tile) {
+    unsigned int tx = tile % tilesX, ty = tile / tilesX;
+
+    for (const Channel &channel : channels_) {
+      const Map &map = maps_[channel.map];
+      unsigned int x0 = tx * map.tileWidth, y0 = ty * map.tileHeight;
+      if (x0 >= map.width || y0 >= map.height)
+        continue;
+
+      unsigned int w = std::min(map.tileWidth, map.width - x0);
+      unsigned int h = std::min(map.tileHeight, map.height - y0);
+      const Entry *entries = map.entries.data() + size_t(y0) * map.width +
+                             size_t(x0) * h;
+
+      const PlaneView &from = src.planes[channel.plane];
+      const PlaneView &to = dst.planes[channel.plane];
+      const uint8_t *base = from.data + channel.offset;
+
+      for (unsigned int y = y0; y < y0 + h; ++y, entries += w) {
+        uint8_t *out = to.row(y) + channel.offset + x0 * channel.step;
+
+        switch (channel.components) {
+        case 1:
+          remapRow<1>(entries, w, base, from.stride, channel.step, out,
+                      channel.fill);
+          break;
+        case 2:
+          remapRow<2>(entries, w, base, from.stride, channel.step, out,
+                      channel.fill);
+          break;
+        case 3:
+          remapRow<3>(entries, w, base, from.stride, channel.step, out,
+                      channel.fill);
+          break;
+        case 4:
+          remapRow4(entries, w, base, from.stride, out, channel.fill);
+          break;
+        }
+      }
+    }
+  });
+
+  return 0;
+}
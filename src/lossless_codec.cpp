@@ -0,0 +1,595 @@
+#include "lossless_codec.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#include "thread_pool.h"
+
+// Unary prefixes this long escape to a raw 8 bit residual.
+static constexpr unsigned int kEscape = 24;
+static constexpr unsigned int kContexts = 8;
+
+namespace {
+
+// Rice coded bitstream, most significant bit first. Every write stores
+// the whole 64 bit accumulator and advances by the completed bytes, which
+// keeps the hot path free of branches. Space is reserved up front.
+class BitPacker {
+public:
+  explicit BitPacker(std::vector<uint8_t> &out)
+    : out_(out), size_(out.size()) {}
+
+  // Make room for the given number of codes of up to 32 bits.
+  void reserve(size_t codes) {
+    if (out_.size() < size_ + 4 * codes + 8)
+      out_.resize(size_ + 4 * codes + 8);
+  }
+
+  // count <= 56, bits must not have bits set above count. Empty writes
+  // are allowed.
+  void write(uint64_t bits, unsigned int count) {
+    buffer_ |= bits << 1 << (63 - count_ - count);
+    count_ += count;
+
+    uint64_t word = __builtin_bswap64(buffer_);
+    memcpy(out_.data() + size_, &word, 8);
+
+    unsigned int bytes = count_ >> 3;
+    size_ += bytes;
+    buffer_ = bytes ? buffer_ << (bytes * 8) : buffer_;
+    count_ &= 7;
+  }
+
+  void flush() {
+    if (count_)
+      write(0, 8 - count_);
+    out_.resize(size_);
+  }
+
+private:
+  std::vector<uint8_t> &out_;
+  size_t size_;
+  uint64_t buffer_ = 0;
+  unsigned int count_ = 0;
+};
+
+class BitUnpacker {
+public:
+  BitUnpacker(const uint8_t *data, size_t size) : data_(data), size_(size) {}
+
+  // Left aligned: the next bit is the top bit of the returned value. At
+  // least 57 bits are valid; past the end of the data zeros are read.
+  uint64_t peek() const {
+    size_t offset = position_ >> 3;
+    uint64_t word = 0;
+
+    if (offset + 8 <= size_) {
+      memcpy(&word, data_ + offset, 8);
+    } else if (offset < size_) {
+      memcpy(&word, data_ + offset, size_ - offset);
+    }
+
+    return __builtin_bswap64(word) << (position_ & 7);
+  }
+
+  void skip(unsigned int count) { position_ += count; }
+
+  bool overrun() const { return position_ > size_ * 8; }
+
+private:
+  const uint8_t *data_;
+  size_t size_;
+  uint64_t position_ = 0;
+};
+
+// Eight samples widened to 16 bits for the predictor arithmetic, one
+// 128 bit register on SSE2 and NEON.
+typedef uint8_t Bytes8 __attribute__((vector_size(8)));
+typedef int16_t Shorts8 __attribute__((vector_size(16)));
+
+// Four 32 bit pixels, and the same register seen as bytes.
+typedef uint32_t Pixels4 __attribute__((vector_size(16)));
+typedef uint8_t Bytes16 __attribute__((vector_size(16)));
+
+} /* namespace */
+
+static bool hasColourTransform(FrameFormat format) {
+  return format == FrameFormat::XRGB8888 || format == FrameFormat::XBGR8888 ||
+         format == FrameFormat::RGB888 || format == FrameFormat::BGR888;
+}
+
+static inline int median(int a, int b, int c) {
+  int lo = std::min(a, b), hi = std::max(a, b);
+  return std::clamp(a + b - c, lo, hi);
+}
+
+// Quantised local activity |a - c| + |b - c|, 0 to 510.
+static inline unsigned int context(unsigned int activity) {
+  return (activity > 0) + (activity > 2) + (activity > 6) + (activity > 14) +
+         (activity > 30) + (activity > 62) + (activity > 126);
+}
+
+// Code table indices of a row, (context + offset) * 256 + zigzag coded MED
+// residual, where offsets select the contexts of each component. cur and
+// prev point to the first sample; the bpp samples before them hold the
+// left padding.
+static void predictRow(const uint8_t *cur, const uint8_t *prev,
+                       unsigned int bpp, unsigned int count,
+                       const uint8_t *offsets, uint16_t *indices) {
+  unsigned int i = 0;
+
+  for (; i + 8 <= count; i += 8) {
+    Bytes8 vx, va, vb, vc, vo;
+    memcpy(&vx, cur + i, 8);
+    memcpy(&va, cur + i - bpp, 8);
+    memcpy(&vb, prev + i, 8);
+    memcpy(&vc, prev + i - bpp, 8);
+    memcpy(&vo, offsets + i, 8);
+
+    Shorts8 x = __builtin_convertvector(vx, Shorts8);
+    Shorts8 a = __builtin_convertvector(va, Shorts8);
+    Shorts8 b = __builtin_convertvector(vb, Shorts8);
+    Shorts8 c = __builtin_convertvector(vc, Shorts8);
+
+    Shorts8 lo = a < b ? a : b;
+    Shorts8 hi = a < b ? b : a;
+    Shorts8 grad = a + b - c;
+    Shorts8 pred = grad < lo ? lo : (grad > hi ? hi : grad);
+
+    Shorts8 r = ((x - pred + 128) & 255) - 128;
+    Shorts8 zz = r < 0 ? -2 * r - 1 : 2 * r;
+
+    Shorts8 da = a - c, db = b - c;
+    Shorts8 act = (da < 0 ? -da : da) + (db < 0 ? -db : db);
+    Shorts8 ctx = -((act > 0) + (act > 2) + (act > 6) + (act > 14) +
+                     (act > 30) + (act > 62) + (act > 126));
+    ctx += __builtin_convertvector(vo, Shorts8);
+
+    Shorts8 index = ctx << 8 | zz;
+    memcpy(indices + i, &index, 16);
+  }
+
+  const uint8_t *left = cur - bpp, *upLeft = prev - bpp;
+  for (; i < count; ++i) {
+    int a = left[i], b = prev[i], c = upLeft[i];
+    int r = int8_t(cur[i] - median(a, b, c));
+    unsigned int ctx = context(std::abs(a - c) + std::abs(b - c));
+    indices[i] = (ctx + offsets[i]) << 8 | (r < 0 ? -2 * r - 1 : 2 * r);
+  }
+}
+
+// Add or subtract G to/from R and B of four byte pixels, four at a time.
+// Returns the number of bytes done.
+static unsigned int transformPixels4(const uint8_t *src, uint8_t *dst,
+                                     unsigned int count, bool inverse) {
+  unsigned int i = 0;
+
+  for (; i + 16 <= count; i += 16) {
+    Pixels4 pixels, green;
+    memcpy(&pixels, src + i, 16);
+    green = pixels >> 8 & 0xff;
+    green |= green << 16;
+
+    Bytes16 bytes, delta;
+    memcpy(&bytes, &pixels, 16);
+    memcpy(&delta, &green, 16);
+    bytes = inverse ? bytes + delta : bytes - delta;
+    memcpy(dst + i, &bytes, 16);
+  }
+
+  return i;
+}
+
+// (R-G, G, B-G, X): red and blue are always at byte 0 and 2.
+static void forwardTransform(const uint8_t *src, uint8_t *dst, bool rct,
+                             unsigned int bpp, unsigned int count) {
+  memcpy(dst, src, count);
+  if (!rct)
+    return;
+
+  unsigned int i = bpp == 4 ? transformPixels4(src, dst, count, false) : 0;
+  for (; i < count; i += bpp) {
+    dst[i] = src[i] - src[i + 1];
+    dst[i + 2] = src[i + 2] - src[i + 1];
+  }
+}
+
+static void inverseTransform(const uint8_t *src, uint8_t *dst, bool rct,
+                             unsigned int bpp, unsigned int count) {
+  memcpy(dst, src, count);
+  if (!rct)
+    return;
+
+  unsigned int i = bpp == 4 ? transformPixels4(src, dst, count, true) : 0;
+  for (; i < count; i += bpp) {
+    dst[i] = src[i] + src[i + 1];
+    dst[i + 2] = src[i + 2] + src[i + 1];
+  }
+}
+
+// Components with the same value over the whole band. Red and blue are
+// excluded under the colour transform, which changes them per pixel.
+static uint8_t constantComponents(const PlaneView &plane, bool rct,
+                                  unsigned int y0, unsigned int y1,
+                                  uint8_t values[4]) {
+  unsigned int bpp = plane.bytesPerPixel;
+  uint8_t mask = 0;
+
+  for (unsigned int c = 0; c < bpp; ++c) {
+    if (rct && (c == 0 || c == 2))
+      continue;
+
+    uint8_t value = plane.row(y0)[c];
+    bool constant = true;
+    for (unsigned int y = y0; y < y1 && constant; ++y) {
+      const uint8_t *row = plane.row(y);
+      for (unsigned int x = c; x < plane.rowBytes(); x += bpp) {
+        if (row[x] != value) {
+          constant = false;
+          break;
+        }
+      }
+    }
+
+    if (constant) {
+      mask |= 1 << c;
+      values[c] = value;
+    }
+  }
+
+  return mask;
+}
+
+namespace {
+
+// Two row buffers with 2 * bpp bytes of left padding, swapped per row.
+struct RowBuffers {
+  std::vector<uint8_t> memory;
+  uint8_t *rows[2];
+  unsigned int pad;
+
+  RowBuffers(unsigned int bpp, size_t count) : memory(2 * (count + 2 * bpp)) {
+    pad = 2 * bpp;
+    rows[0] = memory.data() + pad;
+    rows[1] = memory.data() + 2 * pad + count;
+  }
+
+  // Set up the left padding of cur for row y of a band and return the
+  // row to predict from. The first row of a band predicts from the left
+  // neighbour only: it uses itself shifted by one pixel as the row above.
+  const uint8_t *prepare(uint8_t *cur, uint8_t *prev, bool first,
+                         unsigned int bpp) {
+    if (first) {
+      memset(cur - pad, 0, pad);
+      return cur - bpp;
+    }
+
+    memcpy(cur - bpp, prev, bpp);
+    memcpy(prev - bpp, prev, bpp);
+    return prev;
+  }
+};
+
+} /* namespace */
+
+// Length in bits of a value with Rice parameter k.
+static inline unsigned int riceLength(unsigned int value, unsigned int k) {
+  unsigned int q = value >> k;
+  return q < kEscape ? q + 1 + k : kEscape + 8;
+}
+
+// Rice parameter with the fewest total bits for a residual histogram.
+static unsigned int bestParameter(const uint32_t histogram[256]) {
+  uint64_t best = UINT64_MAX;
+  unsigned int bestK = 0;
+
+  for (unsigned int k = 0; k < 8; ++k) {
+    uint64_t bits = 0;
+    for (unsigned int v = 0; v < 256; ++v)
+      bits += uint64_t(histogram[v]) * riceLength(v, k);
+    if (bits < best) {
+      best = bits;
+      bestK = k;
+    }
+  }
+
+  return bestK;
+}
+
+// Residual coding uses one static Rice parameter per component and
+// context, picked from the histogram of the whole tile and sent in its
+// header. This avoids the serial per-sample state updates of adaptive
+// Rice coding, so both passes stay cheap.
+//
+// Tile layout: constant component mask, the constant values, then for
+// every coded component eight 4 bit parameters, then the bitstream.
+static void encodeTile(const PlaneView &plane, bool rct, unsigned int y0,
+                       unsigned int y1, std::vector<uint8_t> &out) {
+  unsigned int bpp = plane.bytesPerPixel;
+  size_t count = plane.rowBytes();
+  uint8_t values[4] = {};
+  uint8_t mask = constantComponents(plane, rct, y0, y1, values);
+
+  out.clear();
+  out.push_back(mask);
+  for (unsigned int c = 0; c < bpp; ++c)
+    if (mask & (1 << c))
+      out.push_back(values[c]);
+
+  if (mask == (1u << bpp) - 1)
+    return;
+
+  // Pass 1: code table indices and their histograms. Components are told
+  // apart by the offset of their contexts.
+  static thread_local std::vector<uint16_t> indices;
+  static thread_local std::vector<uint8_t> offsets;
+  static thread_local std::vector<uint32_t> histograms;
+  indices.resize(count * (y1 - y0));
+  offsets.resize(count);
+  histograms.assign(2 * 4 * kContexts * 256, 0);
+  uint32_t *even = histograms.data(), *odd = even + 4 * kContexts * 256;
+
+  for (size_t x = 0; x < count; ++x)
+    offsets[x] = x % bpp * kContexts;
+
+  RowBuffers buffers(bpp, count);
+
+  for (unsigned int y = y0; y < y1; ++y) {
+    uint8_t *cur = buffers.rows[y & 1];
+    uint16_t *index = indices.data() + (y - y0) * count;
+
+    forwardTransform(plane.row(y), cur, rct, bpp, count);
+    const uint8_t *prev =
+        buffers.prepare(cur, buffers.rows[~y & 1], y == y0, bpp);
+    predictRow(cur, prev, bpp, count, offsets.data(), index);
+
+    // Two histograms, so that runs of the same index don't wait on the
+    // previous increment.
+    size_t x = 0;
+    for (; x + 2 <= count; x += 2) {
+      even[index[x]]++;
+      odd[index[x + 1]]++;
+    }
+    if (x < count)
+      even[index[x]]++;
+  }
+
+  for (unsigned int i = 0; i < 4 * kContexts * 256; ++i)
+    even[i] += odd[i];
+
+  uint8_t parameters[4 * kContexts] = {};
+  for (unsigned int c = 0; c < bpp; ++c) {
+    if (mask & (1 << c))
+      continue;
+
+    for (unsigned int i = 0; i < kContexts; i += 2) {
+      unsigned int index = c * kContexts + i;
+      parameters[index] = bestParameter(&histograms[index * 256]);
+      parameters[index + 1] = bestParameter(&histograms[(index + 1) * 256]);
+      out.push_back(parameters[index] | parameters[index + 1] << 4);
+    }
+  }
+
+  // Pass 2: the bitstream, in raster order. Codes are looked up per
+  // context and residual; constant components have empty codes, so every
+  // sample is written without checking which component it belongs to.
+  static thread_local std::vector<uint32_t> codes;
+  static thread_local std::vector<uint8_t> lengths;
+  codes.assign(4 * kContexts * 256, 0);
+  lengths.assign(4 * kContexts * 256, 0);
+
+  for (unsigned int i = 0; i < bpp * kContexts; ++i) {
+    if (mask & (1 << (i / kContexts)))
+      continue;
+
+    unsigned int k = parameters[i];
+    for (unsigned int value = 0; value < 256; ++value) {
+      unsigned int q = value >> k;
+      uint32_t code;
+      if (q < kEscape)
+        code = (((1u << q) - 1) << (k + 1)) | (value & ((1u << k) - 1));
+      else
+        code = ((1u << kEscape) - 1) << 8 | value;
+      codes[i * 256 + value] = code;
+      lengths[i * 256 + value] = riceLength(value, k);
+    }
+  }
+
+  BitPacker bits(out);
+
+  for (unsigned int y = 0; y < y1 - y0; ++y) {
+    const uint16_t *index = indices.data() + y * count;
+    size_t x = 0;
+
+    bits.reserve(count);
+
+    // Two codes per write unless both are escapes.
+    for (; x + 2 <= count; x += 2) {
+      unsigned int l0 = lengths[index[x]], l1 = lengths[index[x + 1]];
+      uint64_t c0 = codes[index[x]], c1 = codes[index[x + 1]];
+      if (l0 + l1 <= 56) {
+        bits.write(c0 << l1 | c1, l0 + l1);
+      } else {
+        bits.write(c0, l0);
+        bits.write(c1, l1);
+      }
+    }
+    if (x < count)
+      bits.write(codes[index[x]], lengths[index[x]]);
+  }
+
+  bits.flush();
+}
+
+static bool decodeTile(const uint8_t *data, size_t size,
+                       const PlaneView &plane, bool rct, unsigned int y0,
+                       unsigned int y1) {
+  unsigned int bpp = plane.bytesPerPixel;
+  size_t count = plane.rowBytes();
+  const uint8_t *end = data + size;
+
+  if (data == end)
+    return false;
+
+  uint8_t mask = *data++;
+  uint8_t values[4] = {};
+  for (unsigned int c = 0; c < bpp; ++c) {
+    if (!(mask & (1 << c)))
+      continue;
+    if (data == end)
+      return false;
+    values[c] = *data++;
+  }
+
+  uint8_t parameters[4 * kContexts] = {};
+  if (mask != (1u << bpp) - 1) {
+    for (unsigned int c = 0; c < bpp; ++c) {
+      if (mask & (1 << c))
+        continue;
+      for (unsigned int i = 0; i < kContexts; i += 2) {
+        if (data == end)
+          return false;
+        parameters[c * kContexts + i] = *data & 0xf;
+        parameters[c * kContexts + i + 1] = *data++ >> 4;
+      }
+    }
+  }
+
+  RowBuffers buffers(bpp, count);
+  BitUnpacker bits(data, end - data);
+
+  for (unsigned int y = y0; y < y1; ++y) {
+    uint8_t *cur = buffers.rows[y & 1];
+
+    const uint8_t *prev =
+        buffers.prepare(cur, buffers.rows[~y & 1], y == y0, bpp);
+    const uint8_t *left = cur - bpp, *upLeft = prev - bpp;
+
+    for (size_t x = 0; x < count; x += bpp) {
+      for (unsigned int c = 0; c < bpp; ++c) {
+        size_t i = x + c;
+
+        if (mask & (1 << c)) {
+          cur[i] = values[c];
+          continue;
+        }
+
+        int a = left[i], b = prev[i], cc = upLeft[i];
+        unsigned int ctx = context(std::abs(a - cc) + std::abs(b - cc));
+        unsigned int k = parameters[c * kContexts + ctx];
+
+        uint64_t word = bits.peek();
+        unsigned int q = __builtin_clzll(~word);
+        unsigned int value;
+
+        if (q < kEscape) {
+          value = q << k;
+          if (k)
+            value |= (word << (q + 1)) >> (64 - k);
+          bits.skip(q + 1 + k);
+        } else {
+          value = (word >> (64 - kEscape - 8)) & 0xff;
+          bits.skip(kEscape + 8);
+        }
+
+        int r = (value >> 1) ^ -(value & 1);
+        cur[i] = median(a, b, cc) + r;
+      }
+    }
+
+    inverseTransform(cur, plane.row(y), rct, bpp, count);
+  }
+
+  return !bits.overrun();
+}
+
+namespace {
+
+struct Tile {
+  unsigned int plane;
+  unsigned int y0;
+  unsigned int y1;
+};
+
+} /* namespace */
+
+static std::vector<Tile> frameTiles(const FrameView &view,
+                                    unsigned int tileRows) {
+  std::vector<Tile> tiles;
+
+  for (unsigned int p = 0; p < view.numPlanes; ++p) {
+    unsigned int height = view.planes[p].height;
+    for (unsigned int y = 0; y < height; y += tileRows)
+      tiles.push_back({ p, y, std::min(y + tileRows, height) });
+  }
+
+  return tiles;
+}
+
+static void put32(std::vector<uint8_t> &out, uint32_t value) {
+  for (unsigned int i = 0; i < 4; ++i)
+    out.push_back(value >> (8 * i));
+}
+
+static uint32_t get32(const uint8_t *data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) | (uint32_t(data[3]) << 24);
+}
+
+LosslessEncoder::LosslessEncoder(unsigned int tileRows)
+  : tileRows_(std::max(tileRows, 1u)) {}
+
+void LosslessEncoder::encode(const FrameView &view,
+                             std::vector<uint8_t> &out) {
+  std::vector<Tile> tiles = frameTiles(view, tileRows_);
+  bool rct = hasColourTransform(view.format);
+
+  if (tiles_.size() < tiles.size())
+    tiles_.resize(tiles.size());
+
+  ThreadPool::shared().parallelFor(tiles.size(), [&](unsigned int i) {
+    const Tile &tile = tiles[i];
+    encodeTile(view.planes[tile.plane], rct, tile.y0, tile.y1, tiles_[i]);
+  });
+
+  out.clear();
+  put32(out, tileRows_);
+  put32(out, tiles.size());
+  for (unsigned int i = 0; i < tiles.size(); ++i)
+    put32(out, tiles_[i].size());
+  for (unsigned int i = 0; i < tiles.size(); ++i)
+    out.insert(out.end(), tiles_[i].begin(), tiles_[i].end());
+}
+
+bool decodeLossless(const uint8_t *data, size_t size, const FrameView &view) {
+  if (size < 8)
+    return false;
+
+  unsigned int tileRows = get32(data);
+  if (!tileRows)
+    return false;
+
+  std::vector<Tile> tiles = frameTiles(view, tileRows);
+  if (get32(data + 4) != tiles.size() || size < 8 + 4 * tiles.size())
+    return false;
+
+  std::vector<size_t> offsets(tiles.size() + 1);
+  offsets[0] = 8 + 4 * tiles.size();
+  for (unsigned int i = 0; i < tiles.size(); ++i)
+    offsets[i + 1] = offsets[i] + get32(data + 8 + 4 * i);
+  if (offsets.back() > size)
+    return false;
+
+  bool rct = hasColourTransform(view.format);
+  std::atomic<bool> ok{ true };
+
+  ThreadPool::shared().parallelFor(tiles.size(), [&](unsigned int i) {
+    const Tile &tile = tiles[i];
+    if (!decodeTile(data + offsets[i], offsets[i + 1] - offsets[i],
+                    view.planes[tile.plane], rct, tile.y0, tile.y1))
+      ok = false;
+  });
+
+  return ok;
+}
@@ -0,0 +1,134 @@
+#include "mapped_frame.h"
+
+#include <algorithm>
+#include <cstdio>
+
+#include "buffer_access.h"
+
+using namespace libcamera;
+
+FrameFormat frameFormatFromPixelFormat(const PixelFormat &format) {
+  static const struct {
+    const PixelFormat &pixelFormat;
+    FrameFormat frameFormat;
+  } formats[] = {
+    { formats::XRGB8888, FrameFormat::XRGB8888 },
+    { formats::XBGR8888, FrameFormat::XBGR8888 },
+    { formats::RGB888, FrameFormat::RGB888 },
+    { formats::BGR888, FrameFormat::BGR888 },
+    { formats::YUYV, FrameFormat::YUYV },
+    { formats::UYVY, FrameFormat::UYVY },
+    { formats::NV12, FrameFormat::NV12 },
+    { formats::NV21, FrameFormat::NV21 },
+    { formats::YUV420, FrameFormat::YUV420 },
+    { formats::R8, FrameFormat::R8 },
+    { formats::SBGGR10, FrameFormat::RAW16 },
+    { formats::SGBRG10, FrameFormat::RAW16 },
+    { formats::SGRBG10, FrameFormat::RAW16 },
+    { formats::SRGGB10, FrameFormat::RAW16 },
+    { formats::SBGGR12, FrameFormat::RAW16 },
+    { formats::SGBRG12, FrameFormat::RAW16 },
+    { formats::SGRBG12, FrameFormat::RAW16 },
+    { formats::SRGGB12, FrameFormat::RAW16 },
+    { formats::SBGGR16, FrameFormat::RAW16 },
+    { formats::SGBRG16, FrameFormat::RAW16 },
+    { formats::SGRBG16, FrameFormat::RAW16 },
+    { formats::SRGGB16, FrameFormat::RAW16 },
+    { formats::SBGGR10_CSI2P, FrameFormat::RAW10P },
+    { formats::SGBRG10_CSI2P, FrameFormat::RAW10P },
+    { formats::SGRBG10_CSI2P, FrameFormat::RAW10P },
+    { formats::SRGGB10_CSI2P, FrameFormat::RAW10P },
+    { formats::SBGGR12_CSI2P, FrameFormat::RAW12P },
+    { formats::SGBRG12_CSI2P, FrameFormat::RAW12P },
+    { formats::SGRBG12_CSI2P, FrameFormat::RAW12P },
+    { formats::SRGGB12_CSI2P, FrameFormat::RAW12P },
+  };
+
+  for (const auto &entry : formats) {
+    if (entry.pixelFormat == format)
+      return entry.frameFormat;
+  }
+
+  return FrameFormat::Unknown;
+}
+
+static BufferAccess bufferAccess(int prot) {
+  if (prot & PROT_WRITE)
+    return prot & PROT_READ ? BufferAccess::ReadWrite : BufferAccess::Write;
+  return BufferAccess::Read;
+}
+
+MappedFrame::MappedFrame(const FrameBuffer *buffer,
+                         const StreamConfiguration &config, int prot,
+                         uint8_t *memory)
+    : prot_(prot) {
+  const std::vector<FrameBuffer::Plane> &planes = buffer->planes();
+
+  // Work out how much of each dmabuf has to be mapped to cover all the
+  // planes that live in it.
+  for (const FrameBuffer::Plane &plane : planes) {
+    int fd = plane.fd.get();
+    size_t end = plane.offset + plane.length;
+
+    auto it = std::find_if(mappings_.begin(), mappings_.end(),
+                           [fd](const Mapping &m) { return m.fd == fd; });
+    if (it == mappings_.end())
+      mappings_.push_back({ fd, MAP_FAILED, end, false, false });
+    else
+      it->length = std::max(it->length, end);
+  }
+
+  // A persistent mapping holds all the planes in a single dmabuf.
+  if (memory && mappings_.size() != 1)
+    memory = nullptr;
+
+  for (Mapping &mapping : mappings_) {
+    if (memory) {
+      mapping.address = memory;
+    } else {
+      mapping.address = mmap(NULL, mapping.length, prot, MAP_SHARED,
+                             mapping.fd, 0);
+      if (mapping.address == MAP_FAILED) {
+        printf("Failed to mmap buffer\n");
+        return;
+      }
+      mapping.owned = true;
+    }
+
+    // Invalidate CPU caches before reading what the device wrote.
+    if (beginCpuAccess(mapping.fd, bufferAccess(prot_)) < 0) {
+      printf("Failed to sync buffer for CPU access\n");
+      return;
+    }
+    mapping.synced = true;
+  }
+
+  uint8_t *data[3] = { nullptr, nullptr, nullptr };
+  for (unsigned int i = 0; i < planes.size() && i < 3; ++i) {
+    int fd = planes[i].fd.get();
+    auto it = std::find_if(mappings_.begin(), mappings_.end(),
+                           [fd](const Mapping &m) { return m.fd == fd; });
+    data[i] = static_cast<uint8_t *>(it->address) + planes[i].offset;
+  }
+
+  FrameFormat format = frameFormatFromPixelFormat(config.pixelFormat);
+  if (format == FrameFormat::Unknown) {
+    // Unknown formats are still exposed as a single line of bytes so
+    // that they can be stored as-is.
+    view_ = makeFrameView(FrameFormat::R8, planes[0].length, 1,
+                          planes[0].length, data);
+    return;
+  }
+
+  view_ = makeFrameView(format, config.size.width, config.size.height,
+                        config.stride, data);
+}
+
+MappedFrame::~MappedFrame() {
+  for (Mapping &mapping : mappings_) {
+    if (mapping.synced)
+      endCpuAccess(mapping.fd, bufferAccess(prot_));
+    if (mapping.owned)
+      munmap(mapping.address, mapping.length);
+  }
+}
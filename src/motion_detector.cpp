@@ -0,0 +1,326 @@
+#include "motion_detector.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "thread_pool.h"
+
+/* -------------------------------------------------------------------------
+ * Downscaling
+ */
+
+namespace {
+
+typedef uint8_t Bytes8 __attribute__((vector_size(8)));
+typedef uint16_t Words8 __attribute__((vector_size(16)));
+
+// Add a row of bytes to 16 bit column sums.
+void accumulateRow(const uint8_t *row, size_t size, uint16_t *sums) {
+  size_t x = 0;
+
+  for (; x + 8 <= size; x += 8) {
+    Bytes8 bytes;
+    Words8 acc;
+    memcpy(&bytes, row + x, sizeof(bytes));
+    memcpy(&acc, sums + x, sizeof(acc));
+    acc += __builtin_convertvector(bytes, Words8);
+    memcpy(sums + x, &acc, sizeof(acc));
+  }
+
+  for (; x < size; ++x)
+    sums[x] += row[x];
+}
+
+// Reduce column sums of scale rows to one luma value per scale pixels.
+// Luma is the byte at Offset of each Stride byte pixel, or (R + 2G + B) / 4
+// for RGB formats, where G is always the middle byte.
+template<unsigned int Stride, int Offset>
+void reduceRow(const uint16_t *sums, unsigned int width, unsigned int scale,
+               unsigned int shift, uint8_t *luma) {
+  for (unsigned int x = 0; x < width; ++x) {
+    const uint16_t *p = sums + size_t(x) * scale * Stride;
+    uint32_t sum = 0;
+
+    for (unsigned int i = 0; i < scale; ++i, p += Stride) {
+      if (Offset < 0)
+        sum += p[0] + 2 * p[1] + p[2];
+      else
+        sum += p[Offset];
+    }
+
+    luma[x] = sum >> shift;
+  }
+}
+
+typedef void (*ReduceFunction)(const uint16_t *sums, unsigned int width,
+                               unsigned int scale, unsigned int shift,
+                               uint8_t *luma);
+
+ReduceFunction reduceFunction(FrameFormat format, unsigned int &extraShift) {
+  extraShift = 0;
+
+  switch (format) {
+  case FrameFormat::NV12:
+  case FrameFormat::NV21:
+  case FrameFormat::YUV420:
+  case FrameFormat::R8:
+    return reduceRow<1, 0>;
+  case FrameFormat::YUYV:
+    return reduceRow<2, 0>;
+  case FrameFormat::UYVY:
+    return reduceRow<2, 1>;
+  case FrameFormat::XRGB8888:
+  case FrameFormat::XBGR8888:
+    extraShift = 2;
+    return reduceRow<4, -1>;
+  case FrameFormat::RGB888:
+  case FrameFormat::BGR888:
+    extraShift = 2;
+    return reduceRow<3, -1>;
+  default:
+    return nullptr;
+  }
+}
+
+} /* namespace */
+
+MotionDetector::MotionDetector(const MotionConfig &config) : config_(config) {
+  config_.scale = config_.scale >= 8 ? 8 : 4;
+  config_.learnShift = std::min(config_.learnShift, 12u);
+}
+
+void MotionDetector::reset() {
+  width_ = 0;
+  height_ = 0;
+  format_ = FrameFormat::Unknown;
+  blobs_.clear();
+  foreground_ = 0;
+  active_ = false;
+  moving_ = 0;
+  quiet_ = 0;
+}
+
+void MotionDetector::downscale(const FrameView &view) {
+  unsigned int scale = config_.scale;
+  unsigned int extraShift;
+  ReduceFunction reduce = reduceFunction(view.format, extraShift);
+  unsigned int shift = (scale == 8 ? 6 : 4) + extraShift;
+
+  const PlaneView &plane = view.planes[0];
+  size_t rowBytes = plane.rowBytes();
+
+  ThreadPool::shared().parallelFor(height_, [&](unsigned int y) {
+    thread_local std::vector<uint16_t> sums;
+    sums.assign(rowBytes, 0);
+
+    for (unsigned int i = 0; i < scale; ++i)
+      accumulateRow(plane.row(y * scale + i), rowBytes, sums.data());
+
+    reduce(sums.data(), width_, scale, shift, &luma_[size_t(y) * width_]);
+  });
+}
+
+/* -------------------------------------------------------------------------
+ * Background subtraction
+ */
+
+// Classify pixels against the background and move the background towards
+// the current luma, slower for foreground pixels.
+void MotionDetector::subtractBackground() {
+  size_t size = luma_.size();
+  size_t i = 0;
+  unsigned int count = 0;
+
+  const uint16_t threshold = std::min(config_.threshold, 255u) << 8;
+  const uint16_t learn = config_.learnShift;
+  const uint16_t learnForeground = config_.learnShift + 2;
+  const Words8 learnVector = Words8{} + learn;
+  const Words8 learnForegroundVector = Words8{} + learnForeground;
+
+  for (; i + 8 <= size; i += 8) {
+    Bytes8 bytes;
+    Words8 bg;
+    memcpy(&bytes, &luma_[i], sizeof(bytes));
+    memcpy(&bg, &background_[i], sizeof(bg));
+
+    Words8 cur = __builtin_convertvector(bytes, Words8) << 8;
+    Words8 diff = cur > bg ? cur - bg : bg - cur;
+    Words8 fg = diff > threshold ? Words8{} + 1 : Words8{};
+
+    Words8 step = diff >> (fg ? learnForegroundVector : learnVector);
+    bg = cur > bg ? bg + step : bg - step;
+    memcpy(&background_[i], &bg, sizeof(bg));
+
+    Bytes8 mask = __builtin_convertvector(fg, Bytes8);
+    memcpy(&mask_[i], &mask, sizeof(mask));
+    for (unsigned int j = 0; j < 8; ++j)
+      count += mask[j];
+  }
+
+  for (; i < size; ++i) {
+    uint16_t cur = luma_[i] << 8;
+    uint16_t bg = background_[i];
+    uint16_t diff = cur > bg ? cur - bg : bg - cur;
+    bool fg = diff > threshold;
+
+    uint16_t step = diff >> (fg ? learnForeground : learn);
+    background_[i] = cur > bg ? bg + step : bg - step;
+    mask_[i] = fg;
+    count += fg;
+  }
+
+  foreground_ = count;
+}
+
+/* -------------------------------------------------------------------------
+ * Blobs
+ */
+
+namespace {
+
+uint32_t findRoot(std::vector<uint32_t> &parent, uint32_t label) {
+  while (parent[label] != label) {
+    parent[label] = parent[parent[label]];
+    label = parent[label];
+  }
+  return label;
+}
+
+} /* namespace */
+
+// Label 8-connected runs of foreground pixels with union-find, then sum
+// the area and bounding box of each component.
+void MotionDetector::findBlobs() {
+  std::vector<Run> &runs = runs_;
+  runs.clear();
+  parent_.clear();
+  blobs_.clear();
+
+  size_t previous = 0; // first run of the previous row
+  for (unsigned int y = 0; y < height_; ++y) {
+    const uint8_t *row = &mask_[size_t(y) * width_];
+    size_t current = runs.size();
+    size_t above = previous;
+
+    for (unsigned int x = 0; x < width_;) {
+      if (!row[x]) {
+        ++x;
+        continue;
+      }
+
+      Run run = { y, x, x, uint32_t(parent_.size()) };
+      while (run.x1 < width_ && row[run.x1])
+        ++run.x1;
+      x = run.x1;
+      parent_.push_back(run.label);
+
+      // Runs above that touch this one, diagonals included.
+      while (above < current && runs[above].x1 < run.x0)
+        ++above;
+      for (size_t j = above; j < current && runs[j].x0 <= run.x1; ++j) {
+        uint32_t a = findRoot(parent_, runs[j].label);
+        uint32_t b = findRoot(parent_, run.label);
+        parent_[std::max(a, b)] = std::min(a, b);
+      }
+
+      runs.push_back(run);
+    }
+
+    previous = current;
+  }
+
+  std::vector<MotionBlob> components(parent_.size());
+  std::vector<unsigned int> bottom(parent_.size()), right(parent_.size());
+
+  for (const Run &run : runs) {
+    uint32_t root = findRoot(parent_, run.label);
+    MotionBlob &blob = components[root];
+
+    if (!blob.area) {
+      blob.box.x = run.x0;
+      blob.box.y = run.y;
+    }
+    blob.box.x = std::min(blob.box.x, run.x0);
+    right[root] = std::max(right[root], run.x1);
+    bottom[root] = run.y + 1;
+    blob.area += run.x1 - run.x0;
+  }
+
+  unsigned int scale = config_.scale;
+  for (size_t i = 0; i < components.size(); ++i) {
+    MotionBlob blob = components[i];
+    if (blob.area < std::max(config_.minArea, 1u))
+      continue;
+
+    blob.box.width = (right[i] - blob.box.x) * scale;
+    blob.box.height = (bottom[i] - blob.box.y) * scale;
+    blob.box.x *= scale;
+    blob.box.y *= scale;
+    blobs_.push_back(blob);
+  }
+
+  std::sort(blobs_.begin(), blobs_.end(),
+            [](const MotionBlob &a, const MotionBlob &b) {
+              return a.area > b.area;
+            });
+}
+
+/* -------------------------------------------------------------------------
+ * Events
+ */
+
+MotionEvent MotionDetector::process(const FrameView &view) {
+  unsigned int width = view.width / config_.scale;
+  unsigned int height = view.height / config_.scale;
+  unsigned int extraShift;
+
+  if (!view.isValid() || !width || !height ||
+      !reduceFunction(view.format, extraShift))
+    return MotionEvent::None;
+
+  bool relearn = width != width_ || height != height_ ||
+                 view.format != format_;
+  if (relearn) {
+    width_ = width;
+    height_ = height;
+    format_ = view.format;
+    luma_.resize(size_t(width) * height);
+    mask_.assign(luma_.size(), 0);
+  }
+
+  downscale(view);
+
+  if (!relearn) {
+    subtractBackground();
+    relearn = foreground_ * 2 > luma_.size();
+  }
+
+  if (relearn) {
+    background_.resize(luma_.size());
+    for (size_t i = 0; i < luma_.size(); ++i)
+      background_[i] = luma_[i] << 8;
+    std::fill(mask_.begin(), mask_.end(), 0);
+    foreground_ = 0;
+    blobs_.clear();
+  } else {
+    findBlobs();
+  }
+
+  if (!blobs_.empty()) {
+    quiet_ = 0;
+    if (!active_ && ++moving_ >= config_.triggerFrames) {
+      active_ = true;
+      moving_ = 0;
+      return MotionEvent::Started;
+    }
+  } else {
+    moving_ = 0;
+    if (active_ && ++quiet_ >= config_.releaseFrames) {
+      active_ = false;
+      quiet_ = 0;
+      return MotionEvent::Stopped;
+    }
+  }
+
+  return MotionEvent::None;
+}
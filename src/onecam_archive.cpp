@@ -0,0 +1,95 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "frame_archive.h"
+
+static int info(ArchiveReader &archive) {
+  printf("Format: %s %ux%u, %zu frames\n", formatInfo(archive.format()).name,
+         archive.width(), archive.height(), archive.frames());
+
+  std::vector<uint8_t> memory;
+  FrameView view = allocateFrameView(archive.format(), archive.width(),
+                                     archive.height(), memory);
+  uint64_t stored = 0;
+
+  for (size_t i = 0; i < archive.frames(); ++i) {
+    ArchiveRecord record;
+    if (archive.record(i, record) < 0) {
+      printf("%6zu: corrupt record\n", i);
+      continue;
+    }
+
+    stored += record.size;
+    printf("%6zu: %c seq %06llu ts %llu %llu bytes (%.2fx)\n", i,
+           record.flags & kArchiveDeltaFrame ? 'D' : 'K',
+           static_cast<unsigned long long>(record.sequence),
+           static_cast<unsigned long long>(record.timestamp),
+           static_cast<unsigned long long>(record.size),
+           static_cast<double>(view.packedSize()) / record.size);
+  }
+
+  if (stored)
+    printf("Average ratio %.2fx\n",
+           static_cast<double>(view.packedSize()) * archive.frames() / stored);
+
+  return EXIT_SUCCESS;
+}
+
+// Decode one frame into the same packed layout saveFrameAsRAW() writes.
+static int extract(ArchiveReader &archive, size_t index,
+                   const std::string &output) {
+  std::vector<uint8_t> memory;
+  FrameView view = allocateFrameView(archive.format(), archive.width(),
+                                     archive.height(), memory);
+
+  int ret = archive.read(index, view);
+  if (ret < 0) {
+    fprintf(stderr, "Can't decode frame %zu: %s\n", index, strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  std::ofstream file(output, std::ios::binary);
+  if (!file.is_open() || !writeFrameView(file, view)) {
+    fprintf(stderr, "Can't write %s\n", output.c_str());
+    return EXIT_FAILURE;
+  }
+
+  printf("Frame %zu: %s %ux%u written to %s\n", index,
+         formatInfo(view.format).name, view.width, view.height,
+         output.c_str());
+
+  return EXIT_SUCCESS;
+}
+
+static void usage(const char *argv0) {
+  printf("Usage: %s <command> FILE [args]\n", argv0);
+  printf("  info FILE               List the recorded frames\n");
+  printf("  extract FILE N OUTPUT   Decode frame N to a raw file\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  std::string command = argv[1];
+  ArchiveReader archive;
+  int ret = archive.open(argv[2]);
+  if (ret < 0) {
+    fprintf(stderr, "Can't open %s: %s\n", argv[2], strerror(-ret));
+    return EXIT_FAILURE;
+  }
+
+  if (command == "info")
+    return info(archive);
+  if (command == "extract" && argc == 5)
+    return extract(archive, strtoul(argv[3], NULL, 10), argv[4]);
+
+  usage(argv[0]);
+  return EXIT_FAILURE;
+}
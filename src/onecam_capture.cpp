@@ -1,4 +1,21 @@
 #include "multicam.h"
+#include "buffer_pool.h"
+#include "frame_stats.h"
+#include "frame_transform.h"
+#include "hdr_merge.h"
+#include "jpeg_encoder.h"
+#include "lens_remap.h"
+#include "mapped_frame.h"
+#include "motion_detector.h"
+#include "privacy_mask.h"
+#include "raw_correction.h"
+#include "raw_packing.h"
+#include "request_queue.h"
+#include "resampler.h"
+#include "roi.h"
+#include "temporal_denoise.h"
+#include "tensor_preprocessor.h"
+#include "text_overlay.h"
 
 static std::shared_ptr<Camera> camera;
 static std::atomic<bool> running(true);
@@ -6,9 +23,106 @@ static std::atomic<uint32_t> frameCount(0);
 static auto startTime = std::chrono::steady_clock::now();
 static bool saveNextFrame = false;
 static std::atomic<bool> frameSaved(false);
+static std::atomic<bool> saving(false);
+static std::thread saverThread;
+
+// Give up when nothing was saved after this many seconds, plus the time
+// the frames of a stack, bracket or calibration take to arrive. 0 waits
+// until interrupted, the default when waiting for motion.
+static int timeoutSeconds = -1;
+
 static uint32_t imageWidth = 0;
 static uint32_t imageHeight = 0;
 static std::string pixelFormat = "";
+static const StreamConfiguration *captureConfig = nullptr;
+
+// Region of interest: cropped by the pipeline through ScalerCrop when
+// supported, otherwise in software straight from the mapped buffer.
+static Roi roi;
+static bool softwareCrop = false;
+static Rectangle scalerCrop;
+static Rectangle defaultCrop; // sensor area the uncropped frames show
+static bool cropApplied = false;
+
+// Application-provided buffers instead of FrameBufferAllocator.
+static bool usePool = false;
+static PoolConfig poolConfig;
+
+// Number of requests kept in flight, adapted at runtime by the policy.
+static DepthPolicy depthPolicy = DepthPolicy::Fixed;
+static unsigned int spareRequests = 0;
+static std::unique_ptr<RequestQueue> requestQueue;
+
+// Store the saved frame as JPEG with this quality instead of raw pixels.
+static int jpegQuality = 0;
+
+// Save the frame where motion starts instead of the first frame.
+static bool motionTrigger = false;
+static MotionConfig motionConfig;
+static MotionDetector motionDetector;
+
+// Extra sizes the saved frame is also stored at, resampled in one pass.
+static std::vector<ResampleSize> resizes;
+static ResampleFilter resampleFilter = ResampleFilter::Bilinear;
+
+// Undistort the saved frame. The maps are built once per configuration
+// and cached on disk.
+static bool undistort = false;
+static LensModel lensModel;
+static std::string lensCacheDir = defaultLensCacheDir();
+static LensRemap lensRemap;
+
+// Rotate or mirror the frames: in the pipeline through the configuration
+// orientation when it can, otherwise the saved frame in software.
+static FrameTransform frameTransform = FrameTransform::Identity;
+static bool softwareTransform = false;
+
+// Raw sensor stream, corrected in place with the black level, dark frame
+// and defect map of a calibration, which is mapped at startup. In
+// calibration mode, dark frames are averaged into a new calibration
+// instead of saving a frame. CSI-2 packed frames are unpacked for both,
+// and saved frames can be stored packed or unpacked.
+static bool rawStream = false;
+static std::string rawStore;
+static FrameFormat rawStoreFormat = FrameFormat::Unknown;
+static std::string calibrationFile;
+static RawCalibration rawCalibration;
+static uint16_t blackLevel[4];
+static bool blackLevelSet = false;
+static RawCorrector rawCorrector;
+static std::string calibrateFile;
+static unsigned int calibrateFrames = 16;
+static RawCalibrator rawCalibrator;
+
+// Regions masked in place in the saved frame, before anything reads it.
+static std::vector<MaskRegion> maskRegions;
+static MaskConfig maskConfig;
+static PrivacyMask privacyMask;
+
+// Timestamp and camera name burnt into the frames, after masking.
+static std::string overlayName;
+static OverlayConfig overlayConfig;
+static TextOverlay textOverlay;
+
+// Low light: stack frames of a still scene and save their average instead
+// of a single frame.
+static bool stackFrames = false;
+static DenoiseConfig denoiseConfig;
+static TemporalDenoiser temporalDenoiser;
+
+// HDR: requests cycle through the exposures of a bracket, and a complete
+// bracket of frames, matched to its exposures through their metadata, is
+// fused into the saved frame.
+static std::vector<BracketExposure> bracketExposures;
+static HdrBracket hdrBracket;
+static HdrMerger hdrMerger;
+static FrameHandle bracketFrames[kMaxBracket];
+static std::vector<uint8_t> hdrMemory;
+static FrameView hdrOutput;
+
+// Also store the saved frame as a model input tensor, in NumPy format.
+static bool tensorOutput = false;
+static TensorConfig tensorConfig;
 
 static void signalHandler(int signal) {
   if (signal == SIGINT) {
@@ -17,8 +131,117 @@ static void signalHandler(int signal) {
   }
 }
 
-// Simple function to save raw buffer directly
-static void saveFrameAsRAW(const FrameBuffer *buffer, const FrameMetadata &metadata) {
+// Store a view as raw pixels, or as JPEG when a quality is set. Returns the
+// number of bytes stored, or 0 on error.
+static size_t writeImage(const std::string &filename, const FrameView &view,
+                         bool streaming) {
+  std::ofstream file(filename, std::ios::binary);
+  if (!file.is_open())
+    return 0;
+
+  if (jpegQuality) {
+    YuvImage image;
+    std::vector<uint8_t> jpeg;
+    int ret = convertToYuv420(view, 1, image);
+    if (ret) {
+      printf("Can't encode the frame as JPEG: %s\n", strerror(-ret));
+      return 0;
+    }
+    JpegEncoder(jpegQuality).encode(image, jpeg);
+    file.write(reinterpret_cast<const char *>(jpeg.data()), jpeg.size());
+    return file ? jpeg.size() : 0;
+  }
+
+  return writeFrameView(file, view, streaming);
+}
+
+static std::string imageName(const std::string &stamp, unsigned int width,
+                             unsigned int height) {
+  std::stringstream filename;
+  filename << stamp << "_" << width << "x" << height;
+  filename << (jpegQuality ? ".jpg" : ".raw");
+  return filename.str();
+}
+
+// Resample the frame to every requested size at once and store them.
+static void saveResized(const std::string &stamp, const FrameView &view) {
+  const FormatInfo &info = formatInfo(view.format);
+  std::vector<std::vector<uint8_t>> memory(resizes.size());
+  std::vector<FrameView> outputs;
+
+  for (size_t i = 0; i < resizes.size(); ++i) {
+    // Round down to what the format can represent, e.g. even NV12 sizes.
+    unsigned int width = std::max(resizes[i].width / info.hAlign, 1u);
+    unsigned int height = std::max(resizes[i].height / info.vAlign, 1u);
+    outputs.push_back(allocateFrameView(view.format, width * info.hAlign,
+                                        height * info.vAlign, memory[i]));
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  Resampler resampler(resampleFilter);
+  int ret = resampler.resample(view, outputs.data(), outputs.size());
+  if (ret) {
+    printf("Can't resample the frame: %s\n", strerror(-ret));
+    return;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto elapsed =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+  printf("Resampled (%s) to %zu sizes in %ld µs:\n",
+         resampleFilterName(resampleFilter), outputs.size(),
+         static_cast<long>(elapsed.count()));
+  for (const FrameView &output : outputs) {
+    std::string filename = imageName(stamp, output.width, output.height);
+    size_t written = writeImage(filename, output, false);
+    printf("  %s: %zu bytes\n", filename.c_str(), written);
+  }
+}
+
+// Convert the frame to an input tensor and store it as .npy.
+static void saveTensor(const std::string &stamp, const FrameView &view) {
+  TensorArena arena;
+  int ret = arena.allocate(tensorConfig, 1);
+  if (ret) {
+    printf("Can't allocate the tensor: %s\n", strerror(-ret));
+    return;
+  }
+
+  auto start = std::chrono::high_resolution_clock::now();
+  TensorPreprocessor preprocessor(tensorConfig, resampleFilter);
+  TensorPlacement placement;
+  ret = preprocessor.process(view, arena.data(), &placement);
+  if (ret) {
+    printf("Can't convert the frame to a tensor: %s\n", strerror(-ret));
+    return;
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto elapsed =
+      std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+  std::stringstream filename;
+  filename << stamp << "_tensor";
+  for (unsigned int dim : arena.shape())
+    filename << "_" << dim;
+  filename << "_" << tensorLayoutName(tensorConfig.layout) << "_"
+           << tensorTypeName(tensorConfig.type) << ".npy";
+
+  std::ofstream file(filename.str(), std::ios::binary);
+  if (!arena.writeNpy(file)) {
+    printf("Can't write %s\n", filename.str().c_str());
+    return;
+  }
+
+  printf("Tensor: %s in %ld µs, frame at %u,%u %ux%u\n",
+         filename.str().c_str(), static_cast<long>(elapsed.count()),
+         placement.x, placement.y, placement.width, placement.height);
+}
+
+// Simple function to save raw buffer directly. The pixels come from the
+// frame, or from the denoiser or HDR output when frames are combined;
+// stats were taken from them before anything was drawn on top.
+static void saveFrameAsRAW(const FrameHandle &frame, const FrameView &source,
+                           const FrameStats &stats) {
   auto captureStart = std::chrono::high_resolution_clock::now();
   
   // Generate timestamp filename with resolution
@@ -26,30 +249,56 @@ static void saveFrameAsRAW(const FrameBuffer *buffer, const FrameMetadata &metad
   auto time_t = std::chrono::system_clock::to_time_t(now);
   auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
   
-  std::stringstream filename;
-  filename << std::put_time(std::localtime(&time_t), "%Y%m%d_%H%M%S");
-  filename << "_" << std::setfill('0') << std::setw(3) << ms.count();
-  filename << "_" << imageWidth << "x" << imageHeight;
-  filename << ".raw";
+  std::stringstream stamp;
+  stamp << std::put_time(std::localtime(&time_t), "%Y%m%d_%H%M%S");
+  stamp << "_" << std::setfill('0') << std::setw(3) << ms.count();
   
   auto processStart = std::chrono::high_resolution_clock::now();
   
-  // Get the first plane
-  const FrameBuffer::Plane &plane = buffer->planes()[0];
-  
-  // Map the buffer memory
-  void *mem = mmap(NULL, plane.length, PROT_READ, MAP_SHARED, plane.fd.get(), 0);
-  if (mem == MAP_FAILED) {
-    printf("Failed to mmap buffer\n");
+  FrameView view = source;
+  if (!view.isValid())
     return;
+
+  // The lens model covers the whole frame: undistort before cropping.
+  std::vector<uint8_t> undistorted;
+  if (lensRemap.isConfigured()) {
+    FrameView corrected = allocateFrameView(view.format, view.width,
+                                            view.height, undistorted);
+    if (lensRemap.apply(view, corrected) == 0)
+      view = corrected;
   }
-  
-  // Save raw buffer directly - no conversion needed!
-  std::ofstream file(filename.str(), std::ios::binary);
-  if (file.is_open()) {
-    file.write((char *)mem, plane.length);
-    file.close();
-    
+
+  if (softwareCrop)
+    view = cropFrameView(view, roi);
+
+  std::vector<uint8_t> transformed;
+  if (softwareTransform) {
+    bool swap = transposes(frameTransform);
+    FrameView rotated = allocateFrameView(view.format,
+                                          swap ? view.height : view.width,
+                                          swap ? view.width : view.height,
+                                          transformed);
+    if (transformFrame(view, rotated, frameTransform) == 0)
+      view = rotated;
+  }
+
+  std::vector<uint8_t> repacked;
+  if (rawStoreFormat != FrameFormat::Unknown &&
+      view.format != rawStoreFormat) {
+    FrameView stored = allocateFrameView(rawStoreFormat, view.width,
+                                         view.height, repacked);
+    int ret = rawStoreFormat == FrameFormat::RAW16 ? unpackRaw(view, stored)
+                                                   : packRaw(view, stored);
+    if (ret == 0)
+      view = stored;
+  }
+
+  std::string filename = imageName(stamp.str(), view.width, view.height);
+
+  // Save the visible pixels directly - no conversion needed! Camera
+  // buffers may be mapped uncached: copy out with streaming loads.
+  size_t written = writeImage(filename, view, true);
+  if (written) {
     auto saveEnd = std::chrono::high_resolution_clock::now();
     
     // Calculate timings
@@ -61,72 +310,535 @@ static void saveFrameAsRAW(const FrameBuffer *buffer, const FrameMetadata &metad
                     (saveEnd - captureStart).count();
     
     printf("\n=== Frame Saved ===\n");
-    printf("Filename: %s\n", filename.str().c_str());
-    printf("Resolution: %dx%d\n", imageWidth, imageHeight);
+    printf("Filename: %s\n", filename.c_str());
+    printf("Resolution: %ux%u\n", view.width, view.height);
     printf("Pixel Format: %s\n", pixelFormat.c_str());
-    printf("Buffer Size: %zu bytes\n", plane.length);
+    printf("Stored Size: %zu bytes (buffer %u bytes)\n", written,
+           frame->buffer()->planes()[0].length);
+    if (temporalDenoiser.isConfigured())
+      printf("Stacked: %u frames, %.0f%% of their weight\n",
+             denoiseConfig.frames, 100.0 * temporalDenoiser.stackedFraction());
+    if (hdrMerger.isConfigured())
+      printf("Fused: %zu exposures\n", hdrBracket.size());
     printf("Capture → Processing: %ld µs\n", captureToProcess);
     printf("Processing → Saved: %ld µs\n", processToSave);
     printf("Total time: %ld µs (%.2f ms)\n", totalTime, totalTime / 1000.0);
-    printf("\nTo convert to PNG, use:\n");
-    printf("ffmpeg -f rawvideo -pixel_format bgra -s %dx%d -i %s -frames:v 1 output.png\n",
-           imageWidth, imageHeight, filename.str().c_str());
+    const char *measured = temporalDenoiser.isConfigured() ? "stacked output"
+                           : hdrMerger.isConfigured()      ? "fused output"
+                                                           : "frame";
+    printf("Luma (%s): %.1f, clipped %.1f%% dark / %.1f%% bright, "
+           "sharpness %.0f\n", measured, stats.luma, stats.clippedLow,
+           stats.clippedHigh, stats.sharpness);
+    if (!resizes.empty())
+      saveResized(stamp.str(), view);
+    if (tensorOutput)
+      saveTensor(stamp.str(), view);
+    if (!jpegQuality) {
+      printf("\nTo convert to PNG, use:\n");
+      printf("ffmpeg -f rawvideo -pixel_format bgra -s %ux%u -i %s -frames:v 1 output.png\n",
+             view.width, view.height, filename.c_str());
+    }
     printf("==================\n\n");
   }
-  
-  munmap(mem, plane.length);
+}
+
+// Burn the wall clock time and the camera name into the frames. The text
+// changes, and is rendered again, once a second.
+static void updateOverlay() {
+  static time_t shown = -1;
+  time_t now =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if (now == shown)
+    return;
+  shown = now;
+
+  std::stringstream text;
+  text << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << " "
+       << overlayName;
+  textOverlay.setText(text.str());
+}
+
+// Samples of a raw frame, unpacked into memory when the frame is packed.
+static FrameView rawSamples(const FrameView &view,
+                            std::vector<uint8_t> &memory) {
+  if (view.format == FrameFormat::RAW16)
+    return view;
+
+  FrameView samples = allocateFrameView(FrameFormat::RAW16, view.width,
+                                        view.height, memory);
+  unpackRaw(view, samples);
+  return samples;
+}
+
+// Correct a raw frame in place; packed frames are repacked afterwards.
+static void correctRaw(const FrameView &view) {
+  static std::vector<uint8_t> unpacked;
+  FrameView samples = rawSamples(view, unpacked);
+
+  rawCorrector.apply(samples);
+  if (view.format != FrameFormat::RAW16)
+    packRaw(samples, view);
+}
+
+// Hold the frame in the slot of its exposure, and fuse the bracket once
+// every slot holds a frame of the same cycle. Frames older than a bracket
+// are dropped. Returns true when hdrOutput holds a new fusion.
+static bool collectBracket(const FrameHandle &frame, Request *request) {
+  const ControlList &metadata = request->metadata();
+  auto exposureTime = metadata.get(controls::ExposureTime);
+  auto analogueGain = metadata.get(controls::AnalogueGain);
+  if (!exposureTime || !analogueGain)
+    return false;
+
+  int index = hdrBracket.match(*exposureTime, *analogueGain);
+  if (index < 0)
+    return false;
+  bracketFrames[index] = frame;
+
+  uint32_t sequence = frame->metadata().sequence;
+  FrameView views[kMaxBracket];
+  bool complete = true;
+  for (unsigned int i = 0; i < hdrBracket.size(); ++i) {
+    FrameHandle &held = bracketFrames[i];
+    if (held && sequence - held->metadata().sequence >= hdrBracket.size())
+      held.reset();
+    if (!held) {
+      complete = false;
+      continue;
+    }
+    views[i] = held->view();
+  }
+  if (!complete)
+    return false;
+
+  bool fused = hdrMerger.merge(views, hdrOutput) == 0;
+  for (FrameHandle &held : bracketFrames)
+    held.reset();
+  return fused;
+}
+
+// Average dark frames, then write the calibration and stop. Frames that
+// complete until the main loop stops go straight back to the camera.
+static void calibrate(Request *request) {
+  static std::vector<uint8_t> unpacked;
+  if (rawCalibrator.frames() >= calibrateFrames) {
+    requestQueue->requeue(request);
+    return;
+  }
+
+  FrameHandle frame = requestQueue->acquire(request, *captureConfig);
+  rawCalibrator.add(rawSamples(frame->view(), unpacked));
+  if (rawCalibrator.frames() < calibrateFrames)
+    return;
+
+  int ret = rawCalibrator.save(calibrateFile);
+  if (ret)
+    fprintf(stderr, "Can't write calibration %s: %s\n",
+            calibrateFile.c_str(), strerror(-ret));
+  else
+    printf("Calibration from %u frames written to %s\n",
+           rawCalibrator.frames(), calibrateFile.c_str());
+  frameSaved = true;
 }
 
 static void requestComplete(Request *request) {
+  requestQueue->completed(request);
+
   if (request->status() == Request::RequestCancelled)
     return;
 
+  // Sensors apply controls a few frames late: frames still showing the
+  // default crop go straight back to the camera.
+  if (!scalerCrop.isNull() && !cropApplied) {
+    std::optional<Rectangle> crop =
+        request->metadata().get(controls::ScalerCrop);
+    if (crop && *crop == defaultCrop && scalerCrop != defaultCrop) {
+      requestQueue->requeue(request);
+      return;
+    }
+
+    cropApplied = true;
+    if (crop && *crop != scalerCrop)
+      printf("ROI: pipeline adjusted ScalerCrop to %s\n",
+             crop->toString().c_str());
+  }
+
   frameCount++;
-  
-  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
-  for (auto bufferPair : buffers) {
-    FrameBuffer *buffer = bufferPair.second;
-    const FrameMetadata &metadata = buffer->metadata();
-    
-    // Save first frame immediately
-    if (saveNextFrame || frameCount == 1) {
-      saveFrameAsRAW(buffer, metadata);
-      saveNextFrame = false;
-      frameSaved = true;
+
+  if (!calibrateFile.empty()) {
+    calibrate(request);
+    return;
+  }
+
+  // The request goes back to the camera once every holder of the frame,
+  // including a pending save, has dropped its handle. Corrected, masked or
+  // stamped frames are mapped writable and modified in the buffer before
+  // anything reads them. Only the picture that is saved gets stamped: the
+  // frame itself, or the output when frames are combined.
+  bool denoise = temporalDenoiser.isConfigured();
+  bool hdr = hdrMerger.isConfigured();
+  bool stamp = !overlayName.empty();
+  bool modify = rawCorrector.isConfigured() || privacyMask.isConfigured() ||
+                (stamp && !denoise && !hdr);
+  int prot = modify ? PROT_READ | PROT_WRITE : PROT_READ;
+  FrameHandle frame = requestQueue->acquire(request, *captureConfig, prot);
+  const FrameMetadata &metadata = frame->metadata();
+
+  if (rawCorrector.isConfigured())
+    correctRaw(frame->view());
+
+  // Statistics describe what the camera sees: take them before black
+  // fills and text change the picture.
+  if (prot & PROT_WRITE)
+    frame->stats();
+
+  if (privacyMask.isConfigured())
+    privacyMask.apply(frame->view());
+
+  // The detector works on a small downscaled copy, cheap enough to run on
+  // the camera thread for every frame.
+  if (motionTrigger) {
+    FrameView view = frame->view();
+    if (softwareCrop)
+      view = cropFrameView(view, roi);
+
+    if (motionDetector.process(view) == MotionEvent::Started) {
+      const MotionBlob &blob = motionDetector.blobs().front();
+      printf("Motion at %u,%u %ux%u (seq %06u)\n", blob.box.x, blob.box.y,
+             blob.box.width, blob.box.height, metadata.sequence);
+      saveNextFrame = true;
     }
-    
-    // Print every 10th frame to reduce output
-    if (frameCount % 10 == 0) {
-      auto currentTime = std::chrono::steady_clock::now();
-      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime).count();
-      float fps = (frameCount * 1000.0f) / elapsed;
-      printf(" seq: %06u | frames: %u | fps: %.1f | bytesused: ", 
-             metadata.sequence, frameCount.load(), fps);
-
-      unsigned int nplane = 0;
-      for (const FrameMetadata::Plane &plane : metadata.planes()) {
-        printf("%u", plane.bytesused);
-        if (++nplane < metadata.planes().size())
-          printf("/");
-      }
-      printf("\n");
+  }
+
+  // Stacks and brackets are only fed while no output is being saved, so
+  // the output stays put until the saver is done with it.
+  bool combined = false;
+  if (denoise && !saving)
+    combined = temporalDenoiser.add(frame->view()) > 0;
+  if (hdr && !saving)
+    combined = collectBracket(frame, request);
+
+  // Save first frame immediately, or the first frame with motion; when
+  // combining frames, the first stack or bracket, or the first one
+  // completed after motion started. The disk write runs off the camera
+  // thread while spare requests keep the camera fed.
+  bool ready = !(denoise || hdr) || combined;
+  bool first = denoise || hdr ? combined : frameCount == 1;
+  bool trigger = (saveNextFrame && ready) || (first && !motionTrigger);
+  if (trigger && !saving.exchange(true)) {
+    saveNextFrame = false;
+    if (saverThread.joinable())
+      saverThread.join();
+    FrameView source = denoise ? temporalDenoiser.output()
+                       : hdr   ? hdrOutput
+                               : frame->view();
+    FrameStats stats = denoise || hdr ? computeFrameStats(source)
+                                      : frame->stats();
+    if (stamp) {
+      updateOverlay();
+      textOverlay.apply(source);
     }
+    saverThread = std::thread([frame, source, stats]() {
+      saveFrameAsRAW(frame, source, stats);
+      frameSaved = true;
+      saving = false;
+    });
+  }
+
+  // Print every 10th frame to reduce output
+  if (frameCount % 10 == 0) {
+    auto currentTime = std::chrono::steady_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(currentTime - startTime).count();
+    float fps = (frameCount * 1000.0f) / elapsed;
+    printf(" seq: %06u | frames: %u | fps: %.1f | depth: %u | held: %u | bytesused: ",
+           metadata.sequence, frameCount.load(), fps, requestQueue->depth(),
+           requestQueue->held());
+
+    unsigned int nplane = 0;
+    for (const FrameMetadata::Plane &plane : metadata.planes()) {
+      printf("%u", plane.bytesused);
+      if (++nplane < metadata.planes().size())
+        printf("/");
+    }
+    printf("\n");
   }
 
   // Stop after saving first frame
-  if (frameSaved) {
+  if (frameSaved)
     running = false;
-    return;
-  }
-  
-  // Continue capturing if still running
-  if (running) {
-    request->reuse(Request::ReuseBuffers);
-    camera->queueRequest(request);
+}
+
+// Map an ROI given in output coordinates of a reference size to the
+// sensor crop rectangle expected by controls::ScalerCrop. The reference
+// frame shows the pipeline's default crop, centred and cut to the aspect
+// ratio of the frame.
+static Rectangle roiToScalerCrop(const Roi &roi, const Size &reference,
+                                 const Rectangle &cropDefault) {
+  Rectangle shown = cropDefault.size()
+                        .boundedToAspectRatio(reference)
+                        .centeredTo(cropDefault.center());
+  uint64_t sx = shown.width, sy = shown.height;
+
+  return Rectangle(shown.x + static_cast<int>(roi.x * sx / reference.width),
+                   shown.y + static_cast<int>(roi.y * sy / reference.height),
+                   static_cast<unsigned int>(roi.width * sx / reference.width),
+                   static_cast<unsigned int>(roi.height * sy / reference.height));
+}
+
+// The orientation the pipeline produces when it applies the transform to
+// frames in the sensor's native orientation.
+static Orientation transformOrientation(FrameTransform transform) {
+  switch (transform) {
+  case FrameTransform::HFlip:
+    return Orientation::Rotate0Mirror;
+  case FrameTransform::VFlip:
+    return Orientation::Rotate180Mirror;
+  case FrameTransform::Rot180:
+    return Orientation::Rotate180;
+  case FrameTransform::Transpose:
+    return Orientation::Rotate90Mirror;
+  case FrameTransform::Rot270:
+    return Orientation::Rotate270;
+  case FrameTransform::Rot90:
+    return Orientation::Rotate90;
+  case FrameTransform::Rot180Transpose:
+    return Orientation::Rotate270Mirror;
+  case FrameTransform::Identity:
+    break;
   }
+  return Orientation::Rotate0;
 }
 
-int main() {
+static void usage(const char *argv0) {
+  printf("Usage: %s [options]\n", argv0);
+  printf("  --roi x,y,w,h   Only capture and store the given region\n");
+  printf("  --pool SOURCE   Use our own buffers (auto, udmabuf, dma-heap)\n");
+  printf("  --buffers N     Number of frame buffers to allocate\n");
+  printf("  --depth POLICY  Requests in flight (fixed, latency, throughput)\n");
+  printf("  --spares N      Requests kept back for when consumers hold frames\n");
+  printf("  --jpeg Q        Save the frame as JPEG with quality Q (1-100)\n");
+  printf("  --timeout S     Give up after S seconds without saving (0: never)\n");
+  printf("  --motion T      Wait for motion, luma changing by more than T\n");
+  printf("  --motion-scale N  Detect motion at 1/N resolution (4 or 8)\n");
+  printf("  --resize WxH[,WxH...]  Also save the frame resampled to these sizes\n");
+  printf("  --filter F      Resampling filter (box, bilinear, lanczos)\n");
+  printf("  --undistort fx,fy,cx,cy,k1,k2[,p1,p2[,k3]]\n");
+  printf("                  Correct lens distortion (OpenCV camera model)\n");
+  printf("  --lens-size WxH    Resolution the lens was calibrated at\n");
+  printf("  --lens-zoom Z      Output focal length relative to the lens\n");
+  printf("  --map-cache DIR    Directory of cached lens maps, or none\n");
+  printf("  --raw           Capture the raw sensor stream\n");
+  printf("  --raw-calibration FILE  Correct raw frames with a calibration\n");
+  printf("  --black-level N[,N,N,N] Black levels of the 2x2 Bayer pattern\n");
+  printf("  --raw-store S   Store raw frames packed or unpacked\n");
+  printf("  --calibrate FILE  Average dark frames, lens covered, into FILE\n");
+  printf("  --calibrate-frames N    Dark frames to average (default 16)\n");
+  printf("  --mask x,y,w,h|x1,y1,x2,y2,x3,y3[,...]\n");
+  printf("                  Mask a rectangle or polygon, may be repeated\n");
+  printf("  --mask-style S  How masks hide the frame (fill, blur)\n");
+  printf("  --mask-radius N Blur radius of masks in pixels (1-127)\n");
+  printf("  --overlay NAME  Burn the time and NAME into the frames\n");
+  printf("  --stack N       Save the average of N frames (2-256), for low light\n");
+  printf("  --stack-threshold T  Mean difference of a still tile, 0 for none\n");
+  printf("  --bracket E[xG],E[xG][,...]\n");
+  printf("                  Cycle exposures (µs) and gains, save their fusion\n");
+  printf("  --rotate T      Rotate or mirror the frame (rot90, rot180, rot270,\n");
+  printf("                  hflip, vflip, transpose, rot180transpose)\n");
+  printf("  --tensor WxH    Also save the frame as a model input tensor (.npy)\n");
+  printf("  --tensor-layout L  Tensor layout (nchw, nhwc)\n");
+  printf("  --tensor-type T    Tensor element type (f32, f16, i8)\n");
+  printf("  --tensor-mean R,G,B  Subtracted from the 0-255 pixel values\n");
+  printf("  --tensor-std R,G,B   Divides the pixel values after the mean\n");
+  printf("  --stretch       Stretch the frame to the tensor, no letterbox\n");
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--roi" && i + 1 < argc) {
+      if (!parseRoi(argv[++i], roi)) {
+        fprintf(stderr, "Invalid ROI '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--pool" && i + 1 < argc) {
+      if (!parsePoolSource(argv[++i], poolConfig.source)) {
+        fprintf(stderr, "Unknown buffer pool '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      // The camera can't import a plain memfd, only a dmabuf.
+      if (poolConfig.source == PoolSource::Memfd) {
+        fprintf(stderr, "A memfd pool can't be used for capture\n");
+        return EXIT_FAILURE;
+      }
+      usePool = true;
+    } else if (arg == "--buffers" && i + 1 < argc) {
+      poolConfig.count = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--depth" && i + 1 < argc) {
+      if (!parseDepthPolicy(argv[++i], depthPolicy)) {
+        fprintf(stderr, "Unknown depth policy '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--spares" && i + 1 < argc) {
+      spareRequests = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--timeout" && i + 1 < argc) {
+      timeoutSeconds = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--jpeg" && i + 1 < argc) {
+      jpegQuality = atoi(argv[++i]);
+    } else if (arg == "--motion" && i + 1 < argc) {
+      motionConfig.threshold = strtoul(argv[++i], NULL, 10);
+      motionTrigger = true;
+    } else if (arg == "--motion-scale" && i + 1 < argc) {
+      motionConfig.scale = strtoul(argv[++i], NULL, 10);
+      if (motionConfig.scale != 4 && motionConfig.scale != 8) {
+        fprintf(stderr, "Motion scale must be 4 or 8\n");
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--resize" && i + 1 < argc) {
+      if (!parseResampleSizes(argv[++i], resizes)) {
+        fprintf(stderr, "Invalid sizes '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--undistort" && i + 1 < argc) {
+      if (!parseLensModel(argv[++i], lensModel)) {
+        fprintf(stderr, "Invalid lens model '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      undistort = true;
+    } else if (arg == "--lens-size" && i + 1 < argc) {
+      std::vector<ResampleSize> sizes;
+      if (!parseResampleSizes(argv[++i], sizes) || sizes.size() != 1) {
+        fprintf(stderr, "Invalid lens size '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      lensModel.width = sizes[0].width;
+      lensModel.height = sizes[0].height;
+    } else if (arg == "--lens-zoom" && i + 1 < argc) {
+      lensModel.zoom = strtod(argv[++i], NULL);
+    } else if (arg == "--map-cache" && i + 1 < argc) {
+      lensCacheDir = argv[++i];
+      if (lensCacheDir == "none")
+        lensCacheDir.clear();
+    } else if (arg == "--tensor" && i + 1 < argc) {
+      std::vector<ResampleSize> sizes;
+      if (!parseResampleSizes(argv[++i], sizes) || sizes.size() != 1) {
+        fprintf(stderr, "Invalid tensor size '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      tensorConfig.width = sizes[0].width;
+      tensorConfig.height = sizes[0].height;
+      tensorOutput = true;
+    } else if (arg == "--tensor-layout" && i + 1 < argc) {
+      if (!parseTensorLayout(argv[++i], tensorConfig.layout)) {
+        fprintf(stderr, "Unknown tensor layout '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--tensor-type" && i + 1 < argc) {
+      if (!parseTensorType(argv[++i], tensorConfig.type)) {
+        fprintf(stderr, "Unknown tensor type '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--tensor-mean" && i + 1 < argc) {
+      if (!parseTensorChannels(argv[++i], tensorConfig.mean)) {
+        fprintf(stderr, "Invalid tensor mean '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--tensor-std" && i + 1 < argc) {
+      if (!parseTensorChannels(argv[++i], tensorConfig.std)) {
+        fprintf(stderr, "Invalid tensor std '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--raw") {
+      rawStream = true;
+    } else if (arg == "--raw-store" && i + 1 < argc) {
+      rawStore = argv[++i];
+      if (rawStore != "packed" && rawStore != "unpacked") {
+        fprintf(stderr, "Unknown raw storage '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      rawStream = true;
+    } else if (arg == "--raw-calibration" && i + 1 < argc) {
+      calibrationFile = argv[++i];
+      rawStream = true;
+    } else if (arg == "--black-level" && i + 1 < argc) {
+      if (!parseBlackLevel(argv[++i], blackLevel)) {
+        fprintf(stderr, "Invalid black level '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      blackLevelSet = true;
+      rawStream = true;
+    } else if (arg == "--calibrate" && i + 1 < argc) {
+      calibrateFile = argv[++i];
+      rawStream = true;
+    } else if (arg == "--calibrate-frames" && i + 1 < argc) {
+      calibrateFrames = std::max(strtoul(argv[++i], NULL, 10), 1ul);
+    } else if (arg == "--mask" && i + 1 < argc) {
+      MaskRegion region;
+      if (!parseMaskRegion(argv[++i], region)) {
+        fprintf(stderr, "Invalid mask '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      maskRegions.push_back(region);
+    } else if (arg == "--mask-style" && i + 1 < argc) {
+      if (!parseMaskStyle(argv[++i], maskConfig.style)) {
+        fprintf(stderr, "Unknown mask style '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--mask-radius" && i + 1 < argc) {
+      maskConfig.radius = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--stack" && i + 1 < argc) {
+      denoiseConfig.frames = strtoul(argv[++i], NULL, 10);
+      if (denoiseConfig.frames < 2 || denoiseConfig.frames > 256) {
+        fprintf(stderr, "Stacks must have 2 to 256 frames\n");
+        return EXIT_FAILURE;
+      }
+      stackFrames = true;
+    } else if (arg == "--stack-threshold" && i + 1 < argc) {
+      denoiseConfig.threshold = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--bracket" && i + 1 < argc) {
+      if (!parseBracket(argv[++i], bracketExposures)) {
+        fprintf(stderr, "Invalid bracket '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--overlay" && i + 1 < argc) {
+      overlayName = argv[++i];
+    } else if (arg == "--rotate" && i + 1 < argc) {
+      if (!parseFrameTransform(argv[++i], frameTransform)) {
+        fprintf(stderr, "Unknown transform '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--stretch") {
+      tensorConfig.letterbox = false;
+    } else if (arg == "--filter" && i + 1 < argc) {
+      if (!parseResampleFilter(argv[++i], resampleFilter)) {
+        fprintf(stderr, "Unknown filter '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else {
+      usage(argv[0]);
+      return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
+  motionDetector = MotionDetector(motionConfig);
+
+  if (stackFrames && !bracketExposures.empty()) {
+    fprintf(stderr, "Frames can't be both stacked and bracketed\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!calibrationFile.empty()) {
+    int ret = rawCalibration.load(calibrationFile);
+    if (ret) {
+      fprintf(stderr, "Can't load calibration %s: %s\n",
+              calibrationFile.c_str(), strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    printf("Calibration: %ux%u, %u bits, %zu defects\n",
+           rawCalibration.width(), rawCalibration.height(),
+           rawCalibration.bitDepth(), rawCalibration.defectCount());
+  }
+
   std::unique_ptr<CameraManager> cameraManager =
       std::make_unique<CameraManager>();
   int ret = cameraManager->start();
@@ -148,15 +860,73 @@ int main() {
   printf("Camera Acquired: %s\n", cameraId.c_str());
 
   std::unique_ptr<CameraConfiguration> config =
-      camera->generateConfiguration({StreamRole::Viewfinder});
+      camera->generateConfiguration({rawStream ? StreamRole::Raw
+                                               : StreamRole::Viewfinder});
   StreamConfiguration &streamConfig = config->at(0);
-  printf("Default viewfinder configuration is: %s\n",
+  printf("Default %s configuration is: %s\n",
+         rawStream ? "raw" : "viewfinder",
          streamConfig.toString().c_str());
   
   // Don't set fixed resolution - use camera's default/maximum
   // The camera will use its highest available resolution for Viewfinder
+  // Frames of a bracket are held until it's complete, on top of the
+  // requests that keep the camera fed.
+  if (poolConfig.count)
+    streamConfig.bufferCount = poolConfig.count;
+  else if (!bracketExposures.empty())
+    streamConfig.bufferCount =
+        std::max<unsigned int>(streamConfig.bufferCount,
+                               bracketExposures.size() + 2);
   config->validate();
+
+  if (!roi.isNull()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    Size fullSize = streamConfig.size;
+
+    roi = alignRoi(roi, format, fullSize.width, fullSize.height);
+    if (roi.isNull()) {
+      fprintf(stderr, "ROI is outside of the %ux%u frame\n",
+              fullSize.width, fullSize.height);
+      return EXIT_FAILURE;
+    }
+
+    // Prefer cropping in the pipeline: the stream is then negotiated at
+    // the ROI size and only those pixels ever reach memory.
+    const ControlInfoMap &controlInfo = camera->controls();
+    auto cropInfo = controlInfo.find(&controls::ScalerCrop);
+    if (cropInfo != controlInfo.end()) {
+      // Pipelines report their default crop as the default value, older
+      // ones only the maximum.
+      const ControlValue &def = cropInfo->second.def();
+      defaultCrop = def.type() == ControlTypeRectangle && !def.isArray()
+                        ? def.get<Rectangle>()
+                        : cropInfo->second.max().get<Rectangle>();
+      scalerCrop = roiToScalerCrop(roi, fullSize, defaultCrop);
+
+      streamConfig.size = Size(roi.width, roi.height);
+      config->validate();
+      printf("ROI: ScalerCrop %s\n", scalerCrop.toString().c_str());
+    } else {
+      softwareCrop = true;
+      printf("ROI: software crop %ux%u+%u+%u\n", roi.width, roi.height,
+             roi.x, roi.y);
+    }
+  }
   
+  // Prefer a pipeline that rotates or mirrors itself, the sensor flips
+  // cost nothing; otherwise transform the saved frame in software.
+  if (frameTransform != FrameTransform::Identity) {
+    config->orientation = transformOrientation(frameTransform);
+    config->validate();
+    if (config->orientation != transformOrientation(frameTransform)) {
+      config->orientation = Orientation::Rotate0;
+      config->validate();
+      softwareTransform = true;
+    }
+    printf("Transform: %s in %s\n", frameTransformName(frameTransform),
+           softwareTransform ? "software" : "the pipeline");
+  }
+
   // Store the actual resolution and format
   imageWidth = streamConfig.size.width;
   imageHeight = streamConfig.size.height;
@@ -167,23 +937,161 @@ int main() {
   printf("Pixel Format: %s\n", pixelFormat.c_str());
   
   camera->configure(config.get());
+  captureConfig = &streamConfig;
+
+  // Raw corrections work on unpacked samples, at the calibrated size and
+  // bit depth.
+  bool correct = !calibrationFile.empty() || blackLevelSet;
+  if (correct || !calibrateFile.empty() || !rawStore.empty()) {
+    RawFormat rawFormat;
+    if (!parseRawFormat(pixelFormat, rawFormat)) {
+      fprintf(stderr, "Can't process %s frames\n", pixelFormat.c_str());
+      return EXIT_FAILURE;
+    }
+
+    if (rawStore == "unpacked")
+      rawStoreFormat = FrameFormat::RAW16;
+    else if (rawStore == "packed")
+      rawStoreFormat = packedRawFormat(rawFormat.bitDepth);
+
+    if (!calibrateFile.empty()) {
+      rawCalibrator.configure(imageWidth, imageHeight, rawFormat.bitDepth);
+      printf("Calibrating from %u dark frames\n", calibrateFrames);
+    } else if (correct) {
+      const RawCalibration *calibration =
+          rawCalibration.isLoaded() ? &rawCalibration : nullptr;
+      if ((calibration && calibration->bitDepth() != rawFormat.bitDepth) ||
+          rawCorrector.configure(imageWidth, imageHeight,
+                                 blackLevelSet ? blackLevel : nullptr,
+                                 calibration)) {
+        fprintf(stderr, "Calibration doesn't match %s frames of %ux%u\n",
+                pixelFormat.c_str(), imageWidth, imageHeight);
+        return EXIT_FAILURE;
+      }
+    }
+  }
+
+  // Rasterise the masks once, for the negotiated format and size.
+  if (!maskRegions.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = privacyMask.configure(maskRegions, maskConfig, format,
+                                    imageWidth, imageHeight);
+    if (ret) {
+      fprintf(stderr, "Can't mask %s frames of %ux%u\n",
+              pixelFormat.c_str(), imageWidth, imageHeight);
+      return EXIT_FAILURE;
+    }
+    printf("Privacy mask: %zu pixels, %s\n", privacyMask.maskedPixels(),
+           maskStyleName(maskConfig.style));
+  }
+
+  // The glyphs are rasterised once, at a size that suits the frames.
+  if (!overlayName.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    if (textOverlay.configure(overlayConfig, format, imageWidth,
+                              imageHeight)) {
+      fprintf(stderr, "Can't stamp %s frames\n", pixelFormat.c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  // The stack arena is allocated once; frames are accumulated into it.
+  if (stackFrames) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = temporalDenoiser.configure(denoiseConfig, format, imageWidth,
+                                         imageHeight);
+    if (ret) {
+      fprintf(stderr, "Can't stack %s frames of %ux%u\n",
+              pixelFormat.c_str(), imageWidth, imageHeight);
+      return EXIT_FAILURE;
+    }
+    printf("Stacking %u frames, %zu byte arena, %s bit accumulators\n",
+           denoiseConfig.frames, temporalDenoiser.arenaSize(),
+           temporalDenoiser.wideAccumulators() ? "32" : "16");
+  }
+
+  // Exposures are set per request, which needs manual exposure control.
+  if (!bracketExposures.empty()) {
+    const ControlInfoMap &controlInfo = camera->controls();
+    if (controlInfo.find(&controls::ExposureTime) == controlInfo.end() ||
+        controlInfo.find(&controls::AnalogueGain) == controlInfo.end()) {
+      fprintf(stderr, "Camera can't set the exposure per frame\n");
+      return EXIT_FAILURE;
+    }
 
-  FrameBufferAllocator *allocator = new FrameBufferAllocator(camera);
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    if (hdrMerger.configure(format, imageWidth, imageHeight,
+                            bracketExposures.size())) {
+      fprintf(stderr, "Can't fuse %s frames\n", pixelFormat.c_str());
+      return EXIT_FAILURE;
+    }
+    hdrOutput = allocateFrameView(format, imageWidth, imageHeight,
+                                  hdrMemory);
+    hdrBracket = HdrBracket(bracketExposures);
 
-  for (StreamConfiguration &cfg : *config) {
-    int ret = allocator->allocate(cfg.stream());
+    printf("Bracket:");
+    for (const BracketExposure &exposure : bracketExposures)
+      printf(" %d µs x%.2f", exposure.exposureTime, exposure.analogueGain);
+    printf("\n");
+  }
+
+  // Build or load the lens maps now rather than when the frame arrives.
+  if (undistort) {
+    auto start = std::chrono::steady_clock::now();
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = lensRemap.configure(lensModel, format, imageWidth, imageHeight,
+                                  lensCacheDir);
+    if (ret) {
+      fprintf(stderr, "Can't undistort %s frames of %ux%u\n",
+              pixelFormat.c_str(), imageWidth, imageHeight);
+      return EXIT_FAILURE;
+    }
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    printf("Lens maps: %zu bytes %s in %ld ms%s%s\n", lensRemap.mapBytes(),
+           lensRemap.fromCache() ? "loaded" : "built",
+           static_cast<long>(elapsed.count()),
+           lensRemap.cachePath().empty() ? "" : ", cache ",
+           lensRemap.cachePath().c_str());
+  }
+
+  // Frame buffers come either from libcamera's allocator or from our own
+  // pool, which controls where the memory lives and how much there is.
+  FrameBufferAllocator *allocator = nullptr;
+  BufferPool pool;
+  Stream *stream = streamConfig.stream();
+  std::vector<FrameBuffer *> buffers;
+
+  if (usePool) {
+    int ret = pool.allocate(streamConfig, poolConfig);
     if (ret < 0) {
-      printf("Can't allocate buffers\n");
+      printf("Can't allocate buffers from %s pool: %s\n",
+             poolSourceName(poolConfig.source), strerror(-ret));
       return -ENOMEM;
     }
 
-    size_t allocated = allocator->buffers(cfg.stream()).size();
-    printf("Allocated: %zu\n", allocated);
+    printf("Allocated: %d (%s pool)\n", ret, poolSourceName(pool.source()));
+    for (const BufferPool::Buffer &buffer : pool.buffers())
+      buffers.push_back(buffer.frameBuffer.get());
+  } else {
+    allocator = new FrameBufferAllocator(camera);
+
+    for (StreamConfiguration &cfg : *config) {
+      int ret = allocator->allocate(cfg.stream());
+      if (ret < 0) {
+        printf("Can't allocate buffers\n");
+        return -ENOMEM;
+      }
+
+      size_t allocated = allocator->buffers(cfg.stream()).size();
+      printf("Allocated: %zu\n", allocated);
+    }
+
+    for (const std::unique_ptr<FrameBuffer> &buffer : allocator->buffers(stream))
+      buffers.push_back(buffer.get());
   }
 
-  Stream *stream = streamConfig.stream();
-  const std::vector<std::unique_ptr<FrameBuffer>> &buffers =
-      allocator->buffers(stream);
   std::vector<std::unique_ptr<Request>> requests;
 
   for (unsigned int i = 0; i < buffers.size(); ++i) {
@@ -193,8 +1101,7 @@ int main() {
       return -ENOMEM;
     }
 
-    const std::unique_ptr<FrameBuffer> &buffer = buffers[i];
-    int ret = request->addBuffer(stream, buffer.get());
+    int ret = request->addBuffer(stream, buffers[i]);
     if (ret < 0) {
       printf("Can't set buffer for request");
       return ret;
@@ -204,6 +1111,38 @@ int main() {
   }
 
 
+  requestQueue = std::make_unique<RequestQueue>(camera, depthPolicy, 2,
+                                                spareRequests);
+  requestQueue->add(requests);
+  if (usePool)
+    requestQueue->setBufferPool(&pool);
+
+  // Controls are cleared when a request is reused, the crop and the
+  // bracket exposure are set again every time it's queued.
+  if (!scalerCrop.isNull() || hdrMerger.isConfigured()) {
+    requestQueue->setPrepare([](Request *request) {
+      ControlList &controls = request->controls();
+      if (!scalerCrop.isNull())
+        controls.set(controls::ScalerCrop, scalerCrop);
+      if (!hdrMerger.isConfigured())
+        return;
+
+      const BracketExposure &exposure = hdrBracket.next();
+#if LIBCAMERA_VERSION_MAJOR > 0 || LIBCAMERA_VERSION_MINOR >= 5
+      controls.set(controls::ExposureTimeMode,
+                   controls::ExposureTimeModeManual);
+      controls.set(controls::AnalogueGainMode,
+                   controls::AnalogueGainModeManual);
+#else
+      controls.set(controls::AeEnable, false);
+#endif
+      controls.set(controls::ExposureTime, exposure.exposureTime);
+      controls.set(controls::AnalogueGain, exposure.analogueGain);
+    });
+  }
+  printf("Queue depth policy: %s, initial depth %u\n",
+         depthPolicyName(depthPolicy), requestQueue->depth());
+
   camera->requestCompleted.connect(requestComplete);
 
   // Setup signal handler for graceful shutdown
@@ -214,19 +1153,28 @@ int main() {
   
   startTime = std::chrono::steady_clock::now();
   
-  // Queue all requests initially
-  for (std::unique_ptr<Request> &request : requests) {
-    camera->queueRequest(request.get());
-  }
+  // Queue requests up to the initial depth of the policy
+  requestQueue->start();
   
+  // Frames the saved output is made of, which take their time to arrive.
+  unsigned int neededFrames = !calibrateFile.empty() ? calibrateFrames
+                              : stackFrames ? denoiseConfig.frames
+                              : std::max<unsigned int>(hdrBracket.size(), 1);
+  if (timeoutSeconds < 0)
+    timeoutSeconds = motionTrigger ? 0 : 5;
+
   // Run until frame is saved or interrupted
   auto captureStart = std::chrono::steady_clock::now();
   while (running && !frameSaved) {
     std::this_thread::sleep_for(10ms);
     
-    // Timeout after 5 seconds if frame not saved
+    // Timeout if frame not saved, allowing twice the time the frames it
+    // needs take at the rate seen so far
     auto now = std::chrono::steady_clock::now();
-    if (std::chrono::duration_cast<std::chrono::seconds>(now - captureStart).count() >= 5) {
+    double seconds = std::chrono::duration<double>(now - captureStart).count();
+    double rate = frameCount / seconds;
+    double limit = timeoutSeconds + (rate > 0 ? 2.0 * neededFrames / rate : 0);
+    if (timeoutSeconds && seconds >= limit) {
       printf("Timeout waiting for frame\n");
       running = false;
     }
@@ -240,6 +1188,16 @@ int main() {
   printf("\nStopping capture...\n");
   printf("Captured %u frames in %.2f seconds (%.1f fps average)\n", 
          frameCount.load(), totalTime / 1000.0f, avgFps);
+  printf("Dropped %u frames, final queue depth %u, starved %u times\n",
+         requestQueue->drops(), requestQueue->depth(),
+         requestQueue->starved());
+
+  // Let a pending save finish, then stop recycling requests
+  if (saverThread.joinable())
+    saverThread.join();
+  requestQueue->stop();
+  for (FrameHandle &held : bracketFrames)
+    held.reset();
 
   // Clean up in correct order
   camera->stop();
@@ -247,9 +1205,13 @@ int main() {
   // Wait for any pending operations to complete
   std::this_thread::sleep_for(100ms);
   
-  allocator->free(stream);
-  delete allocator;
+  if (allocator) {
+    allocator->free(stream);
+    delete allocator;
+  }
+  pool.free();
   camera->release();
+  requestQueue.reset();
   camera.reset();
   cameraManager->stop();
   
@@ -1,10 +1,74 @@
 #include "multicam.h"
+#include "buffer_pool.h"
+#include "dmabuf_server.h"
+#include "frame_archive.h"
+#include "frame_bus.h"
+#include "http_preview.h"
+#include "mapped_frame.h"
+#include "motion_detector.h"
+#include "privacy_mask.h"
+#include "request_queue.h"
+#include "shm_ring_writer.h"
+#include "text_overlay.h"
 
 static std::shared_ptr<Camera> camera;
 static std::atomic<bool> running(true);
 static std::atomic<uint32_t> frameCount(0);
 static auto startTime = std::chrono::steady_clock::now();
 
+// Application-provided buffers instead of FrameBufferAllocator.
+static bool usePool = false;
+static PoolConfig poolConfig;
+
+// Number of requests kept in flight, adapted at runtime by the policy.
+static constexpr unsigned int kMinDepth = 2;
+static DepthPolicy depthPolicy = DepthPolicy::Fixed;
+static unsigned int spareRequests = 0;
+static std::unique_ptr<RequestQueue> requestQueue;
+static const StreamConfiguration *captureConfig = nullptr;
+
+// Completed frames are fanned out to the consumers subscribed here.
+static FrameBus frameBus;
+
+// Optional export of frames into a shared-memory ring for local readers.
+static std::string shmName;
+static unsigned int shmSlots = 4;
+static ShmRingWriter shmRing;
+
+// Optional zero-copy sharing of the buffers themselves with local clients.
+static std::string dmabufSocket;
+static constexpr unsigned int kDmabufHeld = 2; // buffers clients may hold
+static DmabufServer dmabufServer;
+static std::unordered_map<const FrameBuffer *, unsigned int> bufferIndex;
+
+// Optional MJPEG preview over HTTP.
+static std::string httpAddress;
+static HttpPreviewServer httpServer;
+
+// Optional lossless recording of every frame.
+static std::string recordPath;
+static ArchiveWriter recorder;
+static FrameBus::Subscriber *recordSubscriber;
+static unsigned int keyframeInterval = 0;
+static unsigned int tileSize = 16;
+static unsigned int tileThreshold = 0;
+
+// Optional motion detection. With --record, only frames seen while motion
+// is active are recorded.
+static bool motionTrigger = false;
+static MotionConfig motionConfig;
+static MotionDetector motionDetector;
+
+// Regions masked in place in every frame, before it is published.
+static std::vector<MaskRegion> maskRegions;
+static MaskConfig maskConfig;
+static PrivacyMask privacyMask;
+
+// Timestamp and camera name burnt into the frames, after masking.
+static std::string overlayName;
+static OverlayConfig overlayConfig;
+static TextOverlay textOverlay;
+
 static void signalHandler(int signal) {
   if (signal == SIGINT) {
     printf("\nReceived interrupt signal, stopping...\n");
@@ -12,45 +76,220 @@ static void signalHandler(int signal) {
   }
 }
 
+// Motion detection on the camera thread, so that the result travels with
+// the frame it was seen in. The detector works on a small downscaled
+// copy, cheap enough to run for every frame.
+static void detectMotion(const FrameHandle &frame) {
+  const FrameMetadata &metadata = frame->metadata();
+  MotionEvent event = motionDetector.process(frame->view());
+
+  if (event == MotionEvent::Started) {
+    const MotionBlob &blob = motionDetector.blobs().front();
+    printf("Motion started at %u,%u %ux%u (seq %06u)\n", blob.box.x,
+           blob.box.y, blob.box.width, blob.box.height, metadata.sequence);
+  } else if (event == MotionEvent::Stopped) {
+    printf("Motion stopped (seq %06u)\n", metadata.sequence);
+  }
+
+  frame->setMotion(motionDetector.active());
+}
+
+// Periodic capture statistics, run as a bus subscriber.
+static void printStats(const FrameHandle &frame) {
+  static uint32_t statsFrames = 0;
+
+  // Print every 10th frame to reduce output
+  if (++statsFrames % 10)
+    return;
+
+  const FrameMetadata &metadata = frame->metadata();
+  auto currentTime = std::chrono::steady_clock::now();
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                     currentTime - startTime)
+                     .count();
+  float fps = (frameCount * 1000.0f) / elapsed;
+  printf(" seq: %06u | frames: %u | fps: %.1f | depth: %u | bytesused: ",
+         metadata.sequence, frameCount.load(), fps, requestQueue->depth());
+
+  unsigned int nplane = 0;
+  for (const FrameMetadata::Plane &plane : metadata.planes()) {
+    printf("%u", plane.bytesused);
+    if (++nplane < metadata.planes().size())
+      printf("/");
+  }
+
+  // Health of the picture itself: a covered lens reads dark and flat, a
+  // focus drift as falling sharpness.
+  const FrameStats &stats = frame->stats();
+  printf(" | luma: %.0f | clipped: %.1f%%/%.1f%% | sharpness: %.0f\n",
+         stats.luma, stats.clippedLow, stats.clippedHigh, stats.sharpness);
+}
+
+// Frames queued per subscriber, each also holding one in its callback.
+static constexpr unsigned int kStatsQueue = 1;
+static constexpr unsigned int kRecordQueue = 2; // absorbs encoding jitter
+
+// Buffers the bus subscribers reserve between them, each its own share.
+static unsigned int subscriberShares() {
+  unsigned int latest = FrameBus::share(Backpressure::LatestOnly, 1);
+  unsigned int shares = FrameBus::share(Backpressure::DropOldest, kStatsQueue);
+
+  if (!shmName.empty())
+    shares += latest;
+  if (!dmabufSocket.empty())
+    shares += latest;
+  if (!httpAddress.empty())
+    shares += latest;
+  if (!recordPath.empty())
+    shares += FrameBus::share(Backpressure::DropOldest, kRecordQueue);
+  return shares;
+}
+
+// Burn the wall clock time and the camera name into the frames. The text
+// changes, and is rendered again, once a second.
+static void updateOverlay() {
+  static time_t shown = -1;
+  time_t now =
+      std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+  if (now == shown)
+    return;
+  shown = now;
+
+  std::stringstream text;
+  text << std::put_time(std::localtime(&now), "%Y-%m-%d %H:%M:%S") << " "
+       << overlayName;
+  textOverlay.setText(text.str());
+}
+
 static void requestComplete(Request *request) {
+  requestQueue->completed(request);
+
   if (request->status() == Request::RequestCancelled)
     return;
 
   frameCount++;
 
-  const std::map<const Stream *, FrameBuffer *> &buffers = request->buffers();
-  for (auto bufferPair : buffers) {
-    FrameBuffer *buffer = bufferPair.second;
-    const FrameMetadata &metadata = buffer->metadata();
-
-    // Print every 10th frame to reduce output
-    if (frameCount % 10 == 0) {
-      auto currentTime = std::chrono::steady_clock::now();
-      auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
-                         currentTime - startTime)
-                         .count();
-      float fps = (frameCount * 1000.0f) / elapsed;
-      printf(" seq: %06u | frames: %u | fps: %.1f | bytesused: ",
-             metadata.sequence, frameCount.load(), fps);
-
-      unsigned int nplane = 0;
-      for (const FrameMetadata::Plane &plane : metadata.planes()) {
-        printf("%u", plane.bytesused);
-        if (++nplane < metadata.planes().size())
-          printf("/");
-      }
-      printf("\n");
-    }
+  // The request is requeued once every subscriber has released the frame.
+  // Masked or stamped frames are mapped writable and modified in the
+  // buffer itself, so no subscriber, dmabuf clients included, sees the
+  // original pixels.
+  bool stamp = !overlayName.empty();
+  int prot = privacyMask.isConfigured() || stamp ? PROT_READ | PROT_WRITE
+                                                 : PROT_READ;
+  FrameHandle frame = requestQueue->acquire(request, *captureConfig, prot);
+
+  // Statistics describe what the camera sees: take them before black
+  // fills, blurs and text change the picture.
+  if (prot & PROT_WRITE)
+    frame->stats();
+
+  if (privacyMask.isConfigured())
+    privacyMask.apply(frame->view());
+  // Masked regions don't trigger, the changing timestamp mustn't either.
+  if (motionTrigger)
+    detectMotion(frame);
+  if (stamp) {
+    updateOverlay();
+    textOverlay.apply(frame->view());
   }
 
-  // Continue capturing if still running
-  if (running) {
-    request->reuse(Request::ReuseBuffers);
-    camera->queueRequest(request);
-  }
+  frameBus.publish(std::move(frame));
+}
+
+static void usage(const char *argv0) {
+  printf("Usage: %s [options]\n", argv0);
+  printf("  --pool SOURCE   Use our own buffers (auto, udmabuf, dma-heap)\n");
+  printf("  --buffers N     Number of frame buffers to allocate\n");
+  printf("  --depth POLICY  Requests in flight (fixed, latency, throughput)\n");
+  printf("  --spares N      Requests kept back for when consumers hold frames\n");
+  printf("  --shm NAME      Publish frames to the shared-memory ring /dev/shm/NAME\n");
+  printf("  --shm-slots N   Number of frames in the shared-memory ring\n");
+  printf("  --dmabuf PATH   Share buffers as dmabuf fds over the unix socket PATH\n");
+  printf("  --http ADDR     MJPEG preview on loopback port ADDR or unix:PATH\n");
+  printf("  --record PATH   Record all frames losslessly to PATH\n");
+  printf("  --keyframe N    Record only changed tiles, with a key frame every N\n");
+  printf("  --tile-size N   Tile size in pixels for --keyframe\n");
+  printf("  --tile-threshold T  Ignore tile changes up to T per byte (lossy)\n");
+  printf("  --motion T      Detect motion, luma changing by more than T\n");
+  printf("  --motion-scale N  Detect motion at 1/N resolution (4 or 8)\n");
+  printf("  --mask x,y,w,h|x1,y1,x2,y2,x3,y3[,...]\n");
+  printf("                  Mask a rectangle or polygon, may be repeated\n");
+  printf("  --mask-style S  How masks hide the frame (fill, blur)\n");
+  printf("  --mask-radius N Blur radius of masks in pixels (1-127)\n");
+  printf("  --overlay NAME  Burn the time and NAME into the frames\n");
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+
+    if (arg == "--pool" && i + 1 < argc) {
+      if (!parsePoolSource(argv[++i], poolConfig.source)) {
+        fprintf(stderr, "Unknown buffer pool '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      // The camera can't import a plain memfd, only a dmabuf.
+      if (poolConfig.source == PoolSource::Memfd) {
+        fprintf(stderr, "A memfd pool can't be used for capture\n");
+        return EXIT_FAILURE;
+      }
+      usePool = true;
+    } else if (arg == "--buffers" && i + 1 < argc) {
+      poolConfig.count = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--depth" && i + 1 < argc) {
+      if (!parseDepthPolicy(argv[++i], depthPolicy)) {
+        fprintf(stderr, "Unknown depth policy '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--spares" && i + 1 < argc) {
+      spareRequests = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--shm" && i + 1 < argc) {
+      shmName = argv[++i];
+    } else if (arg == "--shm-slots" && i + 1 < argc) {
+      shmSlots = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--dmabuf" && i + 1 < argc) {
+      dmabufSocket = argv[++i];
+    } else if (arg == "--http" && i + 1 < argc) {
+      httpAddress = argv[++i];
+    } else if (arg == "--record" && i + 1 < argc) {
+      recordPath = argv[++i];
+    } else if (arg == "--keyframe" && i + 1 < argc) {
+      keyframeInterval = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--tile-size" && i + 1 < argc) {
+      tileSize = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--tile-threshold" && i + 1 < argc) {
+      tileThreshold = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--motion" && i + 1 < argc) {
+      motionConfig.threshold = strtoul(argv[++i], NULL, 10);
+      motionTrigger = true;
+    } else if (arg == "--motion-scale" && i + 1 < argc) {
+      motionConfig.scale = strtoul(argv[++i], NULL, 10);
+      if (motionConfig.scale != 4 && motionConfig.scale != 8) {
+        fprintf(stderr, "Motion scale must be 4 or 8\n");
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--mask" && i + 1 < argc) {
+      MaskRegion region;
+      if (!parseMaskRegion(argv[++i], region)) {
+        fprintf(stderr, "Invalid mask '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+      maskRegions.push_back(region);
+    } else if (arg == "--mask-style" && i + 1 < argc) {
+      if (!parseMaskStyle(argv[++i], maskConfig.style)) {
+        fprintf(stderr, "Unknown mask style '%s'\n", argv[i]);
+        return EXIT_FAILURE;
+      }
+    } else if (arg == "--mask-radius" && i + 1 < argc) {
+      maskConfig.radius = strtoul(argv[++i], NULL, 10);
+    } else if (arg == "--overlay" && i + 1 < argc) {
+      overlayName = argv[++i];
+    } else {
+      usage(argv[0]);
+      return arg == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+  }
+
   std::unique_ptr<CameraManager> cameraManager =
       std::make_unique<CameraManager>();
   int ret = cameraManager->start();
@@ -78,27 +317,85 @@ int main() {
          streamConfig.toString().c_str());
   streamConfig.size.width = 640;
   streamConfig.size.height = 480;
+
+  // Buffers kept for the camera and the dmabuf clients. Subscribers get
+  // the rest, by default exactly their shares.
+  unsigned int reserved = kMinDepth + (dmabufSocket.empty() ? 0 : kDmabufHeld);
+  unsigned int needed = reserved + subscriberShares();
+  if (poolConfig.count)
+    streamConfig.bufferCount = poolConfig.count;
+  else
+    streamConfig.bufferCount =
+        std::max<unsigned int>(streamConfig.bufferCount, needed);
   config->validate();
   printf("Validated viewfinder configuration is: %s\n",
          streamConfig.toString().c_str());
   camera->configure(config.get());
+  captureConfig = &streamConfig;
+
+  // Rasterise the masks once, for the negotiated format and size.
+  if (!maskRegions.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = privacyMask.configure(maskRegions, maskConfig, format,
+                                    streamConfig.size.width,
+                                    streamConfig.size.height);
+    if (ret) {
+      fprintf(stderr, "Can't mask %s frames of %s\n",
+              streamConfig.pixelFormat.toString().c_str(),
+              streamConfig.size.toString().c_str());
+      return EXIT_FAILURE;
+    }
+    printf("Privacy mask: %zu pixels, %s\n", privacyMask.maskedPixels(),
+           maskStyleName(maskConfig.style));
+  }
 
-  FrameBufferAllocator *allocator = new FrameBufferAllocator(camera);
+  // The glyphs are rasterised once, at a size that suits the frames.
+  if (!overlayName.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    if (textOverlay.configure(overlayConfig, format, streamConfig.size.width,
+                              streamConfig.size.height)) {
+      fprintf(stderr, "Can't stamp %s frames\n",
+              streamConfig.pixelFormat.toString().c_str());
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Frame buffers come either from libcamera's allocator or from our own
+  // pool, which controls where the memory lives and how much there is.
+  FrameBufferAllocator *allocator = nullptr;
+  BufferPool pool;
+  Stream *stream = streamConfig.stream();
+  std::vector<FrameBuffer *> buffers;
 
-  for (StreamConfiguration &cfg : *config) {
-    int ret = allocator->allocate(cfg.stream());
+  if (usePool) {
+    int ret = pool.allocate(streamConfig, poolConfig);
     if (ret < 0) {
-      printf("Can't allocate buffers\n");
+      printf("Can't allocate buffers from %s pool: %s\n",
+             poolSourceName(poolConfig.source), strerror(-ret));
       return -ENOMEM;
     }
 
-    size_t allocated = allocator->buffers(cfg.stream()).size();
-    printf("Allocated: %zu\n", allocated);
+    printf("Allocated: %d (%s pool)\n", ret, poolSourceName(pool.source()));
+    for (const BufferPool::Buffer &buffer : pool.buffers())
+      buffers.push_back(buffer.frameBuffer.get());
+  } else {
+    allocator = new FrameBufferAllocator(camera);
+
+    for (StreamConfiguration &cfg : *config) {
+      int ret = allocator->allocate(cfg.stream());
+      if (ret < 0) {
+        printf("Can't allocate buffers\n");
+        return -ENOMEM;
+      }
+
+      size_t allocated = allocator->buffers(cfg.stream()).size();
+      printf("Allocated: %zu\n", allocated);
+    }
+
+    for (const std::unique_ptr<FrameBuffer> &buffer : allocator->buffers(stream))
+      buffers.push_back(buffer.get());
   }
 
-  Stream *stream = streamConfig.stream();
-  const std::vector<std::unique_ptr<FrameBuffer>> &buffers =
-      allocator->buffers(stream);
   std::vector<std::unique_ptr<Request>> requests;
 
   for (unsigned int i = 0; i < buffers.size(); ++i) {
@@ -108,8 +405,7 @@ int main() {
       return -ENOMEM;
     }
 
-    const std::unique_ptr<FrameBuffer> &buffer = buffers[i];
-    int ret = request->addBuffer(stream, buffer.get());
+    int ret = request->addBuffer(stream, buffers[i]);
     if (ret < 0) {
       printf("Can't set buffer for request");
       return ret;
@@ -118,6 +414,132 @@ int main() {
     requests.push_back(std::move(request));
   }
 
+  requestQueue = std::make_unique<RequestQueue>(camera, depthPolicy,
+                                                kMinDepth, spareRequests);
+  requestQueue->add(requests);
+  if (usePool)
+    requestQueue->setBufferPool(&pool);
+  printf("Queue depth policy: %s, initial depth %u\n",
+         depthPolicyName(depthPolicy), requestQueue->depth());
+
+  // However slow the subscribers, they never hold the buffers the camera
+  // needs to keep capturing, nor those of another subscriber.
+  if (buffers.size() < needed) {
+    printf("Need %u buffers for the consumers, use --buffers\n", needed);
+    return EXIT_FAILURE;
+  }
+  frameBus.setBufferBudget(buffers.size() - reserved);
+  printf("Subscribers may hold %u of %zu buffers\n",
+         frameBus.bufferBudget(), buffers.size());
+
+  frameBus.subscribe("stats", Backpressure::DropOldest, kStatsQueue,
+                     printStats);
+
+  if (!shmName.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = shmRing.open(shmName, shmSlots, format, streamConfig.size.width,
+                           streamConfig.size.height);
+    if (ret < 0) {
+      printf("Can't create shared-memory ring %s: %s\n", shmName.c_str(),
+             strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    printf("Publishing frames to /dev/shm%s%s (%u slots)\n",
+           shmName[0] == '/' ? "" : "/", shmName.c_str(), shmSlots);
+
+    // Readers only ever want fresh frames: never hold the camera back.
+    frameBus.subscribe("shm", Backpressure::LatestOnly, 1,
+                       [](const FrameHandle &frame) {
+                         const FrameMetadata &metadata = frame->metadata();
+                         shmRing.write(frame->view(), metadata.sequence,
+                                       metadata.timestamp);
+                       });
+  }
+
+  if (!dmabufSocket.empty()) {
+    std::vector<DmabufServer::BufferDesc> descs;
+    for (FrameBuffer *buffer : buffers) {
+      DmabufServer::BufferDesc desc = {};
+      desc.numPlanes = std::min<size_t>(buffer->planes().size(), 3);
+      for (unsigned int p = 0; p < desc.numPlanes; ++p) {
+        const FrameBuffer::Plane &plane = buffer->planes()[p];
+        desc.fd[p] = plane.fd.get();
+        desc.offset[p] = plane.offset;
+        desc.length[p] = plane.length;
+      }
+
+      bufferIndex[buffer] = descs.size();
+      descs.push_back(desc);
+    }
+
+    DmabufServer::Layout layout = {
+      frameFormatFromPixelFormat(streamConfig.pixelFormat),
+      streamConfig.size.width, streamConfig.size.height, streamConfig.stride
+    };
+    int ret = dmabufServer.start(dmabufSocket, layout, descs, kDmabufHeld);
+    if (ret < 0) {
+      printf("Can't listen on %s: %s\n", dmabufSocket.c_str(), strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    printf("Sharing %zu buffers on %s\n", descs.size(), dmabufSocket.c_str());
+
+    // Only a Ready message is sent per frame. The frame handle stays with
+    // the server until every client released the buffer.
+    frameBus.subscribe("dmabuf", Backpressure::LatestOnly, 1,
+                       [](const FrameHandle &frame) {
+                         const FrameMetadata &metadata = frame->metadata();
+                         dmabufServer.publish(bufferIndex.at(frame->buffer()),
+                                              metadata.sequence,
+                                              metadata.timestamp, frame);
+                       });
+  }
+
+  if (!httpAddress.empty()) {
+    int ret = httpServer.start(httpAddress);
+    if (ret < 0) {
+      printf("Can't start preview server on %s: %s\n", httpAddress.c_str(),
+             strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    printf("MJPEG preview on %s (GET /stream?width=W)\n", httpAddress.c_str());
+
+    // Encoding is slow: preview only ever gets the freshest frame.
+    frameBus.subscribe("http", Backpressure::LatestOnly, 1,
+                       [](const FrameHandle &frame) {
+                         httpServer.publish(frame->view());
+                       });
+  }
+
+  if (motionTrigger)
+    motionDetector = MotionDetector(motionConfig);
+
+  if (!recordPath.empty()) {
+    FrameFormat format = frameFormatFromPixelFormat(streamConfig.pixelFormat);
+    int ret = recorder.open(recordPath, format, streamConfig.size.width,
+                            streamConfig.size.height);
+    if (ret < 0) {
+      printf("Can't record to %s: %s\n", recordPath.c_str(), strerror(-ret));
+      return EXIT_FAILURE;
+    }
+    printf("Recording to %s\n", recordPath.c_str());
+    recorder.setDeltaFrames(keyframeInterval, tileSize, tileThreshold);
+
+    // A short queue absorbs encoding jitter; sustained overload drops
+    // frames rather than starving the camera.
+    recordSubscriber = frameBus.subscribe(
+        "record", Backpressure::DropOldest, kRecordQueue,
+        [](const FrameHandle &frame) {
+          if (motionTrigger && !frame->motion())
+            return;
+
+          const FrameMetadata &metadata = frame->metadata();
+          int ret = recorder.write(frame->view(), metadata.sequence,
+                                   metadata.timestamp);
+          if (ret < 0)
+            printf("Recording failed: %s\n", strerror(-ret));
+        });
+  }
+
   camera->requestCompleted.connect(requestComplete);
 
   // Setup signal handler for graceful shutdown
@@ -128,10 +550,8 @@ int main() {
 
   startTime = std::chrono::steady_clock::now();
 
-  // Queue all requests initially
-  for (std::unique_ptr<Request> &request : requests) {
-    camera->queueRequest(request.get());
-  }
+  // Queue requests up to the initial depth of the policy
+  requestQueue->start();
 
   // Run until interrupted or timeout
   auto captureStart = std::chrono::steady_clock::now();
@@ -156,6 +576,36 @@ int main() {
   printf("\nStopping capture...\n");
   printf("Captured %u frames in %.2f seconds (%.1f fps average)\n",
          frameCount.load(), totalTime / 1000.0f, avgFps);
+  printf("Dropped %u frames, final queue depth %u, starved %u times\n",
+         requestQueue->drops(), requestQueue->depth(),
+         requestQueue->starved());
+  printf("Subscribers:\n");
+  frameBus.printStats();
+
+  requestQueue->stop();
+  frameBus.stop();
+  dmabufServer.stop();
+  httpServer.stop();
+
+  if (recorder.frames()) {
+    printf("Recorded %llu frames to %s, %.1f MB (%.2fx smaller)\n",
+           static_cast<unsigned long long>(recorder.frames()),
+           recordPath.c_str(),
+           recorder.storedBytes() / 1e6,
+           static_cast<double>(recorder.rawBytes()) / recorder.storedBytes());
+    if (keyframeInterval)
+      printf("%llu key frames\n",
+             static_cast<unsigned long long>(recorder.keyframes()));
+  }
+  // Encoding runs on the shared thread pool; RGB frames at high rates may
+  // need more cores than the board has.
+  if (recordSubscriber && recordSubscriber->dropped())
+    printf("Warning: the recording misses %llu frames, %s %ux%u can't be "
+           "encoded at this frame rate\n",
+           static_cast<unsigned long long>(recordSubscriber->dropped()),
+           streamConfig.pixelFormat.toString().c_str(),
+           streamConfig.size.width, streamConfig.size.height);
+  recorder.close();
 
   // Clean up in correct order
   camera->stop();
@@ -163,9 +613,14 @@ int main() {
   // Wait for any pending operations to complete
   std::this_thread::sleep_for(100ms);
 
-  allocator->free(stream);
-  delete allocator;
+  if (allocator) {
+    allocator->free(stream);
+    delete allocator;
+  }
+  pool.free();
+  shmRing.close();
   camera->release();
+  requestQueue.reset();
   camera.reset();
   cameraManager->stop();
 
@@ -0,0 +1,500 @@
+#include "privacy_mask.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "buffer_access.h"
+#include "frame_transform.h"
+#include "thread_pool.h"
+
+bool parseMaskStyle(const std::string &name, MaskStyle &style) {
+  if (name == "fill")
+    style = MaskStyle::Fill;
+  else if (name == "blur")
+    style = MaskStyle::Blur;
+  else
+    return false;
+  return true;
+}
+
+const char *maskStyleName(MaskStyle style) {
+  switch (style) {
+  case MaskStyle::Fill:
+    return "fill";
+  case MaskStyle::Blur:
+    return "blur";
+  }
+  return "unknown";
+}
+
+bool parseMaskRegion(const std::string &arg, MaskRegion &region) {
+  std::vector<int> values;
+  const char *p = arg.c_str();
+
+  while (true) {
+    char *end;
+    long value = strtol(p, &end, 10);
+    if (end == p || value < 0 || value > 65535)
+      return false;
+    values.push_back(value);
+    if (!*end)
+      break;
+    if (*end != ',')
+      return false;
+    p = end + 1;
+  }
+
+  MaskRegion result;
+  if (values.size() == 4) {
+    int x = values[0], y = values[1], w = values[2], h = values[3];
+    if (!w || !h)
+      return false;
+    result.points = { { x, y }, { x + w, y }, { x + w, y + h }, { x, y + h } };
+  } else if (values.size() >= 6 && values.size() % 2 == 0) {
+    for (size_t i = 0; i < values.size(); i += 2)
+      result.points.push_back({ values[i], values[i + 1] });
+  } else {
+    return false;
+  }
+
+  region = result;
+  return true;
+}
+
+namespace {
+
+constexpr unsigned int kMaxRadius = 127;
+constexpr unsigned int kBandRows = 32;
+constexpr unsigned int kStripBytes = 128;
+
+struct Interval {
+  unsigned int x0;
+  unsigned int x1;
+};
+
+// Sort and merge overlapping or touching intervals.
+void mergeIntervals(std::vector<Interval> &intervals) {
+  if (intervals.size() < 2)
+    return;
+
+  std::sort(intervals.begin(), intervals.end(),
+            [](const Interval &a, const Interval &b) { return a.x0 < b.x0; });
+
+  size_t out = 0;
+  for (size_t i = 1; i < intervals.size(); ++i) {
+    if (intervals[i].x0 <= intervals[out].x1)
+      intervals[out].x1 = std::max(intervals[out].x1, intervals[i].x1);
+    else
+      intervals[++out] = intervals[i];
+  }
+  intervals.resize(out + 1);
+}
+
+// Scanline fill at pixel centres: pixel x of row y is inside when the
+// number of edges crossed left of (x + 0.5, y + 0.5) is odd.
+void rasterise(const MaskRegion &region, unsigned int width,
+               unsigned int height, std::vector<std::vector<Interval>> &rows) {
+  const std::vector<MaskRegion::Point> &points = region.points;
+  std::vector<double> crossings;
+
+  int top = points[0].y, bottom = points[0].y;
+  for (const MaskRegion::Point &point : points) {
+    top = std::min(top, point.y);
+    bottom = std::max(bottom, point.y);
+  }
+
+  for (int y = std::max(top, 0); y < std::min<int>(bottom, height); ++y) {
+    double centre = y + 0.5;
+
+    crossings.clear();
+    for (size_t i = 0; i < points.size(); ++i) {
+      const MaskRegion::Point &a = points[i];
+      const MaskRegion::Point &b = points[(i + 1) % points.size()];
+      if ((a.y <= centre) == (b.y <= centre))
+        continue;
+      crossings.push_back(a.x + (centre - a.y) * (b.x - a.x) / (b.y - a.y));
+    }
+    std::sort(crossings.begin(), crossings.end());
+
+    for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+      double x0 = std::ceil(crossings[i] - 0.5);
+      double x1 = std::ceil(crossings[i + 1] - 0.5);
+      x0 = std::max(x0, 0.0);
+      x1 = std::min(x1, double(width));
+      if (x0 < x1)
+        rows[y].push_back({ unsigned(x0), unsigned(x1) });
+    }
+  }
+}
+
+// Grey in every sample of a group, neutral chroma for YUV formats, which
+// are full range like the rest of the frame processing.
+void fillPattern(FrameFormat format, unsigned int plane, uint8_t grey,
+                 uint8_t pattern[4]) {
+  std::fill(pattern, pattern + 4, grey);
+
+  switch (format) {
+  case FrameFormat::YUYV:
+    pattern[1] = pattern[3] = 128;
+    break;
+  case FrameFormat::UYVY:
+    pattern[0] = pattern[2] = 128;
+    break;
+  case FrameFormat::NV12:
+  case FrameFormat::NV21:
+  case FrameFormat::YUV420:
+    if (plane)
+      std::fill(pattern, pattern + 4, 128);
+    break;
+  default:
+    break;
+  }
+}
+
+// Division of a box sum by the box size, rounded, with a 16 bit
+// reciprocal. Sums of a box of at most 255 samples fit in 16 bits.
+struct Divider {
+  explicit Divider(unsigned int r)
+      : radius(r), half(r), inv((65536 + r) / (2 * r + 1)) {}
+
+  uint8_t operator()(uint32_t sum) const {
+    return ((sum + half) * inv) >> 16;
+  }
+
+  unsigned int radius;
+  uint16_t half;
+  uint16_t inv;
+};
+
+// Emit one row of a box blur pass from the column sums of its window, then
+// move the window down a row: one add and one subtract per sample,
+// whatever the radius.
+void boxStep(uint16_t *sum, const uint8_t *add, const uint8_t *sub,
+             uint8_t *out, unsigned int width, const Divider &div) {
+  unsigned int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i half = _mm_set1_epi16(div.half);
+  const __m128i inv = _mm_set1_epi16(div.inv);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= width; i += 16) {
+    __m128i s0 = _mm_loadu_si128(reinterpret_cast<__m128i *>(sum + i));
+    __m128i s1 = _mm_loadu_si128(reinterpret_cast<__m128i *>(sum + i + 8));
+    __m128i d0 = _mm_mulhi_epu16(_mm_add_epi16(s0, half), inv);
+    __m128i d1 = _mm_mulhi_epu16(_mm_add_epi16(s1, half), inv);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_packus_epi16(d0, d1));
+
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(add + i));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(sub + i));
+    s0 = _mm_sub_epi16(_mm_add_epi16(s0, _mm_unpacklo_epi8(a, zero)),
+                       _mm_unpacklo_epi8(b, zero));
+    s1 = _mm_sub_epi16(_mm_add_epi16(s1, _mm_unpackhi_epi8(a, zero)),
+                       _mm_unpackhi_epi8(b, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sum + i), s0);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(sum + i + 8), s1);
+  }
+#elif defined(__aarch64__)
+  const uint16x8_t half = vdupq_n_u16(div.half);
+  const uint16x8_t inv = vdupq_n_u16(div.inv);
+
+  for (; i + 16 <= width; i += 16) {
+    uint16x8_t s0 = vld1q_u16(sum + i);
+    uint16x8_t s1 = vld1q_u16(sum + i + 8);
+    uint16x8_t h0 = vaddq_u16(s0, half);
+    uint16x8_t h1 = vaddq_u16(s1, half);
+    uint16x8_t d0 = vcombine_u16(
+        vshrn_n_u32(vmull_u16(vget_low_u16(h0), vget_low_u16(inv)), 16),
+        vshrn_n_u32(vmull_high_u16(h0, inv), 16));
+    uint16x8_t d1 = vcombine_u16(
+        vshrn_n_u32(vmull_u16(vget_low_u16(h1), vget_low_u16(inv)), 16),
+        vshrn_n_u32(vmull_high_u16(h1, inv), 16));
+    vst1q_u8(out + i, vcombine_u8(vqmovn_u16(d0), vqmovn_u16(d1)));
+
+    uint8x16_t a = vld1q_u8(add + i);
+    uint8x16_t b = vld1q_u8(sub + i);
+    s0 = vsubw_u8(vaddw_u8(s0, vget_low_u8(a)), vget_low_u8(b));
+    s1 = vsubw_u8(vaddw_u8(s1, vget_high_u8(a)), vget_high_u8(b));
+    vst1q_u16(sum + i, s0);
+    vst1q_u16(sum + i + 8, s1);
+  }
+#endif
+
+  for (; i < width; ++i) {
+    out[i] = div(sum[i]);
+    sum[i] += add[i] - sub[i];
+  }
+}
+
+// One box blur pass down a strip of columns, the edges extended.
+void boxColumns(const uint8_t *in, uint8_t *out, size_t stride,
+                unsigned int width, unsigned int rows, const Divider &div) {
+  const unsigned int r = div.radius;
+  const unsigned int last = rows - 1;
+  uint16_t sum[kStripBytes];
+
+  for (unsigned int i = 0; i < width; ++i)
+    sum[i] = in[i] * (r + 1);
+  for (unsigned int k = 1; k <= r; ++k) {
+    const uint8_t *row = in + std::min(k, last) * stride;
+    for (unsigned int i = 0; i < width; ++i)
+      sum[i] += row[i];
+  }
+
+  for (unsigned int y = 0; y < rows; ++y)
+    boxStep(sum, in + std::min(y + r + 1, last) * stride,
+            in + (y >= r ? y - r : 0) * stride, out + y * stride, width, div);
+}
+
+} /* namespace */
+
+int PrivacyMask::configure(const std::vector<MaskRegion> &regions,
+                           const MaskConfig &config, FrameFormat format,
+                           unsigned int width, unsigned int height) {
+  const FormatInfo &info = formatInfo(format);
+
+  planes_.clear();
+  maskedPixels_ = 0;
+
+  if (!info.numPlanes || !width || !height || regions.empty())
+    return -EINVAL;
+  if (config.style == MaskStyle::Blur &&
+      (!config.radius || config.radius > kMaxRadius || !config.passes))
+    return -EINVAL;
+
+  /* ---------------------------------------------------------------------
+   * Frame pixels covered by the union of the regions, and their bounds
+   */
+  std::vector<std::vector<Interval>> rows(height);
+  std::vector<Box> boxes;
+
+  for (const MaskRegion &region : regions) {
+    if (region.points.size() < 3)
+      return -EINVAL;
+
+    std::vector<std::vector<Interval>> covered(height);
+    rasterise(region, width, height, covered);
+
+    Box box = { width, height, 0, 0 };
+    for (unsigned int y = 0; y < height; ++y) {
+      for (const Interval &interval : covered[y]) {
+        box.x0 = std::min(box.x0, interval.x0);
+        box.x1 = std::max(box.x1, interval.x1);
+        box.y0 = std::min(box.y0, y);
+        box.y1 = y + 1;
+        rows[y].push_back(interval);
+      }
+    }
+    if (box.x0 < box.x1)
+      boxes.push_back(box);
+  }
+
+  for (std::vector<Interval> &row : rows) {
+    mergeIntervals(row);
+    for (const Interval &interval : row)
+      maskedPixels_ += interval.x1 - interval.x0;
+  }
+
+  if (!maskedPixels_)
+    return -EINVAL;
+
+  // Overlapping regions are blurred together, once.
+  for (bool merged = true; merged;) {
+    merged = false;
+    for (size_t i = 0; i < boxes.size() && !merged; ++i) {
+      for (size_t j = i + 1; j < boxes.size(); ++j) {
+        Box &a = boxes[i];
+        const Box &b = boxes[j];
+        if (a.x0 >= b.x1 || b.x0 >= a.x1 || a.y0 >= b.y1 || b.y0 >= a.y1)
+          continue;
+
+        a = { std::min(a.x0, b.x0), std::min(a.y0, b.y0),
+              std::max(a.x1, b.x1), std::max(a.y1, b.y1) };
+        boxes.erase(boxes.begin() + j);
+        merged = true;
+        break;
+      }
+    }
+  }
+
+  /* ---------------------------------------------------------------------
+   * Spans and boxes of every plane, covering all the samples that hold
+   * part of a masked pixel
+   */
+  for (unsigned int i = 0; i < info.numPlanes; ++i) {
+    unsigned int hSub = info.hSub[i], vSub = info.vSub[i];
+    unsigned int planeWidth = width / hSub, planeHeight = height / vSub;
+    Plane plane;
+    std::vector<Interval> intervals;
+
+    for (unsigned int y = 0; y < planeHeight; ++y) {
+      intervals.clear();
+      for (unsigned int k = 0; k < vSub; ++k) {
+        for (const Interval &interval : rows[y * vSub + k]) {
+          unsigned int x0 = interval.x0 / hSub;
+          unsigned int x1 = (interval.x1 + hSub - 1) / hSub;
+          x1 = std::min(x1, planeWidth);
+          if (x0 < x1)
+            intervals.push_back({ x0, x1 });
+        }
+      }
+      mergeIntervals(intervals);
+      for (const Interval &interval : intervals)
+        plane.spans.push_back({ y, interval.x0, interval.x1 });
+    }
+
+    for (const Box &box : boxes) {
+      Box scaled = { box.x0 / hSub, box.y0 / vSub,
+                     std::min((box.x1 + hSub - 1) / hSub, planeWidth),
+                     std::min((box.y1 + vSub - 1) / vSub, planeHeight) };
+      if (scaled.x0 < scaled.x1 && scaled.y0 < scaled.y1)
+        plane.boxes.push_back(scaled);
+    }
+
+    plane.radiusX = std::max(config.radius / hSub, 1u);
+    plane.radiusY = std::max(config.radius / vSub, 1u);
+    fillPattern(format, i, config.fill, plane.fill);
+    planes_.push_back(std::move(plane));
+  }
+
+  config_ = config;
+  format_ = format;
+  width_ = width;
+  height_ = height;
+  return 0;
+}
+
+int PrivacyMask::apply(const FrameView &view) const {
+  if (view.format != format_ || view.width != width_ ||
+      view.height != height_ || view.numPlanes != planes_.size())
+    return -EINVAL;
+
+  for (unsigned int i = 0; i < view.numPlanes; ++i) {
+    if (config_.style == MaskStyle::Fill) {
+      fillPlane(view.planes[i], planes_[i]);
+      continue;
+    }
+
+    for (const Box &box : planes_[i].boxes)
+      blurBox(view.planes[i], planes_[i], box);
+  }
+
+  return 0;
+}
+
+void PrivacyMask::fillPlane(const PlaneView &plane, const Plane &mask) const {
+  const unsigned int bpp = plane.bytesPerPixel;
+
+  // A row of the pattern to copy the spans from.
+  thread_local std::vector<uint8_t> pattern;
+  pattern.resize(plane.rowBytes());
+  for (size_t i = 0; i < pattern.size(); ++i)
+    pattern[i] = mask.fill[i % bpp];
+
+  const std::vector<Span> &spans = mask.spans;
+  const uint8_t *source = pattern.data();
+  unsigned int chunks = (spans.size() + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(chunks, [&](unsigned int chunk) {
+    size_t end = std::min<size_t>((chunk + 1) * kBandRows, spans.size());
+    for (size_t i = chunk * kBandRows; i < end; ++i) {
+      const Span &span = spans[i];
+      memcpy(plane.row(span.y) + span.x0 * bpp, source,
+             (span.x1 - span.x0) * bpp);
+    }
+  });
+}
+
+void PrivacyMask::blurBox(const PlaneView &plane, const Plane &mask,
+                          const Box &box) const {
+  const unsigned int bpp = plane.bytesPerPixel;
+  const unsigned int count = box.x1 - box.x0;
+  const unsigned int rows = box.y1 - box.y0;
+  const size_t rowBytes = size_t(count) * bpp;
+  const unsigned int passes = config_.passes;
+
+  // The box is blurred out of place: frame buffers may be mapped uncached,
+  // and the samples outside the masked spans must stay untouched.
+  thread_local std::vector<uint8_t> front, back;
+  front.resize(rowBytes * rows);
+  back.resize(rowBytes * rows);
+  uint8_t *data = front.data();
+  uint8_t *spare = back.data();
+
+  unsigned int bands = (rows + kBandRows - 1) / kBandRows;
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int end = std::min((band + 1) * kBandRows, rows);
+    for (unsigned int y = band * kBandRows; y < end; ++y)
+      streamCopy(data + y * rowBytes, plane.row(box.y0 + y) + box.x0 * bpp,
+                 rowBytes);
+  });
+
+  // Blurs down the columns of a width x height image of samples.
+  auto blurColumns = [&](unsigned int width, unsigned int height,
+                         const Divider &div) {
+    size_t stride = size_t(width) * bpp;
+    unsigned int strips = (stride + kStripBytes - 1) / kStripBytes;
+
+    ThreadPool::shared().parallelFor(strips, [&](unsigned int strip) {
+      size_t offset = size_t(strip) * kStripBytes;
+      unsigned int bytes = std::min<size_t>(kStripBytes, stride - offset);
+      uint8_t *buffers[2] = { data + offset, spare + offset };
+
+      for (unsigned int i = 0; i < passes; ++i)
+        boxColumns(buffers[i % 2], buffers[(i + 1) % 2], stride, bytes,
+                   height, div);
+    });
+
+    if (passes % 2)
+      std::swap(data, spare);
+  };
+
+  auto transpose = [&](unsigned int width, unsigned int height) {
+    PlaneView from = { data, size_t(width) * bpp, width, height, bpp };
+    PlaneView to = { spare, size_t(height) * bpp, height, width, bpp };
+    transposeSamples(from, to);
+    std::swap(data, spare);
+  };
+
+  // Running sums along rows are a serial chain per component. Along
+  // columns, whole rows of sums advance at once in vector registers, so
+  // the horizontal passes run down the columns of the transposed box.
+  transpose(count, rows);
+  blurColumns(rows, count, Divider(mask.radiusX));
+  transpose(rows, count);
+  blurColumns(count, rows, Divider(mask.radiusY));
+
+  // Copy the masked samples back, band by band.
+  const uint8_t *result = data;
+  const std::vector<Span> &spans = mask.spans;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int first = box.y0 + band * kBandRows;
+    unsigned int end = std::min(first + kBandRows, box.y1);
+    auto it = std::lower_bound(spans.begin(), spans.end(), first,
+                               [](const Span &span, unsigned int y) {
+                                 return span.y < y;
+                               });
+
+    for (; it != spans.end() && it->y < end; ++it) {
+      unsigned int x0 = std::max(it->x0, box.x0);
+      unsigned int x1 = std::min(it->x1, box.x1);
+      if (x0 >= x1)
+        continue;
+
+      memcpy(plane.row(it->y) + x0 * bpp,
+             result + (it->y - box.y0) * rowBytes + (x0 - box.x0) * bpp,
+             (x1 - x0) * bpp);
+    }
+  });
+}
@@ -0,0 +1,460 @@
+#include "raw_correction.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+bool parseRawFormat(const std::string &name, RawFormat &format) {
+  static const char *const orders[] = { "SRGGB", "SGRBG", "SGBRG", "SBGGR" };
+
+  size_t pos = 0;
+  for (const char *order : orders) {
+    if (!name.compare(0, 5, order)) {
+      pos = 5;
+      break;
+    }
+  }
+  if (!pos || name.size() < pos + 2)
+    return false;
+
+  std::string depth = name.substr(pos, 2);
+  std::string packing = name.substr(pos + 2);
+  if ((depth != "10" && depth != "12" && depth != "16") ||
+      (!packing.empty() && packing != "_CSI2P") ||
+      (depth == "16" && !packing.empty()))
+    return false;
+
+  format.bitDepth = std::stoi(depth);
+  format.packed = !packing.empty();
+  return true;
+}
+
+bool parseBlackLevel(const std::string &arg, uint16_t blackLevel[4]) {
+  unsigned int v[4];
+  char trailing;
+
+  int count = sscanf(arg.c_str(), "%u,%u,%u,%u%c", &v[0], &v[1], &v[2],
+                     &v[3], &trailing);
+  if (count == 1)
+    v[1] = v[2] = v[3] = v[0];
+  else if (count != 4)
+    return false;
+
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (v[i] > 32767)
+      return false;
+    blackLevel[i] = v[i];
+  }
+
+  return true;
+}
+
+namespace {
+
+constexpr unsigned int kBandRows = 32;
+
+struct CalibrationHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bitDepth;
+  uint16_t blackLevel[4];
+  uint32_t defectCount;
+  uint32_t reserved;
+};
+
+constexpr char kMagic[4] = { 'O', 'C', 'R', 'C' };
+constexpr uint32_t kVersion = 1;
+
+// The defect indices follow the dark frame, 4 byte aligned.
+size_t defectOffset(size_t width, size_t height) {
+  size_t offset = sizeof(CalibrationHeader) + width * height * 2;
+  return (offset + 3) & ~size_t(3);
+}
+
+// Same colour neighbours of a Bayer pixel, nearest first.
+constexpr struct {
+  int dx;
+  int dy;
+} kNeighbours[8] = {
+  { -2, 0 }, { 2, 0 }, { 0, -2 }, { 0, 2 },
+  { -2, -2 }, { 2, -2 }, { -2, 2 }, { 2, 2 },
+};
+
+int writeAll(int fd, const void *data, size_t size) {
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+
+  while (size) {
+    ssize_t ret = ::write(fd, bytes, size);
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+      return -errno;
+    }
+    bytes += ret;
+    size -= ret;
+  }
+
+  return 0;
+}
+
+// Subtract the black level of the two colour channels of a row, given for
+// even and odd columns, offset by the dark frame when there is one.
+void subtractRow(uint16_t *row, const int16_t *dark, unsigned int width,
+                 uint16_t evenBlack, uint16_t oddBlack) {
+  unsigned int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i black = _mm_set_epi16(oddBlack, evenBlack, oddBlack,
+                                      evenBlack, oddBlack, evenBlack,
+                                      oddBlack, evenBlack);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; x + 8 <= width; x += 8) {
+    __m128i *p = reinterpret_cast<__m128i *>(row + x);
+    __m128i offset = black;
+    if (dark) {
+      __m128i fixed =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(dark + x));
+      offset = _mm_max_epi16(_mm_adds_epi16(black, fixed), zero);
+    }
+    _mm_storeu_si128(p, _mm_subs_epu16(_mm_loadu_si128(p), offset));
+  }
+#elif defined(__aarch64__)
+  const uint16_t pattern[8] = { evenBlack, oddBlack, evenBlack, oddBlack,
+                                evenBlack, oddBlack, evenBlack, oddBlack };
+  const int16x8_t black = vreinterpretq_s16_u16(vld1q_u16(pattern));
+
+  for (; x + 8 <= width; x += 8) {
+    uint16x8_t offset = vreinterpretq_u16_s16(black);
+    if (dark) {
+      int16x8_t fixed = vqaddq_s16(black, vld1q_s16(dark + x));
+      offset = vreinterpretq_u16_s16(vmaxq_s16(fixed, vdupq_n_s16(0)));
+    }
+    vst1q_u16(row + x, vqsubq_u16(vld1q_u16(row + x), offset));
+  }
+#endif
+
+  for (; x < width; ++x) {
+    int offset = x & 1 ? oddBlack : evenBlack;
+    if (dark)
+      offset = std::max(offset + dark[x], 0);
+    row[x] = row[x] > offset ? row[x] - offset : 0;
+  }
+}
+
+} /* namespace */
+
+/* -----------------------------------------------------------------------------
+ * RawCalibration
+ */
+
+RawCalibration::~RawCalibration() {
+  if (data_)
+    munmap(data_, size_);
+}
+
+int RawCalibration::load(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -errno;
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    int ret = -errno;
+    ::close(fd);
+    return ret;
+  }
+
+  size_t size = st.st_size;
+  if (size < sizeof(CalibrationHeader)) {
+    ::close(fd);
+    return -EINVAL;
+  }
+
+  // Pages are shared with every process using the same calibration and
+  // only read in as the frames touch them.
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  int ret = data == MAP_FAILED ? -errno : 0;
+  ::close(fd);
+  if (ret)
+    return ret;
+
+  CalibrationHeader header;
+  memcpy(&header, data, sizeof(header));
+
+  uint64_t pixels = uint64_t(header.width) * header.height;
+  bool valid = !memcmp(header.magic, kMagic, sizeof(kMagic)) &&
+               header.version == kVersion && pixels &&
+               pixels <= (uint64_t(1) << 30) && header.bitDepth <= 16 &&
+               defectOffset(header.width, header.height) +
+                       uint64_t(header.defectCount) * sizeof(uint32_t) ==
+                   size;
+  if (!valid) {
+    munmap(data, size);
+    return -EINVAL;
+  }
+
+  if (data_)
+    munmap(data_, size_);
+
+  const uint8_t *bytes = static_cast<const uint8_t *>(data);
+  data_ = data;
+  size_ = size;
+  width_ = header.width;
+  height_ = header.height;
+  bitDepth_ = header.bitDepth;
+  memcpy(blackLevel_, header.blackLevel, sizeof(blackLevel_));
+  darkFrame_ =
+      reinterpret_cast<const int16_t *>(bytes + sizeof(CalibrationHeader));
+  defects_ = reinterpret_cast<const uint32_t *>(
+      bytes + defectOffset(width_, height_));
+  defectCount_ = header.defectCount;
+
+  return 0;
+}
+
+/* -----------------------------------------------------------------------------
+ * RawCalibrator
+ */
+
+int RawCalibrator::configure(unsigned int width, unsigned int height,
+                             unsigned int bitDepth) {
+  if (!width || !height || !bitDepth || bitDepth > 16)
+    return -EINVAL;
+
+  width_ = width;
+  height_ = height;
+  bitDepth_ = bitDepth;
+  frames_ = 0;
+  sums_.assign(size_t(width) * height, 0);
+
+  return 0;
+}
+
+int RawCalibrator::add(const FrameView &view) {
+  if (!width_ || view.format != FrameFormat::RAW16 ||
+      view.width != width_ || view.height != height_)
+    return -EINVAL;
+
+  // Only runs for the few frames of a calibration: plain loops, which the
+  // compiler vectorises well enough.
+  const PlaneView &plane = view.planes[0];
+  unsigned int bands = (height_ + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int last = std::min((band + 1) * kBandRows, height_);
+
+    for (unsigned int y = band * kBandRows; y < last; ++y) {
+      const uint16_t *src = reinterpret_cast<const uint16_t *>(plane.row(y));
+      uint32_t *sum = &sums_[size_t(y) * width_];
+      for (unsigned int x = 0; x < width_; ++x)
+        sum[x] += src[x];
+    }
+  });
+
+  frames_++;
+  return 0;
+}
+
+int RawCalibrator::save(const std::string &path,
+                        unsigned int threshold) const {
+  if (!frames_)
+    return -EINVAL;
+
+  const unsigned int maxLevel = (1u << bitDepth_) - 1;
+  if (!threshold)
+    threshold = std::max((maxLevel + 1) / 64, 1u);
+
+  std::vector<uint16_t> average(sums_.size());
+  for (size_t i = 0; i < sums_.size(); ++i)
+    average[i] = std::min<uint32_t>((sums_[i] + frames_ / 2) / frames_,
+                                    maxLevel);
+
+  // The median of every colour channel, from its histogram.
+  CalibrationHeader header = {};
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.width = width_;
+  header.height = height_;
+  header.bitDepth = bitDepth_;
+
+  std::vector<uint32_t> histogram(maxLevel + 1);
+  for (unsigned int c = 0; c < 4; ++c) {
+    std::fill(histogram.begin(), histogram.end(), 0);
+    size_t count = 0;
+    for (unsigned int y = c / 2; y < height_; y += 2) {
+      for (unsigned int x = c % 2; x < width_; x += 2, ++count)
+        histogram[average[size_t(y) * width_ + x]]++;
+    }
+
+    size_t seen = 0;
+    unsigned int level = 0;
+    while (level < maxLevel && (seen += histogram[level]) <= count / 2)
+      level++;
+    header.blackLevel[c] = std::min(level, 32767u);
+  }
+
+  std::vector<int16_t> dark(average.size());
+  std::vector<uint32_t> defects;
+  for (unsigned int y = 0; y < height_; ++y) {
+    for (unsigned int x = 0; x < width_; ++x) {
+      size_t i = size_t(y) * width_ + x;
+      int black = header.blackLevel[(y & 1) * 2 + (x & 1)];
+      int signal = average[i] - black;
+
+      dark[i] = std::min(std::max(signal, -32768), 32767);
+      if (signal > static_cast<int>(threshold))
+        defects.push_back(i);
+    }
+  }
+  header.defectCount = defects.size();
+
+  // Written to a temporary file renamed into place, so that a running
+  // capture never maps a partial calibration.
+  std::string temporary = path + "." + std::to_string(getpid());
+  int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0)
+    return -errno;
+
+  const uint8_t padding[4] = {};
+  size_t darkEnd = sizeof(header) + dark.size() * sizeof(int16_t);
+
+  int ret = writeAll(fd, &header, sizeof(header));
+  if (!ret)
+    ret = writeAll(fd, dark.data(), dark.size() * sizeof(int16_t));
+  if (!ret)
+    ret = writeAll(fd, padding, defectOffset(width_, height_) - darkEnd);
+  if (!ret)
+    ret = writeAll(fd, defects.data(), defects.size() * sizeof(uint32_t));
+
+  if (::close(fd) < 0 && !ret)
+    ret = -errno;
+  if (!ret && rename(temporary.c_str(), path.c_str()) < 0)
+    ret = -errno;
+  if (ret)
+    unlink(temporary.c_str());
+
+  return ret;
+}
+
+/* -----------------------------------------------------------------------------
+ * RawCorrector
+ */
+
+int RawCorrector::configure(unsigned int width, unsigned int height,
+                            const uint16_t *blackLevel,
+                            const RawCalibration *calibration) {
+  width_ = 0;
+  darkFrame_ = nullptr;
+  defects_.clear();
+
+  if (!width || !height || (!blackLevel && !calibration))
+    return -EINVAL;
+  if (calibration && (!calibration->isLoaded() ||
+                      calibration->width() != width ||
+                      calibration->height() != height))
+    return -EINVAL;
+
+  if (!blackLevel)
+    blackLevel = calibration->blackLevel();
+  for (unsigned int i = 0; i < 4; ++i) {
+    if (blackLevel[i] > 32767)
+      return -EINVAL;
+    blackLevel_[i] = blackLevel[i];
+  }
+
+  if (calibration) {
+    darkFrame_ = calibration->darkFrame();
+
+    // Interpolate every defect from the neighbours that are in the frame
+    // and not defects themselves; the list is sorted, so they can be
+    // looked up by bisection.
+    const uint32_t *begin = calibration->defects();
+    const uint32_t *end = begin + calibration->defectCount();
+
+    for (const uint32_t *defect = begin; defect != end; ++defect) {
+      Defect d = { *defect % width, *defect / width, 0 };
+      if (d.y >= height)
+        break;
+
+      for (unsigned int i = 0; i < 8; ++i) {
+        int x = static_cast<int>(d.x) + kNeighbours[i].dx;
+        int y = static_cast<int>(d.y) + kNeighbours[i].dy;
+        if (x < 0 || y < 0 || x >= static_cast<int>(width) ||
+            y >= static_cast<int>(height))
+          continue;
+
+        uint32_t index = uint32_t(y) * width + x;
+        if (!std::binary_search(begin, end, index))
+          d.neighbours |= 1 << i;
+      }
+
+      defects_.push_back(d);
+    }
+  }
+
+  width_ = width;
+  height_ = height;
+  return 0;
+}
+
+int RawCorrector::apply(const FrameView &view) const {
+  if (!isConfigured() || view.format != FrameFormat::RAW16 ||
+      view.width != width_ || view.height != height_)
+    return -EINVAL;
+
+  const PlaneView &plane = view.planes[0];
+  unsigned int bands = (height_ + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int last = std::min((band + 1) * kBandRows, height_);
+
+    for (unsigned int y = band * kBandRows; y < last; ++y) {
+      const uint16_t *black = &blackLevel_[(y & 1) * 2];
+      const int16_t *dark =
+          darkFrame_ ? darkFrame_ + size_t(y) * width_ : nullptr;
+      subtractRow(reinterpret_cast<uint16_t *>(plane.row(y)), dark, width_,
+                  black[0], black[1]);
+    }
+  });
+
+  // Defects are read only from pixels that aren't defects, which are all
+  // corrected by now, so the order doesn't matter.
+  for (const Defect &defect : defects_) {
+    unsigned int sum = 0;
+    unsigned int count = 0;
+
+    for (unsigned int i = 0; i < 8; ++i) {
+      if (!(defect.neighbours & (1 << i)))
+        continue;
+
+      const uint16_t *row = reinterpret_cast<const uint16_t *>(
+          plane.row(defect.y + kNeighbours[i].dy));
+      sum += row[defect.x + kNeighbours[i].dx];
+      count++;
+    }
+
+    if (count) {
+      uint16_t *row = reinterpret_cast<uint16_t *>(plane.row(defect.y));
+      row[defect.x] = (sum + count / 2) / count;
+    }
+  }
+
+  return 0;
+}
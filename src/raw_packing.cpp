@@ -0,0 +1,376 @@
+#include "raw_packing.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2 1
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+namespace {
+
+constexpr unsigned int kBandRows = 32;
+
+using UnpackRow = void (*)(const uint8_t *src, uint16_t *dst,
+                           unsigned int width);
+using PackRow = void (*)(const uint16_t *src, uint8_t *dst,
+                         unsigned int width);
+
+/* -----------------------------------------------------------------------------
+ * Scalar rows, also the tails of the vector rows
+ */
+
+void unpackRaw10Scalar(const uint8_t *src, uint16_t *dst,
+                       unsigned int width) {
+  for (unsigned int x = 0; x + 4 <= width; x += 4, src += 5, dst += 4) {
+    for (unsigned int i = 0; i < 4; ++i)
+      dst[i] = (src[i] << 2) | ((src[4] >> (2 * i)) & 3);
+  }
+}
+
+void unpackRaw12Scalar(const uint8_t *src, uint16_t *dst,
+                       unsigned int width) {
+  for (unsigned int x = 0; x + 2 <= width; x += 2, src += 3, dst += 2) {
+    dst[0] = (src[0] << 4) | (src[2] & 0xf);
+    dst[1] = (src[1] << 4) | (src[2] >> 4);
+  }
+}
+
+void packRaw10Scalar(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  for (unsigned int x = 0; x + 4 <= width; x += 4, src += 4, dst += 5) {
+    dst[4] = 0;
+    for (unsigned int i = 0; i < 4; ++i) {
+      unsigned int sample = std::min<unsigned int>(src[i], 1023);
+      dst[i] = sample >> 2;
+      dst[4] |= (sample & 3) << (2 * i);
+    }
+  }
+}
+
+void packRaw12Scalar(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  for (unsigned int x = 0; x + 2 <= width; x += 2, src += 2, dst += 3) {
+    unsigned int even = std::min<unsigned int>(src[0], 4095);
+    unsigned int odd = std::min<unsigned int>(src[1], 4095);
+    dst[0] = even >> 4;
+    dst[1] = odd >> 4;
+    dst[2] = (even & 0xf) | ((odd & 0xf) << 4);
+  }
+}
+
+/* -----------------------------------------------------------------------------
+ * AVX2 rows
+ *
+ * Every 128 bit lane converts 8 samples, 10 or 12 packed bytes, loaded or
+ * stored 16 bytes at a time: the loops stop early enough for the extra
+ * bytes to stay within the row. A byte shuffle builds one 16 bit word of
+ * upper bits << 8 | lower bits byte per sample. Multiplies move every
+ * sample's lower bits to the same position, where they can be masked
+ * without a per-lane shift.
+ */
+
+#ifdef HAVE_AVX2
+__attribute__((target("avx2")))
+void unpackRaw10Avx2(const uint8_t *src, uint16_t *dst, unsigned int width) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      4, 0, 4, 1, 4, 2, 4, 3, 9, 5, 9, 6, 9, 7, 9, 8));
+  const __m256i scale = _mm256_set1_epi64x(0x0001000400100040);
+  const __m256i upper = _mm256_set1_epi16(0x3fc);
+  const __m256i lower = _mm256_set1_epi16(3);
+
+  unsigned int x = 0;
+  for (; x + 24 <= width; x += 16, src += 20) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 10)), 1);
+    __m256i words = _mm256_shuffle_epi8(in, shuffle);
+
+    __m256i msb = _mm256_and_si256(_mm256_srli_epi16(words, 6), upper);
+    __m256i lsb = _mm256_and_si256(
+        _mm256_srli_epi16(_mm256_mullo_epi16(words, scale), 6), lower);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x),
+                        _mm256_or_si256(msb, lsb));
+  }
+
+  unpackRaw10Scalar(src, dst + x, width - x);
+}
+
+__attribute__((target("avx2")))
+void unpackRaw12Avx2(const uint8_t *src, uint16_t *dst, unsigned int width) {
+  const __m256i shuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      2, 0, 2, 1, 5, 3, 5, 4, 8, 6, 8, 7, 11, 9, 11, 10));
+  const __m256i scale = _mm256_set1_epi32(0x00010010);
+  const __m256i upper = _mm256_set1_epi16(0xff0);
+  const __m256i lower = _mm256_set1_epi16(0xf);
+
+  unsigned int x = 0;
+  for (; x + 20 <= width; x += 16, src += 24) {
+    __m256i in = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(src))),
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 12)), 1);
+    __m256i words = _mm256_shuffle_epi8(in, shuffle);
+
+    __m256i msb = _mm256_and_si256(_mm256_srli_epi16(words, 4), upper);
+    __m256i lsb = _mm256_and_si256(
+        _mm256_srli_epi16(_mm256_mullo_epi16(words, scale), 4), lower);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x),
+                        _mm256_or_si256(msb, lsb));
+  }
+
+  unpackRaw12Scalar(src, dst + x, width - x);
+}
+
+// The lower bits of a group are summed into its first 32 bit word, by a
+// multiply-add of the bit pairs then an add of the odd word, and shuffled
+// in after the upper bytes.
+__attribute__((target("avx2")))
+void packRaw10Avx2(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  const __m256i upperShuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      0, 2, 4, 6, -1, 8, 10, 12, 14, -1, -1, -1, -1, -1, -1, -1));
+  const __m256i lowerShuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      -1, -1, -1, -1, 0, -1, -1, -1, -1, 8, -1, -1, -1, -1, -1, -1));
+  const __m256i scale = _mm256_set1_epi64x(0x0040001000040001);
+  const __m256i maximum = _mm256_set1_epi16(1023);
+  const __m256i lower = _mm256_set1_epi16(3);
+
+  unsigned int x = 0;
+  for (; x + 24 <= width; x += 16, dst += 20) {
+    __m256i samples = _mm256_min_epu16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x)),
+        maximum);
+
+    __m256i msb = _mm256_srli_epi16(samples, 2);
+    __m256i lsb =
+        _mm256_madd_epi16(_mm256_and_si256(samples, lower), scale);
+    lsb = _mm256_add_epi32(lsb, _mm256_srli_epi64(lsb, 32));
+
+    __m256i out = _mm256_or_si256(_mm256_shuffle_epi8(msb, upperShuffle),
+                                  _mm256_shuffle_epi8(lsb, lowerShuffle));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm256_castsi256_si128(out));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 10),
+                     _mm256_extracti128_si256(out, 1));
+  }
+
+  packRaw10Scalar(src + x, dst, width - x);
+}
+
+__attribute__((target("avx2")))
+void packRaw12Avx2(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  const __m256i upperShuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      0, 2, -1, 4, 6, -1, 8, 10, -1, 12, 14, -1, -1, -1, -1, -1));
+  const __m256i lowerShuffle = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+      -1, -1, 0, -1, -1, 4, -1, -1, 8, -1, -1, 12, -1, -1, -1, -1));
+  const __m256i scale = _mm256_set1_epi32(0x00100001);
+  const __m256i maximum = _mm256_set1_epi16(4095);
+  const __m256i lower = _mm256_set1_epi16(0xf);
+
+  unsigned int x = 0;
+  for (; x + 20 <= width; x += 16, dst += 24) {
+    __m256i samples = _mm256_min_epu16(
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + x)),
+        maximum);
+
+    __m256i msb = _mm256_srli_epi16(samples, 4);
+    __m256i lsb =
+        _mm256_madd_epi16(_mm256_and_si256(samples, lower), scale);
+
+    __m256i out = _mm256_or_si256(_mm256_shuffle_epi8(msb, upperShuffle),
+                                  _mm256_shuffle_epi8(lsb, lowerShuffle));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst),
+                     _mm256_castsi256_si128(out));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 12),
+                     _mm256_extracti128_si256(out, 1));
+  }
+
+  packRaw12Scalar(src + x, dst, width - x);
+}
+
+bool haveAvx2() {
+  static const bool supported = __builtin_cpu_supports("avx2");
+  return supported;
+}
+#endif
+
+/* -----------------------------------------------------------------------------
+ * NEON rows
+ *
+ * RAW12 maps onto the three way interleaved loads and stores. RAW10 uses
+ * a table lookup for the 5 byte groups, and per-lane shifts for the lower
+ * bits.
+ */
+
+#if defined(__aarch64__)
+void unpackRaw10Neon(const uint8_t *src, uint16_t *dst, unsigned int width) {
+  static const uint8_t shuffle[16] = { 4, 0, 4, 1, 4, 2, 4, 3,
+                                       9, 5, 9, 6, 9, 7, 9, 8 };
+  static const int16_t shifts[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+  const uint8x16_t table = vld1q_u8(shuffle);
+  const int16x8_t shift = vld1q_s16(shifts);
+
+  unsigned int x = 0;
+  for (; x + 16 <= width; x += 8, src += 10) {
+    uint16x8_t words =
+        vreinterpretq_u16_u8(vqtbl1q_u8(vld1q_u8(src), table));
+    uint16x8_t msb = vandq_u16(vshrq_n_u16(words, 6), vdupq_n_u16(0x3fc));
+    uint16x8_t lsb = vandq_u16(vshlq_u16(words, shift), vdupq_n_u16(3));
+    vst1q_u16(dst + x, vorrq_u16(msb, lsb));
+  }
+
+  unpackRaw10Scalar(src, dst + x, width - x);
+}
+
+void unpackRaw12Neon(const uint8_t *src, uint16_t *dst, unsigned int width) {
+  unsigned int x = 0;
+  for (; x + 16 <= width; x += 16, src += 24) {
+    uint8x8x3_t in = vld3_u8(src);
+    uint16x8x2_t out;
+    out.val[0] = vorrq_u16(vshll_n_u8(in.val[0], 4),
+                           vmovl_u8(vand_u8(in.val[2], vdup_n_u8(0xf))));
+    out.val[1] = vorrq_u16(vshll_n_u8(in.val[1], 4),
+                           vmovl_u8(vshr_n_u8(in.val[2], 4)));
+    vst2q_u16(dst + x, out);
+  }
+
+  unpackRaw12Scalar(src, dst + x, width - x);
+}
+
+void packRaw10Neon(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  static const uint8_t shuffle[16] = { 0, 1, 2, 3, 8, 4, 5, 6,
+                                       7, 9, 0, 0, 0, 0, 0, 0 };
+  static const int16_t shifts[8] = { 0, 2, 4, 6, 0, 2, 4, 6 };
+  const uint8x16_t table = vld1q_u8(shuffle);
+  const int16x8_t shift = vld1q_s16(shifts);
+
+  unsigned int x = 0;
+  for (; x + 16 <= width; x += 8, dst += 10) {
+    uint16x8_t samples = vminq_u16(vld1q_u16(src + x), vdupq_n_u16(1023));
+
+    // Pairwise adds sum the shifted bit pairs of each group of four.
+    uint16x8_t lsb = vshlq_u16(vandq_u16(samples, vdupq_n_u16(3)), shift);
+    lsb = vpaddq_u16(lsb, lsb);
+    lsb = vpaddq_u16(lsb, lsb);
+
+    uint8x16_t bytes = vcombine_u8(vshrn_n_u16(samples, 2), vmovn_u16(lsb));
+    vst1q_u8(dst, vqtbl1q_u8(bytes, table));
+  }
+
+  packRaw10Scalar(src + x, dst, width - x);
+}
+
+void packRaw12Neon(const uint16_t *src, uint8_t *dst, unsigned int width) {
+  const uint16x8_t maximum = vdupq_n_u16(4095);
+  const uint16x8_t lower = vdupq_n_u16(0xf);
+
+  unsigned int x = 0;
+  for (; x + 16 <= width; x += 16, dst += 24) {
+    uint16x8x2_t in = vld2q_u16(src + x);
+    uint16x8_t even = vminq_u16(in.val[0], maximum);
+    uint16x8_t odd = vminq_u16(in.val[1], maximum);
+
+    uint8x8x3_t out;
+    out.val[0] = vshrn_n_u16(even, 4);
+    out.val[1] = vshrn_n_u16(odd, 4);
+    out.val[2] = vmovn_u16(vorrq_u16(vandq_u16(even, lower),
+                                     vshlq_n_u16(vandq_u16(odd, lower), 4)));
+    vst3_u8(dst, out);
+  }
+
+  packRaw12Scalar(src + x, dst, width - x);
+}
+#endif
+
+struct Kernels {
+  UnpackRow unpack10;
+  UnpackRow unpack12;
+  PackRow pack10;
+  PackRow pack12;
+  const char *name;
+};
+
+const Kernels &kernels() {
+  static const Kernels selected = []() -> Kernels {
+#ifdef HAVE_AVX2
+    if (haveAvx2())
+      return { unpackRaw10Avx2, unpackRaw12Avx2, packRaw10Avx2,
+               packRaw12Avx2, "avx2" };
+#elif defined(__aarch64__)
+    return { unpackRaw10Neon, unpackRaw12Neon, packRaw10Neon, packRaw12Neon,
+             "neon" };
+#endif
+    return { unpackRaw10Scalar, unpackRaw12Scalar, packRaw10Scalar,
+             packRaw12Scalar, "scalar" };
+  }();
+
+  return selected;
+}
+
+bool matchingViews(const FrameView &raw, const FrameView &packed) {
+  return raw.format == FrameFormat::RAW16 &&
+         (packed.format == FrameFormat::RAW10P ||
+          packed.format == FrameFormat::RAW12P) &&
+         raw.width == packed.width && raw.height == packed.height;
+}
+
+} /* namespace */
+
+FrameFormat packedRawFormat(unsigned int bitDepth) {
+  switch (bitDepth) {
+  case 10:
+    return FrameFormat::RAW10P;
+  case 12:
+    return FrameFormat::RAW12P;
+  default:
+    return FrameFormat::Unknown;
+  }
+}
+
+int unpackRaw(const FrameView &src, const FrameView &dst) {
+  if (!matchingViews(dst, src))
+    return -EINVAL;
+
+  UnpackRow unpack = src.format == FrameFormat::RAW10P ? kernels().unpack10
+                                                       : kernels().unpack12;
+  const PlaneView &from = src.planes[0];
+  const PlaneView &to = dst.planes[0];
+  unsigned int bands = (src.height + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int last = std::min((band + 1) * kBandRows, src.height);
+    for (unsigned int y = band * kBandRows; y < last; ++y)
+      unpack(from.row(y), reinterpret_cast<uint16_t *>(to.row(y)),
+             src.width);
+  });
+
+  return 0;
+}
+
+int packRaw(const FrameView &src, const FrameView &dst) {
+  if (!matchingViews(src, dst))
+    return -EINVAL;
+
+  PackRow pack = dst.format == FrameFormat::RAW10P ? kernels().pack10
+                                                   : kernels().pack12;
+  const PlaneView &from = src.planes[0];
+  const PlaneView &to = dst.planes[0];
+  unsigned int bands = (src.height + kBandRows - 1) / kBandRows;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    unsigned int last = std::min((band + 1) * kBandRows, src.height);
+    for (unsigned int y = band * kBandRows; y < last; ++y)
+      pack(reinterpret_cast<const uint16_t *>(from.row(y)), to.row(y),
+           src.width);
+  });
+
+  return 0;
+}
+
+const char *rawPackingImplementation() {
+  return kernels().name;
+}
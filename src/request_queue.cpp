@@ -0,0 +1,143 @@
+#include "request_queue.h"
+
+using namespace libcamera;
+
+RequestQueue::RequestQueue(std::shared_ptr<Camera> camera, DepthPolicy policy,
+                           unsigned int minDepth, unsigned int spares)
+    : camera_(std::move(camera)), controller_(policy, minDepth, minDepth),
+      policy_(policy), minDepth_(minDepth), spares_(spares) {
+}
+
+void RequestQueue::add(const std::vector<std::unique_ptr<Request>> &requests) {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  for (const std::unique_ptr<Request> &request : requests)
+    idle_.push_back(request.get());
+
+  // The controller may use every request we own but the spares.
+  unsigned int count = idle_.size() + inFlight_;
+  unsigned int maxDepth = count > spares_ ? count - spares_ : 1;
+  controller_ = DepthController(policy_, minDepth_, maxDepth);
+}
+
+void RequestQueue::start() {
+  std::unique_lock<std::mutex> locker(lock_);
+  fill();
+}
+
+void RequestQueue::setPrepare(std::function<void(Request *)> prepare) {
+  std::unique_lock<std::mutex> locker(lock_);
+  prepare_ = std::move(prepare);
+}
+
+void RequestQueue::completed(Request *request) {
+  std::unique_lock<std::mutex> locker(lock_);
+
+  inFlight_--;
+  completedAt_[request] = Clock::now();
+
+  if (request->status() == Request::RequestCancelled || stopped_)
+    return;
+
+  // All buffers of a request share the same sequence number.
+  const Request::BufferMap &buffers = request->buffers();
+  if (!buffers.empty()) {
+    const FrameMetadata &metadata = buffers.begin()->second->metadata();
+    controller_.frameCompleted(metadata.sequence, metadata.timestamp);
+  }
+
+  // Top the camera up from the idle and spare requests right away, rather
+  // than waiting for a consumer to release a frame.
+  fill();
+
+  // Nothing left queued and nothing to queue: consumers hold every buffer.
+  if (!inFlight_)
+    starved_++;
+}
+
+void RequestQueue::requeue(Request *request) {
+  request->reuse(Request::ReuseBuffers);
+
+  std::unique_lock<std::mutex> locker(lock_);
+
+  auto it = completedAt_.find(request);
+  if (it != completedAt_.end())
+    controller_.requestRequeued(Clock::now() - it->second);
+
+  idle_.push_back(request);
+  if (!stopped_)
+    fill();
+}
+
+FrameHandle RequestQueue::acquire(Request *request,
+                                  const StreamConfiguration &config,
+                                  int prot) {
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    held_++;
+  }
+
+  return FrameHandle(new Frame(request, config, prot, pool_),
+                     [this](const Frame *frame) {
+    Request *released = frame->request();
+
+    // Unmap and end CPU access before the device may write again.
+    delete frame;
+    release(released);
+  });
+}
+
+void RequestQueue::release(Request *request) {
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    held_--;
+  }
+
+  requeue(request);
+}
+
+void RequestQueue::stop() {
+  std::unique_lock<std::mutex> locker(lock_);
+  stopped_ = true;
+}
+
+// Queue idle requests until the target depth is reached.
+void RequestQueue::fill() {
+  while (!idle_.empty() && inFlight_ < controller_.depth()) {
+    Request *request = idle_.back();
+    idle_.pop_back();
+
+    if (prepare_)
+      prepare_(request);
+    if (camera_->queueRequest(request) < 0) {
+      idle_.push_back(request);
+      break;
+    }
+    inFlight_++;
+  }
+}
+
+unsigned int RequestQueue::depth() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return controller_.depth();
+}
+
+unsigned int RequestQueue::inFlight() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return inFlight_;
+}
+
+unsigned int RequestQueue::drops() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return controller_.drops();
+}
+
+unsigned int RequestQueue::held() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return held_;
+}
+
+unsigned int RequestQueue::starved() const {
+  std::unique_lock<std::mutex> locker(lock_);
+  return starved_;
+}
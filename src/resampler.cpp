@@ -0,0 +1,509 @@
+#include "resampler.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+bool parseResampleFilter(const std::string &name, ResampleFilter &filter) {
+  if (name == "box")
+    filter = ResampleFilter::Box;
+  else if (name == "bilinear")
+    filter = ResampleFilter::Bilinear;
+  else if (name == "lanczos")
+    filter = ResampleFilter::Lanczos;
+  else
+    return false;
+
+  return true;
+}
+
+const char *resampleFilterName(ResampleFilter filter) {
+  switch (filter) {
+  case ResampleFilter::Box:
+    return "box";
+  case ResampleFilter::Bilinear:
+    return "bilinear";
+  case ResampleFilter::Lanczos:
+    return "lanczos";
+  }
+
+  return "unknown";
+}
+
+bool parseResampleSizes(const std::string &arg,
+                        std::vector<ResampleSize> &sizes) {
+  std::vector<ResampleSize> result;
+  size_t pos = 0;
+
+  while (pos <= arg.size()) {
+    size_t end = arg.find(',', pos);
+    if (end == std::string::npos)
+      end = arg.size();
+
+    ResampleSize size;
+    char trailing;
+    if (sscanf(arg.substr(pos, end - pos).c_str(), "%ux%u%c", &size.width,
+               &size.height, &trailing) != 2 ||
+        !size.width || !size.height)
+      return false;
+
+    result.push_back(size);
+    pos = end + 1;
+  }
+
+  sizes = result;
+  return true;
+}
+
+namespace {
+
+constexpr int kWeightBits = 14;
+constexpr int32_t kRound = 1 << (kWeightBits - 1);
+
+// Source rows per band, in luma rows.
+constexpr unsigned int kBandRows = 32;
+
+double filterSupport(ResampleFilter filter) {
+  switch (filter) {
+  case ResampleFilter::Box:
+    return 0.5;
+  case ResampleFilter::Bilinear:
+    return 1.0;
+  case ResampleFilter::Lanczos:
+  default:
+    return 3.0;
+  }
+}
+
+double sinc(double x) {
+  if (x == 0.0)
+    return 1.0;
+  x *= M_PI;
+  return std::sin(x) / x;
+}
+
+double filterWeight(ResampleFilter filter, double x) {
+  switch (filter) {
+  case ResampleFilter::Box:
+    return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+  case ResampleFilter::Bilinear:
+    x = std::fabs(x);
+    return x < 1.0 ? 1.0 - x : 0.0;
+  case ResampleFilter::Lanczos:
+  default:
+    return std::fabs(x) < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+  }
+}
+
+uint8_t clampPixel(int32_t sum) {
+  sum >>= kWeightBits;
+  return sum < 0 ? 0 : sum > 255 ? 255 : sum;
+}
+
+/* -------------------------------------------------------------------------
+ * Vertical pass, over the raw bytes of a row
+ */
+
+void filterColumns(const uint8_t *const *rows, const int16_t *weights,
+                   unsigned int taps, size_t size, uint8_t *out) {
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  // Two source rows at a time: interleaved 16 bit samples of both rows
+  // against a pair of weights make one pmaddwd per four outputs.
+  for (; i + 16 <= size; i += 16) {
+    __m128i acc[4];
+    for (__m128i &a : acc)
+      a = _mm_set1_epi32(kRound);
+
+    for (unsigned int k = 0; k < taps; k += 2) {
+      bool pair = k + 1 < taps;
+      __m128i a =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(rows[k] + i));
+      __m128i b =
+          pair ? _mm_loadu_si128(
+                     reinterpret_cast<const __m128i *>(rows[k + 1] + i))
+               : zero;
+      uint32_t w = uint16_t(weights[k]) |
+                   (pair ? uint32_t(uint16_t(weights[k + 1])) << 16 : 0);
+      __m128i wv = _mm_set1_epi32(w);
+
+      __m128i alo = _mm_unpacklo_epi8(a, zero);
+      __m128i ahi = _mm_unpackhi_epi8(a, zero);
+      __m128i blo = _mm_unpacklo_epi8(b, zero);
+      __m128i bhi = _mm_unpackhi_epi8(b, zero);
+      acc[0] = _mm_add_epi32(acc[0],
+                             _mm_madd_epi16(_mm_unpacklo_epi16(alo, blo), wv));
+      acc[1] = _mm_add_epi32(acc[1],
+                             _mm_madd_epi16(_mm_unpackhi_epi16(alo, blo), wv));
+      acc[2] = _mm_add_epi32(acc[2],
+                             _mm_madd_epi16(_mm_unpacklo_epi16(ahi, bhi), wv));
+      acc[3] = _mm_add_epi32(acc[3],
+                             _mm_madd_epi16(_mm_unpackhi_epi16(ahi, bhi), wv));
+    }
+
+    for (__m128i &a : acc)
+      a = _mm_srai_epi32(a, kWeightBits);
+    __m128i lo = _mm_packs_epi32(acc[0], acc[1]);
+    __m128i hi = _mm_packs_epi32(acc[2], acc[3]);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                     _mm_packus_epi16(lo, hi));
+  }
+#elif defined(__aarch64__)
+  for (; i + 8 <= size; i += 8) {
+    int32x4_t lo = vdupq_n_s32(kRound), hi = vdupq_n_s32(kRound);
+
+    for (unsigned int k = 0; k < taps; ++k) {
+      int16x8_t v = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[k] + i)));
+      lo = vmlal_n_s16(lo, vget_low_s16(v), weights[k]);
+      hi = vmlal_n_s16(hi, vget_high_s16(v), weights[k]);
+    }
+
+    int16x8_t sum = vcombine_s16(vshrn_n_s32(lo, kWeightBits),
+                                 vshrn_n_s32(hi, kWeightBits));
+    vst1_u8(out + i, vqmovun_s16(sum));
+  }
+#endif
+
+  for (; i < size; ++i) {
+    int32_t sum = kRound;
+    for (unsigned int k = 0; k < taps; ++k)
+      sum += weights[k] * rows[k][i];
+    out[i] = clampPixel(sum);
+  }
+}
+
+/* -------------------------------------------------------------------------
+ * Horizontal pass, per pixel of C interleaved components
+ */
+
+typedef void (*RowFilter)(const uint8_t *src, uint8_t *dst,
+                          const Resampler::Axis &axis);
+
+template<unsigned int C>
+void filterRow(const uint8_t *src, uint8_t *dst, const Resampler::Axis &axis) {
+  unsigned int taps = axis.taps;
+  const int16_t *weights = axis.weights.data();
+
+  for (size_t x = 0; x < axis.start.size(); ++x, weights += taps) {
+    const uint8_t *p = src + size_t(axis.start[x]) * C;
+    int32_t sum[C];
+    for (unsigned int c = 0; c < C; ++c)
+      sum[c] = kRound;
+
+    for (unsigned int k = 0; k < taps; ++k, p += C) {
+      for (unsigned int c = 0; c < C; ++c)
+        sum[c] += weights[k] * p[c];
+    }
+
+    for (unsigned int c = 0; c < C; ++c)
+      dst[x * C + c] = clampPixel(sum[c]);
+  }
+}
+
+#if defined(__SSE2__)
+// Eight taps per pmaddwd.
+template<>
+void filterRow<1>(const uint8_t *src, uint8_t *dst,
+                  const Resampler::Axis &axis) {
+  unsigned int taps = axis.taps;
+  const int16_t *weights = axis.weights.data();
+  const __m128i zero = _mm_setzero_si128();
+
+  for (size_t x = 0; x < axis.start.size(); ++x, weights += taps) {
+    const uint8_t *p = src + axis.start[x];
+    __m128i acc = zero;
+    unsigned int k = 0;
+
+    for (; k + 8 <= taps; k += 8) {
+      __m128i v = _mm_unpacklo_epi8(
+          _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k)), zero);
+      __m128i w =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(weights + k));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(v, w));
+    }
+
+    acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 8));
+    acc = _mm_add_epi32(acc, _mm_srli_si128(acc, 4));
+    int32_t sum = _mm_cvtsi128_si32(acc) + kRound;
+
+    for (; k < taps; ++k)
+      sum += weights[k] * p[k];
+
+    dst[x] = clampPixel(sum);
+  }
+}
+
+// Two taps of four components per pmaddwd.
+template<>
+void filterRow<4>(const uint8_t *src, uint8_t *dst,
+                  const Resampler::Axis &axis) {
+  unsigned int taps = axis.taps;
+  const int16_t *weights = axis.weights.data();
+  const __m128i zero = _mm_setzero_si128();
+
+  for (size_t x = 0; x < axis.start.size(); ++x, weights += taps) {
+    const uint8_t *p = src + size_t(axis.start[x]) * 4;
+    __m128i acc = _mm_set1_epi32(kRound);
+
+    for (unsigned int k = 0; k < taps; k += 2) {
+      __m128i v;
+      uint32_t w = uint16_t(weights[k]);
+      if (k + 1 < taps) {
+        v = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p + k * 4));
+        w |= uint32_t(uint16_t(weights[k + 1])) << 16;
+      } else {
+        uint32_t pixel;
+        memcpy(&pixel, p + k * 4, sizeof(pixel));
+        v = _mm_cvtsi32_si128(pixel);
+      }
+
+      // c0 c1 c2 c3 d0 d1 d2 d3 -> c0 d0 c1 d1 c2 d2 c3 d3
+      v = _mm_unpacklo_epi8(v, zero);
+      v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(v, _mm_set1_epi32(w)));
+    }
+
+    acc = _mm_srai_epi32(acc, kWeightBits);
+    acc = _mm_packs_epi32(acc, acc);
+    uint32_t pixel = _mm_cvtsi128_si32(_mm_packus_epi16(acc, acc));
+    memcpy(dst + x * 4, &pixel, sizeof(pixel));
+  }
+}
+#endif
+
+RowFilter rowFilter(unsigned int components) {
+  switch (components) {
+  case 1:
+    return filterRow<1>;
+  case 2:
+    return filterRow<2>;
+  case 3:
+    return filterRow<3>;
+  case 4:
+    return filterRow<4>;
+  default:
+    return nullptr;
+  }
+}
+
+bool isPackedYuv(FrameFormat format) {
+  return format == FrameFormat::YUYV || format == FrameFormat::UYVY;
+}
+
+} /* namespace */
+
+Resampler::Resampler(ResampleFilter filter) : filter_(filter) {}
+
+// Each output sample is centred on its footprint in the source. When
+// downscaling, the filter is stretched to cover the footprint. Taps past
+// the edges are folded onto the edge samples, then every output gets the
+// same number of taps so the inner loops have a fixed length.
+const Resampler::Axis &Resampler::axis(unsigned int srcSize,
+                                       unsigned int dstSize) {
+  auto it = axes_.find({ srcSize, dstSize });
+  if (it != axes_.end())
+    return it->second;
+
+  double scale = static_cast<double>(srcSize) / dstSize;
+  double stretch = std::max(scale, 1.0);
+  double support = filterSupport(filter_) * stretch;
+
+  std::vector<std::vector<double>> windows(dstSize);
+  std::vector<unsigned int> first(dstSize);
+  unsigned int taps = 1;
+
+  for (unsigned int i = 0; i < dstSize; ++i) {
+    double center = (i + 0.5) * scale;
+    int lo = static_cast<int>(std::floor(center - support));
+    int hi = static_cast<int>(std::ceil(center + support));
+    int clampedLo = std::max(lo, 0);
+    int clampedHi = std::min(hi, static_cast<int>(srcSize) - 1);
+
+    std::vector<double> &window = windows[i];
+    window.assign(std::max(clampedHi - clampedLo + 1, 1), 0.0);
+    for (int j = lo; j <= hi; ++j) {
+      int index = std::min(std::max(j, clampedLo), clampedHi) - clampedLo;
+      window[index] += filterWeight(filter_, (j + 0.5 - center) / stretch);
+    }
+
+    // Trim zero weights at both ends.
+    unsigned int begin = 0, end = window.size();
+    while (end - begin > 1 && window[begin] == 0.0)
+      ++begin;
+    while (end - begin > 1 && window[end - 1] == 0.0)
+      --end;
+    window = std::vector<double>(window.begin() + begin, window.begin() + end);
+
+    first[i] = clampedLo + begin;
+    taps = std::max<unsigned int>(taps, window.size());
+  }
+
+  Axis &axis = axes_[{ srcSize, dstSize }];
+  axis.taps = std::min(taps, srcSize);
+  axis.start.resize(dstSize);
+  axis.weights.assign(size_t(dstSize) * axis.taps, 0);
+
+  for (unsigned int i = 0; i < dstSize; ++i) {
+    const std::vector<double> &window = windows[i];
+    unsigned int start = std::min(first[i], srcSize - axis.taps);
+    unsigned int offset = first[i] - start;
+    int16_t *weights = &axis.weights[size_t(i) * axis.taps];
+
+    double total = 0.0;
+    for (double w : window)
+      total += w;
+
+    // Round to fixed point and put the rounding error on the largest tap
+    // so every output has unit gain.
+    int sum = 0;
+    unsigned int largest = offset;
+    for (size_t k = 0; k < window.size(); ++k) {
+      double weight = window[k] / total * (1 << kWeightBits);
+      weights[offset + k] = static_cast<int16_t>(std::lround(weight));
+      sum += weights[offset + k];
+      if (weights[offset + k] > weights[largest])
+        largest = offset + k;
+    }
+    weights[largest] += (1 << kWeightBits) - sum;
+
+    axis.start[i] = start;
+  }
+
+  return axis;
+}
+
+int Resampler::resample(const FrameView &src, const FrameView *outputs,
+                        size_t count) {
+  const FormatInfo &info = formatInfo(src.format);
+  if (!src.isValid())
+    return -EINVAL;
+
+  for (size_t i = 0; i < count; ++i) {
+    const FrameView &out = outputs[i];
+    if (out.format != src.format || !out.width || !out.height)
+      return -EINVAL;
+  }
+
+  // Resolve the coefficients of every plane of every output first: the
+  // cache is not touched from the pool.
+  struct PlaneJob {
+    const PlaneView *src;
+    const PlaneView *dst;
+    const Axis *vertical;
+    const Axis *horizontal;
+    const Axis *chroma; // packed YUV only
+    RowFilter filter;
+    std::vector<unsigned int> bandStart; // first output row of each band
+  };
+
+  bool packed = isPackedYuv(src.format);
+  unsigned int bands = (src.height + kBandRows - 1) / kBandRows;
+  std::vector<PlaneJob> jobs;
+
+  for (size_t i = 0; i < count; ++i) {
+    for (unsigned int p = 0; p < info.numPlanes; ++p) {
+      PlaneJob job;
+      job.src = &src.planes[p];
+      job.dst = &outputs[i].planes[p];
+      if (!job.src->width || !job.src->height || !job.dst->width ||
+          !job.dst->height)
+        return -EINVAL;
+
+      job.vertical = &axis(job.src->height, job.dst->height);
+      job.chroma = nullptr;
+
+      if (packed) {
+        // Plane widths count Y0 U Y1 V groups.
+        job.horizontal = &axis(job.src->width * 2, job.dst->width * 2);
+        job.chroma = &axis(job.src->width, job.dst->width);
+        job.filter = nullptr;
+      } else {
+        job.horizontal = &axis(job.src->width, job.dst->width);
+        job.filter = rowFilter(job.src->bytesPerPixel);
+        if (!job.filter)
+          return -EINVAL;
+      }
+
+      // Output rows go to the band holding the centre of their taps.
+      const Axis &v = *job.vertical;
+      job.bandStart.assign(bands + 1, job.dst->height);
+      for (unsigned int y = job.dst->height; y-- > 0;) {
+        unsigned int centre = (v.start[y] + v.taps / 2) * info.vSub[p];
+        unsigned int band = std::min(centre / kBandRows, bands - 1);
+        for (unsigned int b = 0; b <= band; ++b)
+          job.bandStart[b] = std::min(job.bandStart[b], y);
+      }
+      job.bandStart[0] = 0;
+
+      jobs.push_back(std::move(job));
+    }
+  }
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    thread_local std::vector<uint8_t> column, luma, chroma, lumaOut, chromaOut;
+    thread_local std::vector<const uint8_t *> rows;
+
+    for (const PlaneJob &job : jobs) {
+      const Axis &v = *job.vertical;
+      size_t rowBytes = job.src->rowBytes();
+      column.resize(rowBytes);
+      rows.resize(v.taps);
+
+      for (unsigned int y = job.bandStart[band]; y < job.bandStart[band + 1];
+           ++y) {
+        for (unsigned int k = 0; k < v.taps; ++k)
+          rows[k] = job.src->row(v.start[y] + k);
+        filterColumns(rows.data(), &v.weights[size_t(y) * v.taps], v.taps,
+                      rowBytes, column.data());
+
+        uint8_t *dst = job.dst->row(y);
+        if (job.filter) {
+          job.filter(column.data(), dst, *job.horizontal);
+          continue;
+        }
+
+        // Packed YUV: split luma and chroma pairs, filter each on its own
+        // grid, and interleave them back.
+        unsigned int offset = src.format == FrameFormat::UYVY;
+        unsigned int pairs = rowBytes / 4;
+        luma.resize(pairs * 2);
+        chroma.resize(pairs * 2);
+        for (unsigned int x = 0; x < pairs; ++x) {
+          const uint8_t *s = &column[x * 4];
+          luma[2 * x] = s[offset];
+          luma[2 * x + 1] = s[offset + 2];
+          chroma[2 * x] = s[1 - offset];
+          chroma[2 * x + 1] = s[3 - offset];
+        }
+
+        unsigned int outPairs = job.dst->width;
+        lumaOut.resize(outPairs * 2);
+        chromaOut.resize(outPairs * 2);
+        filterRow<1>(luma.data(), lumaOut.data(), *job.horizontal);
+        filterRow<2>(chroma.data(), chromaOut.data(), *job.chroma);
+        for (unsigned int x = 0; x < outPairs; ++x) {
+          uint8_t *d = dst + x * 4;
+          d[offset] = lumaOut[2 * x];
+          d[offset + 2] = lumaOut[2 * x + 1];
+          d[1 - offset] = chromaOut[2 * x];
+          d[3 - offset] = chromaOut[2 * x + 1];
+        }
+      }
+    }
+  });
+
+  return 0;
+}
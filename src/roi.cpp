@@ -0,0 +1,59 @@
+#include "roi.h"
+
+#include <algorithm>
+#include <cstdio>
+
+bool parseRoi(const std::string &arg, Roi &roi) {
+  Roi result;
+  char trailing;
+
+  if (sscanf(arg.c_str(), "%u,%u,%u,%u%c", &result.x, &result.y,
+             &result.width, &result.height, &trailing) != 4)
+    return false;
+
+  if (result.isNull())
+    return false;
+
+  roi = result;
+  return true;
+}
+
+Roi alignRoi(const Roi &roi, FrameFormat format, unsigned int width,
+             unsigned int height) {
+  const FormatInfo &info = formatInfo(format);
+  Roi result;
+
+  if (roi.x >= width || roi.y >= height)
+    return result;
+
+  unsigned int right = std::min(roi.x + roi.width, width);
+  unsigned int bottom = std::min(roi.y + roi.height, height);
+
+  // Round the origin down and the size down, keeping the ROI inside the
+  // requested area on subsampled formats.
+  result.x = roi.x / info.hAlign * info.hAlign;
+  result.y = roi.y / info.vAlign * info.vAlign;
+  result.width = (right - result.x) / info.hAlign * info.hAlign;
+  result.height = (bottom - result.y) / info.vAlign * info.vAlign;
+
+  return result;
+}
+
+FrameView cropFrameView(const FrameView &view, const Roi &roi) {
+  const FormatInfo &info = formatInfo(view.format);
+  FrameView crop = view;
+
+  crop.width = roi.width;
+  crop.height = roi.height;
+
+  for (unsigned int i = 0; i < view.numPlanes; ++i) {
+    PlaneView &plane = crop.planes[i];
+
+    plane.data += (roi.y / info.vSub[i]) * plane.stride +
+                  (roi.x / info.hSub[i]) * plane.bytesPerPixel;
+    plane.width = roi.width / info.hSub[i];
+    plane.height = roi.height / info.vSub[i];
+  }
+
+  return crop;
+}
@@ -0,0 +1,143 @@
+#include "shm_ring_writer.h"
+
+#include <cerrno>
+#include <new>
+
+#include "buffer_access.h"
+
+static constexpr size_t kPageSize = 4096;
+
+ShmRingWriter::~ShmRingWriter() {
+  close();
+}
+
+int ShmRingWriter::open(const std::string &name, unsigned int slotCount,
+                        FrameFormat format, unsigned int width,
+                        unsigned int height) {
+  const FormatInfo &info = formatInfo(format);
+
+  close();
+
+  if (!slotCount || !info.numPlanes)
+    return -EINVAL;
+
+  // Planes are stored packed, one after the other.
+  uint32_t strides[3] = {};
+  uint64_t offsets[3] = {};
+  uint64_t frameSize = 0;
+  for (unsigned int i = 0; i < info.numPlanes; ++i) {
+    strides[i] = width / info.hSub[i] * info.bytesPerPixel[i];
+    offsets[i] = frameSize;
+    frameSize += uint64_t(strides[i]) * (height / info.vSub[i]);
+  }
+
+  size_t slotSize = (frameSize + kPageSize - 1) / kPageSize * kPageSize;
+  size_t dataOffset = sizeof(ShmRingHeader) +
+                      sizeof(ShmSlotDescriptor) * slotCount;
+  dataOffset = (dataOffset + kPageSize - 1) / kPageSize * kPageSize;
+  size_t size = dataOffset + slotSize * slotCount;
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return -errno;
+
+  if (ftruncate(fd, size) < 0) {
+    int ret = -errno;
+    ::close(fd);
+    shm_unlink(name.c_str());
+    return ret;
+  }
+
+  void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (mem == MAP_FAILED) {
+    int ret = -errno;
+    shm_unlink(name.c_str());
+    return ret;
+  }
+
+  name_ = name;
+  base_ = static_cast<uint8_t *>(mem);
+  size_ = size;
+
+  header_ = new (base_) ShmRingHeader();
+  for (unsigned int i = 0; i < slotCount; ++i)
+    new (descriptor(i)) ShmSlotDescriptor();
+
+  header_->version = kShmRingVersion;
+  header_->slotCount = slotCount;
+  header_->numPlanes = info.numPlanes;
+  header_->slotSize = slotSize;
+  header_->dataOffset = dataOffset;
+  header_->format = static_cast<uint32_t>(format);
+  header_->width = width;
+  header_->height = height;
+  for (unsigned int i = 0; i < 3; ++i) {
+    header_->planeStride[i] = strides[i];
+    header_->planeOffset[i] = offsets[i];
+  }
+  header_->writeIndex.store(0, std::memory_order_relaxed);
+
+  // Readers check the magic last: publish it once the header is complete.
+  std::atomic_thread_fence(std::memory_order_release);
+  header_->magic = kShmRingMagic;
+
+  return 0;
+}
+
+void ShmRingWriter::close() {
+  if (!base_)
+    return;
+
+  munmap(base_, size_);
+  shm_unlink(name_.c_str());
+
+  base_ = nullptr;
+  header_ = nullptr;
+  size_ = 0;
+}
+
+ShmSlotDescriptor *ShmRingWriter::descriptor(uint32_t slot) {
+  return reinterpret_cast<ShmSlotDescriptor *>(base_ + sizeof(ShmRingHeader)) +
+         slot;
+}
+
+void ShmRingWriter::write(const FrameView &view, uint64_t sequence,
+                          uint64_t timestamp) {
+  if (!header_ || view.numPlanes != header_->numPlanes ||
+      view.width != header_->width || view.height != header_->height)
+    return;
+
+  uint64_t index = header_->writeIndex.load(std::memory_order_relaxed);
+  uint32_t slot = index % header_->slotCount;
+  ShmSlotDescriptor *desc = descriptor(slot);
+  uint8_t *data = base_ + header_->dataOffset + slot * header_->slotSize;
+
+  // Seqlock write side: odd while the slot is inconsistent.
+  uint64_t seq = desc->seq.load(std::memory_order_relaxed);
+  desc->seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  uint64_t bytes = 0;
+  for (unsigned int i = 0; i < view.numPlanes; ++i) {
+    const PlaneView &plane = view.planes[i];
+    uint8_t *dst = data + header_->planeOffset[i];
+    size_t rowBytes = plane.rowBytes();
+
+    if (plane.stride == rowBytes) {
+      streamCopy(dst, plane.data, rowBytes * plane.height);
+    } else {
+      for (unsigned int y = 0; y < plane.height; ++y)
+        streamCopy(dst + y * rowBytes, plane.row(y), rowBytes);
+    }
+    bytes += rowBytes * plane.height;
+  }
+
+  desc->frameIndex = index;
+  desc->sequence = sequence;
+  desc->timestamp = timestamp;
+  desc->bytesUsed = bytes;
+
+  desc->seq.store(seq + 2, std::memory_order_release);
+  header_->writeIndex.store(index + 1, std::memory_order_release);
+}
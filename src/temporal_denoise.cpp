@@ -0,0 +1,457 @@
+#include "temporal_denoise.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+#include "tile_change.h"
+
+namespace {
+
+constexpr unsigned int kWeightedFullWeight = 4;
+
+size_t alignArena(size_t size) {
+  return (size + 63) & ~size_t(63);
+}
+
+// Bytes of a frame with packed planes, as allocateFrameView() lays it out.
+size_t frameBytes(FrameFormat format, unsigned int height, size_t stride) {
+  const FormatInfo &info = formatInfo(format);
+  size_t size = 0;
+  for (unsigned int i = 0; i < info.numPlanes; ++i)
+    size += planeStride(format, i, stride) * (height / info.vSub[i]);
+  return size;
+}
+
+// Sum of absolute differences of 16 bit samples, of at most a tile row.
+uint64_t sumAbsDiff16(const uint16_t *a, const uint16_t *b, size_t size) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (; i + 8 <= size; i += 8) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    __m128i diff = _mm_or_si128(_mm_subs_epu16(va, vb),
+                                _mm_subs_epu16(vb, va));
+    acc = _mm_add_epi32(acc, _mm_add_epi32(_mm_unpacklo_epi16(diff, zero),
+                                           _mm_unpackhi_epi16(diff, zero)));
+  }
+  alignas(16) uint32_t lanes[4];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  sum = uint64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__aarch64__)
+  uint32x4_t acc = vdupq_n_u32(0);
+  for (; i + 8 <= size; i += 8)
+    acc = vpadalq_u16(acc, vabdq_u16(vld1q_u16(a + i), vld1q_u16(b + i)));
+  sum = vaddvq_u32(acc);
+#endif
+
+  for (; i < size; ++i)
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  return sum;
+}
+
+/* -----------------------------------------------------------------------------
+ * Accumulation: acc += src * weight
+ */
+
+void accumulate(const uint8_t *src, uint16_t *acc, unsigned int count,
+                unsigned int weight) {
+  unsigned int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w = _mm_set1_epi16(weight);
+
+  for (; x + 16 <= count; x += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+    __m128i *a = reinterpret_cast<__m128i *>(acc + x);
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w);
+    _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), lo));
+    _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), hi));
+  }
+#elif defined(__aarch64__)
+  const uint8x8_t w = vdup_n_u8(weight);
+
+  for (; x + 16 <= count; x += 16) {
+    uint8x16_t s = vld1q_u8(src + x);
+    vst1q_u16(acc + x, vmlal_u8(vld1q_u16(acc + x), vget_low_u8(s), w));
+    vst1q_u16(acc + x + 8,
+              vmlal_u8(vld1q_u16(acc + x + 8), vget_high_u8(s), w));
+  }
+#endif
+
+  for (; x < count; ++x)
+    acc[x] += src[x] * weight;
+}
+
+void accumulate(const uint8_t *src, uint32_t *acc, unsigned int count,
+                unsigned int weight) {
+  unsigned int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i w = _mm_set1_epi16(weight);
+
+  for (; x + 16 <= count; x += 16) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+    __m128i *a = reinterpret_cast<__m128i *>(acc + x);
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), w);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), w);
+    const __m128i products[4] = {
+      _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero),
+      _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero),
+    };
+    for (unsigned int i = 0; i < 4; ++i)
+      _mm_storeu_si128(a + i,
+                       _mm_add_epi32(_mm_loadu_si128(a + i), products[i]));
+  }
+#elif defined(__aarch64__)
+  const uint8x8_t w = vdup_n_u8(weight);
+
+  for (; x + 16 <= count; x += 16) {
+    uint8x16_t s = vld1q_u8(src + x);
+    uint16x8_t lo = vmull_u8(vget_low_u8(s), w);
+    uint16x8_t hi = vmull_u8(vget_high_u8(s), w);
+    vst1q_u32(acc + x, vaddw_u16(vld1q_u32(acc + x), vget_low_u16(lo)));
+    vst1q_u32(acc + x + 4,
+              vaddw_u16(vld1q_u32(acc + x + 4), vget_high_u16(lo)));
+    vst1q_u32(acc + x + 8,
+              vaddw_u16(vld1q_u32(acc + x + 8), vget_low_u16(hi)));
+    vst1q_u32(acc + x + 12,
+              vaddw_u16(vld1q_u32(acc + x + 12), vget_high_u16(hi)));
+  }
+#endif
+
+  for (; x < count; ++x)
+    acc[x] += src[x] * weight;
+}
+
+void accumulate(const uint16_t *src, uint32_t *acc, unsigned int count,
+                unsigned int weight) {
+  unsigned int x = 0;
+
+#if defined(__SSE2__)
+  const __m128i w = _mm_set1_epi16(weight);
+
+  // The low and high halves of the 32 bit products, interleaved.
+  for (; x + 8 <= count; x += 8) {
+    __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + x));
+    __m128i *a = reinterpret_cast<__m128i *>(acc + x);
+    __m128i lo = _mm_mullo_epi16(s, w);
+    __m128i hi = _mm_mulhi_epu16(s, w);
+    _mm_storeu_si128(a, _mm_add_epi32(_mm_loadu_si128(a),
+                                      _mm_unpacklo_epi16(lo, hi)));
+    _mm_storeu_si128(a + 1, _mm_add_epi32(_mm_loadu_si128(a + 1),
+                                          _mm_unpackhi_epi16(lo, hi)));
+  }
+#elif defined(__aarch64__)
+  const uint16x4_t w = vdup_n_u16(weight);
+
+  for (; x + 8 <= count; x += 8) {
+    uint16x8_t s = vld1q_u16(src + x);
+    vst1q_u32(acc + x, vmlal_u16(vld1q_u32(acc + x), vget_low_u16(s), w));
+    vst1q_u32(acc + x + 4,
+              vmlal_u16(vld1q_u32(acc + x + 4), vget_high_u16(s), w));
+  }
+#endif
+
+  for (; x < count; ++x)
+    acc[x] += src[x] * weight;
+}
+
+// Divide by the tile weight through its reciprocal and clear the
+// accumulators for the next stack. Runs once per stack, the compiler
+// vectorises it well enough.
+template<typename Sample, typename Acc>
+void average(Acc *acc, Sample *dst, unsigned int count, float scale) {
+  for (unsigned int x = 0; x < count; ++x) {
+    dst[x] = static_cast<Sample>(acc[x] * scale + 0.5f);
+    acc[x] = 0;
+  }
+}
+
+} /* namespace */
+
+TemporalDenoiser::~TemporalDenoiser() {
+  free();
+}
+
+void TemporalDenoiser::free() {
+  ::free(arena_);
+  arena_ = nullptr;
+  arenaSize_ = 0;
+  numPlanes_ = 0;
+  reference_ = FrameView();
+  output_ = FrameView();
+}
+
+int TemporalDenoiser::configure(const DenoiseConfig &config,
+                                FrameFormat format, unsigned int width,
+                                unsigned int height) {
+  free();
+
+  const FormatInfo &info = formatInfo(format);
+  if (!info.numPlanes || format == FrameFormat::RAW10P ||
+      format == FrameFormat::RAW12P || !width || !height ||
+      config.frames < 2 || config.frames > 256)
+    return -EINVAL;
+
+  config_ = config;
+  config_.tileSize = std::max(config.tileSize & ~1u, 2u);
+  format_ = format;
+  width_ = width;
+  height_ = height;
+  sampleBytes_ = format == FrameFormat::RAW16 ? 2 : 1;
+  fullWeight_ = config.threshold ? kWeightedFullWeight : 1;
+  wide_ = sampleBytes_ == 2 || config.frames * fullWeight_ > 256;
+
+  tilesX_ = (width + config_.tileSize - 1) / config_.tileSize;
+  tilesY_ = (height + config_.tileSize - 1) / config_.tileSize;
+  numPlanes_ = info.numPlanes;
+
+  // Carve everything out of one block: accumulators, reference and output
+  // frames, then the tile weights.
+  size_t accSize[3];
+  size_t size = 0;
+  for (unsigned int p = 0; p < numPlanes_; ++p) {
+    Plane &plane = planes_[p];
+    plane.hSub = info.hSub[p];
+    plane.vSub = info.vSub[p];
+    plane.groupSamples = info.bytesPerPixel[p] / sampleBytes_;
+    plane.width = width / plane.hSub * plane.groupSamples;
+    plane.height = height / plane.vSub;
+
+    accSize[p] = alignArena(size_t(plane.width) * plane.height *
+                            (wide_ ? 4 : 2));
+    size += accSize[p];
+  }
+
+  size_t stride = size_t(width) / info.hSub[0] * info.bytesPerPixel[0];
+  size_t frameSize = alignArena(frameBytes(format, height, stride));
+  size_t tiles = size_t(tilesX_) * tilesY_;
+  size += frameSize * (config.threshold ? 2 : 1);
+  size += alignArena(tiles) + alignArena(tiles * sizeof(uint16_t));
+
+  arena_ = static_cast<uint8_t *>(aligned_alloc(64, size));
+  if (!arena_) {
+    numPlanes_ = 0;
+    return -ENOMEM;
+  }
+  arenaSize_ = size;
+  memset(arena_, 0, size);
+
+  uint8_t *next = arena_;
+  for (unsigned int p = 0; p < numPlanes_; ++p) {
+    planes_[p].acc = next;
+    next += accSize[p];
+  }
+
+  uint8_t *frame[3] = { next };
+  output_ = makeFrameView(format, width, height, stride, frame);
+  next += frameSize;
+  if (config.threshold) {
+    frame[0] = next;
+    reference_ = makeFrameView(format, width, height, stride, frame);
+    next += frameSize;
+  }
+
+  weights_ = next;
+  tileSums_ = reinterpret_cast<uint16_t *>(next + alignArena(tiles));
+
+  count_ = 0;
+  stackedFraction_ = 0.0;
+  return 0;
+}
+
+void TemporalDenoiser::reset() {
+  if (!isConfigured())
+    return;
+
+  for (unsigned int p = 0; p < numPlanes_; ++p)
+    memset(planes_[p].acc, 0, size_t(planes_[p].width) * planes_[p].height *
+                              (wide_ ? 4 : 2));
+  std::fill_n(tileSums_, size_t(tilesX_) * tilesY_, 0);
+  count_ = 0;
+}
+
+unsigned int TemporalDenoiser::tileX(const Plane &plane,
+                                     unsigned int tx) const {
+  return std::min(tx * config_.tileSize / plane.hSub * plane.groupSamples,
+                  plane.width);
+}
+
+unsigned int TemporalDenoiser::tileY(const Plane &plane,
+                                     unsigned int ty) const {
+  return std::min(ty * config_.tileSize / plane.vSub, plane.height);
+}
+
+// Full weight up to the threshold of mean difference to the reference,
+// falling linearly to 0 at twice the threshold. Rows are only compared
+// until the tile is known to get no weight.
+uint8_t TemporalDenoiser::tileWeight(const FrameView &view, unsigned int tx,
+                                     unsigned int ty) const {
+  uint64_t samples = 0;
+  for (unsigned int p = 0; p < numPlanes_; ++p) {
+    const Plane &plane = planes_[p];
+    samples += uint64_t(tileX(plane, tx + 1) - tileX(plane, tx)) *
+               (tileY(plane, ty + 1) - tileY(plane, ty));
+  }
+
+  uint64_t still = uint64_t(config_.threshold) * samples;
+  uint64_t limit = 2 * still;
+  uint64_t sad = 0;
+
+  for (unsigned int p = 0; p < numPlanes_ && sad < limit; ++p) {
+    const Plane &plane = planes_[p];
+    unsigned int x0 = tileX(plane, tx);
+    unsigned int count = tileX(plane, tx + 1) - x0;
+    size_t offset = size_t(x0) * sampleBytes_;
+
+    for (unsigned int y = tileY(plane, ty);
+         y < tileY(plane, ty + 1) && sad < limit; ++y) {
+      const uint8_t *a = view.planes[p].row(y) + offset;
+      const uint8_t *b = reference_.planes[p].row(y) + offset;
+      if (sampleBytes_ == 1)
+        sad += sumAbsDiff(a, b, count);
+      else
+        sad += sumAbsDiff16(reinterpret_cast<const uint16_t *>(a),
+                            reinterpret_cast<const uint16_t *>(b), count);
+    }
+  }
+
+  if (sad <= still)
+    return fullWeight_;
+  if (sad >= limit)
+    return 0;
+  return fullWeight_ * (limit - sad) / still;
+}
+
+// Runs of tiles with the same weight are accumulated in one go, which in
+// a still scene is the whole row.
+void TemporalDenoiser::accumulateRow(const Plane &plane, const uint8_t *src,
+                                     unsigned int y,
+                                     const uint8_t *weights) const {
+  size_t row = size_t(y) * plane.width;
+
+  for (unsigned int tx = 0; tx < tilesX_;) {
+    unsigned int end = tx + 1;
+    while (end < tilesX_ && weights[end] == weights[tx])
+      end++;
+
+    unsigned int weight = weights[tx];
+    unsigned int x0 = tileX(plane, tx);
+    unsigned int count = tileX(plane, end) - x0;
+    tx = end;
+    if (!weight)
+      continue;
+
+    if (!wide_)
+      accumulate(src + x0, static_cast<uint16_t *>(plane.acc) + row + x0,
+                 count, weight);
+    else if (sampleBytes_ == 1)
+      accumulate(src + x0, static_cast<uint32_t *>(plane.acc) + row + x0,
+                 count, weight);
+    else
+      accumulate(reinterpret_cast<const uint16_t *>(src) + x0,
+                 static_cast<uint32_t *>(plane.acc) + row + x0, count,
+                 weight);
+  }
+}
+
+void TemporalDenoiser::averageRow(const Plane &plane,
+                                  const FrameView &output, unsigned int p,
+                                  unsigned int y, unsigned int ty) const {
+  const uint16_t *sums = tileSums_ + size_t(ty) * tilesX_;
+  uint8_t *dst = output.planes[p].row(y);
+  size_t row = size_t(y) * plane.width;
+
+  for (unsigned int tx = 0; tx < tilesX_;) {
+    unsigned int end = tx + 1;
+    while (end < tilesX_ && sums[end] == sums[tx])
+      end++;
+
+    float scale = 1.0f / sums[tx];
+    unsigned int x0 = tileX(plane, tx);
+    unsigned int count = tileX(plane, end) - x0;
+    tx = end;
+
+    if (!wide_)
+      average(static_cast<uint16_t *>(plane.acc) + row + x0, dst + x0,
+              count, scale);
+    else if (sampleBytes_ == 1)
+      average(static_cast<uint32_t *>(plane.acc) + row + x0, dst + x0,
+              count, scale);
+    else
+      average(static_cast<uint32_t *>(plane.acc) + row + x0,
+              reinterpret_cast<uint16_t *>(dst) + x0, count, scale);
+  }
+}
+
+int TemporalDenoiser::add(const FrameView &view) {
+  if (!isConfigured() || view.format != format_ || view.width != width_ ||
+      view.height != height_)
+    return -EINVAL;
+
+  // The first frame of a stack always gets the full weight, so no tile
+  // of the output is ever left without one.
+  bool first = count_ == 0;
+
+  ThreadPool::shared().parallelFor(tilesY_, [&](unsigned int ty) {
+    uint8_t *weights = weights_ + size_t(ty) * tilesX_;
+    uint16_t *sums = tileSums_ + size_t(ty) * tilesX_;
+
+    for (unsigned int tx = 0; tx < tilesX_; ++tx) {
+      weights[tx] = first || !config_.threshold ? fullWeight_
+                                                : tileWeight(view, tx, ty);
+      sums[tx] += weights[tx];
+    }
+
+    for (unsigned int p = 0; p < numPlanes_; ++p) {
+      const Plane &plane = planes_[p];
+      for (unsigned int y = tileY(plane, ty); y < tileY(plane, ty + 1);
+           ++y) {
+        const uint8_t *src = view.planes[p].row(y);
+        if (first && reference_.isValid())
+          std::copy_n(src, size_t(plane.width) * sampleBytes_,
+                      reference_.planes[p].row(y));
+        accumulateRow(plane, src, y, weights);
+      }
+    }
+  });
+
+  if (++count_ < config_.frames)
+    return 0;
+
+  size_t tiles = size_t(tilesX_) * tilesY_;
+  uint64_t total = 0;
+  for (size_t i = 0; i < tiles; ++i)
+    total += tileSums_[i];
+  stackedFraction_ = static_cast<double>(total) /
+                     (tiles * config_.frames * fullWeight_);
+
+  ThreadPool::shared().parallelFor(tilesY_, [&](unsigned int ty) {
+    for (unsigned int p = 0; p < numPlanes_; ++p) {
+      const Plane &plane = planes_[p];
+      for (unsigned int y = tileY(plane, ty); y < tileY(plane, ty + 1);
+           ++y)
+        averageRow(plane, output_, p, y, ty);
+    }
+  });
+
+  std::fill_n(tileSums_, tiles, 0);
+  count_ = 0;
+  return 1;
+}
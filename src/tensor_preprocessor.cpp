@@ -0,0 +1,502 @@
+#include "tensor_preprocessor.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#include "thread_pool.h"
+
+bool parseTensorLayout(const std::string &name, TensorLayout &layout) {
+  if (name == "nchw")
+    layout = TensorLayout::NCHW;
+  else if (name == "nhwc")
+    layout = TensorLayout::NHWC;
+  else
+    return false;
+
+  return true;
+}
+
+const char *tensorLayoutName(TensorLayout layout) {
+  switch (layout) {
+  case TensorLayout::NCHW:
+    return "nchw";
+  case TensorLayout::NHWC:
+    return "nhwc";
+  }
+
+  return "unknown";
+}
+
+bool parseTensorType(const std::string &name, TensorType &type) {
+  if (name == "f32")
+    type = TensorType::Float32;
+  else if (name == "f16")
+    type = TensorType::Float16;
+  else if (name == "i8")
+    type = TensorType::Int8;
+  else
+    return false;
+
+  return true;
+}
+
+const char *tensorTypeName(TensorType type) {
+  switch (type) {
+  case TensorType::Float32:
+    return "f32";
+  case TensorType::Float16:
+    return "f16";
+  case TensorType::Int8:
+    return "i8";
+  }
+
+  return "unknown";
+}
+
+size_t tensorTypeSize(TensorType type) {
+  switch (type) {
+  case TensorType::Float32:
+    return 4;
+  case TensorType::Float16:
+    return 2;
+  case TensorType::Int8:
+  default:
+    return 1;
+  }
+}
+
+bool parseTensorChannels(const std::string &arg, float (&values)[3]) {
+  float parsed[3];
+  char trailing;
+
+  int count = sscanf(arg.c_str(), "%f,%f,%f%c", &parsed[0], &parsed[1],
+                     &parsed[2], &trailing);
+  if (count == 1 && arg.find(',') == std::string::npos)
+    parsed[1] = parsed[2] = parsed[0];
+  else if (count != 3)
+    return false;
+
+  std::copy_n(parsed, 3, values);
+  return true;
+}
+
+namespace {
+
+// Tensor rows per parallel task.
+constexpr unsigned int kBandRows = 16;
+
+uint16_t floatToHalf(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint16_t sign = (bits >> 16) & 0x8000;
+  int exponent = static_cast<int>((bits >> 23) & 0xff) - 127 + 15;
+  uint32_t mantissa = bits & 0x7fffff;
+
+  if (((bits >> 23) & 0xff) == 0xff)
+    return sign | 0x7c00 | (mantissa ? 0x200 : 0);
+  if (exponent >= 31)
+    return sign | 0x7c00;
+
+  // Subnormal halves keep the implicit bit in the mantissa.
+  unsigned int shift = 13;
+  uint32_t half;
+  if (exponent <= 0) {
+    if (exponent < -10)
+      return sign;
+    mantissa |= 0x800000;
+    shift = 14 - exponent;
+    half = 0;
+  } else {
+    half = static_cast<uint32_t>(exponent) << 10;
+  }
+
+  // Round to nearest even; a carry into the exponent is still correct.
+  uint32_t rest = mantissa & ((1u << shift) - 1);
+  uint32_t halfway = 1u << (shift - 1);
+  half += mantissa >> shift;
+  if (rest > halfway || (rest == halfway && (half & 1)))
+    half++;
+
+  return sign | half;
+}
+
+typedef uint8_t Bytes8 __attribute__((vector_size(8)));
+typedef int16_t Shorts8 __attribute__((vector_size(16)));
+
+// Full range BT.601 with 7 fractional bits, small enough for 16 bit lanes.
+void yuvToRgb(const uint8_t *y, const uint8_t *u, const uint8_t *v,
+              unsigned int width, uint8_t *r, uint8_t *g, uint8_t *b) {
+  unsigned int x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    Bytes8 yb, ub, vb;
+    memcpy(&yb, y + x, sizeof(yb));
+    memcpy(&ub, u + x, sizeof(ub));
+    memcpy(&vb, v + x, sizeof(vb));
+
+    Shorts8 luma = __builtin_convertvector(yb, Shorts8);
+    Shorts8 cb = __builtin_convertvector(ub, Shorts8) - 128;
+    Shorts8 cr = __builtin_convertvector(vb, Shorts8) - 128;
+
+    Shorts8 rgb[3] = {
+      luma + ((179 * cr + 64) >> 7),
+      luma - ((44 * cb + 91 * cr + 64) >> 7),
+      luma + ((227 * cb + 64) >> 7),
+    };
+    uint8_t *out[3] = { r + x, g + x, b + x };
+
+    for (unsigned int c = 0; c < 3; ++c) {
+      Shorts8 value = rgb[c];
+      value = value < 0 ? Shorts8{} : value;
+      value = value > 255 ? Shorts8{} + 255 : value;
+      Bytes8 bytes = __builtin_convertvector(value, Bytes8);
+      memcpy(out[c], &bytes, sizeof(bytes));
+    }
+  }
+
+  auto clamp = [](int value) -> uint8_t {
+    return value < 0 ? 0 : value > 255 ? 255 : value;
+  };
+
+  for (; x < width; ++x) {
+    int cb = u[x] - 128, cr = v[x] - 128;
+    r[x] = clamp(y[x] + ((179 * cr + 64) >> 7));
+    g[x] = clamp(y[x] - ((44 * cb + 91 * cr + 64) >> 7));
+    b[x] = clamp(y[x] + ((227 * cb + 64) >> 7));
+  }
+}
+
+// R, G and B of row y, one byte per pixel each. YUV formats go through
+// scratch, three rows of view.width bytes.
+void rgbRow(const FrameView &view, unsigned int y, uint8_t *r, uint8_t *g,
+            uint8_t *b, uint8_t *scratch) {
+  unsigned int width = view.width;
+  const uint8_t *src = view.planes[0].row(y);
+  uint8_t *luma = scratch, *cb = scratch + width, *cr = scratch + 2 * width;
+
+  switch (view.format) {
+  case FrameFormat::XRGB8888:
+  case FrameFormat::XBGR8888:
+  case FrameFormat::RGB888:
+  case FrameFormat::BGR888: {
+    unsigned int bpp = view.planes[0].bytesPerPixel;
+    // XRGB8888 and RGB888 are B G R in memory, the others R G B.
+    bool swap = view.format == FrameFormat::XRGB8888 ||
+                view.format == FrameFormat::RGB888;
+    uint8_t *first = swap ? b : r, *last = swap ? r : b;
+    for (unsigned int x = 0; x < width; ++x, src += bpp) {
+      first[x] = src[0];
+      g[x] = src[1];
+      last[x] = src[2];
+    }
+    return;
+  }
+
+  case FrameFormat::R8:
+    memcpy(r, src, width);
+    memcpy(g, src, width);
+    memcpy(b, src, width);
+    return;
+
+  case FrameFormat::YUYV:
+  case FrameFormat::UYVY: {
+    unsigned int offset = view.format == FrameFormat::UYVY;
+    for (unsigned int x = 0; x + 1 < width; x += 2, src += 4) {
+      luma[x] = src[offset];
+      luma[x + 1] = src[offset + 2];
+      cb[x] = cb[x + 1] = src[1 - offset];
+      cr[x] = cr[x + 1] = src[3 - offset];
+    }
+    break;
+  }
+
+  case FrameFormat::NV12:
+  case FrameFormat::NV21: {
+    const uint8_t *uv = view.planes[1].row(y / 2);
+    unsigned int u = view.format == FrameFormat::NV21;
+    memcpy(luma, src, width);
+    for (unsigned int x = 0; x < width; ++x) {
+      cb[x] = uv[(x & ~1u) + u];
+      cr[x] = uv[(x & ~1u) + 1 - u];
+    }
+    break;
+  }
+
+  case FrameFormat::YUV420: {
+    const uint8_t *u = view.planes[1].row(y / 2);
+    const uint8_t *v = view.planes[2].row(y / 2);
+    memcpy(luma, src, width);
+    for (unsigned int x = 0; x < width; ++x) {
+      cb[x] = u[x / 2];
+      cr[x] = v[x / 2];
+    }
+    break;
+  }
+
+  default:
+    return;
+  }
+
+  yuvToRgb(luma, cb, cr, width, r, g, b);
+}
+
+} /* namespace */
+
+/* -------------------------------------------------------------------------
+ * TensorArena
+ */
+
+TensorArena::~TensorArena() {
+  free();
+}
+
+int TensorArena::allocate(const TensorConfig &config, unsigned int batch) {
+  free();
+
+  if (!batch || !config.width || !config.height)
+    return -EINVAL;
+
+  size_t sampleSize = size_t(config.width) * config.height * 3 *
+                      tensorTypeSize(config.type);
+  size_t size = (sampleSize * batch + 63) & ~size_t(63);
+
+  data_ = static_cast<uint8_t *>(aligned_alloc(64, size));
+  if (!data_)
+    return -ENOMEM;
+
+  config_ = config;
+  batch_ = batch;
+  sampleSize_ = sampleSize;
+  return 0;
+}
+
+void TensorArena::free() {
+  ::free(data_);
+  data_ = nullptr;
+  batch_ = 0;
+  sampleSize_ = 0;
+}
+
+std::vector<unsigned int> TensorArena::shape() const {
+  if (config_.layout == TensorLayout::NCHW)
+    return { batch_, 3, config_.height, config_.width };
+  return { batch_, config_.height, config_.width, 3 };
+}
+
+bool TensorArena::writeNpy(std::ostream &out) const {
+  static const char *descr[] = { "<f4", "<f2", "|i1" };
+
+  std::stringstream header;
+  header << "{'descr': '" << descr[static_cast<int>(config_.type)]
+         << "', 'fortran_order': False, 'shape': (";
+  for (unsigned int dim : shape())
+    header << dim << ", ";
+  header << "), }";
+
+  // Version 1.0: magic, version, 16 bit header length, then the header
+  // padded with spaces and a newline to a multiple of 64 bytes.
+  std::string text = header.str();
+  size_t length = (10 + text.size() + 1 + 63) / 64 * 64 - 10;
+  text.resize(length - 1, ' ');
+  text += '\n';
+
+  const char magic[8] = { '\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0 };
+  uint8_t headerLength[2] = { static_cast<uint8_t>(length),
+                              static_cast<uint8_t>(length >> 8) };
+  out.write(magic, sizeof(magic));
+  out.write(reinterpret_cast<const char *>(headerLength),
+            sizeof(headerLength));
+  out.write(text.data(), text.size());
+  out.write(reinterpret_cast<const char *>(data_), size());
+
+  return static_cast<bool>(out);
+}
+
+/* -------------------------------------------------------------------------
+ * TensorPreprocessor
+ */
+
+TensorPreprocessor::TensorPreprocessor(const TensorConfig &config,
+                                       ResampleFilter filter)
+  : config_(config), resampler_(filter) {
+  size_t element = tensorTypeSize(config_.type);
+  lut_.resize(3 * 256 * element);
+
+  for (unsigned int c = 0; c < 3; ++c) {
+    for (unsigned int v = 0; v < 256; ++v) {
+      float value = (v - config_.mean[c]) / config_.std[c];
+      uint8_t *entry = &lut_[(c * 256 + v) * element];
+
+      switch (config_.type) {
+      case TensorType::Float32:
+        memcpy(entry, &value, sizeof(value));
+        break;
+      case TensorType::Float16: {
+        uint16_t half = floatToHalf(value);
+        memcpy(entry, &half, sizeof(half));
+        break;
+      }
+      case TensorType::Int8: {
+        long q = std::lround(value / config_.quantScale) + config_.zeroPoint;
+        *entry = static_cast<uint8_t>(std::min(std::max(q, -128L), 127L));
+        break;
+      }
+      }
+    }
+  }
+}
+
+size_t TensorPreprocessor::sampleSize() const {
+  return size_t(config_.width) * config_.height * 3 *
+         tensorTypeSize(config_.type);
+}
+
+TensorPlacement TensorPreprocessor::placement(FrameFormat format,
+                                              unsigned int width,
+                                              unsigned int height) const {
+  const FormatInfo &info = formatInfo(format);
+  double scaleX = static_cast<double>(config_.width) / width;
+  double scaleY = static_cast<double>(config_.height) / height;
+  if (config_.letterbox)
+    scaleX = scaleY = std::min(scaleX, scaleY);
+
+  unsigned int w = std::min<unsigned int>(std::lround(width * scaleX),
+                                          config_.width);
+  unsigned int h = std::min<unsigned int>(std::lround(height * scaleY),
+                                          config_.height);
+  w = std::max(w / info.hAlign, 1u) * info.hAlign;
+  h = std::max(h / info.vAlign, 1u) * info.vAlign;
+
+  TensorPlacement placement;
+  placement.width = w;
+  placement.height = h;
+  placement.x = w < config_.width ? (config_.width - w) / 2 : 0;
+  placement.y = h < config_.height ? (config_.height - h) / 2 : 0;
+  placement.scaleX = static_cast<double>(w) / width;
+  placement.scaleY = static_cast<double>(h) / height;
+  return placement;
+}
+
+// Every element is written once: padding from the table entry of the pad
+// value, the frame from the table entries of its pixels.
+template<typename T>
+void TensorPreprocessor::store(const FrameView &content,
+                               const TensorPlacement &placement,
+                               T *tensor) const {
+  unsigned int width = config_.width, height = config_.height;
+  unsigned int bands = (height + kBandRows - 1) / kBandRows;
+  size_t planeSize = size_t(width) * height;
+  const T *lut = reinterpret_cast<const T *>(lut_.data());
+  bool nchw = config_.layout == TensorLayout::NCHW;
+
+  ThreadPool::shared().parallelFor(bands, [&](unsigned int band) {
+    thread_local std::vector<uint8_t> rows;
+    rows.resize(6 * size_t(content.width));
+
+    unsigned int last = std::min((band + 1) * kBandRows, height);
+    for (unsigned int y = band * kBandRows; y < last; ++y) {
+      bool inside = y >= placement.y && y < placement.y + placement.height;
+      unsigned int left = inside ? placement.x : width;
+      unsigned int right = inside ? placement.x + placement.width : width;
+
+      uint8_t *rgb = rows.data();
+      const uint8_t *channel[3] = { rgb, rgb + content.width,
+                                    rgb + 2 * content.width };
+      if (config_.bgr)
+        std::swap(channel[0], channel[2]);
+      if (inside)
+        rgbRow(content, y - placement.y, rgb, rgb + content.width,
+               rgb + 2 * content.width, rgb + 3 * content.width);
+
+      if (nchw) {
+        for (unsigned int c = 0; c < 3; ++c) {
+          const T *table = lut + c * 256;
+          const uint8_t *src = channel[c];
+          T *out = tensor + c * planeSize + size_t(y) * width;
+          T pad = table[config_.pad];
+
+          std::fill(out, out + left, pad);
+          for (unsigned int x = left; x < right; ++x)
+            out[x] = table[src[x - left]];
+          std::fill(out + right, out + width, pad);
+        }
+      } else {
+        T *out = tensor + size_t(y) * width * 3;
+        const T pad[3] = { lut[config_.pad], lut[256 + config_.pad],
+                           lut[512 + config_.pad] };
+        const uint8_t *r = channel[0], *g = channel[1], *b = channel[2];
+
+        for (unsigned int x = 0; x < left; ++x, out += 3)
+          std::copy_n(pad, 3, out);
+        for (unsigned int x = 0; x < right - left; ++x, out += 3) {
+          out[0] = lut[r[x]];
+          out[1] = lut[256 + g[x]];
+          out[2] = lut[512 + b[x]];
+        }
+        for (unsigned int x = right; x < width; ++x, out += 3)
+          std::copy_n(pad, 3, out);
+      }
+    }
+  });
+}
+
+int TensorPreprocessor::process(const FrameView &view, void *tensor,
+                                TensorPlacement *placement) {
+  if (!view.isValid() || view.format == FrameFormat::Unknown)
+    return -EINVAL;
+
+  TensorPlacement place = this->placement(view.format, view.width,
+                                          view.height);
+  if (place.width > config_.width || place.height > config_.height)
+    return -EINVAL;
+
+  // Only the resampler reads the full frame; the rest of the work is on
+  // the scaled copy, small enough to stay in cache.
+  FrameView content = view;
+  if (place.width != view.width || place.height != view.height) {
+    content = allocateFrameView(view.format, place.width, place.height,
+                                scaled_);
+    int ret = resampler_.resample(view, content);
+    if (ret)
+      return ret;
+  }
+
+  switch (config_.type) {
+  case TensorType::Float32:
+    store(content, place, static_cast<float *>(tensor));
+    break;
+  case TensorType::Float16:
+    store(content, place, static_cast<uint16_t *>(tensor));
+    break;
+  case TensorType::Int8:
+    store(content, place, static_cast<int8_t *>(tensor));
+    break;
+  }
+
+  if (placement)
+    *placement = place;
+  return 0;
+}
+
+int TensorPreprocessor::process(const FrameView *views, size_t count,
+                                TensorArena &arena) {
+  const TensorConfig &config = arena.config();
+  if (count > arena.batch() || config.width != config_.width ||
+      config.height != config_.height || config.layout != config_.layout ||
+      config.type != config_.type)
+    return -EINVAL;
+
+  for (size_t i = 0; i < count; ++i) {
+    int ret = process(views[i], arena.sample(i));
+    if (ret)
+      return ret;
+  }
+
+  return 0;
+}
@@ -0,0 +1,409 @@
+#include "text_overlay.h"
+
+#include <algorithm>
+#include <cerrno>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+constexpr unsigned int kFirstChar = 32;
+constexpr unsigned int kLastChar = 126;
+constexpr unsigned int kGlyphWidth = 5;
+constexpr unsigned int kGlyphHeight = 7;
+
+// 5x7 bitmaps of the printable ASCII characters, one byte per row, the
+// leftmost pixel in bit 4.
+const uint8_t kFont[kLastChar - kFirstChar + 1][kGlyphHeight] = {
+  { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // space
+  { 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 }, // !
+  { 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x00 }, // "
+  { 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a }, // #
+  { 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 }, // $
+  { 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 }, // %
+  { 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d }, // &
+  { 0x04, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 }, // '
+  { 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 }, // (
+  { 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 }, // )
+  { 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 }, // *
+  { 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 }, // +
+  { 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 }, // ,
+  { 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 }, // -
+  { 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c }, // .
+  { 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 }, // /
+  { 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e }, // 0
+  { 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e }, // 1
+  { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f }, // 2
+  { 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e }, // 3
+  { 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 }, // 4
+  { 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e }, // 5
+  { 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e }, // 6
+  { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 }, // 7
+  { 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e }, // 8
+  { 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c }, // 9
+  { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 }, // :
+  { 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 }, // ;
+  { 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 }, // <
+  { 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 }, // =
+  { 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 }, // >
+  { 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 }, // ?
+  { 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e }, // @
+  { 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, // A
+  { 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e }, // B
+  { 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e }, // C
+  { 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c }, // D
+  { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f }, // E
+  { 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 }, // F
+  { 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f }, // G
+  { 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 }, // H
+  { 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, // I
+  { 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c }, // J
+  { 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 }, // K
+  { 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f }, // L
+  { 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 }, // M
+  { 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 }, // N
+  { 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, // O
+  { 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 }, // P
+  { 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d }, // Q
+  { 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 }, // R
+  { 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e }, // S
+  { 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // T
+  { 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e }, // U
+  { 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 }, // V
+  { 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a }, // W
+  { 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 }, // X
+  { 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 }, // Y
+  { 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f }, // Z
+  { 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e }, // [
+  { 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 }, // backslash
+  { 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e }, // ]
+  { 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 }, // ^
+  { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f }, // _
+  { 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00 }, // `
+  { 0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f }, // a
+  { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e }, // b
+  { 0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e }, // c
+  { 0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f }, // d
+  { 0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e }, // e
+  { 0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08 }, // f
+  { 0x00, 0x0f, 0x11, 0x11, 0x0f, 0x01, 0x0e }, // g
+  { 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 }, // h
+  { 0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e }, // i
+  { 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0c }, // j
+  { 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 }, // k
+  { 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e }, // l
+  { 0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11 }, // m
+  { 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 }, // n
+  { 0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e }, // o
+  { 0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10 }, // p
+  { 0x00, 0x00, 0x0d, 0x13, 0x0f, 0x01, 0x01 }, // q
+  { 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 }, // r
+  { 0x00, 0x00, 0x0e, 0x10, 0x0e, 0x01, 0x1e }, // s
+  { 0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06 }, // t
+  { 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d }, // u
+  { 0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04 }, // v
+  { 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a }, // w
+  { 0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11 }, // x
+  { 0x00, 0x00, 0x11, 0x11, 0x0f, 0x01, 0x0e }, // y
+  { 0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f }, // z
+  { 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 }, // {
+  { 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 }, // |
+  { 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 }, // }
+  { 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00 }, // ~
+};
+
+// Box blur of radius r along rows (step 1) or columns (step width) of a
+// coverage image, edges treated as empty.
+void blurCoverage(std::vector<uint8_t> &image, unsigned int width,
+                  unsigned int height, unsigned int r, bool columns) {
+  std::vector<uint8_t> out(image.size());
+  unsigned int lines = columns ? width : height;
+  unsigned int length = columns ? height : width;
+  size_t step = columns ? width : 1;
+  size_t next = columns ? 1 : width;
+
+  for (unsigned int line = 0; line < lines; ++line) {
+    const uint8_t *in = image.data() + line * next;
+    uint8_t *o = out.data() + line * next;
+    for (unsigned int i = 0; i < length; ++i) {
+      unsigned int sum = 0;
+      for (unsigned int k = i >= r ? i - r : 0;
+           k <= std::min(i + r, length - 1); ++k)
+        sum += in[k * step];
+      o[i * step] = (sum + r) / (2 * r + 1);
+    }
+  }
+
+  image.swap(out);
+}
+
+// Coverage of the glyph, grown by r pixels in every direction.
+void dilateCoverage(const uint8_t *in, uint8_t *out, unsigned int width,
+                    unsigned int height, unsigned int r) {
+  for (unsigned int y = 0; y < height; ++y) {
+    for (unsigned int x = 0; x < width; ++x) {
+      uint8_t value = 0;
+      for (unsigned int v = y >= r ? y - r : 0;
+           v <= std::min(y + r, height - 1); ++v) {
+        for (unsigned int u = x >= r ? x - r : 0;
+             u <= std::min(x + r, width - 1); ++u)
+          value = std::max(value, in[v * width + u]);
+      }
+      out[y * width + x] = value;
+    }
+  }
+}
+
+// Which pixel of the group a byte of a plane samples, or -1 for chroma,
+// which covers the whole group.
+int lumaPixel(FrameFormat format, unsigned int plane, unsigned int byte) {
+  switch (format) {
+  case FrameFormat::YUYV:
+    return byte % 2 ? -1 : byte / 2;
+  case FrameFormat::UYVY:
+    return byte % 2 ? byte / 2 : -1;
+  case FrameFormat::NV12:
+  case FrameFormat::NV21:
+  case FrameFormat::YUV420:
+    return plane ? -1 : 0;
+  default:
+    return 0;
+  }
+}
+
+// b = (b * keep + text) >> 8 over a row of bytes. keep + text is at most
+// 256 * 255, so the sums stay in 16 bits.
+void blendRow(uint8_t *pixels, const uint16_t *keep, const uint16_t *text,
+              unsigned int count) {
+  unsigned int i = 0;
+
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= count; i += 16) {
+    __m128i p = _mm_loadu_si128(reinterpret_cast<__m128i *>(pixels + i));
+    __m128i k0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keep + i));
+    __m128i k1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keep + i + 8));
+    __m128i t0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+    __m128i t1 =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i + 8));
+
+    __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), k0);
+    __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), k1);
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, t0), 8);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, t1), 8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(pixels + i),
+                     _mm_packus_epi16(lo, hi));
+  }
+#elif defined(__aarch64__)
+  for (; i + 16 <= count; i += 16) {
+    uint8x16_t p = vld1q_u8(pixels + i);
+    uint16x8_t lo = vmlaq_u16(vld1q_u16(text + i), vmovl_u8(vget_low_u8(p)),
+                              vld1q_u16(keep + i));
+    uint16x8_t hi = vmlaq_u16(vld1q_u16(text + i + 8), vmovl_high_u8(p),
+                              vld1q_u16(keep + i + 8));
+    vst1q_u8(pixels + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+  }
+#endif
+
+  for (; i < count; ++i)
+    pixels[i] = (pixels[i] * keep[i] + text[i]) >> 8;
+}
+
+} /* namespace */
+
+void GlyphAtlas::rasterise(unsigned int scale, bool outline) {
+  const unsigned int s = std::max(scale, 1u);
+  const unsigned int border = std::max(s / 2, 1u);
+
+  // A column and a row of spacing, and room for the outline around.
+  cellWidth_ = (kGlyphWidth + 1) * s + 2 * border;
+  cellHeight_ = (kGlyphHeight + 1) * s + 2 * border;
+
+  const size_t cellSize = cellWidth_ * cellHeight_;
+  const unsigned int count = kLastChar - kFirstChar + 1;
+  text_.assign(cellSize * count, 0);
+  outline_.assign(cellSize * count, 0);
+
+  std::vector<uint8_t> glyph(cellSize);
+  for (unsigned int c = 0; c < count; ++c) {
+    std::fill(glyph.begin(), glyph.end(), 0);
+    for (unsigned int y = 0; y < kGlyphHeight * s; ++y) {
+      for (unsigned int x = 0; x < kGlyphWidth * s; ++x) {
+        bool set = kFont[c][y / s] & (0x10 >> (x / s));
+        glyph[(y + border) * cellWidth_ + x + border] = set ? 255 : 0;
+      }
+    }
+
+    // Soften the edges of large glyphs, the staircase of the bitmap
+    // shows from a scale of 2 up.
+    if (s >= 2) {
+      unsigned int radius = std::max(s / 4, 1u);
+      blurCoverage(glyph, cellWidth_, cellHeight_, radius, false);
+      blurCoverage(glyph, cellWidth_, cellHeight_, radius, true);
+    }
+
+    std::copy(glyph.begin(), glyph.end(), text_.begin() + c * cellSize);
+    if (outline)
+      dilateCoverage(glyph.data(), outline_.data() + c * cellSize,
+                     cellWidth_, cellHeight_, border);
+  }
+}
+
+const uint8_t *GlyphAtlas::text(char c) const {
+  unsigned int index = static_cast<unsigned char>(c);
+  if (index < kFirstChar || index > kLastChar)
+    index = '?';
+  return text_.data() + (index - kFirstChar) * cellWidth_ * cellHeight_;
+}
+
+const uint8_t *GlyphAtlas::outline(char c) const {
+  unsigned int index = static_cast<unsigned char>(c);
+  if (index < kFirstChar || index > kLastChar)
+    index = '?';
+  return outline_.data() + (index - kFirstChar) * cellWidth_ * cellHeight_;
+}
+
+int TextOverlay::configure(const OverlayConfig &config, FrameFormat format,
+                           unsigned int width, unsigned int height) {
+  const FormatInfo &info = formatInfo(format);
+  if (!info.numPlanes || !width || !height)
+    return -EINVAL;
+
+  // About 1/40th of the frame height per line of text.
+  unsigned int scale = config.scale ? config.scale
+                                    : std::max(height / 320, 1u);
+  atlas_.rasterise(scale, config.outline);
+
+  config_ = config;
+  format_ = format;
+  width_ = width;
+  height_ = height;
+  text_.clear();
+  layers_.clear();
+  return 0;
+}
+
+bool TextOverlay::setText(const std::string &text) {
+  if (format_ == FrameFormat::Unknown || (text == text_ && !layers_.empty()))
+    return false;
+
+  const FormatInfo &info = formatInfo(format_);
+  text_ = text;
+  layers_.clear();
+
+  /* ---------------------------------------------------------------------
+   * Text at full resolution: alpha from 0 to 256 and premultiplied grey
+   */
+  unsigned int x0 = config_.x / info.hAlign * info.hAlign;
+  unsigned int y0 = config_.y / info.vAlign * info.vAlign;
+  unsigned int cellWidth = atlas_.cellWidth();
+  unsigned int cellHeight = atlas_.cellHeight();
+  unsigned int width = text.size() * cellWidth;
+  unsigned int height = cellHeight;
+  width = (width + info.hAlign - 1) / info.hAlign * info.hAlign;
+  height = (height + info.vAlign - 1) / info.vAlign * info.vAlign;
+
+  std::vector<uint16_t> alpha(size_t(width) * height, 0);
+  std::vector<uint16_t> grey(size_t(width) * height, 0);
+
+  for (size_t i = 0; i < text.size(); ++i) {
+    const uint8_t *glyph = atlas_.text(text[i]);
+    const uint8_t *outline = atlas_.outline(text[i]);
+
+    for (unsigned int y = 0; y < cellHeight; ++y) {
+      for (unsigned int x = 0; x < cellWidth; ++x) {
+        unsigned int t = glyph[y * cellWidth + x];
+        unsigned int o = config_.outline ? outline[y * cellWidth + x] : 0;
+        t += t >> 7;
+        o += o >> 7;
+
+        // Text over its dark outline.
+        size_t pixel = size_t(y) * width + i * cellWidth + x;
+        alpha[pixel] = std::max(t, o);
+        grey[pixel] = config_.foreground * t;
+      }
+    }
+  }
+
+  /* ---------------------------------------------------------------------
+   * Blend factors of every byte of every plane under the text
+   */
+  for (unsigned int i = 0; i < info.numPlanes; ++i) {
+    unsigned int hSub = info.hSub[i], vSub = info.vSub[i];
+    Layer layer;
+    layer.x = x0 / hSub;
+    layer.y = y0 / vSub;
+    layer.width = width / hSub;
+    layer.height = height / vSub;
+    layer.bytesPerPixel = info.bytesPerPixel[i];
+
+    size_t rowBytes = size_t(layer.width) * layer.bytesPerPixel;
+    layer.keep.resize(rowBytes * layer.height);
+    layer.text.resize(rowBytes * layer.height);
+
+    for (unsigned int y = 0; y < layer.height; ++y) {
+      for (unsigned int x = 0; x < layer.width; ++x) {
+        for (unsigned int c = 0; c < layer.bytesPerPixel; ++c) {
+          int pixel = lumaPixel(format_, i, c);
+          unsigned int a, g;
+
+          if (pixel >= 0) {
+            size_t index = size_t(y * vSub) * width + x * hSub + pixel;
+            a = alpha[index];
+            g = grey[index];
+          } else {
+            // Chroma of the group goes neutral as far as the text covers
+            // its pixels.
+            unsigned int sum = 0;
+            for (unsigned int v = 0; v < vSub; ++v) {
+              for (unsigned int u = 0; u < hSub; ++u)
+                sum += alpha[size_t(y * vSub + v) * width + x * hSub + u];
+            }
+            a = sum / (hSub * vSub);
+            g = 128 * a;
+          }
+
+          size_t byte = y * rowBytes + x * layer.bytesPerPixel + c;
+          layer.keep[byte] = 256 - a;
+          layer.text[byte] = g;
+        }
+      }
+    }
+
+    layers_.push_back(std::move(layer));
+  }
+
+  return true;
+}
+
+int TextOverlay::apply(const FrameView &view) const {
+  if (view.format != format_ || view.width != width_ ||
+      view.height != height_ || view.numPlanes != layers_.size())
+    return -EINVAL;
+
+  for (unsigned int i = 0; i < view.numPlanes; ++i) {
+    const PlaneView &plane = view.planes[i];
+    const Layer &layer = layers_[i];
+    if (layer.x >= plane.width || layer.y >= plane.height)
+      continue;
+
+    size_t rowBytes = size_t(layer.width) * layer.bytesPerPixel;
+    unsigned int rows = std::min(layer.height, plane.height - layer.y);
+    unsigned int count =
+        std::min(layer.width, plane.width - layer.x) * layer.bytesPerPixel;
+
+    for (unsigned int y = 0; y < rows; ++y) {
+      blendRow(plane.row(layer.y + y) + layer.x * layer.bytesPerPixel,
+               layer.keep.data() + y * rowBytes,
+               layer.text.data() + y * rowBytes, count);
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,107 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+
+static thread_local bool inPool = false;
+
+ThreadPool::ThreadPool(unsigned int threads) {
+  if (!threads)
+    threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+  for (unsigned int i = 1; i < threads; ++i)
+    workers_.emplace_back(&ThreadPool::worker, this);
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    stopping_ = true;
+  }
+  start_.notify_all();
+
+  for (std::thread &thread : workers_)
+    thread.join();
+}
+
+ThreadPool &ThreadPool::shared() {
+  static ThreadPool pool;
+  return pool;
+}
+
+// Claim and run tasks of the given job until none are left.
+void ThreadPool::runTasks(uint32_t generation, unsigned int count,
+                          const std::function<void(unsigned int)> &fn) {
+  unsigned int done = 0;
+  uint64_t claim = next_.load();
+
+  while (true) {
+    if (claim >> 32 != generation || (claim & 0xffffffff) >= count)
+      break;
+    if (!next_.compare_exchange_weak(claim, claim + 1))
+      continue;
+
+    fn(claim & 0xffffffff);
+    done++;
+    claim = next_.load();
+  }
+
+  std::unique_lock<std::mutex> locker(lock_);
+  finished_ += done;
+  if (done && finished_ == count_)
+    done_.notify_all();
+}
+
+void ThreadPool::worker() {
+  uint32_t seen = 0;
+
+  inPool = true;
+
+  while (true) {
+    const std::function<void(unsigned int)> *fn;
+    unsigned int count;
+
+    {
+      std::unique_lock<std::mutex> locker(lock_);
+      start_.wait(locker, [&]() { return stopping_ || generation_ != seen; });
+      if (stopping_)
+        return;
+      seen = generation_;
+      fn = fn_;
+      count = count_;
+    }
+
+    runTasks(seen, count, *fn);
+  }
+}
+
+void ThreadPool::parallelFor(unsigned int count,
+                             const std::function<void(unsigned int)> &fn) {
+  if (!count)
+    return;
+
+  if (inPool || workers_.empty() || count == 1) {
+    for (unsigned int i = 0; i < count; ++i)
+      fn(i);
+    return;
+  }
+
+  std::unique_lock<std::mutex> job(jobLock_);
+  uint32_t generation;
+
+  {
+    std::unique_lock<std::mutex> locker(lock_);
+    generation = ++generation_;
+    fn_ = &fn;
+    count_ = count;
+    finished_ = 0;
+    next_ = uint64_t(generation) << 32;
+  }
+  start_.notify_all();
+
+  inPool = true;
+  runTasks(generation, count, fn);
+  inPool = false;
+
+  std::unique_lock<std::mutex> locker(lock_);
+  done_.wait(locker, [&]() { return finished_ == count_; });
+}
@@ -0,0 +1,138 @@
+#include "tile_change.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "thread_pool.h"
+
+uint64_t sumAbsDiff(const uint8_t *a, const uint8_t *b, size_t size) {
+  uint64_t sum = 0;
+  size_t i = 0;
+
+#if defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= size; i += 16) {
+    __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+    __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  alignas(16) uint64_t lanes[2];
+  _mm_store_si128(reinterpret_cast<__m128i *>(lanes), acc);
+  sum = lanes[0] + lanes[1];
+#elif defined(__aarch64__)
+  // 16 bit lanes take at most 128 pairwise additions before widening.
+  while (i + 16 <= size) {
+    uint16x8_t acc = vdupq_n_u16(0);
+    size_t end = std::min(size & ~size_t(15), i + 128 * 16);
+    for (; i < end; i += 16)
+      acc = vpadalq_u8(acc, vabdq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+    sum += vaddlvq_u16(acc);
+  }
+#endif
+
+  for (; i < size; ++i)
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+
+  return sum;
+}
+
+TileChangeDetector::TileChangeDetector(unsigned int tileSize,
+                                       unsigned int threshold)
+  : tileSize_(std::max(tileSize & ~1u, 2u)), threshold_(threshold) {}
+
+Roi tileRoi(unsigned int tx, unsigned int ty, unsigned int tileSize,
+            unsigned int width, unsigned int height) {
+  Roi roi;
+  roi.x = tx * tileSize;
+  roi.y = ty * tileSize;
+  roi.width = std::min(tileSize, width - roi.x);
+  roi.height = std::min(tileSize, height - roi.y);
+  return roi;
+}
+
+Roi TileChangeDetector::tile(unsigned int tx, unsigned int ty) const {
+  return tileRoi(tx, ty, tileSize_, reference_.width, reference_.height);
+}
+
+unsigned int TileChangeDetector::detect(const FrameView &view) {
+  unsigned int tilesX = (view.width + tileSize_ - 1) / tileSize_;
+  unsigned int tilesY = (view.height + tileSize_ - 1) / tileSize_;
+  unsigned int count = tilesX * tilesY;
+
+  if (!valid_ || view.format != reference_.format ||
+      view.width != reference_.width || view.height != reference_.height) {
+    valid_ = false;
+    reference_.format = view.format;
+    reference_.width = view.width;
+    reference_.height = view.height;
+    tilesX_ = tilesX;
+    tilesY_ = tilesY;
+    bitmap_.assign((count + 7) / 8, 0);
+    for (unsigned int i = 0; i < count; ++i)
+      bitmap_[i / 8] |= 1 << (i % 8);
+    return count;
+  }
+
+  const FormatInfo &info = formatInfo(view.format);
+  std::vector<uint8_t> changed(count);
+
+  ThreadPool::shared().parallelFor(tilesY_, [&](unsigned int ty) {
+    for (unsigned int tx = 0; tx < tilesX_; ++tx) {
+      Roi roi = tile(tx, ty);
+      FrameView cur = cropFrameView(view, roi);
+      FrameView ref = cropFrameView(reference_, roi);
+      uint64_t limit = 0, sad = 0;
+
+      for (unsigned int p = 0; p < info.numPlanes; ++p)
+        limit += uint64_t(threshold_) * cur.planes[p].rowBytes() *
+                 cur.planes[p].height;
+
+      // Rows are compared until the limit is exceeded.
+      for (unsigned int p = 0; p < info.numPlanes && sad <= limit; ++p) {
+        const PlaneView &a = cur.planes[p], &b = ref.planes[p];
+        for (unsigned int y = 0; y < a.height && sad <= limit; ++y)
+          sad += sumAbsDiff(a.row(y), b.row(y), a.rowBytes());
+      }
+
+      changed[ty * tilesX_ + tx] = sad > limit;
+    }
+  });
+
+  unsigned int total = 0;
+  std::fill(bitmap_.begin(), bitmap_.end(), 0);
+  for (unsigned int i = 0; i < count; ++i) {
+    bitmap_[i / 8] |= changed[i] << (i % 8);
+    total += changed[i];
+  }
+
+  return total;
+}
+
+void TileChangeDetector::update(const FrameView &view) {
+  if (!valid_) {
+    reference_ = allocateFrameView(view.format, view.width, view.height,
+                                   memory_);
+    copyFrameView(view, reference_);
+    valid_ = true;
+    return;
+  }
+
+  for (unsigned int ty = 0; ty < tilesY_; ++ty) {
+    for (unsigned int tx = 0; tx < tilesX_; ++tx) {
+      if (!changed(tx, ty))
+        continue;
+
+      Roi roi = tile(tx, ty);
+      copyFrameView(cropFrameView(view, roi), cropFrameView(reference_, roi));
+    }
+  }
+}
+
+void TileChangeDetector::reset() {
+  valid_ = false;
+}